@@ -0,0 +1,62 @@
+#ifndef BENCH_UTIL_HPP
+#define BENCH_UTIL_HPP
+
+// Small timing helpers shared by the microbenchmarks. Each benchmark is a
+// plain loop timed with steady_clock, run a few times; the fastest run is
+// reported, since everything slower than it is noise from the machine.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Keeps the optimizer from dropping a result the benchmark does not use
+template<typename T>
+inline void do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+template<typename Fn>
+double time_per_op_ns(int iterations, Fn&& fn) {
+    // One warm-up round so lazily initialised state is not billed to the first sample
+    fn(0);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        fn(i);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+// Best of `repetitions` runs of time_per_op_ns
+template<typename Fn>
+double best_per_op_ns(int iterations, int repetitions, Fn&& fn) {
+    double best = time_per_op_ns(iterations, fn);
+    for (int r = 1; r < repetitions; ++r) {
+        best = std::min(best, time_per_op_ns(iterations, fn));
+    }
+    return best;
+}
+
+// One result line, aligned so runs can be diffed
+inline void report(const std::string& name, double ns_per_op, int iterations) {
+    std::cout << std::left << std::setw(36) << name << std::right << std::fixed << std::setprecision(3)
+              << std::setw(14) << ns_per_op / 1000.0 << " us/op" << std::setw(10) << iterations << " iterations"
+              << std::endl;
+}
+
+// Nearest-rank percentile of sorted samples, p in [0, 1]
+inline double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    std::size_t rank = static_cast<std::size_t>(std::ceil(p * static_cast<double>(sorted.size())));
+    rank = std::min(std::max<std::size_t>(rank, 1), sorted.size());
+    return sorted[rank - 1];
+}
+
+#endif // BENCH_UTIL_HPP
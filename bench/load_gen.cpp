@@ -0,0 +1,554 @@
+// HTTP load generator for osm_mapnik_server.
+//
+// Replays a list of tile requests against a running server and reports
+// throughput and latency percentiles. The list is either generated (map
+// views around a centre, zooms drawn from a weight table, fixed seed) or
+// read from a file, so the same run can be repeated after a change.
+//
+// Two ways to apply load:
+//  - closed: N connections, each sends its next request when the previous
+//    response is in. Measures what the server sustains.
+//  - open: requests arrive at a fixed mean rate (Poisson), whether or not
+//    the server keeps up. Latency runs from the scheduled arrival, so time
+//    spent queued behind a slow server is counted.
+//
+// Cache modes: "cold" measures the first pass over the list (start the
+// server fresh for it), "warm" runs one unmeasured pass first, "both"
+// reports the first pass as cold and a second one as warm.
+//
+// Usage: load_gen [--host 127.0.0.1] [--port 8080] [--mode closed|open] ...
+//        load_gen --help
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_util.hpp"
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+namespace po = boost::program_options;
+using tcp = net::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// --- Workload ---
+
+struct WorkloadOptions {
+    std::size_t requests = 10000;
+    std::map<int, double> zoom_weights;
+    double center_lon = -0.1276; // London
+    double center_lat = 51.5072;
+    double spread = 0.25;        // Std deviation of view centres, in degrees
+    int view_width = 4;          // Tiles per map view, a small browser window
+    int view_height = 3;
+    std::string format = "png";
+    std::uint32_t seed = 1;
+};
+
+// "12:1,13:2,14:4" -> {12: 1, 13: 2, 14: 4}
+std::map<int, double> parse_zoom_weights(const std::string& spec) {
+    std::map<int, double> weights;
+    std::istringstream in(spec);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        const std::size_t colon = item.find(':');
+        if (colon == std::string::npos) {
+            throw std::runtime_error("Bad zoom weight '" + item + "', expected zoom:weight");
+        }
+        const int z = std::stoi(item.substr(0, colon));
+        const double weight = std::stod(item.substr(colon + 1));
+        if (z < 0 || z > 20 || weight < 0) {
+            throw std::runtime_error("Bad zoom weight '" + item + "'");
+        }
+        weights[z] = weight;
+    }
+    if (weights.empty()) {
+        throw std::runtime_error("No zoom weights given");
+    }
+    return weights;
+}
+
+// Map views: a zoom from the weights, a centre scattered around the
+// configured one, then every tile of the view, the way a browser asks.
+std::vector<std::string> generate_targets(const WorkloadOptions& options) {
+    std::mt19937 rng(options.seed);
+    std::vector<int> zooms;
+    std::vector<double> weights;
+    for (const auto& entry : options.zoom_weights) {
+        zooms.push_back(entry.first);
+        weights.push_back(entry.second);
+    }
+    std::discrete_distribution<std::size_t> pick_zoom(weights.begin(), weights.end());
+    std::normal_distribution<double> scatter(0.0, options.spread);
+
+    std::vector<std::string> targets;
+    targets.reserve(options.requests);
+    while (targets.size() < options.requests) {
+        const int z = zooms[pick_zoom(rng)];
+        const double lon = std::clamp(options.center_lon + scatter(rng), -179.999, 179.999);
+        const double lat = std::clamp(options.center_lat + scatter(rng), -85.0, 85.0);
+        const int n = 1 << z;
+        const double lat_rad = lat * M_PI / 180.0;
+        const int cx = static_cast<int>((lon + 180.0) / 360.0 * n);
+        const int cy = static_cast<int>((1.0 - std::asinh(std::tan(lat_rad)) / M_PI) / 2.0 * n);
+        for (int dy = 0; dy < options.view_height && targets.size() < options.requests; ++dy) {
+            for (int dx = 0; dx < options.view_width && targets.size() < options.requests; ++dx) {
+                const int x = cx - options.view_width / 2 + dx;
+                const int y = cy - options.view_height / 2 + dy;
+                if (x >= 0 && x < n && y >= 0 && y < n) {
+                    targets.push_back("/" + std::to_string(z) + "/" + std::to_string(x) + "/" + std::to_string(y) + "." +
+                                      options.format);
+                }
+            }
+        }
+    }
+    return targets;
+}
+
+// Value of "key=" in an access log line, or -1
+long log_field(const std::string& line, const std::string& key) {
+    const std::size_t at = line.find(" " + key + "=");
+    return at == std::string::npos ? -1 : std::strtol(line.c_str() + at + key.size() + 2, nullptr, 10);
+}
+
+// Text of "key=" in an access log line, empty if it is not there
+std::string log_text(const std::string& line, const std::string& key) {
+    const std::size_t at = line.find(" " + key + "=");
+    if (at == std::string::npos) {
+        return {};
+    }
+    const std::size_t start = at + key.size() + 2;
+    return line.substr(start, line.find(' ', start) - start);
+}
+
+// One request per line, in any of these forms:
+//   /14/8185/5447.png                               (a bare target)
+//   ... "GET /14/8185/5447.png HTTP/1.1" ...          (common log format)
+//   INFO: tile z=14 x=8185 y=5447 scale=2 style=dark format=png ...
+//                                                   (our own access log; without
+//                                                   scale and style, the default)
+std::vector<std::string> read_targets(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    std::vector<std::string> targets;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::size_t get = line.find("\"GET ");
+        if (!line.empty() && line[0] == '/') {
+            targets.push_back(line.substr(0, line.find_first_of(" \t\r")));
+        } else if (get != std::string::npos) {
+            const std::size_t start = get + 5;
+            targets.push_back(line.substr(start, line.find(' ', start) - start));
+        } else if (line.find(" tile z=") != std::string::npos) {
+            const long z = log_field(line, "z"), x = log_field(line, "x"), y = log_field(line, "y");
+            const long scale = log_field(line, "scale");
+            const std::string style = log_text(line, "style");
+            const std::string format = log_text(line, "format");
+            if (z < 0 || x < 0 || y < 0 || format.empty()) {
+                continue;
+            }
+            targets.push_back((style.empty() || style == "-" ? "" : "/" + style) + "/" + std::to_string(z) + "/" +
+                              std::to_string(x) + "/" + std::to_string(y) +
+                              (scale > 1 ? "@" + std::to_string(scale) + "x" : "") + "." + format);
+        }
+    }
+    if (targets.empty()) {
+        throw std::runtime_error("No requests found in " + path);
+    }
+    return targets;
+}
+
+// --- Load ---
+
+struct RunOptions {
+    bool open_loop = false;
+    std::size_t connections = 16; // Closed: concurrency. Open: most connections opened.
+    double rate = 1000;           // Open loop, requests per second
+    std::chrono::seconds timeout{30};
+    std::string host = "127.0.0.1";
+};
+
+struct Results {
+    std::vector<double> latencies_ms; // Completed requests, any status
+    std::map<unsigned int, std::uint64_t> statuses;
+    std::uint64_t errors = 0; // Connection failures and timeouts
+    std::uint64_t bytes = 0;
+
+    void merge(const Results& other) {
+        latencies_ms.insert(latencies_ms.end(), other.latencies_ms.begin(), other.latencies_ms.end());
+        for (const auto& entry : other.statuses) {
+            statuses[entry.first] += entry.second;
+        }
+        errors += other.errors;
+        bytes += other.bytes;
+    }
+};
+
+class Worker;
+
+// One keep-alive connection, one request at a time
+class Connection : public std::enable_shared_from_this<Connection> {
+    Worker& worker_;
+    beast::tcp_stream stream_;
+    beast::flat_buffer buffer_;
+    http::request<http::empty_body> req_;
+    std::optional<http::response_parser<http::string_body>> parser_;
+    Clock::time_point start_; // When the request was due
+    bool connected_ = false;
+
+public:
+    Connection(Worker& worker, net::io_context& ioc);
+
+    void send(const std::string& target, Clock::time_point due);
+
+private:
+    void on_connect(beast::error_code ec);
+    void do_write();
+    void on_write(beast::error_code ec, std::size_t);
+    void on_read(beast::error_code ec, std::size_t);
+    void fail();
+};
+
+// One I/O thread with its own connections and its share of the load
+class Worker {
+public:
+    Worker(const RunOptions& options, const tcp::resolver::results_type& endpoints,
+           const std::vector<std::string>& targets, std::atomic<std::size_t>& next,
+           std::size_t connections, double rate, std::uint32_t seed)
+        : options_(options),
+          endpoints_(endpoints),
+          targets_(targets),
+          next_(next),
+          connections_(connections),
+          rate_(rate),
+          arrivals_(ioc_),
+          rng_(seed) {}
+
+    Results run() {
+        if (options_.open_loop) {
+            next_arrival_ = Clock::now();
+            schedule_arrival();
+        } else {
+            for (std::size_t i = 0; i < connections_; ++i) {
+                auto connection = std::make_shared<Connection>(*this, ioc_);
+                ++open_;
+                idle(connection);
+            }
+        }
+        ioc_.run();
+        return std::move(results_);
+    }
+
+    // A connection has nothing to do: give it the next request or park it
+    void idle(const std::shared_ptr<Connection>& connection) {
+        if (options_.open_loop) {
+            if (!queued_.empty()) {
+                auto job = queued_.front();
+                queued_.pop_front();
+                connection->send(targets_[job.first], job.second);
+            } else {
+                idle_.push_back(connection);
+            }
+            return;
+        }
+        const std::size_t index = next_.fetch_add(1, std::memory_order_relaxed);
+        if (index < targets_.size()) {
+            connection->send(targets_[index], Clock::now());
+        }
+        // else the connection is dropped, and with the last one the run ends
+    }
+
+    void record(Clock::time_point due, unsigned int status, std::size_t bytes) {
+        results_.latencies_ms.push_back(std::chrono::duration<double, std::milli>(Clock::now() - due).count());
+        ++results_.statuses[status];
+        results_.bytes += bytes;
+    }
+
+    void record_error() { ++results_.errors; }
+
+    const tcp::resolver::results_type& endpoints() const { return endpoints_; }
+    const RunOptions& options() const { return options_; }
+
+private:
+    // Open loop: the next arrival is due whatever the server is doing
+    void schedule_arrival() {
+        const std::size_t index = next_.fetch_add(1, std::memory_order_relaxed);
+        if (index >= targets_.size()) {
+            idle_.clear(); // No more work; let the parked connections go
+            return;
+        }
+        const Clock::time_point due = next_arrival_;
+        std::exponential_distribution<double> gap(rate_);
+        next_arrival_ += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(gap(rng_)));
+
+        arrivals_.expires_at(due);
+        arrivals_.async_wait([this, index, due](beast::error_code) {
+            if (!idle_.empty()) {
+                auto connection = idle_.back();
+                idle_.pop_back();
+                connection->send(targets_[index], due);
+            } else if (open_ < connections_) {
+                ++open_;
+                std::make_shared<Connection>(*this, ioc_)->send(targets_[index], due);
+            } else {
+                queued_.emplace_back(index, due); // Waits for a connection; the wait is part of its latency
+            }
+            schedule_arrival();
+        });
+    }
+
+    const RunOptions& options_;
+    const tcp::resolver::results_type& endpoints_;
+    const std::vector<std::string>& targets_;
+    std::atomic<std::size_t>& next_; // Next request of the list, shared by all workers
+    std::size_t connections_;
+    double rate_;
+
+    net::io_context ioc_;
+    net::steady_timer arrivals_;
+    std::mt19937 rng_;
+    Clock::time_point next_arrival_;
+    std::size_t open_ = 0;
+    std::vector<std::shared_ptr<Connection>> idle_;
+    std::deque<std::pair<std::size_t, Clock::time_point>> queued_;
+    Results results_;
+};
+
+Connection::Connection(Worker& worker, net::io_context& ioc)
+    : worker_(worker), stream_(ioc) {
+    req_.version(11);
+    req_.method(http::verb::get);
+    req_.set(http::field::host, worker.options().host);
+    req_.set(http::field::user_agent, "load_gen");
+    req_.set(http::field::accept_encoding, "gzip");
+}
+
+void Connection::send(const std::string& target, Clock::time_point due) {
+    req_.target(target);
+    start_ = due;
+    stream_.expires_after(worker_.options().timeout);
+    if (connected_) {
+        return do_write();
+    }
+    stream_.async_connect(worker_.endpoints(), [self = shared_from_this()](beast::error_code ec, const tcp::endpoint&) {
+        self->on_connect(ec);
+    });
+}
+
+void Connection::on_connect(beast::error_code ec) {
+    if (ec) {
+        return fail();
+    }
+    connected_ = true;
+    stream_.socket().set_option(tcp::no_delay(true));
+    do_write();
+}
+
+void Connection::do_write() {
+    http::async_write(stream_, req_, beast::bind_front_handler(&Connection::on_write, shared_from_this()));
+}
+
+void Connection::on_write(beast::error_code ec, std::size_t) {
+    if (ec) {
+        return fail();
+    }
+    parser_.emplace();
+    parser_->body_limit(64 * 1024 * 1024);
+    http::async_read(stream_, buffer_, *parser_, beast::bind_front_handler(&Connection::on_read, shared_from_this()));
+}
+
+void Connection::on_read(beast::error_code ec, std::size_t) {
+    if (ec) {
+        return fail();
+    }
+    auto& res = parser_->get();
+    worker_.record(start_, res.result_int(), res.body().size());
+    if (!res.keep_alive()) {
+        beast::error_code ignored;
+        stream_.socket().shutdown(tcp::socket::shutdown_both, ignored);
+        stream_.close();
+        connected_ = false;
+    }
+    worker_.idle(shared_from_this());
+}
+
+void Connection::fail() {
+    // The request counts as an error; the next one reconnects
+    worker_.record_error();
+    stream_.close();
+    connected_ = false;
+    buffer_.clear();
+    worker_.idle(shared_from_this());
+}
+
+Results run_pass(const RunOptions& options, const tcp::resolver::results_type& endpoints,
+                 const std::vector<std::string>& targets, unsigned int threads, std::uint32_t seed,
+                 double& seconds) {
+    std::atomic<std::size_t> next{0};
+    std::vector<Results> results(threads);
+    std::vector<std::thread> pool;
+    const Clock::time_point start = Clock::now();
+    for (unsigned int t = 0; t < threads; ++t) {
+        // Connections and rate are split evenly; the list is shared, so
+        // requests still go out in about list order
+        const std::size_t connections = std::max<std::size_t>(1, options.connections / threads +
+                                                                    (t < options.connections % threads ? 1 : 0));
+        pool.emplace_back([&, t, connections] {
+            Worker worker(options, endpoints, targets, next, connections, options.rate / threads, seed + t);
+            results[t] = worker.run();
+        });
+    }
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    Results total;
+    for (const auto& result : results) {
+        total.merge(result);
+    }
+    return total;
+}
+
+void print_results(const std::string& pass, Results& results, double seconds) {
+    std::sort(results.latencies_ms.begin(), results.latencies_ms.end());
+    const std::size_t completed = results.latencies_ms.size();
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << pass << ":" << std::endl;
+    std::cout << "  requests   : " << completed << " completed, " << results.errors << " errors" << std::endl;
+    std::cout << "  statuses   :";
+    for (const auto& entry : results.statuses) {
+        std::cout << " " << entry.first << "=" << entry.second;
+    }
+    std::cout << std::endl;
+    std::cout << "  throughput : " << completed / seconds << " req/s, "
+              << results.bytes / seconds / (1024 * 1024) << " MiB/s over " << seconds << " s" << std::endl;
+    std::cout << "  latency ms : p50 " << percentile(results.latencies_ms, 0.50)
+              << "  p90 " << percentile(results.latencies_ms, 0.90)
+              << "  p99 " << percentile(results.latencies_ms, 0.99)
+              << "  p999 " << percentile(results.latencies_ms, 0.999)
+              << "  max " << (completed ? results.latencies_ms.back() : 0.0) << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    try {
+        po::options_description desc("Options");
+        desc.add_options()
+            ("help", "Show this help")
+            ("host", po::value<std::string>()->default_value("127.0.0.1"), "Server address")
+            ("port", po::value<unsigned short>()->default_value(8080), "Server port")
+            ("mode", po::value<std::string>()->default_value("closed"), "closed (fixed concurrency) or open (fixed arrival rate)")
+            ("connections", po::value<std::size_t>()->default_value(16), "Closed: concurrent connections. Open: most connections opened")
+            ("rate", po::value<double>()->default_value(1000), "Open: mean arrivals per second")
+            ("threads", po::value<unsigned int>()->default_value(1), "Client I/O threads")
+            ("cache", po::value<std::string>()->default_value("both"), "cold, warm or both (see the top of load_gen.cpp)")
+            ("timeout", po::value<int>()->default_value(30), "Seconds before a request counts as an error")
+            ("replay", po::value<std::string>(), "Request log to replay instead of generated views")
+            ("requests", po::value<std::size_t>()->default_value(10000), "Generated: number of requests")
+            ("zoom_weights", po::value<std::string>()->default_value("10:1,11:1,12:2,13:3,14:4,15:3,16:2,17:1"),
+             "Generated: relative share of each zoom, as zoom:weight,...")
+            ("center", po::value<std::string>()->default_value("-0.1276,51.5072"), "Generated: lon,lat the views scatter around")
+            ("spread", po::value<double>()->default_value(0.25), "Generated: std deviation of view centres, in degrees")
+            ("format", po::value<std::string>()->default_value("png"), "Generated: tile extension")
+            ("seed", po::value<std::uint32_t>()->default_value(1), "Generated list and arrival times");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+        if (vm.count("help")) {
+            std::cout << "Usage: " << argv[0] << " [options]" << std::endl << desc << std::endl;
+            return 0;
+        }
+
+        RunOptions options;
+        options.host = vm["host"].as<std::string>();
+        options.open_loop = vm["mode"].as<std::string>() == "open";
+        if (!options.open_loop && vm["mode"].as<std::string>() != "closed") {
+            throw std::runtime_error("--mode must be closed or open");
+        }
+        options.connections = std::max<std::size_t>(1, vm["connections"].as<std::size_t>());
+        options.rate = vm["rate"].as<double>();
+        if (options.rate <= 0) {
+            throw std::runtime_error("--rate must be positive");
+        }
+        options.timeout = std::chrono::seconds(std::max(1, vm["timeout"].as<int>()));
+        const unsigned int threads = std::max(1u, vm["threads"].as<unsigned int>());
+        const std::string cache = vm["cache"].as<std::string>();
+        if (cache != "cold" && cache != "warm" && cache != "both") {
+            throw std::runtime_error("--cache must be cold, warm or both");
+        }
+        const std::uint32_t seed = vm["seed"].as<std::uint32_t>();
+
+        std::vector<std::string> targets;
+        if (vm.count("replay")) {
+            targets = read_targets(vm["replay"].as<std::string>());
+        } else {
+            WorkloadOptions workload;
+            workload.requests = vm["requests"].as<std::size_t>();
+            workload.zoom_weights = parse_zoom_weights(vm["zoom_weights"].as<std::string>());
+            char comma;
+            std::istringstream center(vm["center"].as<std::string>());
+            if (!(center >> workload.center_lon >> comma >> workload.center_lat) || comma != ',') {
+                throw std::runtime_error("--center must be lon,lat");
+            }
+            workload.spread = vm["spread"].as<double>();
+            workload.format = vm["format"].as<std::string>();
+            workload.seed = seed;
+            targets = generate_targets(workload);
+        }
+
+        net::io_context resolver_ioc;
+        tcp::resolver resolver(resolver_ioc);
+        const auto endpoints = resolver.resolve(options.host, std::to_string(vm["port"].as<unsigned short>()));
+
+        std::cout << targets.size() << " requests, " << (options.open_loop ? "open" : "closed") << " loop, ";
+        if (options.open_loop) {
+            std::cout << options.rate << " req/s, up to ";
+        }
+        std::cout << options.connections << " connections, " << threads << " thread(s)" << std::endl;
+
+        double seconds = 0;
+        if (cache == "warm") {
+            run_pass(options, endpoints, targets, threads, seed, seconds); // Fills the server's caches
+        }
+        Results first = run_pass(options, endpoints, targets, threads, seed, seconds);
+        print_results(cache == "warm" ? "warm" : "cold", first, seconds);
+        if (cache == "both") {
+            Results second = run_pass(options, endpoints, targets, threads, seed, seconds);
+            print_results("warm", second, seconds);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+// Microbenchmark: per-tile map setup cost.
+//
+// Compares the old path (copy the prototype Map, resize, zoom_to_box) with
+// leasing a pre-built Map from the MapPool (lease, zoom_to_box, return).
+//
+// Usage: map_setup_bench <style.xml> <data.pbf> [iterations]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "tile_renderer.hpp"
+#include "bench_util.hpp"
+
+namespace {
+
+// Walk a fixed z14 neighbourhood so both variants see identical extents
+mapnik::box2d<double> bench_bbox(int i) {
+    return tileToMercatorBoundingBox(14, 8185 + (i % 16), 5447 + (i / 16) % 16);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <style.xml> <data.pbf> [iterations]" << std::endl;
+        return 1;
+    }
+    const int iterations = argc > 3 ? std::atoi(argv[3]) : 2000;
+
+    try {
+        TileRenderer renderer(argv[1], argv[2]);
+        const mapnik::Map& prototype = renderer.prototype();
+        const unsigned int tile_size = renderer.tile_size();
+
+        double copy_ns = time_per_op_ns(iterations, [&](int i) {
+            mapnik::Map map_instance = prototype; // What render_tile used to do
+            map_instance.resize(tile_size, tile_size);
+            map_instance.zoom_to_box(bench_bbox(i));
+        });
+
+        double pool_ns = time_per_op_ns(iterations, [&](int i) {
+            MapPool::Lease map = renderer.map_pool().lease();
+            map->zoom_to_box(bench_bbox(i));
+        });
+
+        std::cout << "map setup, copy prototype : " << copy_ns / 1000.0 << " us/tile" << std::endl;
+        std::cout << "map setup, pooled lease   : " << pool_ns / 1000.0 << " us/tile" << std::endl;
+        std::cout << "speedup                   : " << copy_ns / pool_ns << "x" << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+// Microbenchmarks: the per-tile stages of a raster render.
+//
+// Times each stage on its own over a fixed z14 neighbourhood: tile bounds,
+// map setup (lease + zoom_to_box), AGG rendering, encoding, and the whole
+// render_tile / render_metatile calls. Every line is the best of a few runs,
+// in microseconds per operation, so two builds can be compared line by line.
+//
+// Usage: render_bench <style.xml> <data> [iterations]
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "tile_renderer.hpp"
+#include "bench_util.hpp"
+
+namespace {
+
+constexpr int kRepetitions = 3;
+
+// Same tiles for every stage: 16x16 tiles around z14 8185/5447
+int bench_x(int i) { return 8185 + (i % 16); }
+int bench_y(int i) { return 5447 + (i / 16) % 16; }
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <style.xml> <data> [iterations]" << std::endl;
+        return 1;
+    }
+    const int iterations = argc > 3 ? std::atoi(argv[3]) : 200;
+
+    try {
+        TileRenderer renderer(argv[1], argv[2]);
+        const unsigned int tile_size = renderer.tile_size();
+
+        // Pure arithmetic, so it gets many more iterations than the rest
+        const int bounds_iterations = iterations * 10000;
+        report("tileToMercatorBoundingBox", best_per_op_ns(bounds_iterations, kRepetitions, [](int i) {
+            do_not_optimize(tileToMercatorBoundingBox(14, bench_x(i), bench_y(i)));
+        }), bounds_iterations);
+
+        report("map setup (lease + zoom_to_box)", best_per_op_ns(iterations * 10, kRepetitions, [&](int i) {
+            MapPool::Lease map = renderer.map_pool().lease();
+            map->zoom_to_box(tileToMercatorBoundingBox(14, bench_x(i), bench_y(i)));
+        }), iterations * 10);
+
+        // AGG alone, on a map that is already set up
+        mapnik::image_rgba8 image(tile_size, tile_size);
+        report("render (agg_renderer::apply)", best_per_op_ns(iterations, kRepetitions, [&](int i) {
+            MapPool::Lease map = renderer.map_pool().lease();
+            map->zoom_to_box(tileToMercatorBoundingBox(14, bench_x(i), bench_y(i)));
+            mapnik::agg_renderer<mapnik::image_rgba8> agg(*map, image);
+            agg.apply();
+        }), iterations);
+
+        // Encode the last rendered tile over and over; with a quantizing
+        // format this is most of the cost of a tile
+        std::string encoded;
+        report("encode (" + renderer.encoder().extension() + ")", best_per_op_ns(iterations, kRepetitions, [&](int) {
+            renderer.encoder().encode(image, encoded);
+            do_not_optimize(encoded.data());
+        }), iterations);
+        std::cout << "  (" << encoded.size() << " bytes)" << std::endl;
+
+        // End to end, including the empty-tile shortcut where it applies
+        report("render_tile", best_per_op_ns(iterations, kRepetitions, [&](int i) {
+            do_not_optimize(renderer.render_tile(14, bench_x(i), bench_y(i)).get());
+        }), iterations);
+
+        // The same tiles at twice the density; the geostore queries are
+        // shared with the standard ones through the query cache
+        report("render_tile @2x", best_per_op_ns(iterations, kRepetitions, [&](int i) {
+            do_not_optimize(renderer.render_tile(14, bench_x(i), bench_y(i), 2).get());
+        }), iterations);
+
+        // An 8x8 metatile, per tile it yields
+        RenderOptions meta_options;
+        meta_options.metatile_size = 8;
+        TileRenderer meta_renderer(argv[1], argv[2], meta_options);
+        const int metatiles = std::max(1, iterations / 64);
+        const double metatile_ns = best_per_op_ns(metatiles, kRepetitions, [&](int i) {
+            do_not_optimize(meta_renderer.render_metatile(14, 8184 + 8 * (i % 2), 5440 + 8 * (i / 2 % 2)).size());
+        });
+        report("render_metatile 8x8, per tile", metatile_ns / 64, metatiles);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Microbenchmark: tile URL parsing.
+//
+// Compares the old handle_request path (copy the target into a std::string,
+// std::regex_match, three std::stoi, bounds via std::pow) with
+// parse_tile_route. Also counts heap allocations per parse, by hooking the
+// global operator new.
+//
+// Usage: route_bench [iterations]
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "tile_route.hpp"
+#include "bench_util.hpp"
+
+namespace {
+std::atomic<std::uint64_t> allocations{0};
+}
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+// What handle_request did before the router; returns the zoom to keep the work observable
+int regex_route(std::string_view target) {
+    static const std::regex tile_regex(R"(\/(\d+)\/(\d+)\/(\d+)\.(png|webp|jpg|mvt|pbf))");
+    std::smatch match;
+    std::string target_str(target.data(), target.size());
+    if (!std::regex_match(target_str, match, tile_regex)) {
+        return -1;
+    }
+    int z = std::stoi(match[1].str());
+    int x = std::stoi(match[2].str());
+    int y = std::stoi(match[3].str());
+    if (z < 0 || z > 20) {
+        return -1;
+    }
+    double max_coord = std::pow(2.0, z);
+    if (x < 0 || x >= max_coord || y < 0 || y >= max_coord) {
+        return -1;
+    }
+    return z;
+}
+
+int fast_route(std::string_view target) {
+    TileRoute route;
+    return parse_tile_route(target, route) == RouteStatus::Ok ? route.z : -1;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const int iterations = argc > 1 ? std::atoi(argv[1]) : 1000000;
+
+    // A z14 neighbourhood, like a map view being panned, with the odd miss
+    std::vector<std::string> targets;
+    for (int i = 0; i < 64; ++i) {
+        targets.push_back("/14/" + std::to_string(8185 + i % 8) + "/" + std::to_string(5447 + i / 8) +
+                          (i % 4 == 3 ? ".mvt" : ".png"));
+    }
+    targets.push_back("/favicon.ico");
+    const std::size_t n = targets.size();
+
+    long checksum = 0; // Keeps the optimizer from dropping the parses
+    std::uint64_t before = allocations.load();
+    double regex_ns = time_per_op_ns(iterations, [&](int i) { checksum += regex_route(targets[i % n]); });
+    const double regex_allocs = static_cast<double>(allocations.load() - before) / (iterations + 1);
+
+    before = allocations.load();
+    double fast_ns = time_per_op_ns(iterations, [&](int i) { checksum += fast_route(targets[i % n]); });
+    const double fast_allocs = static_cast<double>(allocations.load() - before) / (iterations + 1);
+
+    std::cout << "route, regex + stoi : " << regex_ns << " ns/request, " << regex_allocs << " allocations" << std::endl;
+    std::cout << "route, string_view  : " << fast_ns << " ns/request, " << fast_allocs << " allocations" << std::endl;
+    std::cout << "speedup             : " << regex_ns / fast_ns << "x" << std::endl;
+    std::cout << "(checksum " << checksum << ")" << std::endl;
+    return 0;
+}
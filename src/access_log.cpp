@@ -0,0 +1,65 @@
+#include "access_log.hpp"
+
+#include <cstdio>
+#include <iostream>
+
+AccessLog::AccessLog(unsigned int sample_every, std::size_t max_queue)
+    : sample_every_(sample_every > 0 ? sample_every : 1), max_queue_(max_queue), thread_([this] { run(); }) {}
+
+AccessLog::~AccessLog() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+bool AccessLog::sample() {
+    // Per-thread countdown; threads sample independently, which is
+    // close enough to one in N overall
+    thread_local unsigned int countdown = 0;
+    if (countdown == 0) {
+        countdown = sample_every_;
+    }
+    return --countdown == 0;
+}
+
+void AccessLog::log(const Entry& entry) {
+    char line[256];
+    const long long us = static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(entry.elapsed).count());
+    // Everything needed to request the same tile again (load_gen --replay); "-" is the default style
+    std::snprintf(line, sizeof line, "INFO: tile z=%d x=%d y=%d scale=%d style=%s format=%s status=%u cache=%s bytes=%llu us=%lld",
+                  entry.z, entry.x, entry.y, entry.scale, entry.style[0] ? entry.style : "-", entry.format,
+                  entry.status, entry.cache_hit ? "hit" : "miss",
+                  static_cast<unsigned long long>(entry.bytes), us);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queue_.size() >= max_queue_) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        queue_.emplace_back(line);
+    }
+    cv_.notify_one();
+}
+
+void AccessLog::run() {
+    std::deque<std::string> batch;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return; // Stopping and nothing left to write
+            }
+            batch.swap(queue_);
+        }
+        // Written outside the lock, one flush per batch
+        for (const std::string& line : batch) {
+            std::clog << line << '\n';
+        }
+        std::clog.flush();
+        batch.clear();
+    }
+}
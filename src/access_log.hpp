@@ -0,0 +1,58 @@
+#ifndef ACCESS_LOG_HPP
+#define ACCESS_LOG_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "metrics.hpp"
+
+// Sampled, asynchronous log of tile requests.
+//
+// One in `sample_every` requests is logged. The line is formatted on the
+// calling thread and handed to a background thread that writes it to
+// std::clog, so no request waits on the stream lock or the terminal.
+// When more than `max_queue` lines are waiting, new ones are dropped.
+class AccessLog {
+public:
+    struct Entry {
+        int z, x, y;
+        int scale;          // n of @{n}x, 1 for standard tiles
+        const char* style;  // Tileset name from the URL, "" for the default style
+        const char* format; // Extension, "png", "mvt", ...
+        unsigned status;
+        bool cache_hit;     // Answered from the memory cache
+        std::uint64_t bytes;
+        Metrics::Clock::duration elapsed;
+    };
+
+    explicit AccessLog(unsigned int sample_every, std::size_t max_queue = 4096);
+    ~AccessLog();
+
+    AccessLog(const AccessLog&) = delete;
+    AccessLog& operator=(const AccessLog&) = delete;
+
+    // Next in line for the sample? Lock-free; call before building an Entry.
+    bool sample();
+    void log(const Entry& entry);
+
+    std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    void run();
+
+    unsigned int sample_every_;
+    std::size_t max_queue_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::string> queue_;
+    bool stopping_ = false;
+    std::atomic<std::uint64_t> dropped_{0};
+    std::thread thread_;
+};
+
+#endif // ACCESS_LOG_HPP
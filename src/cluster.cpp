@@ -0,0 +1,189 @@
+#include "cluster.hpp"
+
+#include <boost/asio/strand.hpp>
+#include <boost/beast/version.hpp> // For BOOST_BEAST_VERSION_STRING
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
+
+namespace {
+
+constexpr int kVirtualNodes = 128;                 // Points per peer on the ring; evens out the shares
+constexpr std::size_t kIdleConnections = 16;       // Kept open per peer
+constexpr std::chrono::seconds kConnectTimeout{1}; // A dead peer should not hold up the fallback for long
+
+std::int64_t steady_now() {
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+} // namespace
+
+struct Cluster::Peer {
+    std::string host; // For the Host header
+    tcp::resolver::results_type endpoints;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<beast::tcp_stream>> idle; // Keep-alive connections ready for reuse
+    std::atomic<std::int64_t> down_until{0};             // steady_clock ticks
+};
+
+// One request to a peer and its response
+struct Cluster::Exchange {
+    std::size_t peer = 0;
+    std::unique_ptr<beast::tcp_stream> stream;
+    bool reused = false; // Taken from the idle pool; the peer may have closed it meanwhile
+    http::request<http::empty_body> req;
+    beast::flat_buffer buffer;
+    Response res;
+    FetchCallback done;
+};
+
+Cluster::Cluster(net::io_context& ioc, std::vector<std::string> peers, const std::string& self,
+                 std::chrono::seconds timeout, std::chrono::seconds retry_after)
+    : ioc_(ioc), names_(std::move(peers)), timeout_(timeout), retry_after_(retry_after) {
+    // Same list, same indices on every node, whatever order it was given in
+    std::sort(names_.begin(), names_.end());
+    names_.erase(std::unique(names_.begin(), names_.end()), names_.end());
+    self_ = names_.size();
+
+    tcp::resolver resolver(ioc_);
+    for (std::size_t i = 0; i < names_.size(); ++i) {
+        const std::string& name = names_[i];
+        const std::size_t colon = name.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == name.size()) {
+            throw std::runtime_error("Invalid peer '" + name + "', expected host:port");
+        }
+        auto peer = std::make_unique<Peer>();
+        peer->host = name;
+        beast::error_code ec;
+        peer->endpoints = resolver.resolve(name.substr(0, colon), name.substr(colon + 1), ec);
+        if (ec) {
+            throw std::runtime_error("Cannot resolve peer " + name + ": " + ec.message());
+        }
+        peers_.push_back(std::move(peer));
+        if (name == self) {
+            self_ = i;
+        }
+
+        // The ring is built from the names alone, so every node builds the same one
+        for (int v = 0; v < kVirtualNodes; ++v) {
+            const std::string point = name + "#" + std::to_string(v);
+            ring_.emplace_back(content_hash(point), i);
+        }
+    }
+    if (self_ == names_.size()) {
+        throw std::runtime_error("This node (" + self + ") is not in the peer list");
+    }
+    std::sort(ring_.begin(), ring_.end());
+}
+
+Cluster::~Cluster() = default;
+
+std::size_t Cluster::owner(const TileKey& metatile) const {
+    // The first point at or after the key's hash, wrapping around
+    const std::uint64_t h = TileKeyHash{}(metatile);
+    auto it = std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(h, std::size_t(0)));
+    return (it == ring_.end() ? ring_.front() : *it).second;
+}
+
+bool Cluster::available(std::size_t peer) const {
+    return steady_now() >= peers_[peer]->down_until.load(std::memory_order_relaxed);
+}
+
+std::size_t Cluster::peers_down() const {
+    std::size_t down = 0;
+    for (std::size_t i = 0; i < peers_.size(); ++i) {
+        if (!available(i)) {
+            ++down;
+        }
+    }
+    return down;
+}
+
+void Cluster::mark_down(std::size_t peer) {
+    const std::int64_t now = steady_now();
+    const std::int64_t until = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(retry_after_).count();
+    if (peers_[peer]->down_until.exchange(until, std::memory_order_relaxed) < now) {
+        std::cerr << "WARNING: Peer " << names_[peer] << " unreachable, rendering its tiles locally for "
+                  << retry_after_.count() << "s" << std::endl;
+    }
+}
+
+void Cluster::fetch(std::size_t peer, const std::string& target, FetchCallback done) {
+    auto exchange = std::make_shared<Exchange>();
+    exchange->peer = peer;
+    exchange->done = std::move(done);
+    exchange->req = {http::verb::get, target, 11};
+    exchange->req.set(http::field::host, peers_[peer]->host);
+    exchange->req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+    exchange->req.set(http::field::accept_encoding, "gzip"); // Vector tiles the way they are cached
+    exchange->req.set(kPeerHeader, names_[self_]);
+    exchange->req.keep_alive(true);
+    {
+        std::lock_guard<std::mutex> lock(peers_[peer]->mutex);
+        if (!peers_[peer]->idle.empty()) {
+            exchange->stream = std::move(peers_[peer]->idle.back());
+            peers_[peer]->idle.pop_back();
+            exchange->reused = true;
+        }
+    }
+    start(exchange);
+}
+
+void Cluster::start(const std::shared_ptr<Exchange>& exchange) {
+    if (exchange->stream) {
+        return send(exchange);
+    }
+    exchange->stream = std::make_unique<beast::tcp_stream>(net::make_strand(ioc_));
+    exchange->stream->expires_after(kConnectTimeout);
+    exchange->stream->async_connect(peers_[exchange->peer]->endpoints,
+        [this, exchange](beast::error_code ec, const tcp::endpoint&) {
+            if (ec) {
+                return finish(exchange, ec);
+            }
+            send(exchange);
+        });
+}
+
+void Cluster::send(const std::shared_ptr<Exchange>& exchange) {
+    // The peer may have to render the tile first, so this is generous
+    exchange->stream->expires_after(timeout_);
+    http::async_write(*exchange->stream, exchange->req, [this, exchange](beast::error_code ec, std::size_t) {
+        if (ec) {
+            return finish(exchange, ec);
+        }
+        http::async_read(*exchange->stream, exchange->buffer, exchange->res,
+            [this, exchange](beast::error_code ec, std::size_t) {
+                finish(exchange, ec);
+            });
+    });
+}
+
+void Cluster::finish(const std::shared_ptr<Exchange>& exchange, beast::error_code ec) {
+    if (ec) {
+        if (exchange->reused && ec != beast::error::timeout) {
+            // Most likely the peer closed the idle connection; once more on a new one
+            exchange->reused = false;
+            exchange->stream.reset();
+            exchange->buffer.clear();
+            exchange->res = {};
+            return start(exchange);
+        }
+        mark_down(exchange->peer);
+        return exchange->done(false, {});
+    }
+
+    if (exchange->res.keep_alive()) {
+        exchange->stream->expires_never();
+        Peer& peer = *peers_[exchange->peer];
+        std::lock_guard<std::mutex> lock(peer.mutex);
+        if (peer.idle.size() < kIdleConnections) {
+            peer.idle.push_back(std::move(exchange->stream));
+        }
+    }
+    exchange->done(true, std::move(exchange->res));
+}
@@ -0,0 +1,82 @@
+#ifndef CLUSTER_HPP
+#define CLUSTER_HPP
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tile.hpp"
+
+// Several servers sharing the work: every metatile has an owner among a
+// static list of peers, picked by consistent hashing, so each one is
+// rendered and cached by one node instead of by all of them. Adding or
+// removing a peer only moves the metatiles next to it on the ring.
+//
+// The other nodes ask the owner over plain HTTP (keep-alive connections,
+// pooled per peer). A peer that cannot be reached is left alone for a while
+// and its tiles are rendered locally meanwhile.
+//
+// Every node has to be started with the same peer list; they need not agree
+// on the order.
+class Cluster {
+public:
+    using Response = boost::beast::http::response<boost::beast::http::string_body>;
+    // Runs on a peer connection's strand. On failure `ok` is false and the
+    // response is empty.
+    using FetchCallback = std::function<void(bool ok, Response res)>;
+
+    // Marks requests sent on by a peer; they are always answered locally,
+    // so nodes with different peer lists cannot bounce a request around
+    static constexpr const char* kPeerHeader = "X-Tile-Peer";
+
+    // `peers` are host:port of every node, this one included as `self`.
+    // Throws std::runtime_error if self is not among them or a peer does not
+    // resolve.
+    Cluster(boost::asio::io_context& ioc, std::vector<std::string> peers, const std::string& self,
+            std::chrono::seconds timeout, std::chrono::seconds retry_after);
+    ~Cluster();
+
+    Cluster(const Cluster&) = delete;
+    Cluster& operator=(const Cluster&) = delete;
+
+    // Index into peers() of the node owning the metatile with this origin
+    std::size_t owner(const TileKey& metatile) const;
+    bool is_self(std::size_t peer) const { return peer == self_; }
+    // False for a while after a request to the peer failed
+    bool available(std::size_t peer) const;
+
+    // GETs `target` from the peer
+    void fetch(std::size_t peer, const std::string& target, FetchCallback done);
+
+    const std::vector<std::string>& peers() const { return names_; }
+    std::size_t peers_down() const;
+
+private:
+    struct Peer;
+    struct Exchange;
+
+    void start(const std::shared_ptr<Exchange>& exchange);
+    void send(const std::shared_ptr<Exchange>& exchange);
+    void finish(const std::shared_ptr<Exchange>& exchange, boost::beast::error_code ec);
+    void mark_down(std::size_t peer);
+
+    boost::asio::io_context& ioc_;
+    std::vector<std::string> names_;
+    std::size_t self_;
+    std::chrono::seconds timeout_;
+    std::chrono::seconds retry_after_;
+    std::vector<std::unique_ptr<Peer>> peers_;
+    std::vector<std::pair<std::uint64_t, std::size_t>> ring_; // Point on the ring, peer; sorted
+};
+
+#endif // CLUSTER_HPP
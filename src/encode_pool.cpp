@@ -0,0 +1,106 @@
+#include "encode_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+// The slices of one run(). Helpers may take their queue entry after the
+// batch is done; they find nothing left to claim and never touch the task,
+// which only lives as long as run().
+struct EncodePool::Batch {
+    const std::function<void(std::size_t)>* task = nullptr;
+    std::size_t count = 0;
+    std::atomic<std::size_t> next{0}; // Next slice to claim
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::size_t finished = 0; // Slices done, with the mutex held
+    std::exception_ptr error;
+};
+
+EncodePool::EncodePool(unsigned int helpers) {
+    threads_.reserve(helpers);
+    for (unsigned int i = 0; i < helpers; ++i) {
+        threads_.emplace_back([this] { helper_loop(); });
+    }
+}
+
+EncodePool::~EncodePool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) {
+        t.join();
+    }
+}
+
+void EncodePool::run(std::size_t count, const std::function<void(std::size_t)>& task) {
+    if (count == 0) {
+        return;
+    }
+    auto batch = std::make_shared<Batch>();
+    batch->task = &task;
+    batch->count = count;
+
+    // Invite as many helpers as there are slices besides the one this thread starts on
+    const std::size_t invited = std::min<std::size_t>(threads_.size(), count - 1);
+    if (invited > 0) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.insert(queue_.end(), invited, batch);
+        }
+        if (invited == 1) {
+            cv_.notify_one();
+        } else {
+            cv_.notify_all();
+        }
+    }
+
+    work(*batch);
+
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->cv.wait(lock, [&] { return batch->finished == count; });
+    if (batch->error) {
+        std::rethrow_exception(batch->error);
+    }
+}
+
+void EncodePool::work(Batch& batch) {
+    for (;;) {
+        const std::size_t i = batch.next.fetch_add(1, std::memory_order_relaxed);
+        if (i >= batch.count) {
+            return;
+        }
+        std::exception_ptr error;
+        try {
+            (*batch.task)(i);
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> lock(batch.mutex);
+        if (error && !batch.error) {
+            batch.error = error;
+        }
+        if (++batch.finished == batch.count) {
+            batch.cv.notify_one(); // Only run() waits on it
+        }
+    }
+}
+
+void EncodePool::helper_loop() {
+    for (;;) {
+        std::shared_ptr<Batch> batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return; // Stopping
+            }
+            batch = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        work(*batch);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef ENCODE_POOL_HPP
+#define ENCODE_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of helper threads that encode the slices of metatiles, started
+// once and shared by the renderers of every style (and their replacements
+// after a reload). All render threads share it, so the number of threads
+// encoding at once stays bounded however many styles and metatiles there are.
+//
+// The render thread works through its slices itself and the helpers join in
+// as they come free; a render never waits for a helper that is busy with
+// another metatile.
+class EncodePool {
+public:
+    // 0 helpers: run() does everything on the calling thread
+    explicit EncodePool(unsigned int helpers);
+    ~EncodePool();
+
+    EncodePool(const EncodePool&) = delete;
+    EncodePool& operator=(const EncodePool&) = delete;
+
+    // Calls task(i) once for every i < count, and returns when all calls
+    // have. Rethrows the first exception a call threw.
+    void run(std::size_t count, const std::function<void(std::size_t)>& task);
+
+    unsigned int helpers() const { return static_cast<unsigned int>(threads_.size()); }
+
+private:
+    struct Batch;
+
+    void helper_loop();
+    static void work(Batch& batch);
+
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<Batch>> queue_; // One entry per helper invited to a batch
+    bool stopping_ = false;
+};
+
+#endif // ENCODE_POOL_HPP
@@ -0,0 +1,134 @@
+#include "generalize.hpp"
+#include "projection.hpp" // For resolutionForZoom
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace {
+
+// Squared distance from p to the segment a-b
+double segment_distance_sq(const GeoPoint& p, const GeoPoint& a, const GeoPoint& b) {
+    const double ax = a.x, ay = a.y;
+    const double dx = static_cast<double>(b.x) - ax;
+    const double dy = static_cast<double>(b.y) - ay;
+    double t = 0.0;
+    const double len_sq = dx * dx + dy * dy;
+    if (len_sq > 0.0) {
+        t = ((p.x - ax) * dx + (p.y - ay) * dy) / len_sq;
+        t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+    }
+    const double ex = ax + t * dx - p.x;
+    const double ey = ay + t * dy - p.y;
+    return ex * ex + ey * ey;
+}
+
+} // namespace
+
+std::vector<GeoPoint> simplify_douglas_peucker(const std::vector<GeoPoint>& points, double tolerance) {
+    if (points.size() < 3 || tolerance <= 0.0) {
+        return points;
+    }
+
+    const double tolerance_sq = tolerance * tolerance;
+    std::vector<char> keep(points.size(), 0);
+    keep.front() = keep.back() = 1;
+
+    // Explicit stack instead of recursion: long coastlines would blow the call stack
+    std::vector<std::pair<std::size_t, std::size_t>> stack;
+    stack.emplace_back(0, points.size() - 1);
+    while (!stack.empty()) {
+        auto [first, last] = stack.back();
+        stack.pop_back();
+
+        double max_sq = 0.0;
+        std::size_t max_index = first;
+        for (std::size_t i = first + 1; i < last; ++i) {
+            double d = segment_distance_sq(points[i], points[first], points[last]);
+            if (d > max_sq) {
+                max_sq = d;
+                max_index = i;
+            }
+        }
+        if (max_sq > tolerance_sq) {
+            keep[max_index] = 1;
+            stack.emplace_back(first, max_index);
+            stack.emplace_back(max_index, last);
+        }
+    }
+
+    std::vector<GeoPoint> out;
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        if (keep[i]) {
+            out.push_back(points[i]);
+        }
+    }
+    return out;
+}
+
+double ring_area(const std::vector<GeoPoint>& ring) {
+    if (ring.size() < 3) {
+        return 0.0;
+    }
+    double twice_area = 0.0;
+    for (std::size_t i = 0, j = ring.size() - 1; i < ring.size(); j = i++) {
+        twice_area += (static_cast<double>(ring[j].x) + ring[i].x) * (static_cast<double>(ring[j].y) - ring[i].y);
+    }
+    return std::fabs(twice_area) / 2.0;
+}
+
+bool generalize_for_zoom(const GeoFeature& feature, int zoom, const GeneralizeOptions& options,
+                         std::vector<GeoPoint>& out) {
+    // Pixel size at the finest zoom this level serves, in stored units (cm)
+    const double pixel = resolutionForZoom(zoom) * 100.0;
+
+    switch (feature.type) {
+        case GeoType::Point:
+            out = feature.coords;
+            return true;
+
+        case GeoType::LineString: {
+            std::int32_t minx = feature.coords.front().x, maxx = minx;
+            std::int32_t miny = feature.coords.front().y, maxy = miny;
+            for (const GeoPoint& p : feature.coords) {
+                minx = std::min(minx, p.x); maxx = std::max(maxx, p.x);
+                miny = std::min(miny, p.y); maxy = std::max(maxy, p.y);
+            }
+            if (std::max(maxx - minx, maxy - miny) < pixel) {
+                return false; // Collapses into a single pixel
+            }
+            out = simplify_douglas_peucker(feature.coords, options.tolerance_px * pixel);
+            return out.size() >= 2;
+        }
+
+        case GeoType::Polygon: {
+            // Each ring on its own; holes too small to see go, and without
+            // its outer ring the polygon goes
+            const double min_area = options.min_area_px * pixel * pixel;
+            out.clear();
+            std::vector<GeoPoint> ring;
+            for (std::size_t begin = 0; begin < feature.coords.size();) {
+                auto end = std::find_if(feature.coords.begin() + begin, feature.coords.end(), is_ring_break);
+                ring.assign(feature.coords.begin() + begin, end);
+                const bool outer = begin == 0;
+                begin = static_cast<std::size_t>(end - feature.coords.begin()) + 1;
+
+                if (ring_area(ring) < min_area) {
+                    if (outer) return false;
+                    continue;
+                }
+                ring = simplify_douglas_peucker(ring, options.tolerance_px * pixel);
+                if (ring.size() < 4) { // No longer a closed ring with some area
+                    if (outer) return false;
+                    continue;
+                }
+                if (!outer) {
+                    out.push_back(kRingBreak);
+                }
+                out.insert(out.end(), ring.begin(), ring.end());
+            }
+            return !out.empty();
+        }
+    }
+    return false;
+}
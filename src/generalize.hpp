@@ -0,0 +1,27 @@
+#ifndef GENERALIZE_HPP
+#define GENERALIZE_HPP
+
+#include <vector>
+
+#include "geo_store.hpp"
+
+// Geometry generalization used by osm_import to build the low-zoom levels of
+// a geostore. Coordinates and tolerances are in stored units (Mercator cm).
+
+// Douglas-Peucker simplification: drops vertices closer than `tolerance` to
+// the simplified line. Endpoints are always kept, so closed rings stay closed.
+std::vector<GeoPoint> simplify_douglas_peucker(const std::vector<GeoPoint>& points, double tolerance);
+
+// Absolute area of a closed ring (shoelace formula)
+double ring_area(const std::vector<GeoPoint>& ring);
+
+// Produces the geometry of `feature` for a level that serves zooms up to
+// `zoom`: simplified with a tolerance of options.tolerance_px pixels at that
+// zoom, and dropped (returns false) if it would cover less than
+// options.min_area_px square pixels (polygons) or a single pixel (lines).
+// Holes of polygons are simplified the same way, and left out on their own
+// when they are too small.
+bool generalize_for_zoom(const GeoFeature& feature, int zoom, const GeneralizeOptions& options,
+                         std::vector<GeoPoint>& out);
+
+#endif // GENERALIZE_HPP
@@ -0,0 +1,527 @@
+#include "geo_store.hpp"
+#include "generalize.hpp"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+
+// On-disk layout, native byte order. Sections start on 8-byte boundaries so
+// they can be used in place from the mapping.
+struct GeoStore::Header {
+    char magic[4];                 // "OMGS"
+    std::uint32_t version;
+    std::uint32_t level_count;
+    std::uint32_t reserved;
+    std::uint64_t tag_count;       // key/value pairs, shared by all levels
+    std::uint64_t string_count;
+    std::uint64_t string_bytes;
+    std::uint64_t levels_offset;   // LevelHeader[level_count]
+    std::uint64_t tags_offset;
+    std::uint64_t string_offsets_offset;
+    std::uint64_t strings_offset;
+    std::int64_t created;          // Unix time of the import
+    std::int32_t extent[4];        // minx, miny, maxx, maxy
+    std::uint64_t element_count;
+    std::uint64_t elements_offset; // ElementRef[element_count]
+};
+static_assert(sizeof(GeoStore::Header) == 112, "Geostore header layout changed");
+
+struct GeoStore::LevelHeader {
+    std::uint32_t max_zoom;
+    std::uint32_t reserved;
+    std::uint64_t feature_count;
+    std::uint64_t coord_count;
+    std::uint64_t cell_keys_offset;
+    std::uint64_t records_offset;
+    std::uint64_t coords_offset;
+};
+static_assert(sizeof(GeoStore::LevelHeader) == 48, "Geostore level header layout changed");
+
+struct GeoStore::Record {
+    std::int64_t id;
+    std::uint64_t coords_begin;
+    std::uint32_t coord_count;
+    std::uint32_t tags_begin;      // First key/value pair
+    std::uint16_t tag_count;
+    std::uint8_t type;
+    std::uint8_t reserved;
+    std::int32_t bbox[4];
+    std::uint32_t reserved2;
+};
+static_assert(sizeof(GeoStore::Record) == 48, "Geostore record layout changed");
+
+// One entry of the element index: an OSM element and a full-detail feature
+// made from it
+struct GeoStore::ElementRef {
+    std::uint64_t element;         // id << 2 | OsmType
+    std::uint32_t feature;         // Index in the full-detail level
+    std::uint32_t vertex;          // Where a node is in the feature, or kWholeFeature
+};
+static_assert(sizeof(GeoStore::ElementRef) == 16, "Geostore element index layout changed");
+
+namespace {
+
+constexpr char kMagic[4] = {'O', 'M', 'G', 'S'};
+// 3: element index
+constexpr std::uint32_t kVersion = 3;
+
+std::uint64_t element_key(OsmType type, std::int64_t id) {
+    return (static_cast<std::uint64_t>(id) << 2) | static_cast<std::uint64_t>(type);
+}
+
+// Web Mercator world edge in stored units (pi * 6378137 m, in cm)
+constexpr double kHalfWorld = 2003750834.2789244;
+
+std::uint64_t cell_key(int level, std::uint64_t x, std::uint64_t y) {
+    return (static_cast<std::uint64_t>(level) << 58) | (y << 29) | x;
+}
+
+// Quadtree cell column/row containing a point at the given level (tile order: y grows southwards)
+std::uint64_t cell_x(double units, int level) {
+    double cells = std::ldexp(1.0, level);
+    double c = std::floor((units + kHalfWorld) / (2 * kHalfWorld) * cells);
+    return static_cast<std::uint64_t>(std::min(std::max(c, 0.0), cells - 1));
+}
+std::uint64_t cell_y(double units, int level) {
+    double cells = std::ldexp(1.0, level);
+    double c = std::floor((kHalfWorld - units) / (2 * kHalfWorld) * cells);
+    return static_cast<std::uint64_t>(std::min(std::max(c, 0.0), cells - 1));
+}
+
+// Deepest cell that fully contains the box
+std::uint64_t cell_for(const GeoBox& box) {
+    for (int level = kIndexMaxLevel; level > 0; --level) {
+        std::uint64_t x0 = cell_x(box.minx, level), x1 = cell_x(box.maxx, level);
+        std::uint64_t y0 = cell_y(box.maxy, level), y1 = cell_y(box.miny, level);
+        if (x0 == x1 && y0 == y1) {
+            return cell_key(level, x0, y0);
+        }
+    }
+    return cell_key(0, 0, 0);
+}
+
+GeoBox bbox_of(const std::vector<GeoPoint>& coords) {
+    // Holes are inside the outer ring, so it alone bounds a polygon
+    const auto end = std::find_if(coords.begin(), coords.end(), is_ring_break);
+    GeoBox box{coords.front().x, coords.front().y, coords.front().x, coords.front().y};
+    for (auto it = coords.begin(); it != end; ++it) {
+        const GeoPoint& p = *it;
+        box.minx = std::min(box.minx, p.x);
+        box.miny = std::min(box.miny, p.y);
+        box.maxx = std::max(box.maxx, p.x);
+        box.maxy = std::max(box.maxy, p.y);
+    }
+    return box;
+}
+
+std::uint64_t align8(std::uint64_t offset) {
+    return (offset + 7) & ~std::uint64_t(7);
+}
+
+// `count` items of `size` bytes at `offset` lie within the file, on the
+// 8-byte boundary the writer puts every section on
+bool section_fits(std::uint64_t offset, std::uint64_t count, std::size_t size, std::size_t length) {
+    return offset % 8 == 0 && offset <= length && count <= (length - offset) / size;
+}
+
+void write_padding(std::ofstream& out, std::uint64_t& pos) {
+    static const char zeros[8] = {};
+    std::uint64_t aligned = align8(pos);
+    out.write(zeros, static_cast<std::streamsize>(aligned - pos));
+    pos = aligned;
+}
+
+template<typename T>
+void write_array(std::ofstream& out, std::uint64_t& pos, const std::vector<T>& v) {
+    out.write(reinterpret_cast<const char*>(v.data()), static_cast<std::streamsize>(v.size() * sizeof(T)));
+    pos += v.size() * sizeof(T);
+    write_padding(out, pos);
+}
+
+} // namespace
+
+//------------------------------------------------------------------------------
+// Writer
+//------------------------------------------------------------------------------
+
+void write_geo_store(const std::string& path, std::vector<GeoFeature>& features, const GeneralizeOptions& options) {
+    features.erase(std::remove_if(features.begin(), features.end(),
+                                  [](const GeoFeature& f) { return f.coords.empty(); }),
+                   features.end());
+
+    // Intern tag strings; tags are stored once and shared by every level
+    std::unordered_map<std::string, std::uint32_t> string_ids;
+    std::vector<const std::string*> strings;
+    auto intern = [&](const std::string& s) {
+        auto it = string_ids.find(s);
+        if (it != string_ids.end()) {
+            return it->second;
+        }
+        auto id = static_cast<std::uint32_t>(strings.size());
+        strings.push_back(&string_ids.emplace(s, id).first->first);
+        return id;
+    };
+
+    std::vector<std::uint32_t> tags;
+    std::vector<std::uint32_t> tags_begin(features.size());
+    for (std::size_t i = 0; i < features.size(); ++i) {
+        tags_begin[i] = static_cast<std::uint32_t>(tags.size() / 2);
+        std::size_t count = std::min<std::size_t>(features[i].tags.size(), 0xffff);
+        for (std::size_t t = 0; t < count; ++t) {
+            tags.push_back(intern(features[i].tags[t].first));
+            tags.push_back(intern(features[i].tags[t].second));
+        }
+    }
+
+    std::vector<std::uint64_t> string_offsets;
+    string_offsets.reserve(strings.size() + 1);
+    std::uint64_t string_bytes = 0;
+    for (const std::string* s : strings) {
+        string_offsets.push_back(string_bytes);
+        string_bytes += s->size();
+    }
+    string_offsets.push_back(string_bytes);
+
+    // Build every level: generalized geometry for the low zooms, then full detail
+    std::vector<int> zooms = options.level_zooms;
+    std::sort(zooms.begin(), zooms.end());
+    zooms.erase(std::unique(zooms.begin(), zooms.end()), zooms.end());
+    zooms.push_back(kFullDetailZoom);
+
+    struct LevelData {
+        std::uint32_t max_zoom;
+        std::vector<std::uint64_t> keys;
+        std::vector<GeoStore::Record> records;
+        std::vector<GeoPoint> coords;
+    };
+    std::vector<LevelData> levels;
+    std::vector<GeoStore::ElementRef> elements;
+    GeoBox extent{0, 0, 0, 0};
+
+    for (int zoom : zooms) {
+        const bool full = zoom == kFullDetailZoom;
+
+        std::vector<std::vector<GeoPoint>> simplified(full ? 0 : features.size());
+        std::vector<std::size_t> kept;
+        kept.reserve(features.size());
+        for (std::size_t i = 0; i < features.size(); ++i) {
+            if (full || generalize_for_zoom(features[i], zoom, options, simplified[i])) {
+                kept.push_back(i);
+            }
+        }
+        auto geometry = [&](std::size_t i) -> const std::vector<GeoPoint>& {
+            return full ? features[i].coords : simplified[i];
+        };
+
+        std::vector<GeoBox> boxes(features.size());
+        std::vector<std::uint64_t> keys(features.size());
+        for (std::size_t i : kept) {
+            boxes[i] = bbox_of(geometry(i));
+            keys[i] = cell_for(boxes[i]);
+        }
+        std::sort(kept.begin(), kept.end(), [&](std::size_t a, std::size_t b) { return keys[a] < keys[b]; });
+
+        LevelData level;
+        level.max_zoom = static_cast<std::uint32_t>(zoom);
+        level.keys.reserve(kept.size());
+        level.records.reserve(kept.size());
+        for (std::size_t n = 0; n < kept.size(); ++n) {
+            const std::size_t i = kept[n];
+            const GeoFeature& f = features[i];
+            const std::vector<GeoPoint>& coords = geometry(i);
+            const GeoBox& box = boxes[i];
+
+            GeoStore::Record rec{};
+            rec.id = f.id;
+            rec.coords_begin = level.coords.size();
+            rec.coord_count = static_cast<std::uint32_t>(coords.size());
+            rec.tags_begin = tags_begin[i];
+            rec.tag_count = static_cast<std::uint16_t>(std::min<std::size_t>(f.tags.size(), 0xffff));
+            rec.type = static_cast<std::uint8_t>(f.type);
+            rec.bbox[0] = box.minx; rec.bbox[1] = box.miny; rec.bbox[2] = box.maxx; rec.bbox[3] = box.maxy;
+
+            level.coords.insert(level.coords.end(), coords.begin(), coords.end());
+            level.records.push_back(rec);
+            level.keys.push_back(keys[i]);
+
+            if (full) {
+                extent = n == 0 ? box : GeoBox{std::min(extent.minx, box.minx), std::min(extent.miny, box.miny),
+                                               std::max(extent.maxx, box.maxx), std::max(extent.maxy, box.maxy)};
+            }
+        }
+        levels.push_back(std::move(level));
+
+        if (full) {
+            // Element index: where each feature came from, and which line
+            // and area vertices every node is at
+            for (std::size_t n = 0; n < kept.size(); ++n) {
+                const GeoFeature& f = features[kept[n]];
+                const auto feature = static_cast<std::uint32_t>(n);
+                elements.push_back({element_key(f.source, f.id), feature, GeoStore::kWholeFeature});
+                for (std::int64_t way : f.member_ways) {
+                    elements.push_back({element_key(OsmType::Way, way), feature, GeoStore::kWholeFeature});
+                }
+                if (f.type == GeoType::Point || f.node_refs.size() != f.coords.size()) {
+                    continue;
+                }
+                for (std::size_t v = 0; v < f.coords.size(); ++v) {
+                    if (f.node_refs[v] != 0 && !is_ring_break(f.coords[v])) {
+                        elements.push_back({element_key(OsmType::Node, f.node_refs[v]), feature,
+                                            static_cast<std::uint32_t>(v)});
+                    }
+                }
+            }
+            std::sort(elements.begin(), elements.end(), [](const GeoStore::ElementRef& a, const GeoStore::ElementRef& b) {
+                return std::tie(a.element, a.feature, a.vertex) < std::tie(b.element, b.feature, b.vertex);
+            });
+        }
+    }
+
+    // Work out the section offsets, then stream everything out in one go
+    GeoStore::Header header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.level_count = static_cast<std::uint32_t>(levels.size());
+    header.tag_count = tags.size() / 2;
+    header.string_count = strings.size();
+    header.string_bytes = string_bytes;
+    header.created = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    header.extent[0] = extent.minx; header.extent[1] = extent.miny;
+    header.extent[2] = extent.maxx; header.extent[3] = extent.maxy;
+
+    std::uint64_t offset = align8(sizeof(header));
+    header.levels_offset = offset;
+    offset = align8(offset + levels.size() * sizeof(GeoStore::LevelHeader));
+
+    std::vector<GeoStore::LevelHeader> level_headers;
+    for (const LevelData& level : levels) {
+        GeoStore::LevelHeader lh{};
+        lh.max_zoom = level.max_zoom;
+        lh.feature_count = level.records.size();
+        lh.coord_count = level.coords.size();
+        lh.cell_keys_offset = offset; offset = align8(offset + level.keys.size() * sizeof(std::uint64_t));
+        lh.records_offset = offset;   offset = align8(offset + level.records.size() * sizeof(GeoStore::Record));
+        lh.coords_offset = offset;    offset = align8(offset + level.coords.size() * sizeof(GeoPoint));
+        level_headers.push_back(lh);
+    }
+    header.tags_offset = offset;           offset = align8(offset + tags.size() * sizeof(std::uint32_t));
+    header.string_offsets_offset = offset; offset = align8(offset + string_offsets.size() * sizeof(std::uint64_t));
+    header.element_count = elements.size();
+    header.elements_offset = offset;       offset = align8(offset + elements.size() * sizeof(GeoStore::ElementRef));
+    header.strings_offset = offset;
+
+    const std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Cannot create geostore: " + tmp_path);
+    }
+    std::uint64_t pos = 0;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    pos += sizeof(header);
+    write_padding(out, pos);
+    write_array(out, pos, level_headers);
+    for (const LevelData& level : levels) {
+        write_array(out, pos, level.keys);
+        write_array(out, pos, level.records);
+        write_array(out, pos, level.coords);
+    }
+    write_array(out, pos, tags);
+    write_array(out, pos, string_offsets);
+    write_array(out, pos, elements);
+    for (const std::string* s : strings) {
+        out.write(s->data(), static_cast<std::streamsize>(s->size()));
+    }
+    out.close();
+    if (!out) {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Failed writing geostore: " + tmp_path);
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Failed to move geostore into place: " + path);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Reader
+//------------------------------------------------------------------------------
+
+GeoStore::GeoStore(const std::string& path) {
+    mapping_ = map_file_readonly(path, length_, sizeof(Header));
+    if (!mapping_) {
+        throw std::runtime_error("Cannot open geostore: " + path);
+    }
+    base_ = static_cast<const char*>(mapping_.get());
+
+    Header header;
+    std::memcpy(&header, base_, sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+        throw std::runtime_error("Not a geostore (or built by an incompatible osm_import): " + path);
+    }
+
+    // Everything below points into the mapping, so a damaged or truncated
+    // file has to be caught here rather than as a crash in some render
+    if (header.level_count == 0 ||
+        !section_fits(header.levels_offset, header.level_count, sizeof(LevelHeader), length_) ||
+        !section_fits(header.tags_offset, header.tag_count, 2 * sizeof(std::uint32_t), length_) ||
+        header.string_count == UINT64_MAX ||
+        !section_fits(header.string_offsets_offset, header.string_count + 1, sizeof(std::uint64_t), length_) ||
+        header.strings_offset > length_ || header.string_bytes > length_ - header.strings_offset ||
+        (header.element_count > 0 &&
+         !section_fits(header.elements_offset, header.element_count, sizeof(ElementRef), length_))) {
+        throw std::runtime_error("Truncated or damaged geostore: " + path);
+    }
+
+    for (std::uint32_t l = 0; l < header.level_count; ++l) {
+        LevelHeader lh;
+        std::memcpy(&lh, base_ + header.levels_offset + l * sizeof(LevelHeader), sizeof(lh));
+        if (!section_fits(lh.cell_keys_offset, lh.feature_count, sizeof(std::uint64_t), length_) ||
+            !section_fits(lh.records_offset, lh.feature_count, sizeof(Record), length_) ||
+            !section_fits(lh.coords_offset, lh.coord_count, sizeof(GeoPoint), length_)) {
+            throw std::runtime_error("Truncated or damaged geostore (level " + std::to_string(l) + "): " + path);
+        }
+        Level level;
+        level.max_zoom = static_cast<int>(lh.max_zoom);
+        level.feature_count = static_cast<std::size_t>(lh.feature_count);
+        level.cell_keys = reinterpret_cast<const std::uint64_t*>(base_ + lh.cell_keys_offset);
+        level.records = base_ + lh.records_offset;
+        level.coords = reinterpret_cast<const GeoPoint*>(base_ + lh.coords_offset);
+        levels_.push_back(level);
+    }
+
+    string_count_ = static_cast<std::size_t>(header.string_count);
+    tags_ = reinterpret_cast<const std::uint32_t*>(base_ + header.tags_offset);
+    string_offsets_ = reinterpret_cast<const std::uint64_t*>(base_ + header.string_offsets_offset);
+    strings_ = base_ + header.strings_offset;
+    string_bytes_ = header.string_bytes;
+    elements_ = reinterpret_cast<const ElementRef*>(base_ + header.elements_offset);
+    element_count_ = static_cast<std::size_t>(header.element_count);
+    extent_ = {header.extent[0], header.extent[1], header.extent[2], header.extent[3]};
+    created_ = header.created;
+
+    // Tag keys are few; index them so queries can resolve property names quickly
+    for (std::size_t i = 0; i < header.tag_count; ++i) {
+        std::uint32_t key = tags_[2 * i];
+        if (key_ids_.emplace(string(key), key).second) {
+            keys_.push_back(key);
+        }
+    }
+}
+
+const GeoStore::Record& GeoStore::record(const Level& level, std::size_t index) {
+    return *reinterpret_cast<const Record*>(level.records + index * sizeof(Record));
+}
+
+std::size_t GeoStore::level_for_zoom(int zoom) const {
+    for (std::size_t l = 0; l < levels_.size(); ++l) {
+        if (zoom <= levels_[l].max_zoom) {
+            return l;
+        }
+    }
+    return full_level();
+}
+
+std::string_view GeoStore::string(std::uint32_t id) const {
+    if (id >= string_count_) {
+        return {};
+    }
+    const std::uint64_t begin = string_offsets_[id];
+    const std::uint64_t end = string_offsets_[id + 1];
+    if (begin > end || end > string_bytes_) {
+        return {}; // Damaged string table
+    }
+    return std::string_view(strings_ + begin, end - begin);
+}
+
+void GeoStore::find_element(OsmType type, std::int64_t id,
+                            const std::function<void(std::size_t, std::uint32_t)>& fn) const {
+    const std::uint64_t key = element_key(type, id);
+    const ElementRef* end = elements_ + element_count_;
+    const ElementRef* it = std::lower_bound(elements_, end, key,
+        [](const ElementRef& e, std::uint64_t k) { return e.element < k; });
+    const std::size_t features = feature_count();
+    for (; it != end && it->element == key; ++it) {
+        if (it->feature >= features) {
+            continue; // Damaged index
+        }
+        if (it->vertex != kWholeFeature && it->vertex >= feature(full_level(), it->feature).size()) {
+            continue;
+        }
+        fn(it->feature, it->vertex);
+    }
+}
+
+std::int64_t GeoStore::find_key(std::string_view key) const {
+    auto it = key_ids_.find(key);
+    return it != key_ids_.end() ? static_cast<std::int64_t>(it->second) : -1;
+}
+
+template<typename Fn>
+bool GeoStore::scan(const GeoBox& box, std::size_t level_index, Fn&& fn) const {
+    const Level& level = levels_.at(level_index);
+    const std::uint64_t* keys_end = level.cell_keys + level.feature_count;
+    for (int cell_level = 0; cell_level <= kIndexMaxLevel; ++cell_level) {
+        std::uint64_t x0 = cell_x(box.minx, cell_level), x1 = cell_x(box.maxx, cell_level);
+        std::uint64_t y0 = cell_y(box.maxy, cell_level), y1 = cell_y(box.miny, cell_level);
+
+        // Rows of one cell level are contiguous runs of keys, one binary search each
+        for (std::uint64_t y = y0; y <= y1; ++y) {
+            const std::uint64_t* first = std::lower_bound(level.cell_keys, keys_end, cell_key(cell_level, x0, y));
+            const std::uint64_t* last = std::upper_bound(first, keys_end, cell_key(cell_level, x1, y));
+            for (const std::uint64_t* k = first; k != last; ++k) {
+                std::size_t index = static_cast<std::size_t>(k - level.cell_keys);
+                const Record& rec = record(level, index);
+                if (box.intersects({rec.bbox[0], rec.bbox[1], rec.bbox[2], rec.bbox[3]}) && !fn(index)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void GeoStore::query(const GeoBox& box, std::size_t level, const std::function<void(std::size_t)>& fn) const {
+    scan(box, level, [&fn](std::size_t index) {
+        fn(index);
+        return true;
+    });
+}
+
+bool GeoStore::any(const GeoBox& box, std::size_t level) const {
+    return !scan(box, level, [](std::size_t) { return false; });
+}
+
+//------------------------------------------------------------------------------
+// Feature view
+//------------------------------------------------------------------------------
+
+std::int64_t GeoStore::Feature::id() const { return record(*level_, index_).id; }
+GeoType GeoStore::Feature::type() const { return static_cast<GeoType>(record(*level_, index_).type); }
+std::size_t GeoStore::Feature::size() const { return record(*level_, index_).coord_count; }
+std::size_t GeoStore::Feature::tag_count() const { return record(*level_, index_).tag_count; }
+
+GeoBox GeoStore::Feature::bbox() const {
+    const Record& rec = record(*level_, index_);
+    return {rec.bbox[0], rec.bbox[1], rec.bbox[2], rec.bbox[3]};
+}
+
+GeoPoint GeoStore::Feature::point(std::size_t i) const {
+    return level_->coords[record(*level_, index_).coords_begin + i];
+}
+
+std::uint32_t GeoStore::Feature::tag_key(std::size_t i) const {
+    return store_->tags_[2 * (record(*level_, index_).tags_begin + i)];
+}
+
+std::uint32_t GeoStore::Feature::tag_value(std::size_t i) const {
+    return store_->tags_[2 * (record(*level_, index_).tags_begin + i) + 1];
+}
@@ -0,0 +1,199 @@
+#ifndef GEO_STORE_HPP
+#define GEO_STORE_HPP
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Compact, memory-mappable store of imported OSM features ("geostore").
+//
+// Built once from a PBF by osm_import and then only read. Geometry is kept in
+// Web Mercator as int32 centimetres, so no reprojection or parsing happens at
+// render time. Every feature is filed under the deepest quadtree cell (down to
+// kIndexMaxLevel) that fully contains its bounding box, and features are
+// stored sorted by cell, which doubles as the spatial index: a bbox query is a
+// handful of binary searches per level over the sorted cell keys.
+//
+// The store holds several detail levels. Each generalized level serves zooms
+// up to its max_zoom with simplified geometry and without features too small
+// to see there; the last level has the full-resolution data. Levels share the
+// tag and string tables, only geometry and index are per level.
+
+enum class GeoType : std::uint8_t {
+    Point = 1,
+    LineString = 2,
+    Polygon = 3,
+};
+
+struct GeoPoint {
+    std::int32_t x; // Web Mercator, centimetres
+    std::int32_t y;
+};
+
+// Separates the rings of a polygon. Outside the Mercator world (which ends
+// at +-2.0e9 cm), so it is never a real vertex.
+constexpr GeoPoint kRingBreak{INT32_MIN, INT32_MIN};
+inline bool is_ring_break(const GeoPoint& p) { return p.x == kRingBreak.x && p.y == kRingBreak.y; }
+
+// What kind of OSM element an id belongs to
+enum class OsmType : std::uint8_t {
+    Node = 0,
+    Way = 1,
+    Relation = 2,
+};
+
+// Input to the writer
+struct GeoFeature {
+    std::int64_t id = 0; // OSM id
+    OsmType source = OsmType::Node; // ... of this kind
+    GeoType type = GeoType::Point;
+    std::vector<std::pair<std::string, std::string>> tags;
+    // Polygons are closed rings: the outer one, then each hole after a kRingBreak
+    std::vector<GeoPoint> coords;
+    // For the element index, all optional: the node at each vertex of a line
+    // or area (anything at ring breaks), and the ways a multipolygon was
+    // assembled from
+    std::vector<std::int64_t> node_refs;
+    std::vector<std::int64_t> member_ways;
+};
+
+// Mercator bounding box in centimetres
+struct GeoBox {
+    std::int32_t minx, miny, maxx, maxy;
+
+    bool intersects(const GeoBox& o) const {
+        return minx <= o.maxx && o.minx <= maxx && miny <= o.maxy && o.miny <= maxy;
+    }
+};
+
+constexpr int kIndexMaxLevel = 14;
+
+// max_zoom of the full-detail level
+constexpr int kFullDetailZoom = 255;
+
+// How write_geo_store builds the generalized levels
+struct GeneralizeOptions {
+    std::vector<int> level_zooms{5, 8, 11}; // Max zoom served by each generalized level
+    double tolerance_px = 0.5; // Douglas-Peucker tolerance, in pixels at the level's max zoom
+    double min_area_px = 1.0;  // Smaller polygons are left out of a level, in square pixels
+};
+
+// Mercator metres <-> stored centimetres
+inline std::int32_t to_geo_units(double metres) { return static_cast<std::int32_t>(metres * 100.0 + (metres < 0 ? -0.5 : 0.5)); }
+inline double from_geo_units(std::int32_t units) { return static_cast<double>(units) / 100.0; }
+
+// Builds the detail levels, sorts each into index order and writes the store.
+// Throws on I/O errors.
+void write_geo_store(const std::string& path, std::vector<GeoFeature>& features,
+                     const GeneralizeOptions& options = {});
+
+class GeoStore {
+    struct Level {
+        int max_zoom = kFullDetailZoom;
+        std::size_t feature_count = 0;
+        const std::uint64_t* cell_keys = nullptr; // Sorted, parallel to the records
+        const char* records = nullptr;
+        const GeoPoint* coords = nullptr;
+    };
+
+public:
+    // A read-only view of one stored feature, valid while the store is alive
+    class Feature {
+    public:
+        std::int64_t id() const;
+        GeoType type() const;
+        GeoBox bbox() const;
+        std::size_t size() const;           // Number of vertices, ring breaks included
+        GeoPoint point(std::size_t i) const; // May be a kRingBreak in a polygon
+        std::size_t tag_count() const;
+        std::uint32_t tag_key(std::size_t i) const;   // String ids, see GeoStore::string()
+        std::uint32_t tag_value(std::size_t i) const;
+
+    private:
+        friend class GeoStore;
+        Feature(const GeoStore& store, const Level& level, std::size_t index)
+            : store_(&store), level_(&level), index_(index) {}
+        const GeoStore* store_;
+        const Level* level_;
+        std::size_t index_;
+    };
+
+    // Maps the store; throws if it is missing or not a geostore
+    explicit GeoStore(const std::string& path);
+
+    GeoStore(const GeoStore&) = delete;
+    GeoStore& operator=(const GeoStore&) = delete;
+
+    std::size_t level_count() const { return levels_.size(); }
+    std::size_t full_level() const { return levels_.size() - 1; }
+    int level_max_zoom(std::size_t level) const { return levels_[level].max_zoom; }
+    // The coarsest level that still has enough detail for `zoom`
+    std::size_t level_for_zoom(int zoom) const;
+
+    std::size_t feature_count(std::size_t level) const { return levels_[level].feature_count; }
+    std::size_t feature_count() const { return feature_count(full_level()); }
+    Feature feature(std::size_t level, std::size_t index) const { return Feature(*this, levels_[level], index); }
+    GeoBox extent() const { return extent_; }
+    std::int64_t created() const { return created_; } // Unix time of the import
+
+    // Empty only for a store without features; a store without node refs
+    // has only the features' own ids in it
+    bool has_element_index() const { return element_count_ > 0; }
+    // Vertex of a find_element() hit that stands for the whole feature
+    static constexpr std::uint32_t kWholeFeature = UINT32_MAX;
+    // Calls fn(feature_index, vertex) for every full-detail feature made from
+    // the element: its own feature, and the areas of multipolygons a way is
+    // part of (with kWholeFeature); and every line and area vertex a node is
+    // at. A couple of binary searches.
+    void find_element(OsmType type, std::int64_t id,
+                      const std::function<void(std::size_t, std::uint32_t)>& fn) const;
+
+    std::string_view string(std::uint32_t id) const;
+    // String id for a tag key, or -1 if no feature uses it
+    std::int64_t find_key(std::string_view key) const;
+    const std::vector<std::uint32_t>& keys() const { return keys_; }
+
+    // Calls fn(feature_index) for every feature of `level` whose bbox intersects `box`
+    void query(const GeoBox& box, std::size_t level, const std::function<void(std::size_t)>& fn) const;
+    // True if any feature of `level` has a bbox intersecting `box`; stops at the first one
+    bool any(const GeoBox& box, std::size_t level) const;
+
+    // On-disk layout, defined in geo_store.cpp and shared with the writer
+    struct Header;
+    struct LevelHeader;
+    struct Record;
+    struct ElementRef;
+
+private:
+    static const Record& record(const Level& level, std::size_t index);
+    // Calls fn(index) for each hit until it returns false; false if stopped early
+    template<typename Fn>
+    bool scan(const GeoBox& box, std::size_t level, Fn&& fn) const;
+
+    std::shared_ptr<const void> mapping_;
+    std::size_t length_ = 0;
+    const char* base_ = nullptr;
+
+    std::vector<Level> levels_; // Coarsest first, full detail last
+    std::size_t string_count_ = 0;
+    const std::uint32_t* tags_ = nullptr;       // key,value string id pairs
+    const std::uint64_t* string_offsets_ = nullptr;
+    const char* strings_ = nullptr;
+    std::uint64_t string_bytes_ = 0;
+    const ElementRef* elements_ = nullptr; // Sorted by element
+    std::size_t element_count_ = 0;
+    GeoBox extent_{0, 0, 0, 0};
+    std::int64_t created_ = 0;
+
+    std::vector<std::uint32_t> keys_; // Distinct tag keys (string ids)
+    std::unordered_map<std::string_view, std::uint32_t> key_ids_;
+};
+
+#endif // GEO_STORE_HPP
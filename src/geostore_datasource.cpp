@@ -0,0 +1,248 @@
+#include "geostore_datasource.hpp"
+
+#include <mapnik/feature.hpp>
+#include <mapnik/feature_factory.hpp>
+#include <mapnik/geometry.hpp>
+#include <mapnik/unicode.hpp>
+
+#include "projection.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Hands out the features found by one query, building each Mapnik feature
+// (geometry plus only the attributes the style asked for) on demand
+class GeoStoreFeatureset : public mapnik::Featureset {
+public:
+    GeoStoreFeatureset(std::shared_ptr<const GeoStore> store, std::size_t level, GeoQueryCache::Hits hits,
+                       std::vector<std::pair<std::uint32_t, std::string>> properties)
+        : store_(std::move(store)),
+          level_(level),
+          hits_(std::move(hits)),
+          properties_(std::move(properties)),
+          ctx_(std::make_shared<mapnik::context_type>()),
+          tr_("utf-8") {
+        for (const auto& property : properties_) {
+            ctx_->push(property.second);
+        }
+    }
+
+    mapnik::feature_ptr next() override {
+        if (pos_ >= hits_->size()) {
+            return mapnik::feature_ptr();
+        }
+        // Counted as query time: the renderer draws between calls
+        const Metrics::Clock::time_point start = Metrics::Clock::now();
+        mapnik::feature_ptr feature = build(store_->feature(level_, (*hits_)[pos_++]));
+        Metrics::add_query_time(Metrics::Clock::now() - start);
+        return feature;
+    }
+
+private:
+    mapnik::feature_ptr build(const GeoStore::Feature& f) {
+        mapnik::feature_ptr feature(mapnik::feature_factory::create(ctx_, f.id()));
+        for (std::size_t t = 0; t < f.tag_count(); ++t) {
+            const std::uint32_t key = f.tag_key(t);
+            for (const auto& property : properties_) {
+                if (property.first == key) {
+                    std::string_view value = store_->string(f.tag_value(t));
+                    feature->put_new(property.second, tr_.transcode(value.data(), static_cast<std::int32_t>(value.size())));
+                    break;
+                }
+            }
+        }
+
+        switch (f.type()) {
+            case GeoType::Point: {
+                GeoPoint p = f.point(0);
+                feature->set_geometry(mapnik::geometry::point<double>(from_geo_units(p.x), from_geo_units(p.y)));
+                break;
+            }
+            case GeoType::LineString: {
+                mapnik::geometry::line_string<double> line;
+                line.reserve(f.size());
+                for (std::size_t i = 0; i < f.size(); ++i) {
+                    GeoPoint p = f.point(i);
+                    line.emplace_back(from_geo_units(p.x), from_geo_units(p.y));
+                }
+                feature->set_geometry(std::move(line));
+                break;
+            }
+            case GeoType::Polygon: {
+                // The outer ring, then the holes
+                mapnik::geometry::polygon<double> polygon;
+                mapnik::geometry::linear_ring<double> ring;
+                ring.reserve(f.size());
+                for (std::size_t i = 0; i < f.size(); ++i) {
+                    GeoPoint p = f.point(i);
+                    if (is_ring_break(p)) {
+                        polygon.push_back(std::move(ring));
+                        ring = {};
+                        continue;
+                    }
+                    ring.emplace_back(from_geo_units(p.x), from_geo_units(p.y));
+                }
+                polygon.push_back(std::move(ring));
+                feature->set_geometry(std::move(polygon));
+                break;
+            }
+        }
+        return feature;
+    }
+
+    std::shared_ptr<const GeoStore> store_;
+    std::size_t level_;
+    GeoQueryCache::Hits hits_; // Possibly shared with other featuresets of the same box
+    std::size_t pos_ = 0;
+    std::vector<std::pair<std::uint32_t, std::string>> properties_; // Key string id, attribute name
+    mapnik::context_ptr ctx_;
+    mapnik::transcoder tr_;
+};
+
+GeoBox to_geo_box(const mapnik::box2d<double>& box) {
+    return {to_geo_units(box.minx()), to_geo_units(box.miny()), to_geo_units(box.maxx()), to_geo_units(box.maxy())};
+}
+
+// Boxes computed for different pixel sizes differ in the last bits
+bool same_box(const mapnik::box2d<double>& a, const mapnik::box2d<double>& b) {
+    const double tolerance = 1e-9 * std::max(a.width(), a.height());
+    return std::abs(a.minx() - b.minx()) <= tolerance && std::abs(a.miny() - b.miny()) <= tolerance &&
+           std::abs(a.maxx() - b.maxx()) <= tolerance && std::abs(a.maxy() - b.maxy()) <= tolerance;
+}
+
+bool contains_box(const mapnik::box2d<double>& outer, const mapnik::box2d<double>& inner) {
+    const double tolerance = 1e-9 * std::max(outer.width(), outer.height());
+    return outer.minx() <= inner.minx() + tolerance && outer.miny() <= inner.miny() + tolerance &&
+           outer.maxx() >= inner.maxx() - tolerance && outer.maxy() >= inner.maxy() - tolerance;
+}
+
+} // namespace
+
+GeoQueryCache::Hits GeoQueryCache::find(const GeoStore& store, const mapnik::box2d<double>& bbox, std::size_t level) {
+    Hits outer;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto containing = entries_.end();
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->level != level) {
+                continue;
+            }
+            if (same_box(it->bbox, bbox)) {
+                entries_.splice(entries_.begin(), entries_, it);
+                reused_.fetch_add(1, std::memory_order_relaxed);
+                return it->hits;
+            }
+            if (containing == entries_.end() && contains_box(it->bbox, bbox)) {
+                containing = it;
+            }
+        }
+        if (containing == entries_.end()) {
+            return nullptr;
+        }
+        entries_.splice(entries_.begin(), entries_, containing);
+        outer = containing->hits;
+    }
+
+    // A smaller box inside an earlier query (a part of a metatile drawn in
+    // pieces) keeps the features intersecting it. The index hands features
+    // out in cell order, so they come in the order a query of their own would.
+    const GeoBox box = to_geo_box(bbox);
+    auto hits = std::make_shared<std::vector<std::size_t>>();
+    for (std::size_t index : *outer) {
+        if (box.intersects(store.feature(level, index).bbox())) {
+            hits->push_back(index);
+        }
+    }
+    reused_.fetch_add(1, std::memory_order_relaxed);
+    insert(bbox, level, hits); // For the other layers of the same part
+    return hits;
+}
+
+void GeoQueryCache::insert(const mapnik::box2d<double>& bbox, std::size_t level, Hits hits) {
+    if (capacity_ == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.push_front(Entry{bbox, level, std::move(hits)});
+    if (entries_.size() > capacity_) {
+        entries_.pop_back();
+    }
+}
+
+GeoStoreDatasource::GeoStoreDatasource(const mapnik::parameters& params, std::shared_ptr<const GeoStore> store,
+                                       std::shared_ptr<GeoQueryCache> queries)
+    : mapnik::datasource(params),
+      store_(std::move(store)),
+      queries_(std::move(queries)),
+      desc_(name(), "utf-8") {
+    for (std::uint32_t key : store_->keys()) {
+        desc_.add_descriptor(mapnik::attribute_descriptor(std::string(store_->string(key)), mapnik::String));
+    }
+}
+
+mapnik::datasource::datasource_t GeoStoreDatasource::type() const {
+    return mapnik::datasource::Vector;
+}
+
+mapnik::featureset_ptr GeoStoreDatasource::features(const mapnik::query& q) const {
+    // Pick the coarsest level generalized for at least the zoom being drawn
+    // (rounding fractional zooms up). The zoom comes from the scale
+    // denominator, which Mapnik corrects for the scale factor, so a @2x tile
+    // reads the same level as the standard one rather than the next zoom's.
+    std::size_t level = store_->full_level();
+    const double scale_denominator = q.scale_denominator();
+    if (scale_denominator > 0) {
+        double zoom = zoomForScaleDenominator(scale_denominator);
+        level = store_->level_for_zoom(static_cast<int>(std::ceil(zoom - 1e-6)));
+    }
+    return features_in(q.get_bbox(), level, q.property_names());
+}
+
+mapnik::featureset_ptr GeoStoreDatasource::features_at_point(const mapnik::coord2d& pt, double tol) const {
+    return features_in(mapnik::box2d<double>(pt.x - tol, pt.y - tol, pt.x + tol, pt.y + tol), store_->full_level(), {});
+}
+
+mapnik::featureset_ptr GeoStoreDatasource::features_in(const mapnik::box2d<double>& bbox, std::size_t level,
+                                                       const std::set<std::string>& properties) const {
+    const Metrics::Clock::time_point start = Metrics::Clock::now();
+    GeoQueryCache::Hits hits = queries_ ? queries_->find(*store_, bbox, level) : nullptr;
+    if (!hits) {
+        auto found = std::make_shared<std::vector<std::size_t>>();
+        store_->query(to_geo_box(bbox), level, [&found](std::size_t index) { found->push_back(index); });
+        hits = std::move(found);
+        if (queries_) {
+            queries_->insert(bbox, level, hits);
+        }
+    }
+    Metrics::add_query_time(Metrics::Clock::now() - start);
+
+    // Resolve the attribute names used by the style to string ids once per query
+    std::vector<std::pair<std::uint32_t, std::string>> wanted;
+    for (const std::string& property : properties) {
+        std::int64_t key = store_->find_key(property);
+        if (key >= 0) {
+            wanted.emplace_back(static_cast<std::uint32_t>(key), property);
+        }
+    }
+    return std::make_shared<GeoStoreFeatureset>(store_, level, std::move(hits), std::move(wanted));
+}
+
+mapnik::box2d<double> GeoStoreDatasource::envelope() const {
+    GeoBox e = store_->extent();
+    return mapnik::box2d<double>(from_geo_units(e.minx), from_geo_units(e.miny),
+                                 from_geo_units(e.maxx), from_geo_units(e.maxy));
+}
+
+boost::optional<mapnik::datasource_geometry_t> GeoStoreDatasource::get_geometry_type() const {
+    return mapnik::datasource_geometry_t::Collection;
+}
+
+mapnik::layer_descriptor GeoStoreDatasource::get_descriptor() const {
+    return desc_;
+}
@@ -0,0 +1,84 @@
+#ifndef GEOSTORE_DATASOURCE_HPP
+#define GEOSTORE_DATASOURCE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/optional.hpp>
+#include <mapnik/datasource.hpp>
+#include <mapnik/feature_layer_desc.hpp>
+#include <mapnik/query.hpp>
+
+#include "geo_store.hpp"
+
+// Recent query results of a geostore: the features found in a box at a detail
+// level. A tile drawn at another scale factor queries the same box at the
+// same level (both are worked out from the extent and the style scale, not
+// the pixel count), as do layers sharing a buffer size, so the spatial index
+// is walked once for all of them. A box inside an earlier one, like a part of
+// a high-density metatile drawn in pieces, is answered from the larger query.
+// Shared by every layer of every style over the same data (see RenderData).
+class GeoQueryCache {
+public:
+    using Hits = std::shared_ptr<const std::vector<std::size_t>>;
+
+    explicit GeoQueryCache(std::size_t capacity) : capacity_(capacity) {}
+
+    // Features of an earlier query for (about) the same box and level, those
+    // of an earlier query for a box containing it that intersect it, or null
+    Hits find(const GeoStore& store, const mapnik::box2d<double>& bbox, std::size_t level);
+    void insert(const mapnik::box2d<double>& bbox, std::size_t level, Hits hits);
+
+    std::uint64_t reused() const { return reused_.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry {
+        mapnik::box2d<double> bbox;
+        std::size_t level;
+        Hits hits;
+    };
+
+    std::size_t capacity_;
+    std::mutex mutex_;
+    std::list<Entry> entries_; // Most recent first; short, so searched linearly
+    std::atomic<std::uint64_t> reused_{0};
+};
+
+// Mapnik datasource that answers bbox queries from an imported geostore.
+// Constructed in-process by TileRenderer (it is not loaded through the plugin
+// directory), and shared by every layer: all layers query the same mapped
+// file and filter features with their style rules, like the osm plugin.
+// Features are reported in Web Mercator, so layers using it must use EPSG:3857.
+// Each query reads the store's detail level matching the zoom being rendered,
+// whatever the scale factor it is drawn with.
+class GeoStoreDatasource : public mapnik::datasource {
+public:
+    // `queries` may be null, then every query walks the index
+    GeoStoreDatasource(const mapnik::parameters& params, std::shared_ptr<const GeoStore> store,
+                       std::shared_ptr<GeoQueryCache> queries = nullptr);
+
+    static const char* name() { return "geostore"; }
+
+    mapnik::datasource::datasource_t type() const override;
+    mapnik::featureset_ptr features(const mapnik::query& q) const override;
+    mapnik::featureset_ptr features_at_point(const mapnik::coord2d& pt, double tol = 0) const override;
+    mapnik::box2d<double> envelope() const override;
+    boost::optional<mapnik::datasource_geometry_t> get_geometry_type() const override;
+    mapnik::layer_descriptor get_descriptor() const override;
+
+private:
+    mapnik::featureset_ptr features_in(const mapnik::box2d<double>& bbox, std::size_t level,
+                                       const std::set<std::string>& properties) const;
+
+    std::shared_ptr<const GeoStore> store_;
+    std::shared_ptr<GeoQueryCache> queries_;
+    mapnik::layer_descriptor desc_;
+};
+
+#endif // GEOSTORE_DATASOURCE_HPP
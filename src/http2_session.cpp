@@ -0,0 +1,401 @@
+#include "http2_session.hpp"
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/write.hpp>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace {
+
+beast::string_view as_view(const uint8_t* data, size_t size) {
+    return beast::string_view(reinterpret_cast<const char*>(data), size);
+}
+
+std::string_view body_bytes(const http::response<TileBody>& res) {
+    return res.body() ? res.body()->bytes() : std::string_view();
+}
+
+std::string_view body_bytes(const http::response<http::string_body>& res) {
+    return res.body();
+}
+
+// HTTP/1.1 connection headers mean nothing in HTTP/2, and are in fact
+// forbidden there
+bool connection_specific(std::string_view name) {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+           name == "transfer-encoding" || name == "upgrade";
+}
+
+} // namespace
+
+Http2Session::Http2Session(tcp::socket&& socket, std::shared_ptr<HttpContext> context, std::string initial,
+                           std::optional<HttpRequest> upgrade)
+    : stream_(std::move(socket)), context_(std::move(context)), idle_timer_(stream_.get_executor()),
+      initial_(std::move(initial)), upgrade_(std::move(upgrade)) {
+    beast::error_code ec;
+    remote_ = stream_.socket().remote_endpoint(ec);
+
+    nghttp2_session_callbacks* callbacks = nullptr;
+    if (nghttp2_session_callbacks_new(&callbacks) != 0) {
+        throw std::runtime_error("nghttp2: out of memory");
+    }
+    nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, &Http2Session::on_begin_headers);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, &Http2Session::on_header);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, &Http2Session::on_frame_recv);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, &Http2Session::on_stream_close);
+    // Request bodies are not used by any endpoint; without a data chunk
+    // callback nghttp2 drops them (and still credits the flow control window)
+    int rv = nghttp2_session_server_new(&session_, callbacks, this);
+    nghttp2_session_callbacks_del(callbacks);
+    if (rv != 0) {
+        throw std::runtime_error(std::string("nghttp2: ") + nghttp2_strerror(rv));
+    }
+
+    context_->connections.fetch_add(1, std::memory_order_relaxed);
+    context_->http2_connections.fetch_add(1, std::memory_order_relaxed);
+}
+
+Http2Session::~Http2Session() {
+    nghttp2_session_del(session_);
+    context_->connections.fetch_sub(1, std::memory_order_relaxed);
+    context_->http2_connections.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void Http2Session::run() {
+    net::dispatch(stream_.get_executor(),
+                  beast::bind_front_handler(
+                      &Http2Session::start,
+                      shared_from_this()));
+}
+
+void Http2Session::start() {
+    // Our SETTINGS go first. Everything else (window sizes, frame sizes,
+    // header table) stays at nghttp2's defaults.
+    nghttp2_settings_entry settings[] = {
+        {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, context_->options.max_streams},
+    };
+    int rv = nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, settings, sizeof(settings) / sizeof(settings[0]));
+    if (rv != 0) {
+        std::cerr << "ERROR: HTTP/2 settings failed: " << nghttp2_strerror(rv) << std::endl;
+        return do_close();
+    }
+
+    if (upgrade_) {
+        // The request that asked for the upgrade becomes stream 1, half
+        // closed already; the client's own SETTINGS came along with it
+        auto header = (*upgrade_)["HTTP2-Settings"];
+        std::string payload;
+        if (!decode_http2_settings(std::string_view(header.data(), header.size()), payload) ||
+            nghttp2_session_upgrade2(session_, reinterpret_cast<const uint8_t*>(payload.data()), payload.size(),
+                                     0, nullptr) != 0) {
+            std::cerr << "WARNING: Rejecting h2c upgrade with bad HTTP2-Settings" << std::endl;
+            return do_close();
+        }
+        auto stream = std::make_unique<Stream>();
+        stream->req = std::move(*upgrade_);
+        upgrade_.reset();
+        streams_[1] = std::move(stream);
+        dispatch(1);
+    }
+
+    if (!initial_.empty()) {
+        receiving_ = true;
+        ssize_t n = nghttp2_session_mem_recv(session_, reinterpret_cast<const uint8_t*>(initial_.data()), initial_.size());
+        receiving_ = false;
+        initial_.clear();
+        if (n < 0) {
+            std::cerr << "HTTP/2 protocol error: " << nghttp2_strerror(static_cast<int>(n)) << std::endl;
+            return do_close();
+        }
+    }
+
+    if (streams_.empty()) {
+        arm_idle_timer();
+    }
+    do_write();
+    do_read();
+}
+
+void Http2Session::do_read() {
+    if (closed_) {
+        return;
+    }
+    // Quiet connections are looked after by the idle timer
+    stream_.expires_never();
+    stream_.async_read_some(net::buffer(read_buffer_),
+                            beast::bind_front_handler(
+                                &Http2Session::on_read,
+                                shared_from_this()));
+}
+
+void Http2Session::on_read(beast::error_code ec, std::size_t bytes_transferred) {
+    if (closed_) {
+        return;
+    }
+    if (ec) {
+        if (ec != net::error::eof && ec != net::error::operation_aborted) {
+            std::cerr << "Read failed: " << ec.message() << std::endl;
+        }
+        return do_close();
+    }
+
+    // Runs the callbacks below: new streams are dispatched from in here,
+    // and cache hits are submitted before this returns
+    receiving_ = true;
+    ssize_t n = nghttp2_session_mem_recv(session_, reinterpret_cast<const uint8_t*>(read_buffer_.data()), bytes_transferred);
+    receiving_ = false;
+    if (n < 0) {
+        std::cerr << "HTTP/2 protocol error: " << nghttp2_strerror(static_cast<int>(n)) << std::endl;
+        return do_close();
+    }
+
+    do_write();
+    do_read();
+}
+
+void Http2Session::do_write() {
+    if (writing_ || closed_ || receiving_) {
+        return;
+    }
+
+    // Collect whatever frames nghttp2 has ready. The pointer it hands out
+    // is only good until the next call, hence the copy; capped so one busy
+    // connection does not buffer its whole backlog at once.
+    write_buffer_.clear();
+    for (;;) {
+        const uint8_t* data = nullptr;
+        ssize_t n = nghttp2_session_mem_send(session_, &data);
+        if (n < 0) {
+            std::cerr << "HTTP/2 send failed: " << nghttp2_strerror(static_cast<int>(n)) << std::endl;
+            return do_close();
+        }
+        if (n == 0) {
+            break;
+        }
+        write_buffer_.append(reinterpret_cast<const char*>(data), static_cast<std::size_t>(n));
+        if (write_buffer_.size() >= 64 * 1024) {
+            break;
+        }
+    }
+
+    if (write_buffer_.empty()) {
+        // Nothing to send and nothing more expected: GOAWAY went both ways
+        if (!nghttp2_session_want_read(session_) && !nghttp2_session_want_write(session_)) {
+            do_close();
+        }
+        return;
+    }
+
+    writing_ = true;
+    stream_.expires_after(context_->options.write_timeout);
+    net::async_write(stream_, net::buffer(write_buffer_),
+                     beast::bind_front_handler(
+                         &Http2Session::on_write,
+                         shared_from_this()));
+}
+
+void Http2Session::on_write(beast::error_code ec, std::size_t bytes_transferred) {
+    boost::ignore_unused(bytes_transferred);
+    writing_ = false;
+    if (closed_) {
+        return;
+    }
+    if (ec) {
+        std::cerr << "Write failed: " << ec.message() << std::endl;
+        return do_close();
+    }
+    do_write();
+}
+
+void Http2Session::arm_idle_timer() {
+    idle_timer_.expires_after(context_->options.idle_timeout);
+    idle_timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+        if (ec || self->closed_ || !self->streams_.empty() ||
+            self->idle_timer_.expiry() > std::chrono::steady_clock::now()) {
+            return;
+        }
+        // Polite close: GOAWAY, then the socket once it is written
+        nghttp2_session_terminate_session(self->session_, NGHTTP2_NO_ERROR);
+        self->do_write();
+    });
+}
+
+void Http2Session::dispatch(std::int32_t stream_id) {
+    auto it = streams_.find(stream_id);
+    if (it == streams_.end()) {
+        return;
+    }
+    // The handler builds HTTP/1.1 style responses; the connection headers
+    // that adds are dropped again in send_response
+    HttpRequest& req = it->second->req;
+    req.version(11);
+    req.keep_alive(true);
+
+    auto self = shared_from_this();
+    handle_http_request(context_, req, remote_, stream_.get_executor(), it->second->gone,
+        [self, stream_id](HttpResponse res) {
+            self->send_response(stream_id, std::move(res));
+        });
+}
+
+void Http2Session::send_response(std::int32_t stream_id, HttpResponse&& response) {
+    auto it = streams_.find(stream_id);
+    if (closed_ || it == streams_.end()) {
+        return; // Reset by the client while it rendered
+    }
+    Stream& stream = *it->second;
+    stream.res = std::move(response);
+    stream.ready = Metrics::Clock::now();
+
+    // Header names go lowercase in HTTP/2. nghttp2 copies the name/value
+    // pairs on submit, so these only have to outlive the call.
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::visit([&](auto& msg) {
+        headers.emplace_back(":status", std::to_string(msg.result_int()));
+        for (const auto& field : msg) {
+            std::string name(field.name_string().data(), field.name_string().size());
+            std::transform(name.begin(), name.end(), name.begin(),
+                           [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+            if (!connection_specific(name)) {
+                headers.emplace_back(std::move(name), std::string(field.value().data(), field.value().size()));
+            }
+        }
+        stream.body = body_bytes(msg);
+    }, *stream.res);
+
+    std::vector<nghttp2_nv> nva;
+    nva.reserve(headers.size());
+    for (auto& header : headers) {
+        nva.push_back({reinterpret_cast<uint8_t*>(header.first.data()), reinterpret_cast<uint8_t*>(header.second.data()),
+                       header.first.size(), header.second.size(), NGHTTP2_NV_FLAG_NONE});
+    }
+
+    // The body is read straight out of the response (for tiles, the shared
+    // tile) as flow control lets it go
+    nghttp2_data_provider provider;
+    provider.source.ptr = &stream;
+    provider.read_callback = &Http2Session::read_body;
+    int rv = nghttp2_submit_response(session_, stream_id, nva.data(), nva.size(), stream.body.empty() ? nullptr : &provider);
+    if (rv != 0) {
+        std::cerr << "ERROR: HTTP/2 response failed: " << nghttp2_strerror(rv) << std::endl;
+        nghttp2_submit_rst_stream(session_, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_INTERNAL_ERROR);
+    }
+    do_write();
+}
+
+void Http2Session::do_close() {
+    closed_ = true;
+    for (auto& stream : streams_) {
+        stream.second->gone->store(true, std::memory_order_relaxed);
+    }
+    idle_timer_.cancel();
+
+    // Send a TCP shutdown
+    beast::error_code ec;
+    stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+
+    // And drop the pending read
+    stream_.cancel();
+}
+
+int Http2Session::on_begin_headers(nghttp2_session*, const nghttp2_frame* frame, void* user_data) {
+    if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+        return 0;
+    }
+    auto* self = static_cast<Http2Session*>(user_data);
+    self->streams_[frame->hd.stream_id] = std::make_unique<Stream>();
+    self->idle_timer_.cancel();
+    return 0;
+}
+
+int Http2Session::on_header(nghttp2_session*, const nghttp2_frame* frame, const uint8_t* name, size_t namelen,
+                            const uint8_t* value, size_t valuelen, uint8_t, void* user_data) {
+    if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+        return 0;
+    }
+    auto* self = static_cast<Http2Session*>(user_data);
+    auto it = self->streams_.find(frame->hd.stream_id);
+    if (it == self->streams_.end()) {
+        return 0;
+    }
+    // nghttp2 has already checked the pseudo headers are well formed
+    HttpRequest& req = it->second->req;
+    const beast::string_view n = as_view(name, namelen);
+    const beast::string_view v = as_view(value, valuelen);
+    if (n == ":method") {
+        req.method_string(v);
+    } else if (n == ":path") {
+        req.target(v);
+    } else if (n == ":authority") {
+        req.set(http::field::host, v);
+    } else if (n.empty() || n[0] != ':') {
+        req.insert(n, v);
+    }
+    return 0;
+}
+
+int Http2Session::on_frame_recv(nghttp2_session*, const nghttp2_frame* frame, void* user_data) {
+    // A request is complete once its stream is closed from the client's side
+    if ((frame->hd.type == NGHTTP2_HEADERS || frame->hd.type == NGHTTP2_DATA) &&
+        (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+        static_cast<Http2Session*>(user_data)->dispatch(frame->hd.stream_id);
+    }
+    return 0;
+}
+
+int Http2Session::on_stream_close(nghttp2_session*, int32_t stream_id, uint32_t error_code, void* user_data) {
+    auto* self = static_cast<Http2Session*>(user_data);
+    auto it = self->streams_.find(stream_id);
+    if (it != self->streams_.end()) {
+        // Closed cleanly after our END_STREAM: the last frame has been
+        // handed to the write buffer
+        if (error_code == NGHTTP2_NO_ERROR && it->second->res) {
+            Metrics::observe(Metrics::Stage::Write, -1, Metrics::Clock::now() - it->second->ready);
+        }
+        it->second->gone->store(true, std::memory_order_relaxed); // Answered or reset, nothing left to render for it
+        self->streams_.erase(it);
+    }
+    if (self->streams_.empty() && !self->closed_) {
+        self->arm_idle_timer();
+    }
+    return 0;
+}
+
+ssize_t Http2Session::read_body(nghttp2_session*, int32_t, uint8_t* buf, size_t length, uint32_t* data_flags,
+                                nghttp2_data_source* source, void*) {
+    auto* stream = static_cast<Stream*>(source->ptr);
+    const std::size_t n = std::min(length, stream->body.size());
+    std::memcpy(buf, stream->body.data(), n);
+    stream->body.remove_prefix(n);
+    if (stream->body.empty()) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return static_cast<ssize_t>(n);
+}
+
+bool decode_http2_settings(std::string_view header, std::string& payload) {
+    payload.clear();
+    std::uint32_t bits = 0;
+    int count = 0;
+    for (char c : header) {
+        int value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '-' || c == '+') value = 62;
+        else if (c == '_' || c == '/') value = 63;
+        else if (c == '=') break; // Padding is not supposed to be there, but harmless
+        else return false;
+        bits = (bits << 6) | static_cast<std::uint32_t>(value);
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            payload.push_back(static_cast<char>((bits >> count) & 0xff));
+        }
+    }
+    return payload.size() % 6 == 0; // Whole SETTINGS entries only
+}
@@ -0,0 +1,88 @@
+#ifndef HTTP2_SESSION_HPP
+#define HTTP2_SESSION_HPP
+
+#include <boost/beast/core.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <nghttp2/nghttp2.h>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "http_handler.hpp" // Options, shared state and the request handler
+#include "metrics.hpp"      // Write stage timing
+
+// Handles one cleartext HTTP/2 (h2c) connection.
+//
+// nghttp2 does the protocol: framing, HPACK, flow control, stream limits.
+// This class feeds it bytes from the socket and writes out what it wants to
+// send. Every stream is handed to handle_http_request on its own, so the
+// tiles of a viewport render in parallel and go out as each one is ready,
+// all over one connection.
+//
+// Sessions come from HttpSession, which saw either the connection preface
+// (prior knowledge) or an "Upgrade: h2c" request; in the latter case that
+// request is answered as stream 1.
+class Http2Session : public std::enable_shared_from_this<Http2Session> {
+    // One request/response exchange
+    struct Stream {
+        HttpRequest req;
+        std::optional<HttpResponse> res; // Kept until sent, it owns the body
+        std::string_view body;           // Part of the body nghttp2 has not taken yet
+        Metrics::Clock::time_point ready; // When res was submitted
+        // Set when the stream closes, so a render still queued for it is dropped
+        std::shared_ptr<std::atomic<bool>> gone = std::make_shared<std::atomic<bool>>(false);
+    };
+
+    beast::tcp_stream stream_;
+    std::shared_ptr<HttpContext> context_;
+    tcp::endpoint remote_;
+    net::steady_timer idle_timer_;
+    nghttp2_session* session_ = nullptr;
+    std::map<std::int32_t, std::unique_ptr<Stream>> streams_; // Open streams by id
+
+    std::string initial_;                     // Bytes HttpSession read past the HTTP/1.1 part
+    std::optional<HttpRequest> upgrade_;      // The request that asked for h2c, if any
+    std::array<char, 16 * 1024> read_buffer_;
+    std::string write_buffer_;                // Frames being written
+    bool receiving_ = false; // Inside nghttp2_session_mem_recv, which must not be re-entered by a send
+    bool writing_ = false;
+    bool closed_ = false;
+
+public:
+    Http2Session(tcp::socket&& socket, std::shared_ptr<HttpContext> context, std::string initial,
+                 std::optional<HttpRequest> upgrade);
+    ~Http2Session();
+
+    void run();
+
+private:
+    void start();
+    void do_read();
+    void on_read(beast::error_code ec, std::size_t bytes_transferred);
+    void do_write();
+    void on_write(beast::error_code ec, std::size_t bytes_transferred);
+    void arm_idle_timer();
+    void dispatch(std::int32_t stream_id);
+    void send_response(std::int32_t stream_id, HttpResponse&& response);
+    void do_close();
+
+    // nghttp2 callbacks; user_data is the session
+    static int on_begin_headers(nghttp2_session* session, const nghttp2_frame* frame, void* user_data);
+    static int on_header(nghttp2_session* session, const nghttp2_frame* frame, const uint8_t* name, size_t namelen,
+                         const uint8_t* value, size_t valuelen, uint8_t flags, void* user_data);
+    static int on_frame_recv(nghttp2_session* session, const nghttp2_frame* frame, void* user_data);
+    static int on_stream_close(nghttp2_session* session, int32_t stream_id, uint32_t error_code, void* user_data);
+    static ssize_t read_body(nghttp2_session* session, int32_t stream_id, uint8_t* buf, size_t length,
+                             uint32_t* data_flags, nghttp2_data_source* source, void* user_data);
+};
+
+// Decodes the HTTP2-Settings header of an h2c upgrade (base64url, no
+// padding) into the SETTINGS payload; false if it is malformed
+bool decode_http2_settings(std::string_view header, std::string& payload);
+
+#endif // HTTP2_SESSION_HPP
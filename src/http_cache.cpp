@@ -0,0 +1,158 @@
+#include "http_cache.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <ctime>
+#include <sstream>
+#include <stdexcept>
+
+#include "tile_route.hpp" // kMaxZoom
+
+std::vector<int> parse_zoom_seconds(const std::string& spec) {
+    std::vector<int> seconds_per_zoom(kMaxZoom + 1, -1);
+    std::istringstream in(spec);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        if (range.find_first_not_of(" \t") == std::string::npos) {
+            continue;
+        }
+        std::istringstream parts(range);
+        int min_zoom = 0, max_zoom = 0;
+        long seconds = 0;
+        char dash = 0, colon = 0;
+        if (!(parts >> min_zoom >> dash >> max_zoom >> colon >> seconds) || dash != '-' || colon != ':' ||
+            min_zoom < 0 || max_zoom > kMaxZoom || min_zoom > max_zoom || seconds < 0 || seconds > 0x7fffffff) {
+            throw std::runtime_error("Invalid zoom lifetime '" + range + "', expected min_zoom-max_zoom:seconds");
+        }
+        for (int z = min_zoom; z <= max_zoom; ++z) {
+            seconds_per_zoom[z] = static_cast<int>(seconds);
+        }
+    }
+    return seconds_per_zoom;
+}
+
+HttpCachePolicy::HttpCachePolicy(const std::string& spec, const std::vector<int>& max_stale)
+    : max_age_(parse_zoom_seconds(spec)), cache_control_(kMaxZoom + 1) {
+    for (int z = 0; z <= kMaxZoom; ++z) {
+        if (max_age_[z] > 0) {
+            cache_control_[z] = "public, max-age=" + std::to_string(max_age_[z]);
+            if (static_cast<std::size_t>(z) < max_stale.size() && max_stale[z] > 0) {
+                cache_control_[z] += ", stale-while-revalidate=" + std::to_string(max_stale[z]);
+            }
+        } else if (max_age_[z] == 0) {
+            cache_control_[z] = "no-cache";
+        }
+    }
+}
+
+int HttpCachePolicy::max_age(int z) const {
+    return z >= 0 && z <= kMaxZoom ? max_age_[z] : -1;
+}
+
+const std::string& HttpCachePolicy::cache_control(int z) const {
+    static const std::string none;
+    return z >= 0 && z <= kMaxZoom ? cache_control_[z] : none;
+}
+
+const std::string& HttpCachePolicy::stale_cache_control() {
+    static const std::string stale = "no-cache";
+    return stale;
+}
+
+std::string HttpCachePolicy::http_date(std::int64_t unix_time) {
+    const std::time_t t = static_cast<std::time_t>(unix_time);
+    std::tm tm;
+    gmtime_r(&t, &tm);
+    // Not strftime: it follows the locale, HTTP dates are always English
+    static const char* const days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static const char* const months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                         "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    char buf[32];
+    std::snprintf(buf, sizeof buf, "%s, %02d %s %04d %02d:%02d:%02d GMT", days[tm.tm_wday], tm.tm_mday,
+                  months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    return buf;
+}
+
+std::string format_etag(std::uint64_t hash, std::string_view suffix) {
+    static const char digits[] = "0123456789abcdef";
+    std::string etag(18 + suffix.size(), '"');
+    for (int i = 0; i < 16; ++i) {
+        etag[1 + i] = digits[(hash >> (60 - 4 * i)) & 0xf];
+    }
+    etag.replace(17, suffix.size(), suffix.data(), suffix.size());
+    return etag;
+}
+
+bool etag_matches(std::string_view if_none_match, std::string_view etag) {
+    while (!if_none_match.empty()) {
+        const std::size_t comma = if_none_match.find(',');
+        std::string_view candidate = if_none_match.substr(0, comma);
+        if_none_match = comma == std::string_view::npos ? std::string_view() : if_none_match.substr(comma + 1);
+
+        const std::size_t begin = candidate.find_first_not_of(" \t");
+        if (begin == std::string_view::npos) {
+            continue;
+        }
+        candidate = candidate.substr(begin, candidate.find_last_not_of(" \t") - begin + 1);
+        if (candidate == "*") {
+            return true;
+        }
+        if (candidate.substr(0, 2) == "W/") {
+            candidate.remove_prefix(2);
+        }
+        if (candidate == etag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+namespace {
+
+std::string_view trim(std::string_view s) {
+    const std::size_t begin = s.find_first_not_of(" \t");
+    if (begin == std::string_view::npos) {
+        return {};
+    }
+    return s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    });
+}
+
+} // namespace
+
+bool accepts_encoding(std::string_view accept_encoding, std::string_view coding) {
+    int named = -1;    // 1 accepted, 0 refused (q=0), -1 not listed
+    int wildcard = -1; // The same for "*"
+    while (!accept_encoding.empty()) {
+        const std::size_t comma = accept_encoding.find(',');
+        std::string_view item = accept_encoding.substr(0, comma);
+        accept_encoding = comma == std::string_view::npos ? std::string_view() : accept_encoding.substr(comma + 1);
+
+        // "gzip;q=0.5": the coding, then parameters of which only q counts.
+        // A q-value is at most 1 with three decimals, so it is 0 exactly when
+        // it has no digit other than 0.
+        const std::string_view name = trim(item.substr(0, item.find(';')));
+        bool accepted = true;
+        for (std::size_t semicolon = item.find(';'); semicolon != std::string_view::npos;) {
+            item.remove_prefix(semicolon + 1);
+            semicolon = item.find(';');
+            const std::string_view param = trim(item.substr(0, semicolon));
+            if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                accepted = param.find_first_not_of("0.", 2) != std::string_view::npos;
+            }
+        }
+
+        if (iequals(name, coding)) {
+            named = accepted;
+        } else if (name == "*") {
+            wildcard = accepted;
+        }
+    }
+    return named >= 0 ? named == 1 : wildcard == 1;
+}
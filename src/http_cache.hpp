@@ -0,0 +1,55 @@
+#ifndef HTTP_CACHE_HPP
+#define HTTP_CACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Caching headers for tile responses: Cache-Control/Expires per zoom, so
+// browsers and CDNs keep tiles and revalidate them with If-None-Match instead
+// of downloading them again. Last-Modified follows the data, which can be
+// reloaded, so it comes from TileService::data_modified() per response.
+class HttpCachePolicy {
+public:
+    // `spec` is a list of lifetimes per zoom (see parse_zoom_seconds()).
+    // Zooms not covered get no Cache-Control, 0 means "no-cache" (always
+    // revalidate). `max_stale` (per zoom, seconds) adds stale-while-revalidate
+    // where it is positive, as the server itself serves out of date tiles
+    // that long. Throws std::runtime_error on a bad spec.
+    explicit HttpCachePolicy(const std::string& spec, const std::vector<int>& max_stale = {});
+
+    // Lifetime for tiles of zoom z in seconds, -1 if there is none
+    int max_age(int z) const;
+    // Cache-Control value for zoom z (empty if none)
+    const std::string& cache_control(int z) const;
+    // Cache-Control of an out of date tile that is being redrawn: caches
+    // should come back for the new one as soon as they can
+    static const std::string& stale_cache_control();
+
+    // RFC 7231 IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+    static std::string http_date(std::int64_t unix_time);
+
+private:
+    std::vector<int> max_age_;             // Per zoom
+    std::vector<std::string> cache_control_; // Per zoom, preformatted
+};
+
+// Parses a comma-separated list of zoom ranges and seconds, e.g.
+// "0-12:86400,13-20:3600" or "0-20:600"; later ranges win where they
+// overlap. Returns the seconds per zoom, -1 for zooms not covered. Throws
+// std::runtime_error on a bad spec.
+std::vector<int> parse_zoom_seconds(const std::string& spec);
+
+// "\"<16 hex digits>\"", the ETag of a tile with the given content hash
+std::string format_etag(std::uint64_t hash, std::string_view suffix = {});
+
+// True if an If-None-Match header value matches `etag` (weak comparison, so
+// W/ prefixes are ignored; "*" matches anything)
+bool etag_matches(std::string_view if_none_match, std::string_view etag);
+
+// True if an Accept-Encoding header value accepts `coding` (e.g. "gzip"):
+// listed by name, or else covered by "*", with a q-value above 0
+bool accepts_encoding(std::string_view accept_encoding, std::string_view coding);
+
+#endif // HTTP_CACHE_HPP
@@ -0,0 +1,609 @@
+#include "http_handler.hpp"
+#include "tile_route.hpp"
+#include "metrics.hpp"
+#include <boost/asio/post.hpp> // For resuming on the session strand
+#include <boost/beast/version.hpp> // For BOOST_BEAST_VERSION_STRING
+#include <iostream>
+#include <string>
+#include <sstream> // For the stats and metrics pages
+#include <cctype>  // For query string decoding
+
+namespace {
+
+// Value of one query string parameter, percent-decoded; empty if absent
+std::string query_param(beast::string_view target, beast::string_view name) {
+    const std::size_t query = target.find('?');
+    if (query == beast::string_view::npos) {
+        return {};
+    }
+    const std::string_view raw = find_query_param(std::string_view(target.data() + query + 1, target.size() - query - 1),
+                                                  std::string_view(name.data(), name.size()));
+    std::string value;
+    for (std::size_t i = 0; i < raw.size(); ++i) {
+        if (raw[i] == '%' && i + 2 < raw.size() && std::isxdigit(static_cast<unsigned char>(raw[i + 1])) &&
+            std::isxdigit(static_cast<unsigned char>(raw[i + 2]))) {
+            value += static_cast<char>(std::stoi(std::string(raw.substr(i + 1, 2)), nullptr, 16));
+            i += 2;
+        } else {
+            value += raw[i] == '+' ? ' ' : raw[i];
+        }
+    }
+    return value;
+}
+
+// Helper to create a response
+template<class Body>
+http::response<Body> make_response(http::status status, beast::string_view content_type, unsigned version, bool keep_alive) {
+    http::response<Body> res{status, version};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    if (!content_type.empty()) {
+        res.set(http::field::content_type, content_type);
+    }
+    res.keep_alive(keep_alive);
+    return res;
+}
+
+http::response<http::string_body> text_response(http::status status, unsigned version, bool keep_alive, std::string body) {
+    auto res = make_response<http::string_body>(status, "text/plain", version, keep_alive);
+    res.body() = std::move(body);
+    res.prepare_payload();
+    return res;
+}
+
+http::response<http::string_body> bad_request(const HttpRequest& req, beast::string_view why) {
+    return text_response(http::status::bad_request, req.version(), false, std::string(why)); // Close connection on bad request
+}
+
+http::response<http::string_body> not_found(const HttpRequest& req) {
+    return text_response(http::status::not_found, req.version(), req.keep_alive(),
+                         "The resource '" + std::string(req.target().data(), req.target().size()) + "' was not found.");
+}
+
+http::response<http::string_body> server_error(unsigned version, beast::string_view what) {
+    return text_response(http::status::internal_server_error, version, false, // Close on server error
+                         "Internal server error: " + std::string(what));
+}
+
+http::response<http::string_body> service_unavailable(unsigned version, bool keep_alive, beast::string_view why) {
+    auto res = text_response(http::status::service_unavailable, version, keep_alive,
+                             "Service unavailable: " + std::string(why));
+    res.set(http::field::retry_after, "1"); // Backlogs are short-lived, ask the client to retry soon
+    return res;
+}
+
+http::response<http::string_body> service_unavailable(const HttpRequest& req, beast::string_view why) {
+    return service_unavailable(req.version(), req.keep_alive(), why);
+}
+
+// For a request whose client went away before its render started, as
+// nginx logs it
+http::response<http::string_body> client_gone(unsigned version) {
+    return text_response(static_cast<http::status>(499), version, false, "Client closed request");
+}
+
+// What a tile response needs to know about its request. Renders finish
+// after the session may have moved on, so this is copied out up front.
+struct TileRequest {
+    TileKey key;
+    const char* format; // URL extension, for the access log
+    Metrics::Clock::time_point start;
+    unsigned version;
+    bool keep_alive;
+    bool accepts_gzip;
+    std::string if_none_match;
+};
+
+// Last-Modified of the data being served. It changes only on reloads, so
+// each thread keeps the formatted date until then.
+const std::string& last_modified_header(const TileService& tiles) {
+    thread_local std::int64_t formatted_for = 0;
+    thread_local std::string header;
+    const std::int64_t modified = tiles.data_modified();
+    if (modified != formatted_for) {
+        header = modified > 0 ? HttpCachePolicy::http_date(modified) : std::string();
+        formatted_for = modified;
+    }
+    return header;
+}
+
+// `stale`: an out of date tile, answered with while it is redrawn
+template<class Body>
+void set_cache_headers(const HttpContext& context, http::response<Body>& res, const TileKey& key, const std::string& etag,
+                       bool stale) {
+    const HttpCachePolicy& policy = *context.cache_policy;
+    res.set(http::field::etag, etag);
+    const std::string& cache_control = policy.cache_control(key.z);
+    if (stale) {
+        // Revalidated next time, by when the new tile has its own ETag
+        res.set(http::field::cache_control, HttpCachePolicy::stale_cache_control());
+        res.set(http::field::warning, "110 - \"Response is Stale\"");
+    } else if (!cache_control.empty()) {
+        res.set(http::field::cache_control, cache_control);
+        const std::int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        res.set(http::field::expires, HttpCachePolicy::http_date(now + policy.max_age(key.z)));
+    }
+    const std::string& last_modified = last_modified_header(*context.tiles);
+    if (!last_modified.empty()) {
+        res.set(http::field::last_modified, last_modified);
+    }
+    if (key.format == TileFormat::Vector && context.tiles->vector_options().gzip) {
+        res.set(http::field::vary, "Accept-Encoding");
+    }
+}
+
+HttpResponse tile_response(HttpContext& context, const TileRequest& request, TilePtr tile, bool stale = false) {
+    const TileKey& key = request.key;
+    beast::string_view content_type = context.tiles->encoder().content_type();
+    bool gzipped = false;
+    bool decompress = false;
+    if (key.format == TileFormat::Vector) {
+        // Vector tiles are kept gzipped. The odd client that cannot take that
+        // gets a decompressed copy, which is a different representation and
+        // so gets its own ETag.
+        content_type = VectorTileBuilder::content_type();
+        gzipped = context.tiles->vector_options().gzip;
+        decompress = gzipped && !request.accepts_gzip;
+    }
+    const std::string etag = format_etag(tile->hash, decompress ? "-identity" : "");
+
+    // Revalidation: the client already has these bytes, answer with headers only
+    if (!request.if_none_match.empty() && etag_matches(request.if_none_match, etag)) {
+        context.not_modified.fetch_add(1, std::memory_order_relaxed);
+        auto res = make_response<http::string_body>(http::status::not_modified, {}, request.version, request.keep_alive);
+        set_cache_headers(context, res, key, etag, stale);
+        return res; // 304 has no body, so no Content-Length either
+    }
+
+    if (decompress) {
+        auto res = make_response<http::string_body>(http::status::ok, content_type, request.version, request.keep_alive);
+        try {
+            res.body() = gzip_decompress(tile->bytes());
+        } catch (const std::exception& e) {
+            return server_error(request.version, e.what());
+        }
+        set_cache_headers(context, res, key, etag, stale);
+        res.prepare_payload();
+        return res;
+    }
+
+    // The body only references the shared tile, the bytes are never copied
+    auto res = make_response<TileBody>(http::status::ok, content_type, request.version, request.keep_alive);
+    if (gzipped) {
+        res.set(http::field::content_encoding, "gzip");
+    }
+    set_cache_headers(context, res, key, etag, stale);
+    res.body() = std::move(tile);
+    res.prepare_payload(); // Sets Content-Length
+    return res;
+}
+
+// Accounts for a tile response on its way out: request latency and bytes
+// by zoom, and a line in the access log if this one is sampled
+HttpResponse finish_tile(HttpContext& context, const TileRequest& request, bool cache_hit, HttpResponse res) {
+    const Metrics::Clock::duration elapsed = Metrics::Clock::now() - request.start;
+    Metrics::observe(Metrics::Stage::Request, request.key.z, elapsed);
+    unsigned status = 0;
+    std::uint64_t bytes = 0;
+    std::visit([&](const auto& msg) {
+        status = msg.result_int();
+        bytes = msg.payload_size().value_or(0);
+    }, res);
+    Metrics::bytes_out(request.key.z, bytes);
+    if (context.access_log && context.access_log->sample()) {
+        context.access_log->log({request.key.z, request.key.x, request.key.y, request.key.scale,
+                                 context.tiles->tileset_name(request.key.tileset).c_str(), request.format,
+                                 status, cache_hit, bytes, elapsed});
+    }
+    return res;
+}
+
+void handle_expire(const std::shared_ptr<HttpContext>& context, const HttpRequest& req, const tcp::endpoint& remote,
+                   const beast::tcp_stream::executor_type& executor, ResponseHandler done) {
+    // Reads files named by the caller, so only local processes (a cron job
+    // running next to the server) may use it
+    if (!remote.address().is_loopback()) {
+        return done(text_response(http::status::forbidden, req.version(), false, "Forbidden"));
+    }
+
+    const std::string osc = query_param(req.target(), "osc");
+    if (osc.empty()) {
+        return done(bad_request(req, "Missing osc=<path of the change file>"));
+    }
+    int min_zoom = 0, max_zoom = 18;
+    try {
+        std::string value = query_param(req.target(), "min_zoom");
+        if (!value.empty()) min_zoom = std::stoi(value);
+        value = query_param(req.target(), "max_zoom");
+        if (!value.empty()) max_zoom = std::stoi(value);
+    } catch (const std::exception&) {
+        return done(bad_request(req, "Invalid zoom range"));
+    }
+
+    // Parsing the file and scanning the data takes a while; do it on the
+    // render pool and answer on the session's strand afterwards
+    const unsigned version = req.version();
+    const bool keep_alive = req.keep_alive();
+    bool queued = context->tiles->render_pool().submit([context, executor, done, osc, min_zoom, max_zoom, version, keep_alive] {
+        HttpResponse res;
+        try {
+            TileService::ExpireResult r = context->tiles->expire_osc(osc, min_zoom, max_zoom);
+            std::ostringstream out;
+            out << "nodes " << r.nodes << "\n"
+                << "ways " << r.ways << "\n"
+                << "relations " << r.relations << "\n"
+                << "metatiles " << r.metatiles << "\n"
+                << "cached " << r.cached << "\n"
+                << "stored " << r.stored << "\n";
+            res = text_response(http::status::ok, version, keep_alive, out.str());
+        } catch (const std::exception& e) {
+            std::cerr << "ERROR: Expiring " << osc << " failed: " << e.what() << std::endl;
+            res = server_error(version, e.what());
+        }
+        net::post(executor, [done, res = std::move(res)]() mutable { done(std::move(res)); });
+    }, RenderPriority::Background); // Nobody's tile is waiting on it
+    if (!queued) {
+        return done(service_unavailable(req, "Render queue full"));
+    }
+}
+
+void handle_reload(const std::shared_ptr<HttpContext>& context, const HttpRequest& req, const tcp::endpoint& remote,
+                   const beast::tcp_stream::executor_type& executor, ResponseHandler done) {
+    // Same rule as expire: reads files and swaps the whole style, local callers only
+    if (!remote.address().is_loopback()) {
+        return done(text_response(http::status::forbidden, req.version(), false, "Forbidden"));
+    }
+    if (!context->reloader) {
+        return done(not_found(req));
+    }
+
+    // Loading the new style and data takes as long as a start-up; the
+    // answer comes once it is in place, or why it was not
+    const unsigned version = req.version();
+    const bool keep_alive = req.keep_alive();
+    bool started = context->reloader->start([executor, done, version, keep_alive](const Reloader::Result& r) {
+        HttpResponse res;
+        if (r.ok) {
+            std::ostringstream out;
+            out << "changed_zooms " << r.changed_zooms << "\n"
+                << "seconds " << r.seconds << "\n";
+            res = text_response(http::status::ok, version, keep_alive, out.str());
+        } else {
+            res = server_error(version, r.error);
+        }
+        net::post(executor, [done, res = std::move(res)]() mutable { done(std::move(res)); });
+    });
+    if (!started) {
+        return done(text_response(http::status::conflict, req.version(), req.keep_alive(), "A reload is already running"));
+    }
+}
+
+HttpResponse stats_response(const HttpContext& context, const HttpRequest& req) {
+    TileService& tiles = *context.tiles;
+    TileCache::Stats cache = tiles.cache().stats();
+    TileService::Stats service = tiles.stats();
+    TileRenderer::Stats render = tiles.render_stats();
+    std::ostringstream out;
+    out << "connections " << context.connections.load(std::memory_order_relaxed) << "\n"
+        << "http2_connections " << context.http2_connections.load(std::memory_order_relaxed) << "\n"
+        << "rejected_connections " << context.rejected_connections.load(std::memory_order_relaxed) << "\n"
+        << "pending_renders " << context.pending_renders.load(std::memory_order_relaxed) << "\n"
+        << "rejected_requests " << context.rejected_requests.load(std::memory_order_relaxed) << "\n"
+        << "not_modified " << context.not_modified.load(std::memory_order_relaxed) << "\n"
+        << "forwarded_requests " << context.forwarded.load(std::memory_order_relaxed) << "\n"
+        << "forward_fallbacks " << context.forward_fallbacks.load(std::memory_order_relaxed) << "\n"
+        << "peers_down " << (context.cluster ? context.cluster->peers_down() : 0) << "\n"
+        << "cache_hits " << cache.hits << "\n"
+        << "cache_misses " << cache.misses << "\n"
+        << "cache_insertions " << cache.insertions << "\n"
+        << "cache_evictions " << cache.evictions << "\n"
+        << "cache_entries " << cache.entries << "\n"
+        << "cache_bytes " << cache.bytes << "\n"
+        << "cache_capacity_bytes " << cache.capacity_bytes << "\n";
+    for (std::size_t t = 1; t < cache.tileset_bytes.size() && t < tiles.tileset_count(); ++t) {
+        out << "cache_bytes_" << tiles.tileset_name(t) << " " << cache.tileset_bytes[t] << "\n";
+    }
+    out << "render_queue " << tiles.render_pool().queued() << "\n";
+    for (std::size_t p = 0; p < kRenderPriorities; ++p) {
+        const auto priority = static_cast<RenderPriority>(p);
+        out << "render_queue_" << render_priority_name(priority) << " " << tiles.render_pool().queued(priority) << "\n"
+            << "render_running_" << render_priority_name(priority) << " " << tiles.render_pool().running(priority) << "\n";
+    }
+    out << "renders " << service.renders << "\n"
+        << "renders_in_flight " << service.in_flight << "\n"
+        << "coalesced_requests " << service.coalesced << "\n"
+        << "dropped_requests " << service.dropped << "\n"
+        << "abandoned_requests " << service.abandoned << "\n"
+        << "dropped_renders " << service.skipped << "\n"
+        << "refreshes " << service.refreshes << "\n"
+        << "dirty_metatiles " << service.dirty << "\n"
+        << "stale_hits " << service.stale_hits << "\n"
+        << "stale_served " << service.stale_served << "\n"
+        << "too_stale " << service.too_stale << "\n"
+        << "reloads " << service.reloads << "\n"
+        << "solid_tiles " << render.solid_tiles << "\n"
+        << "skipped_renders " << render.skipped_renders << "\n"
+        << "reused_queries " << render.reused_queries << "\n";
+    if (TileStore* store = tiles.store()) {
+        TileStore::Stats disk = store->stats();
+        out << "store_reads " << disk.reads << "\n"
+            << "store_hits " << disk.hits << "\n"
+            << "store_expired " << disk.expired << "\n"
+            << "store_writes " << disk.writes << "\n"
+            << "store_write_errors " << disk.write_errors << "\n"
+            << "store_dirty_reads " << disk.dirty_reads << "\n"
+            << "store_expirations " << disk.expirations << "\n";
+    }
+    return text_response(http::status::ok, req.version(), req.keep_alive(), out.str());
+}
+
+HttpResponse metrics_response(const HttpContext& context, const HttpRequest& req) {
+    TileService& tiles = *context.tiles;
+    TileService::Stats service = tiles.stats();
+    TileCache::Stats cache = tiles.cache().stats();
+    std::ostringstream out;
+    Metrics::write_prometheus(out);
+
+    // Point-in-time state of the server next to the recorded series
+    auto gauge = [&out](const char* name, const char* help, std::uint64_t value) {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " gauge\n"
+            << name << " " << value << "\n";
+    };
+    auto counter = [&out](const char* name, const char* help, std::uint64_t value) {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " counter\n"
+            << name << " " << value << "\n";
+    };
+    gauge("tile_http_connections", "Open client connections.", context.connections.load(std::memory_order_relaxed));
+    gauge("tile_http2_connections", "Open HTTP/2 connections.", context.http2_connections.load(std::memory_order_relaxed));
+    gauge("tile_pending_renders", "Requests waiting on a render.", context.pending_renders.load(std::memory_order_relaxed));
+    gauge("tile_renders_in_flight", "Render jobs queued or running.", service.in_flight);
+    gauge("tile_render_queue", "Render jobs waiting for a render thread.", tiles.render_pool().queued());
+    out << "# HELP tile_render_jobs Render jobs by priority and state.\n"
+        << "# TYPE tile_render_jobs gauge\n";
+    for (std::size_t p = 0; p < kRenderPriorities; ++p) {
+        const auto priority = static_cast<RenderPriority>(p);
+        out << "tile_render_jobs{priority=\"" << render_priority_name(priority) << "\",state=\"queued\"} "
+            << tiles.render_pool().queued(priority) << "\n"
+            << "tile_render_jobs{priority=\"" << render_priority_name(priority) << "\",state=\"running\"} "
+            << tiles.render_pool().running(priority) << "\n";
+    }
+    gauge("tile_cache_entries", "Tiles in the memory cache.", cache.entries);
+    gauge("tile_cache_bytes", "Bytes held by the memory cache.", cache.bytes);
+    counter("tile_renders_total", "Render jobs started.", service.renders);
+    counter("tile_coalesced_requests_total", "Requests that joined a render already in flight.", service.coalesced);
+    counter("tile_dropped_requests_total", "Requests given up before their render started because their deadline passed.", service.dropped);
+    counter("tile_abandoned_requests_total", "Requests given up before their render started because their client went away.", service.abandoned);
+    counter("tile_dropped_renders_total", "Renders skipped because every request for them was dropped.", service.skipped);
+    counter("tile_stale_hits_total", "Cache hits on tiles drawn before a reload changed their style.", service.stale_hits);
+    counter("tile_stale_served_total", "Out of date tiles answered with while they were redrawn.", service.stale_served);
+    counter("tile_too_stale_total", "Out of date tiles past their zoom's maximum staleness, redrawn before answering.", service.too_stale);
+    counter("tile_reloads_total", "Style and data reloads.", service.reloads);
+    counter("tile_rejected_connections_total", "Connections turned away with 503.", context.rejected_connections.load(std::memory_order_relaxed));
+    counter("tile_rejected_requests_total", "Requests turned away with 503.", context.rejected_requests.load(std::memory_order_relaxed));
+    counter("tile_not_modified_total", "Revalidations answered with 304.", context.not_modified.load(std::memory_order_relaxed));
+    if (context.cluster) {
+        counter("tile_forwarded_requests_total", "Tile requests sent on to the peer owning them.", context.forwarded.load(std::memory_order_relaxed));
+        counter("tile_forward_fallbacks_total", "Forwarded requests rendered locally because the owner failed.", context.forward_fallbacks.load(std::memory_order_relaxed));
+        gauge("tile_peers_down", "Peers being left alone after a failed request.", context.cluster->peers_down());
+    }
+    if (context.access_log) {
+        counter("tile_access_log_dropped_total", "Access log lines dropped because the writer fell behind.", context.access_log->dropped());
+    }
+
+    auto res = make_response<http::string_body>(http::status::ok, "text/plain; version=0.0.4", req.version(), req.keep_alive());
+    res.body() = out.str();
+    res.prepare_payload();
+    return res;
+}
+
+// Renders the tile here; the request already counts in pending_renders.
+//
+// Render on the render pool so the I/O thread can keep serving other
+// sockets. The result is posted back onto the session's strand. Until
+// the render starts, the request is let go if its client disconnects or
+// it waited past the deadline.
+void render_tile(const std::shared_ptr<HttpContext>& context, const TileRequest& request,
+                 const beast::tcp_stream::executor_type& executor, std::shared_ptr<const std::atomic<bool>> gone,
+                 ResponseHandler done) {
+    RenderClient client;
+    client.gone = std::move(gone);
+    if (context->options.render_deadline.count() > 0) {
+        client.deadline = request.start + context->options.render_deadline;
+    }
+    bool queued = context->tiles->render(request.key, [context, executor, done, request](TilePtr tile, const std::string& error, bool stale) {
+        context->pending_renders.fetch_sub(1, std::memory_order_relaxed);
+        net::post(executor, [context, done, request, tile = std::move(tile), error, stale]() mutable {
+            const TileKey& key = request.key;
+            if (!tile && error == TileService::kClientGone) {
+                // Nobody reads this; it only ends the exchange and the access log line
+                return done(finish_tile(*context, request, false, client_gone(request.version)));
+            }
+            if (!tile && error == TileService::kDeadlinePassed) {
+                // The client waited too long; it may try again
+                context->rejected_requests.fetch_add(1, std::memory_order_relaxed);
+                return done(finish_tile(*context, request, false,
+                                        service_unavailable(request.version, request.keep_alive, "Render deadline passed")));
+            }
+            if (!tile) {
+                std::cerr << "ERROR rendering tile Z=" << key.z << " X=" << key.x << " Y=" << key.y << ": " << error << std::endl;
+                return done(finish_tile(*context, request, false, server_error(request.version, "Tile rendering failed")));
+            }
+            done(finish_tile(*context, request, false, tile_response(*context, request, std::move(tile), stale)));
+        });
+    }, std::move(client));
+
+    if (!queued) {
+        context->pending_renders.fetch_sub(1, std::memory_order_relaxed);
+        context->rejected_requests.fetch_add(1, std::memory_order_relaxed);
+        // Counted in rejected_requests; a line per request would only add to the overload
+        return done(finish_tile(*context, request, false, service_unavailable(request.version, request.keep_alive, "Render queue full")));
+    }
+}
+
+// Asks the metatile's owner for the tile; the request already counts in
+// pending_renders. If the owner cannot be reached or cannot answer, the
+// tile is rendered here after all.
+void forward_tile(const std::shared_ptr<HttpContext>& context, const TileRequest& request, const std::string& target,
+                  std::size_t owner, const beast::tcp_stream::executor_type& executor,
+                  std::shared_ptr<const std::atomic<bool>> gone, ResponseHandler done) {
+    context->forwarded.fetch_add(1, std::memory_order_relaxed);
+    context->cluster->fetch(owner, target, [context, request, executor, gone, done](bool ok, Cluster::Response res) {
+        auto fall_back = [&] {
+            context->forward_fallbacks.fetch_add(1, std::memory_order_relaxed);
+            net::post(executor, [context, request, executor, gone, done]() mutable {
+                render_tile(context, request, executor, std::move(gone), std::move(done));
+            });
+        };
+        if (!ok || res.result() != http::status::ok) {
+            return fall_back();
+        }
+
+        // The owner may run with another --mvt_gzip: the tile is cached and
+        // served the way this node keeps them. An encoding we do not expect
+        // from a peer means the tile is rendered here.
+        const bool vector = request.key.format == TileFormat::Vector;
+        const bool want_gzip = vector && context->tiles->vector_options().gzip;
+        const beast::string_view encoding = res[http::field::content_encoding];
+        std::string body = std::move(res.body());
+        try {
+            if (encoding.empty() || beast::iequals(encoding, "identity")) {
+                if (want_gzip) {
+                    body = gzip_compress(body);
+                }
+            } else if (vector && beast::iequals(encoding, "gzip")) {
+                if (!want_gzip) {
+                    body = gzip_decompress(body);
+                }
+            } else {
+                return fall_back();
+            }
+        } catch (const std::exception&) {
+            return fall_back(); // Not the gzip it said it was
+        }
+
+        auto tile = std::make_shared<EncodedTile>();
+        tile->data = std::move(body);
+        tile->hash = content_hash(tile->data);
+        // An out of date tile is the owner's to redraw; we ask again next time
+        const bool stale = res.count(http::field::warning) > 0;
+        if (!stale) {
+            context->tiles->cache_remote(request.key, tile);
+        }
+        context->pending_renders.fetch_sub(1, std::memory_order_relaxed);
+        net::post(executor, [context, done, request, tile = TilePtr(std::move(tile)), stale]() mutable {
+            done(finish_tile(*context, request, false, tile_response(*context, request, std::move(tile), stale)));
+        });
+    });
+}
+
+} // namespace
+
+void handle_http_request(const std::shared_ptr<HttpContext>& context, const HttpRequest& req,
+                         const tcp::endpoint& remote, const beast::tcp_stream::executor_type& executor,
+                         std::shared_ptr<const std::atomic<bool>> gone, ResponseHandler done) {
+    const Metrics::Clock::time_point start = Metrics::Clock::now();
+    TileService& tiles = *context->tiles;
+
+    // Admin actions change server state, so they are POSTs
+    beast::string_view path = req.target().substr(0, req.target().find('?'));
+    if (path == "/admin/expire") {
+        if (req.method() != http::verb::post) {
+            return done(bad_request(req, "Use POST for admin actions"));
+        }
+        return handle_expire(context, req, remote, executor, std::move(done));
+    }
+    if (path == "/admin/reload") {
+        if (req.method() != http::verb::post) {
+            return done(bad_request(req, "Use POST for admin actions"));
+        }
+        return handle_reload(context, req, remote, executor, std::move(done));
+    }
+
+    // Only handle GET requests
+    if (req.method() != http::verb::get) {
+        return done(bad_request(req, "Unsupported HTTP-method"));
+    }
+
+    // Basic health check or root path
+    if (path == "/" || path == "/health") {
+        return done(text_response(http::status::ok, req.version(), req.keep_alive(), "OK"));
+    }
+
+    if (path == "/stats") {
+        return done(stats_response(*context, req));
+    }
+
+    if (path == "/metrics") {
+        return done(metrics_response(*context, req));
+    }
+
+    // Tile paths are parsed in place: no copy of the target, no regex
+    TileRoute route;
+    switch (parse_tile_route(std::string_view(req.target().data(), req.target().size()), route)) {
+        case RouteStatus::NotTile:
+            return done(not_found(req));
+        case RouteStatus::BadZoom:
+            return done(bad_request(req, "Invalid zoom level"));
+        case RouteStatus::BadCoordinates:
+            return done(bad_request(req, "Invalid tile coordinates for zoom level"));
+        case RouteStatus::Ok:
+            break;
+    }
+
+    // Raster extensions have to match the configured format; .mvt and .pbf
+    // ask for a vector tile. The style segment picks a tileset (none is the
+    // default style). @{n}x asks for a denser raster tile, up to
+    // --max_scale; vector tiles have no pixels.
+    const bool vector = route.extension == "mvt" || route.extension == "pbf";
+    const int tileset = tiles.find_tileset(route.style);
+    if ((!vector && route.extension != tiles.encoder().extension()) || tileset < 0 ||
+        route.scale > tiles.max_scale() || (vector && route.scale != 1)) {
+        return done(not_found(req));
+    }
+
+    Metrics::observe(Metrics::Stage::Parse, route.z, Metrics::Clock::now() - start);
+
+    TileRequest request;
+    request.key = TileKey{route.z, route.x, route.y, vector ? TileFormat::Vector : TileFormat::Raster,
+                          static_cast<std::uint8_t>(route.scale), static_cast<std::uint8_t>(tileset)};
+    request.format = vector ? "mvt" : tiles.encoder().extension().c_str();
+    request.start = start;
+    request.version = req.version();
+    request.keep_alive = req.keep_alive();
+    const beast::string_view accept_encoding = req[http::field::accept_encoding];
+    request.accepts_gzip = accepts_encoding({accept_encoding.data(), accept_encoding.size()}, "gzip");
+    auto if_none_match = req[http::field::if_none_match];
+    request.if_none_match.assign(if_none_match.data(), if_none_match.size());
+    const TileKey& key = request.key;
+
+    // Cache hits are answered right here on the I/O thread, out of date
+    // ones too while they are redrawn
+    bool stale = false;
+    if (TilePtr tile = tiles.cached(key, &stale)) {
+        return done(finish_tile(*context, request, true, tile_response(*context, request, std::move(tile), stale)));
+    }
+
+    // Requests parked on renders are bounded server-wide. Past the limit we
+    // shed load now rather than let every connection's pipeline fill up
+    // with work the render pool cannot get to.
+    if (context->pending_renders.fetch_add(1, std::memory_order_relaxed) >= context->options.max_pending_renders) {
+        context->pending_renders.fetch_sub(1, std::memory_order_relaxed);
+        context->rejected_requests.fetch_add(1, std::memory_order_relaxed);
+        return done(finish_tile(*context, request, false, service_unavailable(req, "Too many pending renders")));
+    }
+
+    // In a cluster every metatile has one owner that renders and caches it;
+    // the other nodes ask it for the tile and keep a copy. Requests from a
+    // peer are always answered here.
+    if (context->cluster && req[Cluster::kPeerHeader].empty()) {
+        const std::size_t owner = context->cluster->owner(tiles.job_key_for(key));
+        if (!context->cluster->is_self(owner) && context->cluster->available(owner)) {
+            return forward_tile(context, request, std::string(req.target()), owner, executor, std::move(gone),
+                                std::move(done));
+        }
+    }
+
+    render_tile(context, request, executor, std::move(gone), std::move(done));
+}
@@ -0,0 +1,76 @@
+#ifndef HTTP_HANDLER_HPP
+#define HTTP_HANDLER_HPP
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <variant>
+
+#include "tile_service.hpp" // Cache + render pipeline
+#include "tile_body.hpp"    // Zero-copy body for shared tiles
+#include "http_cache.hpp"   // ETag / Cache-Control / Last-Modified
+#include "access_log.hpp"   // Sampled request log
+#include "reloader.hpp"     // Style and data hot reload
+#include "cluster.hpp"      // Tile ownership across server nodes
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace http = beast::http;           // from <boost/beast/http.hpp>
+namespace net = boost::asio;            // from <boost/asio.hpp>
+using tcp = net::ip::tcp;               // from <boost/asio/ip/tcp.hpp>
+
+// Connection handling limits. Past them the server answers 503 with
+// Retry-After right away instead of letting work pile up.
+struct HttpOptions {
+    std::size_t max_connections = 10000;    // Open connections; more are turned away on accept
+    std::size_t max_pending_renders = 1024; // Requests waiting on a render, server-wide
+    std::size_t max_pipeline = 16;          // Requests read ahead on one HTTP/1.1 connection
+    std::chrono::seconds idle_timeout{30};  // Keep-alive connections without a request are closed
+    std::chrono::seconds write_timeout{30}; // A response not written by then drops the connection
+    bool http2 = true;                      // Accept h2c (prior knowledge or Upgrade) if built with nghttp2
+    std::uint32_t max_streams = 128;        // Concurrent HTTP/2 streams per connection
+    std::chrono::seconds render_deadline{30}; // A request still queued for a render by then gets 503; 0 = never
+};
+
+// Everything the server and its sessions share
+struct HttpContext {
+    std::shared_ptr<TileService> tiles;                  // Shared tile pipeline
+    std::shared_ptr<const HttpCachePolicy> cache_policy; // Caching headers of tile responses
+    HttpOptions options;
+    std::shared_ptr<AccessLog> access_log;               // Null when request logging is off
+    std::shared_ptr<Reloader> reloader;                  // POST /admin/reload; null disables it
+    std::shared_ptr<Cluster> cluster;                    // Null when running alone
+
+    std::atomic<std::size_t> connections{0};
+    std::atomic<std::size_t> http2_connections{0}; // Of those, the ones speaking HTTP/2
+    std::atomic<std::size_t> pending_renders{0};
+    std::atomic<std::uint64_t> rejected_connections{0};
+    std::atomic<std::uint64_t> rejected_requests{0}; // 503s for pending_renders or a full render queue
+    std::atomic<std::uint64_t> not_modified{0};      // 304 revalidations
+    std::atomic<std::uint64_t> forwarded{0};         // Tile requests sent on to their owner
+    std::atomic<std::uint64_t> forward_fallbacks{0}; // ... of which were rendered here after all
+};
+
+using HttpRequest = http::request<http::string_body>;
+using HttpResponse = std::variant<http::response<TileBody>, http::response<http::string_body>>;
+using ResponseHandler = std::function<void(HttpResponse)>;
+
+// Works out the response to one request, whichever protocol it came in on:
+// tiles, health, /stats, /metrics and the admin endpoints.
+//
+// `done` is called exactly once. Anything answered from memory (cache hits,
+// errors, stats) calls it before this returns; renders and admin jobs call it
+// later, posted to `executor` so sessions get it on their own strand. The
+// request only has to live until this returns.
+//
+// The session sets `gone` once nobody will read the response any more (the
+// connection or stream closed); a render not started by then is skipped.
+void handle_http_request(const std::shared_ptr<HttpContext>& context, const HttpRequest& req,
+                         const tcp::endpoint& remote, const beast::tcp_stream::executor_type& executor,
+                         std::shared_ptr<const std::atomic<bool>> gone, ResponseHandler done);
+
+#endif // HTTP_HANDLER_HPP
@@ -1,14 +1,37 @@
 #include "http_server.hpp"
+#include <boost/asio/write.hpp> // For turning away connections
+#include <boost/beast/http/rfc7230.hpp> // For the Upgrade header
+#include <algorithm>
 #include <iostream>
 #include <string>
-#include <regex> // For parsing URL path
+#include <string_view>
+
+#ifdef HAVE_NGHTTP2
+#include "http2_session.hpp"
+#endif
+
+namespace {
+
+#ifdef HAVE_NGHTTP2
+// Sent by HTTP/2 clients with prior knowledge before anything else
+constexpr std::string_view http2_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// "Upgrade: h2c" plus the HTTP2-Settings header such a request has to carry.
+// Only body-less GETs: the body would have to be replayed as HTTP/2 DATA.
+bool wants_h2c(const HttpRequest& req) {
+    return req.method() == http::verb::get && req.body().empty() &&
+           http::token_list(req[http::field::upgrade]).exists("h2c") && req.find("HTTP2-Settings") != req.end();
+}
+#endif
+
+} // namespace
 
 //------------------------------------------------------------------------------
 // HttpServer Implementation
 //------------------------------------------------------------------------------
 
-HttpServer::HttpServer(net::io_context& ioc, tcp::endpoint endpoint, std::shared_ptr<TileRenderer> renderer)
-    : ioc_(ioc), acceptor_(ioc), renderer_(std::move(renderer)) {
+HttpServer::HttpServer(net::io_context& ioc, tcp::endpoint endpoint, std::shared_ptr<HttpContext> context)
+    : ioc_(ioc), acceptor_(ioc), context_(std::move(context)) {
     beast::error_code ec;
 
     // Open the acceptor
@@ -60,42 +83,167 @@ void HttpServer::do_accept() {
 void HttpServer::on_accept(beast::error_code ec, tcp::socket socket) {
     if (ec) {
         std::cerr << "Accept failed: " << ec.message() << std::endl;
+    } else if (context_->connections.load(std::memory_order_relaxed) >= context_->options.max_connections) {
+        reject(std::move(socket));
     } else {
         // Create the http session and run it
-        std::make_shared<HttpSession>(std::move(socket), renderer_)->run();
+        std::make_shared<HttpSession>(std::move(socket), context_)->run();
     }
 
     // Accept the next connection
     do_accept();
 }
 
+void HttpServer::reject(tcp::socket socket) {
+    // Too many open connections: a canned 503 is all this one gets. Cheaper
+    // than a session, and it tells the client to come back instead of
+    // leaving it waiting in the accept backlog.
+    context_->rejected_connections.fetch_add(1, std::memory_order_relaxed);
+    static const char response[] =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: 1\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    auto sp = std::make_shared<tcp::socket>(std::move(socket));
+    net::async_write(*sp, net::buffer(response, sizeof(response) - 1),
+        [sp](beast::error_code, std::size_t) {
+            beast::error_code ec;
+            sp->shutdown(tcp::socket::shutdown_send, ec);
+        });
+}
+
 
 //------------------------------------------------------------------------------
 // HttpSession Implementation
 //------------------------------------------------------------------------------
 
-HttpSession::HttpSession(tcp::socket&& socket, std::shared_ptr<TileRenderer> renderer)
-    : stream_(std::move(socket)), renderer_(std::move(renderer)) {}
+HttpSession::HttpSession(tcp::socket&& socket, std::shared_ptr<HttpContext> context)
+    : stream_(std::move(socket)), context_(std::move(context)), idle_timer_(stream_.get_executor()) {
+    beast::error_code ec;
+    remote_ = stream_.socket().remote_endpoint(ec);
+    context_->connections.fetch_add(1, std::memory_order_relaxed);
+}
+
+HttpSession::~HttpSession() {
+    context_->connections.fetch_sub(1, std::memory_order_relaxed);
+}
 
 void HttpSession::run() {
     // We need to be executing within a strand to perform async operations
     // on the stream. Although not strictly necessary for simple cases,
     // it's good practice. We use dispatch here to run do_read().
+#ifdef HAVE_NGHTTP2
+    if (context_->options.http2) {
+        // First find out whether this is HTTP/2 with prior knowledge
+        return net::dispatch(stream_.get_executor(),
+                             beast::bind_front_handler(
+                                 &HttpSession::do_detect,
+                                 shared_from_this()));
+    }
+#endif
     net::dispatch(stream_.get_executor(),
                   beast::bind_front_handler(
                       &HttpSession::do_read,
                       shared_from_this()));
 }
 
+#ifdef HAVE_NGHTTP2
+void HttpSession::do_detect() {
+    arm_idle_timer();
+    stream_.expires_never();
+    reading_ = true;
+    stream_.async_read_some(buffer_.prepare(4096),
+                            beast::bind_front_handler(
+                                &HttpSession::on_detect,
+                                shared_from_this()));
+}
+
+void HttpSession::on_detect(beast::error_code ec, std::size_t bytes_transferred) {
+    reading_ = false;
+    if (ec) {
+        if (ec != net::error::eof && ec != net::error::operation_aborted) {
+            std::cerr << "Read failed: " << ec.message() << std::endl;
+        }
+        return do_close();
+    }
+    buffer_.commit(bytes_transferred);
+
+    // The bytes stay in buffer_ either way: the HTTP/1.1 parser or nghttp2
+    // picks them up from there
+    const std::string_view data(static_cast<const char*>(buffer_.data().data()), buffer_.size());
+    const std::size_t common = std::min(data.size(), http2_preface.size());
+    if (data.substr(0, common) != http2_preface.substr(0, common)) {
+        return do_read(); // HTTP/1.x
+    }
+    if (data.size() < http2_preface.size()) {
+        return do_detect(); // Could still be either
+    }
+    start_http2(std::nullopt);
+}
+
+void HttpSession::upgrade_h2c() {
+    // Nothing else is queued (see on_read), so the 101 is the next thing
+    // the client sees; HTTP/2 starts right after it
+    writing_ = true;
+    idle_timer_.cancel();
+    static const char response[] =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n"
+        "\r\n";
+    stream_.expires_after(context_->options.write_timeout);
+    net::async_write(stream_, net::buffer(response, sizeof(response) - 1),
+        [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            self->writing_ = false;
+            if (ec) {
+                std::cerr << "Write failed: " << ec.message() << std::endl;
+                return self->do_close();
+            }
+            self->start_http2(std::move(self->req_));
+        });
+}
+
+void HttpSession::start_http2(std::optional<HttpRequest> upgrade) {
+    // Hand the socket, and whatever was read past the HTTP/1.1 part, to an
+    // Http2Session. This session is done once the last handler returns.
+    closed_ = true;
+    idle_timer_.cancel();
+    std::string initial(static_cast<const char*>(buffer_.data().data()), buffer_.size());
+    buffer_.consume(buffer_.size());
+    try {
+        std::make_shared<Http2Session>(stream_.release_socket(), context_, std::move(initial), std::move(upgrade))->run();
+    } catch (const std::exception& e) {
+        std::cerr << "ERROR: Starting HTTP/2 session failed: " << e.what() << std::endl;
+    }
+}
+#endif
+
 void HttpSession::do_read() {
+    if (closed_ || read_closed_) {
+        return;
+    }
+    // Nothing left to answer: the client has idle_timeout to send the next request
+    if (exchanges_.empty()) {
+        arm_idle_timer();
+    }
+    // One read at a time, and no more than max_pipeline requests queued.
+    // A full pipeline resumes reading as responses go out (see on_write).
+    if (reading_ || exchanges_.size() >= context_->options.max_pipeline) {
+        return;
+    }
+
     // Make the request empty before reading,
     // otherwise the operation behavior is undefined.
     req_ = {};
 
-    // Set the timeout.
-    stream_.expires_after(std::chrono::seconds(30));
+    // Reads can wait on renders for as long as they take, the idle timer
+    // covers the quiet times. Only applies to this read; a write already in
+    // flight keeps its own deadline.
+    stream_.expires_never();
 
     // Read a request
+    reading_ = true;
     http::async_read(stream_, buffer_, req_,
                      beast::bind_front_handler(
                          &HttpSession::on_read,
@@ -104,175 +252,145 @@ void HttpSession::do_read() {
 
 void HttpSession::on_read(beast::error_code ec, std::size_t bytes_transferred) {
     boost::ignore_unused(bytes_transferred);
+    reading_ = false;
+    if (closed_) {
+        return;
+    }
 
-    // This means they closed the connection
-    if (ec == http::error::end_of_stream)
-        return do_close();
+    // This means they closed their side. That may be a half-close after
+    // pipelining requests, so the ones read are still answered, renders
+    // included; the connection closes after the last response. Should the
+    // client be gone for good, the first write fails and closes it.
+    if (ec == http::error::end_of_stream) {
+        read_closed_ = true;
+        if (exchanges_.empty()) {
+            do_close();
+        }
+        return;
+    }
 
     if (ec) {
-         std::cerr << "Read failed: " << ec.message() << std::endl;
+        if (ec != net::error::operation_aborted) { // Idle timeout
+            std::cerr << "Read failed: " << ec.message() << std::endl;
+        }
         return do_close(); // Consider sending bad request?
     }
 
+    idle_timer_.cancel();
 
-    // Handle the request
-    handle_request();
-}
-
-// Helper to create a response
-template<class Body>
-http::response<Body> make_response(http::status status, beast::string_view content_type, unsigned version, bool keep_alive) {
-    http::response<Body> res{status, version};
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    if (!content_type.empty()) {
-        res.set(http::field::content_type, content_type);
+#ifdef HAVE_NGHTTP2
+    // Only taken up with nothing else in flight, so no HTTP/1.1 response
+    // can end up behind the 101
+    if (context_->options.http2 && exchanges_.empty() && !writing_ && wants_h2c(req_)) {
+        return upgrade_h2c();
     }
-    res.keep_alive(keep_alive);
-    return res;
-}
-
+#endif
 
-void HttpSession::handle_request() {
-    // Only handle GET requests
-    if (req_.method() != http::verb::get) {
-        return send_bad_request("Unsupported HTTP-method");
+    if (!req_.keep_alive()) {
+        read_closed_ = true; // Connection: close, this is the last request
     }
-
-    // Basic health check or root path
-     if (req_.target() == "/" || req_.target() == "/health") {
-        auto res = make_response<http::string_body>(http::status::ok, "text/plain", req_.version(), req_.keep_alive());
-        res.body() = "OK";
-        res.prepare_payload();
-         return send_response(std::move(res)); // Need to adjust send_response template or create overload
-    }
-
-    // Regex to parse /z/x/y.png (or other image formats if needed)
-    // Target looks like: "/12/2048/1365.png"
-    static const std::regex tile_regex(R"(\/(\d+)\/(\d+)\/(\d+)\.png)");
-    std::smatch match;
-    std::string target_str(req_.target().data(), req_.target().size()); // Convert beast::string_view
-
-    if (std::regex_match(target_str, match, tile_regex)) {
-        try {
-            int z = std::stoi(match[1].str());
-            int x = std::stoi(match[2].str());
-            int y = std::stoi(match[3].str());
-
-            // Validate zoom level (example range)
-            if (z < 0 || z > 20) {
-                 return send_bad_request("Invalid zoom level");
-            }
-
-            // Validate X/Y against zoom level
-             double max_coord = std::pow(2.0, z);
-             if (x < 0 || x >= max_coord || y < 0 || y >= max_coord) {
-                 return send_bad_request("Invalid tile coordinates for zoom level");
-             }
-
-
-             std::clog << "INFO: Requesting tile Z=" << z << ", X=" << x << ", Y=" << y << std::endl;
-
-
-            // Render the tile using the renderer
-            std::vector<unsigned char> png_data = renderer_->render_tile(z, x, y);
-
-            // Create the HTTP response with the PNG data
-            auto res = make_response<http::vector_body<unsigned char>>(http::status::ok, "image/png", req_.version(), req_.keep_alive());
-            res.body() = std::move(png_data); // Move the vector data
-            res.prepare_payload(); // Sets Content-Length
-
-            return send_response(std::move(res));
-
-        } catch (const std::invalid_argument& e) {
-            std::cerr << "ERROR: Invalid coordinate in URL: " << target_str << " - " << e.what() << std::endl;
-            return send_bad_request("Invalid tile coordinates format");
-        } catch (const std::out_of_range& e) {
-             std::cerr << "ERROR: Coordinate out of range in URL: " << target_str << " - " << e.what() << std::endl;
-            return send_bad_request("Tile coordinate out of range");
-        }
-         catch (const std::exception& e) {
-             std::cerr << "ERROR rendering tile Z=" << match[1].str() << " X=" << match[2].str() << " Y=" << match[3].str() << ": " << e.what() << std::endl;
-            return send_server_error("Tile rendering failed");
-         }
-
-    } else {
-        // Path didn't match the tile format
-        return send_not_found();
-    }
-}
-
-
-void HttpSession::send_response(http::response<http::string_body>&& response) {
-    // For string bodies (used by error handlers)
-    auto sp = shared_from_this(); // Keep session alive
-
-    // Write the response
-    http::async_write(stream_, std::move(response),
-        [sp](beast::error_code ec, std::size_t bytes) {
-            sp->on_write(sp->req_.keep_alive(), ec, bytes); // Check keep_alive from original request
-        });
-}
-
-
-void HttpSession::send_response(http::response<http::vector_body<unsigned char>>&& response) {
-    // For vector<uchar> bodies (used for PNG data)
-     auto self = shared_from_this(); // Keep session alive
-
-    // The lifetime of the response body must extend until the write is complete.
-    // Since we are moving the response, its body (the vector) is moved too.
-    // We capture the response by value in the lambda to ensure it lives long enough.
-    // Note: For large bodies, consider using a shared_ptr for the body data.
-     http::async_write(stream_, std::move(response),
-        [self](beast::error_code ec, std::size_t bytes) {
-            self->on_write(self->req_.keep_alive(), ec, bytes); // Use req_.keep_alive() from *this* session's request
+    exchanges_.push_back(Exchange{std::move(req_), std::nullopt, {}});
+
+    // Handle the request, then go straight on to the next one while it
+    // renders. Cache hits complete right away, renders come back on this
+    // session's strand and fill in their exchange.
+    const std::uint64_t id = first_id_ + exchanges_.size() - 1;
+    auto self = shared_from_this();
+    handle_http_request(context_, exchanges_.back().req, remote_, stream_.get_executor(), gone_,
+        [self, id](HttpResponse res) {
+            self->send_response(id, std::move(res));
         });
+    do_read();
 }
 
-void HttpSession::send_bad_request(beast::string_view why) {
-    auto res = make_response<http::string_body>(http::status::bad_request, "text/plain", req_.version(), false); // Close connection on bad request
-    res.body() = std::string(why);
-    res.prepare_payload();
-    send_response(std::move(res));
+void HttpSession::arm_idle_timer() {
+    idle_timer_.expires_after(context_->options.idle_timeout);
+    idle_timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+        // Re-arming cancels the old wait, but its handler may already have
+        // been queued; only a timer that really ran out closes the connection
+        if (ec || self->idle_timer_.expiry() > std::chrono::steady_clock::now() || !self->exchanges_.empty()) {
+            return;
+        }
+        self->stream_.cancel(); // Fails the pending read, which closes
+    });
 }
 
-void HttpSession::send_not_found() {
-    auto res = make_response<http::string_body>(http::status::not_found, "text/plain", req_.version(), req_.keep_alive());
-    res.body() = "The resource '" + std::string(req_.target().data(), req_.target().size()) + "' was not found.";
-    res.prepare_payload();
-    send_response(std::move(res));
+void HttpSession::send_response(std::uint64_t id, HttpResponse&& response) {
+    // Responses can be ready in any order; they are parked in their
+    // exchange and written in request order by do_write
+    if (closed_ || id < first_id_ || id - first_id_ >= exchanges_.size()) {
+        return; // Connection went away while rendering
+    }
+    Exchange& exchange = exchanges_[id - first_id_];
+    exchange.res = std::move(response);
+    exchange.ready = Metrics::Clock::now();
+    do_write();
 }
 
-void HttpSession::send_server_error(beast::string_view what) {
-    auto res = make_response<http::string_body>(http::status::internal_server_error, "text/plain", req_.version(), false); // Close on server error
-    res.body() = "Internal server error: " + std::string(what);
-    res.prepare_payload();
-    send_response(std::move(res));
+void HttpSession::do_write() {
+    if (writing_ || closed_ || exchanges_.empty() || !exchanges_.front().res) {
+        return; // Busy, or the oldest request is still rendering
+    }
+    writing_ = true;
+
+    // A client that stops reading gets dropped instead of holding the
+    // response (and for tiles, the shared tile) forever. Leaves the pending
+    // read alone.
+    stream_.expires_after(context_->options.write_timeout);
+
+    // The message stays in its exchange until on_write, so it outlives the
+    // operation. For tiles the body is a shared_ptr to the tile, which keeps
+    // the (possibly cached) bytes alive for the duration of the write too.
+    std::visit([this](auto& msg) {
+        http::async_write(stream_, msg,
+            beast::bind_front_handler(
+                &HttpSession::on_write,
+                shared_from_this(),
+                msg.need_eof())); // Connection: close, or HTTP/1.0 without keep-alive
+    }, *exchanges_.front().res);
 }
 
-
-void HttpSession::on_write(bool keep_alive, beast::error_code ec, std::size_t bytes_transferred) {
+void HttpSession::on_write(bool close, beast::error_code ec, std::size_t bytes_transferred) {
     boost::ignore_unused(bytes_transferred);
+    writing_ = false;
+    if (closed_) {
+        return;
+    }
 
     if (ec) {
         std::cerr << "Write failed: " << ec.message() << std::endl;
          return do_close();
     }
 
+    // Includes the wait behind earlier responses of the pipeline
+    Metrics::observe(Metrics::Stage::Write, -1, Metrics::Clock::now() - exchanges_.front().ready);
+    exchanges_.pop_front();
+    ++first_id_;
 
-    if (!keep_alive) {
+    if (close || (read_closed_ && exchanges_.empty())) {
         // This means we should close the connection, usually because
         // the response indicated the connection should be closed.
         return do_close();
     }
 
-    // Read another request
+    // Write the next response if it is ready, and read more requests now
+    // that the pipeline has room again
+    do_write();
     do_read();
 }
 
 void HttpSession::do_close() {
+    closed_ = true;
+    gone_->store(true, std::memory_order_relaxed);
+    idle_timer_.cancel();
+
     // Send a TCP shutdown
     beast::error_code ec;
     stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
 
+    // Drop a read still waiting for pipelined requests. Exchanges stay
+    // put: a write may still reference its message until it completes.
+    stream_.cancel();
+
     // At this point the connection is closed gracefully
-}
\ No newline at end of file
+}
@@ -4,19 +4,18 @@
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/config.hpp>
-#include <boost/beast/version.hpp> // Added for BOOST_BEAST_VERSION_STRING
+#include <atomic>
+#include <cstdint>
+#include <deque>
 #include <string>
 #include <memory> // For shared_ptr
-#include <vector> // For vector<uchar> tile data
+#include <optional>
 
-#include "tile_renderer.hpp" // Include the renderer
-
-namespace beast = boost::beast;         // from <boost/beast.hpp>
-namespace http = beast::http;           // from <boost/beast/http.hpp>
-namespace net = boost::asio;            // from <boost/asio.hpp>
-using tcp = net::ip::tcp;               // from <boost/asio/ip/tcp.hpp>
+#include "http_handler.hpp" // Options, shared state and the request handler
+#include "metrics.hpp"      // Write stage timing
 
 // Forward declaration
 class HttpSession;
@@ -25,42 +24,72 @@ class HttpSession;
 class HttpServer : public std::enable_shared_from_this<HttpServer> {
     net::io_context& ioc_;
     tcp::acceptor acceptor_;
-    std::shared_ptr<TileRenderer> renderer_; // Share the renderer
+    std::shared_ptr<HttpContext> context_;
 
 public:
-    HttpServer(net::io_context& ioc, tcp::endpoint endpoint, std::shared_ptr<TileRenderer> renderer);
+    HttpServer(net::io_context& ioc, tcp::endpoint endpoint, std::shared_ptr<HttpContext> context);
 
     void run();
 
 private:
     void do_accept();
     void on_accept(beast::error_code ec, tcp::socket socket);
+    void reject(tcp::socket socket);
 };
 
-// Handles one HTTP connection
+// Handles one HTTP/1.1 connection.
+//
+// Requests are pipelined: the session keeps reading while earlier requests
+// render, up to max_pipeline of them. Each request gets an exchange in a
+// queue; responses fill in whenever they are ready (cache hits at once,
+// renders later, in any order) and are written strictly in request order.
+//
+// Built with nghttp2, a connection that opens with the HTTP/2 preface or
+// asks for "Upgrade: h2c" is handed over to an Http2Session instead.
 class HttpSession : public std::enable_shared_from_this<HttpSession> {
+    // One request and, once ready, its response
+    struct Exchange {
+        HttpRequest req;
+        std::optional<HttpResponse> res; // Empty until the response is ready
+        Metrics::Clock::time_point ready; // When res was filled in
+    };
+
     beast::tcp_stream stream_;
     beast::flat_buffer buffer_;
-    std::shared_ptr<TileRenderer> renderer_; // Share the renderer
-    http::request<http::string_body> req_;
+    std::shared_ptr<HttpContext> context_;
+    tcp::endpoint remote_;
+    net::steady_timer idle_timer_;
+    HttpRequest req_; // Request being read
+
+    std::deque<Exchange> exchanges_; // Read but not yet written, oldest first
+    std::uint64_t first_id_ = 0;     // Id of exchanges_.front(); ids count requests
+    bool reading_ = false;
+    bool writing_ = false;
+    bool read_closed_ = false; // No more requests will be read
+    bool closed_ = false;
+    // Set on close (including a failed write), so renders still queued for
+    // this connection are dropped
+    std::shared_ptr<std::atomic<bool>> gone_ = std::make_shared<std::atomic<bool>>(false);
 
 public:
-    HttpSession(tcp::socket&& socket, std::shared_ptr<TileRenderer> renderer);
+    HttpSession(tcp::socket&& socket, std::shared_ptr<HttpContext> context);
+    ~HttpSession();
 
     void run();
 
 private:
+    void do_detect();
+    void on_detect(beast::error_code ec, std::size_t bytes_transferred);
     void do_read();
     void on_read(beast::error_code ec, std::size_t bytes_transferred);
-    void handle_request();
-    void send_response(http::response<http::vector_body<unsigned char>>&& response);
-    void send_response(http::response<http::string_body>&& response); // Overload for string body
-    void send_bad_request(beast::string_view why);
-    void send_not_found();
-    void send_server_error(beast::string_view what);
+    void arm_idle_timer();
+    void upgrade_h2c();
+    void start_http2(std::optional<HttpRequest> upgrade);
+    void send_response(std::uint64_t id, HttpResponse&& response);
+    void do_write();
     void on_write(bool close, beast::error_code ec, std::size_t bytes_transferred);
     void do_close();
 };
 
 
-#endif // HTTP_SERVER_HPP
\ No newline at end of file
+#endif // HTTP_SERVER_HPP
@@ -0,0 +1,488 @@
+// osm_import: decodes an OSM PBF once and writes a .geostore that
+// osm_mapnik_server can render from directly (pass it as --pbf_file).
+
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <exception>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "geo_store.hpp"
+#include "generalize.hpp" // For ring_area
+#include "pbf_reader.hpp"
+#include "projection.hpp"
+
+namespace po = boost::program_options;
+
+namespace {
+
+using Tags = std::vector<std::pair<std::string, std::string>>;
+
+struct PendingWay {
+    std::int64_t id;
+    std::vector<std::int64_t> refs;
+    Tags tags;
+};
+
+// A multipolygon relation, drawn as areas with holes
+struct PendingRelation {
+    std::int64_t id;
+    std::vector<std::pair<std::int64_t, bool>> ways; // Member way id, inner ring
+    Tags tags;
+};
+
+using NodeRing = std::vector<std::int64_t>;
+
+// Runs fn(block, worker) over every block of the file on `threads` threads
+template<typename Fn>
+void for_each_block(const PbfReader& reader, unsigned int threads, Fn&& fn) {
+    std::atomic<std::size_t> next{0};
+    std::vector<std::thread> workers;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    for (unsigned int w = 0; w < threads; ++w) {
+        workers.emplace_back([&, w] {
+            try {
+                for (std::size_t b = next++; b < reader.block_count(); b = next++) {
+                    fn(b, w);
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) error = std::current_exception();
+                next = reader.block_count(); // Make the other workers stop early
+            }
+        });
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+bool wanted(const PbfTags& tags, const std::unordered_set<std::string>& keys) {
+    for (const auto& tag : tags) {
+        if (keys.count(std::string(tag.first))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Tags copy_tags(const PbfTags& tags) {
+    Tags out;
+    out.reserve(tags.size());
+    for (const auto& tag : tags) {
+        out.emplace_back(std::string(tag.first), std::string(tag.second));
+    }
+    return out;
+}
+
+// Closed ways are areas unless their tags say they are linear (the usual osm2pgsql-style heuristic)
+bool is_area(const PendingWay& way) {
+    if (way.refs.size() < 4 || way.refs.front() != way.refs.back()) {
+        return false;
+    }
+    for (const auto& tag : way.tags) {
+        if (tag.first == "area") {
+            return tag.second != "no";
+        }
+    }
+    for (const auto& tag : way.tags) {
+        const std::string& k = tag.first;
+        const std::string& v = tag.second;
+        if (k == "building" || k == "landuse" || k == "leisure" || k == "amenity") return true;
+        if (k == "natural" && v != "coastline" && v != "cliff" && v != "tree_row") return true;
+        if (k == "waterway" && (v == "riverbank" || v == "dock")) return true;
+    }
+    return false;
+}
+
+GeoPoint to_geo_point(double lon, double lat) {
+    Point m = lonLatToMercator(lon, lat);
+    return {to_geo_units(m.x), to_geo_units(m.y)};
+}
+
+bool is_multipolygon(const PbfTags& tags) {
+    for (const auto& tag : tags) {
+        if (tag.first == "type") {
+            return tag.second == "multipolygon";
+        }
+    }
+    return false;
+}
+
+// Joins member ways end to end into closed rings. False if one does not close.
+bool join_rings(const std::vector<const NodeRing*>& parts, std::vector<NodeRing>& rings) {
+    std::unordered_multimap<std::int64_t, std::size_t> ends; // End node -> part
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+        ends.emplace(parts[i]->front(), i);
+        ends.emplace(parts[i]->back(), i);
+    }
+    std::vector<char> used(parts.size(), 0);
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+        if (used[i]) {
+            continue;
+        }
+        used[i] = 1;
+        NodeRing ring = *parts[i];
+        while (ring.front() != ring.back()) {
+            std::size_t next = parts.size();
+            auto range = ends.equal_range(ring.back());
+            for (auto it = range.first; it != range.second; ++it) {
+                if (!used[it->second]) {
+                    next = it->second;
+                    break;
+                }
+            }
+            if (next == parts.size()) {
+                return false;
+            }
+            used[next] = 1;
+            const NodeRing& part = *parts[next];
+            if (part.front() == ring.back()) {
+                ring.insert(ring.end(), part.begin() + 1, part.end());
+            } else {
+                ring.insert(ring.end(), part.rbegin() + 1, part.rend());
+            }
+        }
+        if (ring.size() < 4) {
+            return false;
+        }
+        rings.push_back(std::move(ring));
+    }
+    return true;
+}
+
+// Even-odd test; holes are placed in the outer ring around their first vertex
+bool ring_contains(const std::vector<GeoPoint>& ring, const GeoPoint& p) {
+    bool inside = false;
+    for (std::size_t i = 0, j = ring.size() - 1; i < ring.size(); j = i++) {
+        const double xi = ring[i].x, yi = ring[i].y, xj = ring[j].x, yj = ring[j].y;
+        if ((yi > p.y) != (yj > p.y) && p.x < (xj - xi) * (p.y - yi) / (yj - yi) + xi) {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    try {
+        po::options_description desc("Allowed options");
+        desc.add_options()
+            ("help,h", "Produce help message")
+            ("pbf_file", po::value<std::string>()->required(), "Path to the input OSM PBF file")
+            ("output", po::value<std::string>()->required(), "Path of the .geostore to write")
+            ("threads", po::value<unsigned int>()->default_value(0), "Decoder threads (0 = one per CPU core)")
+            ("keys", po::value<std::string>()->default_value(
+                "highway,railway,waterway,natural,landuse,building,leisure,amenity,boundary,place,aeroway,man_made"),
+             "Comma separated tag keys; features without any of them are dropped")
+            ("levels", po::value<std::string>()->default_value("5,8,11"),
+             "Comma separated max zooms of the generalized detail levels (empty = full detail only)")
+            ("tolerance_px", po::value<double>()->default_value(0.5),
+             "Simplification tolerance of the generalized levels, in pixels")
+            ("min_area_px", po::value<double>()->default_value(1.0),
+             "Polygons smaller than this many square pixels are left out of a generalized level")
+            ("node_index", po::value<bool>()->default_value(true),
+             "Index the node at every line and area vertex, so change files expire only the "
+             "segments next to a moved node (about 16 bytes per vertex)");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 1;
+        }
+        po::notify(vm);
+
+        const std::string pbf_file = vm["pbf_file"].as<std::string>();
+        const std::string output = vm["output"].as<std::string>();
+        if (output.size() < 9 || output.compare(output.size() - 9, 9, ".geostore") != 0) {
+            std::cerr << "WARNING: osm_mapnik_server only recognises imported data by the .geostore extension" << std::endl;
+        }
+        unsigned int threads = vm["threads"].as<unsigned int>();
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+        std::unordered_set<std::string> keys;
+        std::istringstream key_list(vm["keys"].as<std::string>());
+        for (std::string key; std::getline(key_list, key, ',');) {
+            if (!key.empty()) keys.insert(key);
+        }
+
+        GeneralizeOptions generalize;
+        generalize.level_zooms.clear();
+        std::istringstream level_list(vm["levels"].as<std::string>());
+        for (std::string level; std::getline(level_list, level, ',');) {
+            if (!level.empty()) generalize.level_zooms.push_back(std::stoi(level));
+        }
+        generalize.tolerance_px = vm["tolerance_px"].as<double>();
+        generalize.min_area_px = vm["min_area_px"].as<double>();
+        const bool node_index = vm["node_index"].as<bool>();
+
+        const auto start = std::chrono::steady_clock::now();
+        PbfReader reader(pbf_file);
+        std::clog << "INFO: " << pbf_file << ": " << reader.block_count() << " data block(s), "
+                  << threads << " thread(s)" << std::endl;
+
+        // Pass 0: multipolygon relations we keep, and the ways they are made of
+        std::vector<std::vector<PendingRelation>> relations_per_worker(threads);
+        for_each_block(reader, threads, [&](std::size_t block, unsigned int worker) {
+            auto& out = relations_per_worker[worker];
+            PbfHandler h;
+            h.relation = [&](const PbfRelation& relation) {
+                if (!is_multipolygon(relation.tags) || !wanted(relation.tags, keys)) {
+                    return;
+                }
+                PendingRelation pending{relation.id, {}, copy_tags(relation.tags)};
+                for (const PbfMember& member : relation.members) {
+                    if (member.type == PbfMemberType::Way) {
+                        pending.ways.emplace_back(member.ref, member.role == "inner");
+                    }
+                }
+                if (!pending.ways.empty()) {
+                    out.push_back(std::move(pending));
+                }
+            };
+            reader.read_block(block, h);
+        });
+
+        std::vector<PendingRelation> relations;
+        for (auto& chunk : relations_per_worker) {
+            std::move(chunk.begin(), chunk.end(), std::back_inserter(relations));
+        }
+        std::vector<std::int64_t> member_way_ids;
+        for (const auto& relation : relations) {
+            for (const auto& member : relation.ways) {
+                member_way_ids.push_back(member.first);
+            }
+        }
+        std::sort(member_way_ids.begin(), member_way_ids.end());
+        member_way_ids.erase(std::unique(member_way_ids.begin(), member_way_ids.end()), member_way_ids.end());
+
+        // Pass 1: ways we keep, the node lists of relation members (which
+        // are often untagged), and the set of node ids they all reference
+        std::vector<std::vector<PendingWay>> ways_per_worker(threads);
+        std::vector<std::vector<std::pair<std::int64_t, NodeRing>>> members_per_worker(threads);
+        for_each_block(reader, threads, [&](std::size_t block, unsigned int worker) {
+            auto& out = ways_per_worker[worker];
+            auto& members = members_per_worker[worker];
+            PbfHandler h;
+            h.way = [&](const PbfWay& way) {
+                if (way.refs.size() < 2) {
+                    return;
+                }
+                if (wanted(way.tags, keys)) {
+                    out.push_back({way.id, way.refs, copy_tags(way.tags)});
+                }
+                if (std::binary_search(member_way_ids.begin(), member_way_ids.end(), way.id)) {
+                    members.emplace_back(way.id, way.refs);
+                }
+            };
+            reader.read_block(block, h);
+        });
+
+        std::vector<PendingWay> ways;
+        for (auto& chunk : ways_per_worker) {
+            std::move(chunk.begin(), chunk.end(), std::back_inserter(ways));
+            std::vector<PendingWay>().swap(chunk);
+        }
+        std::vector<std::pair<std::int64_t, NodeRing>> member_ways;
+        for (auto& chunk : members_per_worker) {
+            std::move(chunk.begin(), chunk.end(), std::back_inserter(member_ways));
+        }
+        std::sort(member_ways.begin(), member_ways.end(),
+                  [](const auto& a, const auto& b) { return a.first < b.first; });
+        std::vector<std::int64_t> node_ids;
+        for (const auto& way : ways) {
+            node_ids.insert(node_ids.end(), way.refs.begin(), way.refs.end());
+        }
+        for (const auto& way : member_ways) {
+            node_ids.insert(node_ids.end(), way.second.begin(), way.second.end());
+        }
+        std::sort(node_ids.begin(), node_ids.end());
+        node_ids.erase(std::unique(node_ids.begin(), node_ids.end()), node_ids.end());
+        std::clog << "INFO: Pass 1: " << ways.size() << " way(s), " << relations.size()
+                  << " multipolygon relation(s), " << node_ids.size() << " referenced node(s)" << std::endl;
+
+        // Pass 2: locations of the referenced nodes, plus tagged nodes as points.
+        // Every node id maps to its own slot, so workers write without locking.
+        const GeoPoint missing{INT32_MIN, INT32_MIN};
+        std::vector<GeoPoint> locations(node_ids.size(), missing);
+        std::vector<std::vector<GeoFeature>> points_per_worker(threads);
+        for_each_block(reader, threads, [&](std::size_t block, unsigned int worker) {
+            auto& points = points_per_worker[worker];
+            PbfHandler h;
+            h.node = [&](const PbfNode& node) {
+                auto it = std::lower_bound(node_ids.begin(), node_ids.end(), node.id);
+                if (it != node_ids.end() && *it == node.id) {
+                    locations[static_cast<std::size_t>(it - node_ids.begin())] = to_geo_point(node.lon, node.lat);
+                }
+                if (!node.tags.empty() && wanted(node.tags, keys)) {
+                    GeoFeature f;
+                    f.id = node.id;
+                    f.type = GeoType::Point;
+                    f.tags = copy_tags(node.tags);
+                    f.coords.push_back(to_geo_point(node.lon, node.lat));
+                    points.push_back(std::move(f));
+                }
+            };
+            reader.read_block(block, h);
+        });
+
+        // Pass 3: assemble way geometries
+        std::vector<GeoFeature> features;
+        for (auto& chunk : points_per_worker) {
+            std::move(chunk.begin(), chunk.end(), std::back_inserter(features));
+        }
+        const std::size_t point_count = features.size();
+        std::size_t incomplete = 0;
+        for (auto& way : ways) {
+            GeoFeature f;
+            f.id = way.id;
+            f.source = OsmType::Way;
+            f.type = is_area(way) ? GeoType::Polygon : GeoType::LineString;
+            f.coords.reserve(way.refs.size());
+            for (std::int64_t ref : way.refs) {
+                auto it = std::lower_bound(node_ids.begin(), node_ids.end(), ref);
+                GeoPoint p = locations[static_cast<std::size_t>(it - node_ids.begin())];
+                if (p.x != missing.x) {
+                    f.coords.push_back(p);
+                    if (node_index) f.node_refs.push_back(ref);
+                }
+            }
+            if (f.coords.size() < 2) {
+                ++incomplete; // Clipped extract: the way's nodes are outside the file
+                continue;
+            }
+            f.tags = std::move(way.tags);
+            features.push_back(std::move(f));
+        }
+        std::vector<PendingWay>().swap(ways);
+        std::clog << "INFO: Pass 2/3: " << point_count << " point(s), "
+                  << features.size() - point_count << " line/area feature(s), "
+                  << incomplete << " way(s) skipped for missing nodes" << std::endl;
+
+        // Multipolygons: member ways joined into rings, each outer ring an
+        // area of its own with the inner rings inside it as holes
+        auto location = [&](std::int64_t ref) {
+            auto it = std::lower_bound(node_ids.begin(), node_ids.end(), ref);
+            return locations[static_cast<std::size_t>(it - node_ids.begin())];
+        };
+        const std::size_t way_feature_count = features.size();
+        std::size_t broken = 0;
+        for (auto& relation : relations) {
+            std::vector<const NodeRing*> outer_parts, inner_parts;
+            bool complete = true;
+            for (const auto& member : relation.ways) {
+                auto it = std::lower_bound(member_ways.begin(), member_ways.end(), member.first,
+                                           [](const auto& way, std::int64_t id) { return way.first < id; });
+                if (it == member_ways.end() || it->first != member.first) {
+                    complete = false; // Clipped extract
+                    break;
+                }
+                (member.second ? inner_parts : outer_parts).push_back(&it->second);
+            }
+            std::vector<NodeRing> outer_refs, inner_refs;
+            if (!complete || outer_parts.empty() || !join_rings(outer_parts, outer_refs) ||
+                !join_rings(inner_parts, inner_refs)) {
+                ++broken;
+                continue;
+            }
+
+            auto to_points = [&](const NodeRing& refs, std::vector<GeoPoint>& ring) {
+                ring.clear();
+                for (std::int64_t ref : refs) {
+                    GeoPoint p = location(ref);
+                    if (p.x == missing.x) {
+                        return false;
+                    }
+                    ring.push_back(p);
+                }
+                return true;
+            };
+            std::vector<std::vector<GeoPoint>> outers(outer_refs.size()), inners(inner_refs.size());
+            for (std::size_t i = 0; i < outer_refs.size() && complete; ++i) complete = to_points(outer_refs[i], outers[i]);
+            for (std::size_t i = 0; i < inner_refs.size() && complete; ++i) complete = to_points(inner_refs[i], inners[i]);
+            if (!complete) {
+                ++broken;
+                continue;
+            }
+
+            // A hole goes into the smallest outer ring around it (islands in
+            // lakes in islands have outers inside holes)
+            std::vector<std::vector<std::size_t>> holes(outers.size());
+            for (std::size_t h = 0; h < inners.size(); ++h) {
+                std::size_t best = outers.size();
+                double best_area = 0.0;
+                for (std::size_t o = 0; o < outers.size(); ++o) {
+                    if (ring_contains(outers[o], inners[h].front())) {
+                        const double area = ring_area(outers[o]);
+                        if (best == outers.size() || area < best_area) {
+                            best = o;
+                            best_area = area;
+                        }
+                    }
+                }
+                if (best < outers.size()) {
+                    holes[best].push_back(h);
+                }
+            }
+            for (std::size_t o = 0; o < outers.size(); ++o) {
+                GeoFeature f;
+                f.id = relation.id;
+                f.source = OsmType::Relation;
+                f.type = GeoType::Polygon;
+                f.tags = relation.tags;
+                f.coords = std::move(outers[o]);
+                if (node_index) f.node_refs = outer_refs[o];
+                for (std::size_t h : holes[o]) {
+                    f.coords.push_back(kRingBreak);
+                    f.coords.insert(f.coords.end(), inners[h].begin(), inners[h].end());
+                    if (node_index) {
+                        f.node_refs.push_back(0);
+                        f.node_refs.insert(f.node_refs.end(), inner_refs[h].begin(), inner_refs[h].end());
+                    }
+                }
+                // So a change to any member way finds the area
+                for (const auto& member : relation.ways) {
+                    f.member_ways.push_back(member.first);
+                }
+                features.push_back(std::move(f));
+            }
+        }
+        std::clog << "INFO: Pass 3: " << relations.size() - broken << " multipolygon relation(s) as "
+                  << features.size() - way_feature_count << " area(s)" << std::endl;
+        if (broken > 0) {
+            std::cerr << "WARNING: " << broken << " multipolygon relation(s) left out: rings that do not close, "
+                      << "or members outside the extract" << std::endl;
+        }
+
+        write_geo_store(output, features, generalize);
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::clog << "INFO: Wrote " << output << " (" << features.size() << " features, "
+                  << generalize.level_zooms.size() << " generalized level(s)) in "
+                  << seconds << "s" << std::endl;
+
+    } catch (const po::error& e) {
+        std::cerr << "Argument Error: " << e.what() << std::endl;
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,27 +1,147 @@
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/signal_set.hpp>
 #include <boost/program_options.hpp>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <thread>
 #include <vector>
 
+#include "cluster.hpp"
+#include "encode_pool.hpp"
+#include "http_cache.hpp"
 #include "http_server.hpp"
+#include "reloader.hpp"
+#include "render_data.hpp"
+#include "render_pool.hpp"
+#include "seeder.hpp"
+#include "tile_cache.hpp"
 #include "tile_renderer.hpp"
+#include "tile_route.hpp"
+#include "tile_service.hpp"
+#include "tile_store.hpp"
 
 namespace po = boost::program_options;
 
+namespace {
+
+// Comma-separated list, without blanks and empty entries
+std::vector<std::string> split_list(const std::string& list) {
+    std::vector<std::string> items;
+    std::istringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        item.erase(std::remove_if(item.begin(), item.end(), [](unsigned char c) { return std::isspace(c); }), item.end());
+        if (!item.empty()) {
+            items.push_back(std::move(item));
+        }
+    }
+    return items;
+}
+
+// One named style of --styles_file
+struct StyleConfig {
+    std::string name;
+    std::string file;
+    std::size_t cache_mb = 0; // Most of the tile cache it may take, 0 = no quota
+    unsigned int weight = 1;  // Its share of the render threads and queue when styles compete
+};
+
+// One style per line: "name style.xml [cache_mb] [weight]"; blank lines and
+// lines starting with # are skipped
+std::vector<StyleConfig> read_styles_file(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Cannot read styles file " + path);
+    }
+    std::vector<StyleConfig> styles;
+    std::string line;
+    int line_number = 0;
+    while (std::getline(in, line)) {
+        ++line_number;
+        std::istringstream fields(line);
+        StyleConfig style;
+        if (!(fields >> style.name) || style.name[0] == '#') {
+            continue;
+        }
+        std::string extra;
+        if (!(fields >> style.file) || !valid_style_name(style.name) ||
+            (!(fields >> style.cache_mb) && !fields.eof()) || (!(fields >> style.weight) && !fields.eof()) ||
+            (fields >> extra)) {
+            throw std::runtime_error(path + ":" + std::to_string(line_number) +
+                                     ": expected 'name style.xml [cache_mb] [weight]', name of letters, digits, _ and -");
+        }
+        for (const StyleConfig& other : styles) {
+            if (other.name == style.name) {
+                throw std::runtime_error(path + ":" + std::to_string(line_number) + ": style '" + style.name + "' defined twice");
+            }
+        }
+        styles.push_back(std::move(style));
+    }
+    if (styles.size() > 254) {
+        throw std::runtime_error(path + ": at most 254 styles"); // TileKey::tileset is a byte, with the default style
+    }
+    return styles;
+}
+
+} // namespace
+
 int main(int argc, char* argv[]) {
     try {
         // --- Argument Parsing ---
         po::options_description desc("Allowed options");
         desc.add_options()
             ("help,h", "Produce help message")
-            ("pbf_file", po::value<std::string>()->required(), "Path to the input OSM PBF file")
-            ("style_file", po::value<std::string>()->required(), "Path to the Mapnik XML style file")
+            ("pbf_file", po::value<std::string>()->required(), "Path to the input OSM PBF file, or a .geostore built by osm_import")
+            ("style_file", po::value<std::string>()->required(), "Path to the Mapnik XML style file (the default style, at /z/x/y)")
+            ("styles_file", po::value<std::string>()->default_value(""), "More styles over the same data, at /{name}/z/x/y: one 'name style.xml [cache_mb] [weight]' per line")
             ("address", po::value<std::string>()->default_value("0.0.0.0"), "IP address to bind to")
             ("port", po::value<unsigned short>()->default_value(8080), "Port to listen on")
-            ("threads", po::value<int>()->default_value(1), "Number of worker threads");
+            ("threads", po::value<int>()->default_value(1), "Number of I/O threads (accept/read/write)")
+            ("render_threads", po::value<int>()->default_value(0), "Number of render threads (0 = one per CPU core)")
+            ("render_queue", po::value<std::size_t>()->default_value(256), "Maximum number of queued renders before requests get 503, split between styles by weight")
+            ("refresh_threads", po::value<unsigned int>()->default_value(0), "Most render threads redrawing expired or stale tiles at once (0 = half of them)")
+            ("background_threads", po::value<unsigned int>()->default_value(1), "Most render threads on background work (change file expiry) at once")
+            ("render_deadline", po::value<int>()->default_value(30), "Seconds a request may wait for its render to start before it gets 503 (0 = no limit)")
+            ("cache_mb", po::value<std::size_t>()->default_value(256), "In-memory tile cache size in MiB (0 = disabled)")
+            ("cache_shards", po::value<std::size_t>()->default_value(16), "Number of independently locked tile cache shards")
+            ("metatile", po::value<int>()->default_value(8), "Render NxN tiles per pass (1 = no metatiling)")
+            ("tile_size", po::value<unsigned int>()->default_value(256), "Pixels across a tile, e.g. 512 for the same tiles at twice the density")
+            ("max_scale", po::value<int>()->default_value(3), "Largest @Nx scale served (1 = no high-density tiles, at most 9)")
+            ("metatile_buffer", po::value<int>()->default_value(128), "Pixels rendered around each metatile to avoid clipped labels")
+            ("encode_threads", po::value<unsigned int>()->default_value(4), "Threads encoding the slices of a metatile: its render thread and up to N-1 helpers shared by all renders")
+            ("format", po::value<std::string>()->default_value("png"), "Tile format as a Mapnik format string, e.g. png8:m=h:z=1, png32:z=1 or webp:quality=80")
+            ("palette", po::value<std::string>()->default_value(""), "Fixed palette for png8 tiles (.act or raw RGB/RGBA file)")
+            ("mvt_extent", po::value<unsigned int>()->default_value(4096), "Coordinate extent of vector tiles (/z/x/y.mvt)")
+            ("mvt_buffer", po::value<unsigned int>()->default_value(64), "Geometry kept around vector tiles, in extent units")
+            ("mvt_gzip", po::value<bool>()->default_value(true), "Store and serve vector tiles gzip-compressed")
+            ("max_stale", po::value<std::string>()->default_value(""), "How long out of date tiles (expired, past store_max_age, or from before a reload) may still be served while they are redrawn, per zoom as min-max:seconds ranges (none = no limit, 0 = never)")
+            ("http_max_age", po::value<std::string>()->default_value("0-10:86400,11-20:3600"), "Browser/CDN cache lifetime of tiles per zoom, as min-max:seconds ranges (0 = always revalidate)")
+            ("max_connections", po::value<std::size_t>()->default_value(10000), "Open connections before new ones are answered with 503")
+            ("max_pending_renders", po::value<std::size_t>()->default_value(1024), "Requests waiting on renders, server-wide, before further misses get 503")
+            ("max_pipeline", po::value<std::size_t>()->default_value(16), "Pipelined requests read ahead on one connection")
+            ("http2", po::value<bool>()->default_value(true), "Accept cleartext HTTP/2 (prior knowledge or Upgrade: h2c); needs a build with nghttp2")
+            ("max_streams", po::value<std::uint32_t>()->default_value(128), "Concurrent HTTP/2 streams per connection")
+            ("access_log_sample", po::value<unsigned int>()->default_value(100), "Log one in N tile requests (0 = no access log)")
+            ("idle_timeout", po::value<int>()->default_value(30), "Seconds a keep-alive connection may sit idle")
+            ("write_timeout", po::value<int>()->default_value(30), "Seconds a client gets to take a response")
+            ("cluster_peers", po::value<std::string>()->default_value(""), "host:port of every server sharing the tiles, this one included, comma-separated (empty = run alone)")
+            ("cluster_self", po::value<std::string>()->default_value(""), "This server's entry in --cluster_peers")
+            ("peer_timeout", po::value<int>()->default_value(10), "Seconds a peer gets to answer a forwarded tile request before it is rendered here")
+            ("peer_retry", po::value<int>()->default_value(5), "Seconds a peer that failed is left alone before it is asked again")
+            ("store_dir", po::value<std::string>()->default_value(""), "Directory for the persistent on-disk tile store (empty = disabled)")
+            ("store_max_age", po::value<long>()->default_value(0), "Re-render stored metatiles older than this many seconds (0 = never expire)")
+            ("seed_bbox", po::value<std::string>(), "Seed mode: pre-render min_lon,min_lat,max_lon,max_lat into --store_dir and exit")
+            ("seed_zooms", po::value<std::string>()->default_value("0-14"), "Zoom range to seed, as min-max")
+            ("seed_refresh", po::bool_switch(), "Re-render metatiles already in the store instead of skipping them")
+            ("seed_style", po::value<std::string>()->default_value(""), "Seed this style of --styles_file instead of the default one")
+            ("seed_report", po::value<int>()->default_value(10), "Seconds between seed progress reports");
 
         po::variables_map vm;
         po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -40,21 +160,223 @@ int main(int argc, char* argv[]) {
         const std::string style_file = vm["style_file"].as<std::string>();
         int threads = vm["threads"].as<int>();
         if (threads <= 0) threads = 1;
+        int render_threads = vm["render_threads"].as<int>();
+        if (render_threads <= 0) {
+            render_threads = static_cast<int>(std::thread::hardware_concurrency());
+            if (render_threads <= 0) render_threads = 1;
+        }
+        const std::size_t render_queue = vm["render_queue"].as<std::size_t>();
+        // Interactive renders may use every thread; the rest only their share
+        const auto render_threads_u = static_cast<unsigned int>(render_threads);
+        unsigned int refresh_threads = vm["refresh_threads"].as<unsigned int>();
+        if (refresh_threads == 0) refresh_threads = std::max(1u, render_threads_u / 2);
+        RenderPool::Limits render_limits{};
+        render_limits[static_cast<std::size_t>(RenderPriority::Refresh)] = std::min(refresh_threads, render_threads_u);
+        render_limits[static_cast<std::size_t>(RenderPriority::Background)] =
+            std::min(std::max(1u, vm["background_threads"].as<unsigned int>()), render_threads_u);
+        const std::size_t cache_mb = vm["cache_mb"].as<std::size_t>();
+        const std::size_t cache_shards = vm["cache_shards"].as<std::size_t>();
+        int metatile = vm["metatile"].as<int>();
+        if (metatile <= 0) metatile = 1;
+        const unsigned int tile_size = std::max(64u, vm["tile_size"].as<unsigned int>());
+        const int max_scale = std::min(9, std::max(1, vm["max_scale"].as<int>())); // @{n}x is one digit
+        const std::string store_dir = vm["store_dir"].as<std::string>();
+        const long store_max_age = vm["store_max_age"].as<long>();
+        const std::vector<int> max_stale = parse_zoom_seconds(vm["max_stale"].as<std::string>());
+
+        // The default style is tileset 0 and has no name; --styles_file adds
+        // the rest, in file order
+        std::vector<StyleConfig> styles{StyleConfig{"", style_file}};
+        if (!vm["styles_file"].as<std::string>().empty()) {
+            for (StyleConfig& style : read_styles_file(vm["styles_file"].as<std::string>())) {
+                styles.push_back(std::move(style));
+            }
+        }
+        std::vector<std::string> style_files;
+        std::vector<std::string> style_names;
+        for (const StyleConfig& style : styles) {
+            style_files.push_back(style.file);
+            style_names.push_back(style.name);
+        }
 
         std::clog << "INFO: PBF file: " << pbf_file << std::endl;
         std::clog << "INFO: Style file: " << style_file << std::endl;
+        for (std::size_t i = 1; i < styles.size(); ++i) {
+            std::clog << "INFO: Style '" << styles[i].name << "': " << styles[i].file << " (cache "
+                      << (styles[i].cache_mb ? std::to_string(styles[i].cache_mb) + " MiB" : std::string("shared"))
+                      << ", weight " << styles[i].weight << ")" << std::endl;
+        }
         std::clog << "INFO: Binding to " << address << ":" << port << std::endl;
-        std::clog << "INFO: Using " << threads << " worker thread(s)." << std::endl;
+        std::clog << "INFO: Using " << threads << " I/O thread(s)." << std::endl;
+        std::clog << "INFO: Using " << render_threads << " render thread(s), queue depth " << render_queue << "." << std::endl;
+        std::clog << "INFO: At most " << render_limits[static_cast<std::size_t>(RenderPriority::Refresh)] << " refresh and "
+                  << render_limits[static_cast<std::size_t>(RenderPriority::Background)] << " background render(s) at once." << std::endl;
+        std::clog << "INFO: Tile cache " << cache_mb << " MiB in " << cache_shards << " shard(s)." << std::endl;
+        std::clog << "INFO: Metatile size " << metatile << "x" << metatile << "." << std::endl;
+        std::clog << "INFO: Tile size " << tile_size << "px, up to @" << max_scale << "x." << std::endl;
+        std::clog << "INFO: Tile format " << vm["format"].as<std::string>() << "." << std::endl;
+        if (!store_dir.empty()) {
+            std::clog << "INFO: Tile store: " << store_dir << " (max age "
+                      << (store_max_age > 0 ? std::to_string(store_max_age) + "s" : std::string("unlimited")) << ")" << std::endl;
+        }
+        if (!vm["max_stale"].as<std::string>().empty()) {
+            std::clog << "INFO: Out of date tiles served while redrawn for at most " << vm["max_stale"].as<std::string>()
+                      << " (zooms:seconds)." << std::endl;
+        }
+
+        RenderOptions render_options;
+        render_options.tile_size = tile_size;
+        render_options.max_scale = max_scale;
+        render_options.map_pool_size = static_cast<std::size_t>(render_threads); // Map setup never on the hot path
+        render_options.metatile_size = metatile;
+        render_options.buffer_size = vm["metatile_buffer"].as<int>();
+        render_options.encode_threads = vm["encode_threads"].as<unsigned int>();
+        // One set of helpers for every style, kept across reloads
+        render_options.encode_pool = std::make_shared<EncodePool>(std::max(1u, render_options.encode_threads) - 1);
+        render_options.image_format = vm["format"].as<std::string>();
+        render_options.palette_file = vm["palette"].as<std::string>();
+        render_options.vector.extent = std::max(1u, vm["mvt_extent"].as<unsigned int>());
+        render_options.vector.buffer = vm["mvt_buffer"].as<unsigned int>();
+        render_options.vector.gzip = vm["mvt_gzip"].as<bool>();
+
+        // --- Seed mode: render a region into the tile store and exit ---
+        if (vm.count("seed_bbox")) {
+            if (store_dir.empty()) {
+                std::cerr << "Argument Error: --seed_bbox needs --store_dir" << std::endl;
+                return 1;
+            }
+            SeedOptions seed;
+            char comma1, comma2, comma3, dash;
+            std::istringstream bbox_in(vm["seed_bbox"].as<std::string>());
+            std::istringstream zooms_in(vm["seed_zooms"].as<std::string>());
+            if (!(bbox_in >> seed.bbox.min_lon >> comma1 >> seed.bbox.min_lat >> comma2
+                          >> seed.bbox.max_lon >> comma3 >> seed.bbox.max_lat) ||
+                comma1 != ',' || comma2 != ',' || comma3 != ',' ||
+                seed.bbox.min_lon > seed.bbox.max_lon || seed.bbox.min_lat > seed.bbox.max_lat) {
+                std::cerr << "Argument Error: --seed_bbox must be min_lon,min_lat,max_lon,max_lat" << std::endl;
+                return 1;
+            }
+            if (!(zooms_in >> seed.min_zoom >> dash >> seed.max_zoom) || dash != '-' || seed.min_zoom > seed.max_zoom) {
+                std::cerr << "Argument Error: --seed_zooms must be min-max, e.g. 0-14" << std::endl;
+                return 1;
+            }
+            seed.threads = static_cast<unsigned int>(render_threads);
+            seed.refresh = vm["seed_refresh"].as<bool>();
+            seed.state_file = store_dir + "/seed.state";
+            seed.report_interval = std::chrono::seconds(std::max(1, vm["seed_report"].as<int>()));
+
+            const std::string seed_style = vm["seed_style"].as<std::string>();
+            const auto seeded = std::find_if(styles.begin(), styles.end(),
+                                             [&](const StyleConfig& style) { return style.name == seed_style; });
+            if (seeded == styles.end()) {
+                std::cerr << "Argument Error: --seed_style '" << seed_style << "' is not in --styles_file" << std::endl;
+                return 1;
+            }
+            seed.tileset = static_cast<std::uint8_t>(seeded - styles.begin());
+            if (seed.tileset != 0) {
+                seed.state_file = store_dir + "/seed-" + seed_style + ".state";
+            }
+
+            auto renderer = std::make_shared<TileRenderer>(seeded->file, pbf_file, render_options);
+            // Seeded bundles are only ever read back, so they never expire here
+            auto store = std::make_shared<TileStore>(store_dir, metatile, std::chrono::seconds(0),
+                                                     renderer->encoder().fingerprint(), style_names);
+
+            Seeder seeder(renderer, store, seed);
+
+            // Ctrl-C stops after the metatiles being rendered; the store keeps
+            // everything finished so far and the next run skips it
+            net::io_context signal_ioc;
+            net::signal_set signals(signal_ioc, SIGINT, SIGTERM);
+            signals.async_wait([&](beast::error_code const& ec, int) {
+                if (!ec) {
+                    std::clog << "INFO: Stopping seed..." << std::endl;
+                    seeder.stop();
+                }
+            });
+            std::thread signal_thread([&signal_ioc] { signal_ioc.run(); });
+
+            const bool complete = seeder.run();
+
+            signals.cancel();
+            signal_thread.join();
+            return complete ? 0 : 1;
+        }
 
         // --- Initialization ---
         net::io_context ioc{threads}; // IO context for the server
 
-        // Initialize the Tile Renderer (shared among sessions)
-        // This loads the Mapnik style and sets up datasources
-        auto renderer = std::make_shared<TileRenderer>(style_file, pbf_file);
+        // Initialize the Tile Renderers (shared among sessions), one per style.
+        // They all read the same data, opened once here
+        auto data = std::make_shared<RenderData>(pbf_file, 8 * static_cast<std::size_t>(render_threads));
+        std::vector<TileService::Tileset> tilesets;
+        std::vector<std::size_t> cache_quotas;
+        std::vector<unsigned int> render_weights;
+        for (const StyleConfig& style : styles) {
+            tilesets.push_back({style.name, std::make_shared<TileRenderer>(style.file, data, render_options)});
+            cache_quotas.push_back(style.cache_mb * 1024 * 1024);
+            render_weights.push_back(std::max(1u, style.weight));
+        }
+
+        // Renders happen on their own threads so slow tiles never block socket I/O
+        auto render_pool = std::make_shared<RenderPool>(static_cast<unsigned int>(render_threads), render_queue,
+                                                        render_weights, render_limits);
+
+        // Encoded tiles are cached in memory in front of the renderer
+        auto cache = std::make_shared<TileCache>(cache_mb * 1024 * 1024, cache_shards, cache_quotas);
+        // Rendered metatiles persist across restarts when a store directory is given
+        std::shared_ptr<TileStore> store;
+        if (!store_dir.empty()) {
+            store = std::make_shared<TileStore>(store_dir, metatile, std::chrono::seconds(store_max_age),
+                                                tilesets[0].renderer->encoder().fingerprint(), style_names);
+        }
+        auto tiles = std::make_shared<TileService>(std::move(tilesets), render_pool, cache, store, max_stale);
+
+        // Tiles carry Cache-Control per zoom (Last-Modified follows the data)
+        auto cache_policy = std::make_shared<const HttpCachePolicy>(vm["http_max_age"].as<std::string>(), max_stale);
+
+        // Style and data can be reloaded in place, on SIGHUP or POST /admin/reload
+        auto reloader = std::make_shared<Reloader>(tiles, style_files, pbf_file, render_options);
+
+        auto context = std::make_shared<HttpContext>();
+        context->tiles = tiles;
+        context->cache_policy = cache_policy;
+        context->reloader = reloader;
+        context->options.max_connections = std::max<std::size_t>(1, vm["max_connections"].as<std::size_t>());
+        context->options.max_pending_renders = std::max<std::size_t>(1, vm["max_pending_renders"].as<std::size_t>());
+        context->options.max_pipeline = std::max<std::size_t>(1, vm["max_pipeline"].as<std::size_t>());
+        context->options.http2 = vm["http2"].as<bool>();
+        context->options.max_streams = std::max<std::uint32_t>(1, vm["max_streams"].as<std::uint32_t>());
+#ifndef HAVE_NGHTTP2
+        if (context->options.http2) {
+            std::clog << "INFO: Built without nghttp2, serving HTTP/1.1 only." << std::endl;
+            context->options.http2 = false;
+        }
+#endif
+        context->options.idle_timeout = std::chrono::seconds(std::max(1, vm["idle_timeout"].as<int>()));
+        context->options.write_timeout = std::chrono::seconds(std::max(1, vm["write_timeout"].as<int>()));
+        context->options.render_deadline = std::chrono::seconds(std::max(0, vm["render_deadline"].as<int>()));
+        if (unsigned int sample = vm["access_log_sample"].as<unsigned int>()) {
+            context->access_log = std::make_shared<AccessLog>(sample);
+        }
+
+        // With other servers around, each metatile is rendered and cached by
+        // its owner only
+        const std::vector<std::string> peers = split_list(vm["cluster_peers"].as<std::string>());
+        if (!peers.empty()) {
+            const std::string self = vm["cluster_self"].as<std::string>();
+            if (self.empty()) {
+                throw std::runtime_error("--cluster_self is required with --cluster_peers");
+            }
+            context->cluster = std::make_shared<Cluster>(ioc, peers, self,
+                                                         std::chrono::seconds(std::max(1, vm["peer_timeout"].as<int>())),
+                                                         std::chrono::seconds(std::max(1, vm["peer_retry"].as<int>())));
+            std::clog << "INFO: Cluster of " << context->cluster->peers().size() << " server(s), this one "
+                      << self << "." << std::endl;
+        }
 
         // Create and launch the HTTP server
-        auto server = std::make_shared<HttpServer>(ioc, tcp::endpoint{address, port}, renderer);
+        auto server = std::make_shared<HttpServer>(ioc, tcp::endpoint{address, port}, context);
         server->run();
 
         // Capture SIGINT and SIGTERM to perform a clean shutdown
@@ -65,6 +387,21 @@ int main(int argc, char* argv[]) {
             ioc.stop();
         });
 
+        // SIGHUP reloads the style and data, the way daemons reread their config
+        net::signal_set reload_signals(ioc, SIGHUP);
+        std::function<void()> wait_for_reload = [&] {
+            reload_signals.async_wait([&](beast::error_code const& ec, int) {
+                if (ec) {
+                    return;
+                }
+                if (!reloader->start()) {
+                    std::clog << "INFO: A reload is already running, ignoring SIGHUP." << std::endl;
+                }
+                wait_for_reload();
+            });
+        };
+        wait_for_reload();
+
         // Run the I/O service on the requested number of threads
         std::vector<std::thread> v;
         v.reserve(threads - 1);
@@ -79,6 +416,10 @@ int main(int argc, char* argv[]) {
             t.join();
         }
 
+        // Let in-flight renders finish before tearing down the renderer
+        render_pool->stop();
+        reloader->wait();
+
         std::clog << "INFO: Server stopped." << std::endl;
 
 
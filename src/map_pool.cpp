@@ -0,0 +1,43 @@
+#include "map_pool.hpp"
+#include <iostream>
+
+MapPool::MapPool(const mapnik::Map& prototype, unsigned int width, unsigned int height, std::size_t size)
+    : prototype_(prototype), width_(width), height_(height) {
+    free_.reserve(size);
+    for (std::size_t i = 0; i < size; ++i) {
+        free_.push_back(make_map());
+    }
+    total_ = size;
+}
+
+MapPool::Lease MapPool::lease() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_.empty()) {
+            std::unique_ptr<mapnik::Map> map = std::move(free_.back());
+            free_.pop_back();
+            return Lease(map.release(), Returner{this});
+        }
+        ++total_;
+    }
+
+    // Pool exhausted: build outside the lock, copying is the slow part
+    std::clog << "INFO: Map pool exhausted, growing to " << size() << " map(s)" << std::endl;
+    return Lease(make_map().release(), Returner{this});
+}
+
+std::size_t MapPool::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return total_;
+}
+
+std::unique_ptr<mapnik::Map> MapPool::make_map() const {
+    auto map = std::make_unique<mapnik::Map>(prototype_); // Copy constructor
+    map->resize(width_, height_);
+    return map;
+}
+
+void MapPool::give_back(mapnik::Map* map) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.emplace_back(map);
+}
@@ -0,0 +1,50 @@
+#ifndef MAP_POOL_HPP
+#define MAP_POOL_HPP
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <mapnik/map.hpp>
+
+// Checkout/return pool of ready-to-render mapnik::Map objects.
+// Copying a Map deep-copies its styles, layers and datasource handles, so we do
+// that once per slot at startup instead of once per tile. A leased map only
+// needs zoom_to_box() before it can be rendered.
+class MapPool {
+    struct Returner {
+        MapPool* pool;
+        void operator()(mapnik::Map* map) const { pool->give_back(map); }
+    };
+
+public:
+    // Hands the map back to the pool when it goes out of scope
+    using Lease = std::unique_ptr<mapnik::Map, Returner>;
+
+    // Builds `size` copies of the prototype, each resized to width x height
+    MapPool(const mapnik::Map& prototype, unsigned int width, unsigned int height, std::size_t size);
+
+    MapPool(const MapPool&) = delete;
+    MapPool& operator=(const MapPool&) = delete;
+
+    // Takes a map out of the pool. If every map is in use (more concurrent
+    // renders than the pool was sized for) a new one is built from the
+    // prototype and joins the pool when it is returned.
+    Lease lease();
+
+    std::size_t size() const;
+
+private:
+    std::unique_ptr<mapnik::Map> make_map() const;
+    void give_back(mapnik::Map* map);
+
+    const mapnik::Map& prototype_;
+    unsigned int width_;
+    unsigned int height_;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<mapnik::Map>> free_;
+    std::size_t total_ = 0;
+};
+
+#endif // MAP_POOL_HPP
@@ -0,0 +1,29 @@
+#include "mapped_file.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::shared_ptr<const void> map_file_readonly(const std::string& path, std::size_t& length,
+                                              std::size_t min_length) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size <= 0 || static_cast<std::size_t>(st.st_size) < min_length) {
+        ::close(fd);
+        return nullptr;
+    }
+    const std::size_t size = static_cast<std::size_t>(st.st_size);
+    void* addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // The mapping keeps the file contents reachable
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+    length = size;
+    return std::shared_ptr<const void>(addr, [size](const void* p) {
+        ::munmap(const_cast<void*>(p), size);
+    });
+}
@@ -0,0 +1,15 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// Maps a whole file read-only. The returned pointer unmaps it when the last
+// copy is released, so slices of the file can be handed out and kept alive
+// independently. Returns nullptr (length untouched) if the file cannot be
+// opened, is smaller than min_length, or cannot be mapped.
+std::shared_ptr<const void> map_file_readonly(const std::string& path, std::size_t& length,
+                                              std::size_t min_length = 1);
+
+#endif // MAPPED_FILE_HPP
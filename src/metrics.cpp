@@ -0,0 +1,224 @@
+#include "metrics.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "tile_route.hpp" // kMaxZoom
+
+namespace {
+
+constexpr std::size_t kStages = static_cast<std::size_t>(Metrics::Stage::Count);
+constexpr std::size_t kTiers = static_cast<std::size_t>(Metrics::Tier::Count);
+constexpr std::size_t kZooms = kMaxZoom + 2; // 0..kMaxZoom, then one slot for "no zoom"
+constexpr std::size_t kNoZoom = kMaxZoom + 1;
+constexpr std::size_t kBuckets = 46;         // Bounded buckets; bucket kBuckets takes the rest
+
+const char* const kStageNames[kStages] = {"parse", "queue_wait", "map_setup", "query",
+                                          "render", "encode", "write", "request"};
+const char* const kTierNames[kTiers] = {"memory", "store"};
+
+// Upper bound of bucket i in microseconds: 16, 24, 32, 48, 64, 96, ...
+constexpr std::uint64_t bucket_bound(std::size_t i) {
+    return (i % 2 ? 24ull : 16ull) << (i / 2);
+}
+
+std::size_t bucket_for(std::uint64_t us) {
+    if (us <= 16) {
+        return 0;
+    }
+    // The leading bit picks the power of two above 16us, then it is the
+    // lower or upper half of it
+    const std::size_t octave = 63 - static_cast<std::size_t>(__builtin_clzll((us - 1) >> 4));
+    const std::size_t bucket = 2 * octave + (us <= (24ull << octave) ? 1 : 2);
+    return bucket < kBuckets ? bucket : kBuckets;
+}
+
+std::size_t zoom_slot(int z) {
+    return z >= 0 && z <= kMaxZoom ? static_cast<std::size_t>(z) : kNoZoom;
+}
+
+// One thread's counters. Only the owning thread writes them, so increments
+// are a load and a store, not a locked read-modify-write; the atomics are
+// there so a concurrent scrape reads whole values.
+struct Shard {
+    std::atomic<std::uint64_t> buckets[kStages][kZooms][kBuckets + 1];
+    std::atomic<std::uint64_t> sum_us[kStages][kZooms];
+    std::atomic<std::uint64_t> lookups[kTiers][kZooms][2]; // Misses, hits
+    std::atomic<std::uint64_t> bytes[kZooms];
+    Metrics::Clock::duration query_time{}; // Owner only, never scraped
+};
+
+inline void bump(std::atomic<std::uint64_t>& counter, std::uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<Shard*> free; // Left behind by threads that exited
+};
+
+Registry& registry() {
+    static Registry* registry = new Registry(); // Never destroyed: threads may outlive static destructors
+    return *registry;
+}
+
+// Hands a shard to each thread on first use, and back to the free list
+// when the thread exits
+struct ShardHandle {
+    Shard* shard;
+
+    ShardHandle() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        if (!r.free.empty()) {
+            shard = r.free.back();
+            r.free.pop_back();
+        } else {
+            r.shards.push_back(std::make_unique<Shard>()); // Value-initialized: all zero
+            shard = r.shards.back().get();
+        }
+    }
+
+    ~ShardHandle() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        shard->query_time = {};
+        r.free.push_back(shard);
+    }
+};
+
+Shard& local_shard() {
+    thread_local ShardHandle handle;
+    return *handle.shard;
+}
+
+void write_labels(std::ostream& out, const char* stage, std::size_t zoom) {
+    out << "{stage=\"" << stage << "\"";
+    if (zoom != kNoZoom) {
+        out << ",zoom=\"" << zoom << "\"";
+    }
+}
+
+} // namespace
+
+void Metrics::observe(Stage stage, int z, Clock::duration elapsed) {
+    const std::int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    const std::uint64_t value = us > 0 ? static_cast<std::uint64_t>(us) : 0;
+    Shard& shard = local_shard();
+    const std::size_t s = static_cast<std::size_t>(stage);
+    const std::size_t zoom = zoom_slot(z);
+    bump(shard.buckets[s][zoom][bucket_for(value)]);
+    bump(shard.sum_us[s][zoom], value);
+}
+
+void Metrics::cache_lookup(Tier tier, int z, bool hit) {
+    bump(local_shard().lookups[static_cast<std::size_t>(tier)][zoom_slot(z)][hit ? 1 : 0]);
+}
+
+void Metrics::bytes_out(int z, std::uint64_t bytes) {
+    bump(local_shard().bytes[zoom_slot(z)], bytes);
+}
+
+void Metrics::add_query_time(Clock::duration elapsed) {
+    local_shard().query_time += elapsed;
+}
+
+Metrics::Clock::duration Metrics::take_query_time() {
+    Shard& shard = local_shard();
+    Clock::duration elapsed = shard.query_time;
+    shard.query_time = {};
+    return elapsed;
+}
+
+void Metrics::write_prometheus(std::ostream& out) {
+    // Sum the shards first; the lock only keeps the shard list still
+    std::vector<std::uint64_t> buckets(kStages * kZooms * (kBuckets + 1));
+    std::vector<std::uint64_t> sums(kStages * kZooms);
+    std::vector<std::uint64_t> lookups(kTiers * kZooms * 2);
+    std::vector<std::uint64_t> bytes(kZooms);
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (const auto& shard : r.shards) {
+            for (std::size_t s = 0; s < kStages; ++s) {
+                for (std::size_t z = 0; z < kZooms; ++z) {
+                    for (std::size_t b = 0; b <= kBuckets; ++b) {
+                        buckets[(s * kZooms + z) * (kBuckets + 1) + b] += shard->buckets[s][z][b].load(std::memory_order_relaxed);
+                    }
+                    sums[s * kZooms + z] += shard->sum_us[s][z].load(std::memory_order_relaxed);
+                }
+            }
+            for (std::size_t t = 0; t < kTiers; ++t) {
+                for (std::size_t z = 0; z < kZooms; ++z) {
+                    for (std::size_t hit = 0; hit < 2; ++hit) {
+                        lookups[(t * kZooms + z) * 2 + hit] += shard->lookups[t][z][hit].load(std::memory_order_relaxed);
+                    }
+                }
+            }
+            for (std::size_t z = 0; z < kZooms; ++z) {
+                bytes[z] += shard->bytes[z].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Series that never saw a sample are left out
+    out << "# HELP tile_stage_duration_seconds Time spent in each stage of serving a tile.\n"
+        << "# TYPE tile_stage_duration_seconds histogram\n";
+    char le[32];
+    for (std::size_t s = 0; s < kStages; ++s) {
+        for (std::size_t z = 0; z < kZooms; ++z) {
+            const std::uint64_t* counts = &buckets[(s * kZooms + z) * (kBuckets + 1)];
+            std::uint64_t total = 0;
+            for (std::size_t b = 0; b <= kBuckets; ++b) {
+                total += counts[b];
+            }
+            if (total == 0) {
+                continue;
+            }
+            std::uint64_t cumulative = 0;
+            for (std::size_t b = 0; b < kBuckets; ++b) {
+                cumulative += counts[b];
+                std::snprintf(le, sizeof le, "%.6f", static_cast<double>(bucket_bound(b)) / 1e6);
+                out << "tile_stage_duration_seconds_bucket";
+                write_labels(out, kStageNames[s], z);
+                out << ",le=\"" << le << "\"} " << cumulative << "\n";
+            }
+            out << "tile_stage_duration_seconds_bucket";
+            write_labels(out, kStageNames[s], z);
+            out << ",le=\"+Inf\"} " << total << "\n";
+            std::snprintf(le, sizeof le, "%.6f", static_cast<double>(sums[s * kZooms + z]) / 1e6);
+            out << "tile_stage_duration_seconds_sum";
+            write_labels(out, kStageNames[s], z);
+            out << "} " << le << "\n";
+            out << "tile_stage_duration_seconds_count";
+            write_labels(out, kStageNames[s], z);
+            out << "} " << total << "\n";
+        }
+    }
+
+    out << "# HELP tile_cache_lookups_total Tile lookups per cache tier.\n"
+        << "# TYPE tile_cache_lookups_total counter\n";
+    for (std::size_t t = 0; t < kTiers; ++t) {
+        for (std::size_t z = 0; z < kMaxZoom + 1; ++z) {
+            const std::uint64_t misses = lookups[(t * kZooms + z) * 2];
+            const std::uint64_t hits = lookups[(t * kZooms + z) * 2 + 1];
+            if (hits + misses == 0) {
+                continue;
+            }
+            out << "tile_cache_lookups_total{tier=\"" << kTierNames[t] << "\",zoom=\"" << z << "\",result=\"hit\"} " << hits << "\n"
+                << "tile_cache_lookups_total{tier=\"" << kTierNames[t] << "\",zoom=\"" << z << "\",result=\"miss\"} " << misses << "\n";
+        }
+    }
+
+    out << "# HELP tile_response_bytes_total Tile body bytes sent.\n"
+        << "# TYPE tile_response_bytes_total counter\n";
+    for (std::size_t z = 0; z < kMaxZoom + 1; ++z) {
+        if (bytes[z] > 0) {
+            out << "tile_response_bytes_total{zoom=\"" << z << "\"} " << bytes[z] << "\n";
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Process-wide request and render telemetry, exposed at /metrics.
+//
+// Everything is recorded into per-thread shards: a thread only ever writes
+// its own counters, so recording is a couple of plain loads and stores with
+// no lock and no shared cache line. A scrape sums the shards. Latencies go
+// into log-linear (HDR style) histograms with two buckets per power of two,
+// i.e. within 25% of the true value, from 16us up to about a minute.
+//
+// Call from long-lived threads (I/O, render); a thread's shard is recycled
+// when it exits, its counts stay.
+class Metrics {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Where the time of a tile request goes
+    enum class Stage : std::uint8_t {
+        Parse,     // Routing the request
+        QueueWait, // Render job waiting for a render thread
+        MapSetup,  // Leasing and sizing a map, setting its extent
+        Query,     // Datasource queries (geostore data only, else part of Render)
+        Render,    // AGG rendering, or building vector tile layers
+        Encode,    // Image / vector tile encoding and compression
+        Write,     // Response ready until it is written (no zoom)
+        Request,   // Request read until its response is ready
+        Count
+    };
+
+    // Cache tiers in front of the renderer
+    enum class Tier : std::uint8_t { Memory, Store, Count };
+
+    static void observe(Stage stage, int z, Clock::duration elapsed);
+    static void cache_lookup(Tier tier, int z, bool hit);
+    static void bytes_out(int z, std::uint64_t bytes);
+
+    // Datasource time of the calling thread. Datasources add to it; the
+    // renderer takes it around a render to split query time from drawing.
+    static void add_query_time(Clock::duration elapsed);
+    static Clock::duration take_query_time();
+
+    // Prometheus text exposition format (version 0.0.4) of everything above
+    static void write_prometheus(std::ostream& out);
+};
+
+#endif // METRICS_HPP
@@ -0,0 +1,111 @@
+#include "osc_reader.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <zlib.h>
+
+namespace {
+
+// gzread handles plain and gzip-compressed files alike
+std::string read_file(const std::string& path) {
+    gzFile file = ::gzopen(path.c_str(), "rb");
+    if (!file) {
+        throw std::runtime_error("Cannot open change file: " + path);
+    }
+    std::string data;
+    char chunk[1 << 16];
+    int n;
+    while ((n = ::gzread(file, chunk, sizeof(chunk))) > 0) {
+        data.append(chunk, static_cast<std::size_t>(n));
+    }
+    ::gzclose(file);
+    if (n < 0) {
+        throw std::runtime_error("Failed to read change file: " + path);
+    }
+    return data;
+}
+
+// Value of attribute `name` inside one start tag, or empty if absent. The
+// attributes we read are numbers, so entities never need decoding.
+std::string_view attribute(std::string_view tag, std::string_view name) {
+    std::size_t pos = 0;
+    while ((pos = tag.find(name, pos)) != std::string_view::npos) {
+        const bool starts_word = pos > 0 && (tag[pos - 1] == ' ' || tag[pos - 1] == '\t' || tag[pos - 1] == '\n');
+        std::size_t eq = pos + name.size();
+        if (starts_word && eq + 1 < tag.size() && tag[eq] == '=' && (tag[eq + 1] == '"' || tag[eq + 1] == '\'')) {
+            const char quote = tag[eq + 1];
+            std::size_t end = tag.find(quote, eq + 2);
+            if (end == std::string_view::npos) {
+                return {};
+            }
+            return tag.substr(eq + 2, end - eq - 2);
+        }
+        pos = eq;
+    }
+    return {};
+}
+
+std::int64_t to_int(std::string_view s) {
+    return std::strtoll(std::string(s).c_str(), nullptr, 10);
+}
+
+double to_double(std::string_view s) {
+    return std::strtod(std::string(s).c_str(), nullptr);
+}
+
+} // namespace
+
+OscChanges read_osc(const std::string& path) {
+    const std::string data = read_file(path);
+    if (data.find("<osmChange") == std::string::npos) {
+        throw std::runtime_error("Not an osmChange document: " + path);
+    }
+
+    // A flat scan over the start tags is enough: osmChange nests at most
+    // action > element > (tag | nd | member), and only nd needs its parent
+    OscChanges changes;
+    OscChanges::Way* current_way = nullptr;
+    std::size_t pos = 0;
+    while ((pos = data.find('<', pos)) != std::string::npos) {
+        std::size_t end = data.find('>', pos);
+        if (end == std::string::npos) {
+            break;
+        }
+        std::string_view tag(data.data() + pos + 1, end - pos - 1);
+        pos = end + 1;
+
+        if (tag.empty() || tag[0] == '?' || tag[0] == '!') {
+            continue; // Declaration or comment
+        }
+        if (tag[0] == '/') {
+            if (tag.substr(1, 3) == "way") current_way = nullptr;
+            continue;
+        }
+
+        std::size_t name_end = tag.find_first_of(" \t\n/");
+        std::string_view name = tag.substr(0, name_end);
+        const bool self_closing = tag.back() == '/';
+
+        if (name == "node") {
+            OscChanges::Node node;
+            node.id = to_int(attribute(tag, "id"));
+            std::string_view lat = attribute(tag, "lat"), lon = attribute(tag, "lon");
+            if (!lat.empty() && !lon.empty()) {
+                node.has_location = true;
+                node.lat = to_double(lat);
+                node.lon = to_double(lon);
+            }
+            changes.nodes.push_back(node);
+        } else if (name == "way") {
+            changes.ways.push_back({to_int(attribute(tag, "id")), {}});
+            current_way = self_closing ? nullptr : &changes.ways.back();
+        } else if (name == "nd" && current_way) {
+            current_way->refs.push_back(to_int(attribute(tag, "ref")));
+        } else if (name == "relation") {
+            changes.relations.push_back(to_int(attribute(tag, "id")));
+        }
+    }
+    return changes;
+}
@@ -0,0 +1,35 @@
+#ifndef OSC_READER_HPP
+#define OSC_READER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What an OSM change file (.osc, optionally gzipped) touches. Only the parts
+// tile expiry needs are kept: element ids, node locations and way node lists.
+// Relation members are left out; the geostore knows which ways its
+// multipolygons were made of.
+// Whether an element was created, modified or deleted does not matter here,
+// every one of them can change what some tile looks like.
+struct OscChanges {
+    struct Node {
+        std::int64_t id = 0;
+        bool has_location = false; // Deletions may come without coordinates
+        double lon = 0;
+        double lat = 0;
+    };
+    struct Way {
+        std::int64_t id = 0;
+        std::vector<std::int64_t> refs;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Way> ways;
+    std::vector<std::int64_t> relations; // Ids only
+};
+
+// Reads a .osc or .osc.gz file. Throws std::runtime_error if it cannot be read
+// or is not an osmChange document.
+OscChanges read_osc(const std::string& path);
+
+#endif // OSC_READER_HPP
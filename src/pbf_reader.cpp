@@ -0,0 +1,350 @@
+#include "pbf_reader.hpp"
+#include "mapped_file.hpp"
+
+#include <stdexcept>
+#include <zlib.h>
+
+namespace {
+
+// Just enough protobuf wire-format decoding for the OSM PBF messages
+class ProtoReader {
+    const std::uint8_t* p_;
+    const std::uint8_t* end_;
+
+public:
+    ProtoReader(const void* data, std::size_t size)
+        : p_(static_cast<const std::uint8_t*>(data)), end_(p_ + size) {}
+    explicit ProtoReader(std::string_view bytes) : ProtoReader(bytes.data(), bytes.size()) {}
+
+    bool empty() const { return p_ >= end_; }
+
+    std::uint64_t varint() {
+        std::uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (p_ >= end_) {
+                throw std::runtime_error("Truncated varint in PBF");
+            }
+            std::uint8_t byte = *p_++;
+            value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Overlong varint in PBF");
+    }
+
+    std::int64_t svarint() {
+        std::uint64_t v = varint();
+        return static_cast<std::int64_t>(v >> 1) ^ -static_cast<std::int64_t>(v & 1); // ZigZag
+    }
+
+    // Reads the next field tag; false at end of message
+    bool next(std::uint32_t& field, std::uint32_t& wire_type) {
+        if (empty()) {
+            return false;
+        }
+        std::uint64_t key = varint();
+        field = static_cast<std::uint32_t>(key >> 3);
+        wire_type = static_cast<std::uint32_t>(key & 7);
+        return true;
+    }
+
+    std::string_view bytes() {
+        std::uint64_t len = varint();
+        if (len > static_cast<std::uint64_t>(end_ - p_)) {
+            throw std::runtime_error("Truncated field in PBF");
+        }
+        std::string_view out(reinterpret_cast<const char*>(p_), static_cast<std::size_t>(len));
+        p_ += len;
+        return out;
+    }
+
+    void skip(std::uint32_t wire_type) {
+        switch (wire_type) {
+            case 0: varint(); break;
+            case 1: advance(8); break;
+            case 2: bytes(); break;
+            case 5: advance(4); break;
+            default: throw std::runtime_error("Unsupported protobuf wire type in PBF");
+        }
+    }
+
+private:
+    void advance(std::size_t n) {
+        if (n > static_cast<std::size_t>(end_ - p_)) {
+            throw std::runtime_error("Truncated field in PBF");
+        }
+        p_ += n;
+    }
+};
+
+// Packed repeated fields are length-delimited runs of varints
+template<typename Fn>
+void for_each_packed(std::string_view packed, bool zigzag, Fn&& fn) {
+    ProtoReader r(packed);
+    while (!r.empty()) {
+        fn(zigzag ? r.svarint() : static_cast<std::int64_t>(r.varint()));
+    }
+}
+
+std::uint32_t read_be32(const std::uint8_t* p) {
+    return (std::uint32_t(p[0]) << 24) | (std::uint32_t(p[1]) << 16) | (std::uint32_t(p[2]) << 8) | std::uint32_t(p[3]);
+}
+
+// Returns the decoded Blob payload, inflating it into `storage` if needed
+std::string_view blob_payload(std::string_view blob, std::string& storage) {
+    ProtoReader r(blob);
+    std::uint32_t field, wire;
+    std::string_view raw, zlib_data;
+    std::uint64_t raw_size = 0;
+    while (r.next(field, wire)) {
+        switch (field) {
+            case 1: raw = r.bytes(); break;
+            case 2: raw_size = r.varint(); break;
+            case 3: zlib_data = r.bytes(); break;
+            default: r.skip(wire); break;
+        }
+    }
+    if (!raw.empty()) {
+        return raw;
+    }
+    if (zlib_data.empty()) {
+        throw std::runtime_error("PBF blob uses an unsupported compression");
+    }
+
+    storage.resize(static_cast<std::size_t>(raw_size));
+    uLongf out_len = static_cast<uLongf>(raw_size);
+    int rc = ::uncompress(reinterpret_cast<Bytef*>(&storage[0]), &out_len,
+                          reinterpret_cast<const Bytef*>(zlib_data.data()), static_cast<uLong>(zlib_data.size()));
+    if (rc != Z_OK || out_len != raw_size) {
+        throw std::runtime_error("Failed to inflate PBF blob");
+    }
+    return storage;
+}
+
+struct BlockContext {
+    std::vector<std::string_view> strings;
+    std::int64_t granularity = 100;
+    std::int64_t lat_offset = 0;
+    std::int64_t lon_offset = 0;
+
+    double lat(std::int64_t raw) const { return 1e-9 * static_cast<double>(lat_offset + granularity * raw); }
+    double lon(std::int64_t raw) const { return 1e-9 * static_cast<double>(lon_offset + granularity * raw); }
+
+    std::string_view str(std::int64_t index) const {
+        if (index < 0 || static_cast<std::size_t>(index) >= strings.size()) {
+            throw std::runtime_error("PBF string table index out of range");
+        }
+        return strings[static_cast<std::size_t>(index)];
+    }
+};
+
+void decode_node(std::string_view msg, const BlockContext& ctx, const PbfHandler& handler, PbfTags& tags) {
+    ProtoReader r(msg);
+    std::uint32_t field, wire;
+    std::int64_t id = 0, lat = 0, lon = 0;
+    std::vector<std::int64_t> keys, vals;
+    while (r.next(field, wire)) {
+        switch (field) {
+            case 1: id = r.svarint(); break;
+            case 2: for_each_packed(r.bytes(), false, [&](std::int64_t v) { keys.push_back(v); }); break;
+            case 3: for_each_packed(r.bytes(), false, [&](std::int64_t v) { vals.push_back(v); }); break;
+            case 8: lat = r.svarint(); break;
+            case 9: lon = r.svarint(); break;
+            default: r.skip(wire); break;
+        }
+    }
+    tags.clear();
+    for (std::size_t i = 0; i < keys.size() && i < vals.size(); ++i) {
+        tags.emplace_back(ctx.str(keys[i]), ctx.str(vals[i]));
+    }
+    handler.node(PbfNode{id, ctx.lon(lon), ctx.lat(lat), tags});
+}
+
+void decode_dense_nodes(std::string_view msg, const BlockContext& ctx, const PbfHandler& handler, PbfTags& tags) {
+    ProtoReader r(msg);
+    std::uint32_t field, wire;
+    std::string_view ids, lats, lons, keys_vals;
+    while (r.next(field, wire)) {
+        switch (field) {
+            case 1: ids = r.bytes(); break;
+            case 8: lats = r.bytes(); break;
+            case 9: lons = r.bytes(); break;
+            case 10: keys_vals = r.bytes(); break;
+            default: r.skip(wire); break;
+        }
+    }
+
+    // The four arrays run in parallel; ids and coordinates are delta coded and
+    // keys_vals is a stream of key,value,...,0 per node
+    ProtoReader id_r(ids), lat_r(lats), lon_r(lons), kv_r(keys_vals);
+    std::int64_t id = 0, lat = 0, lon = 0;
+    while (!id_r.empty()) {
+        id += id_r.svarint();
+        lat += lat_r.svarint();
+        lon += lon_r.svarint();
+
+        tags.clear();
+        while (!kv_r.empty()) {
+            std::int64_t k = static_cast<std::int64_t>(kv_r.varint());
+            if (k == 0) {
+                break;
+            }
+            std::int64_t v = static_cast<std::int64_t>(kv_r.varint());
+            tags.emplace_back(ctx.str(k), ctx.str(v));
+        }
+        handler.node(PbfNode{id, ctx.lon(lon), ctx.lat(lat), tags});
+    }
+}
+
+void decode_way(std::string_view msg, const BlockContext& ctx, const PbfHandler& handler,
+                PbfTags& tags, std::vector<std::int64_t>& refs) {
+    ProtoReader r(msg);
+    std::uint32_t field, wire;
+    std::int64_t id = 0;
+    std::vector<std::int64_t> keys, vals;
+    refs.clear();
+    while (r.next(field, wire)) {
+        switch (field) {
+            case 1: id = static_cast<std::int64_t>(r.varint()); break;
+            case 2: for_each_packed(r.bytes(), false, [&](std::int64_t v) { keys.push_back(v); }); break;
+            case 3: for_each_packed(r.bytes(), false, [&](std::int64_t v) { vals.push_back(v); }); break;
+            case 8: {
+                std::int64_t ref = 0;
+                for_each_packed(r.bytes(), true, [&](std::int64_t delta) { refs.push_back(ref += delta); });
+                break;
+            }
+            default: r.skip(wire); break;
+        }
+    }
+    tags.clear();
+    for (std::size_t i = 0; i < keys.size() && i < vals.size(); ++i) {
+        tags.emplace_back(ctx.str(keys[i]), ctx.str(vals[i]));
+    }
+    handler.way(PbfWay{id, refs, tags});
+}
+
+void decode_relation(std::string_view msg, const BlockContext& ctx, const PbfHandler& handler,
+                     PbfTags& tags, std::vector<PbfMember>& members) {
+    ProtoReader r(msg);
+    std::uint32_t field, wire;
+    std::int64_t id = 0;
+    std::vector<std::int64_t> keys, vals, roles, ids, types;
+    while (r.next(field, wire)) {
+        switch (field) {
+            case 1: id = static_cast<std::int64_t>(r.varint()); break;
+            case 2: for_each_packed(r.bytes(), false, [&](std::int64_t v) { keys.push_back(v); }); break;
+            case 3: for_each_packed(r.bytes(), false, [&](std::int64_t v) { vals.push_back(v); }); break;
+            case 8: for_each_packed(r.bytes(), false, [&](std::int64_t v) { roles.push_back(v); }); break;
+            case 9: {
+                std::int64_t ref = 0;
+                for_each_packed(r.bytes(), true, [&](std::int64_t delta) { ids.push_back(ref += delta); });
+                break;
+            }
+            case 10: for_each_packed(r.bytes(), false, [&](std::int64_t v) { types.push_back(v); }); break;
+            default: r.skip(wire); break;
+        }
+    }
+    tags.clear();
+    for (std::size_t i = 0; i < keys.size() && i < vals.size(); ++i) {
+        tags.emplace_back(ctx.str(keys[i]), ctx.str(vals[i]));
+    }
+    // The member arrays run in parallel
+    members.clear();
+    for (std::size_t i = 0; i < ids.size() && i < roles.size() && i < types.size(); ++i) {
+        if (types[i] < 0 || types[i] > 2) {
+            throw std::runtime_error("Unknown relation member type in PBF");
+        }
+        members.push_back({static_cast<PbfMemberType>(types[i]), ids[i], ctx.str(roles[i])});
+    }
+    handler.relation(PbfRelation{id, members, tags});
+}
+
+} // namespace
+
+PbfReader::PbfReader(const std::string& path) {
+    mapping_ = map_file_readonly(path, length_);
+    if (!mapping_) {
+        throw std::runtime_error("Cannot open PBF file: " + path);
+    }
+
+    // Walk the BlobHeader/Blob framing once to find the data blocks
+    const auto* base = static_cast<const std::uint8_t*>(mapping_.get());
+    std::size_t pos = 0;
+    while (pos + 4 <= length_) {
+        std::size_t header_size = read_be32(base + pos);
+        pos += 4;
+        if (pos + header_size > length_) {
+            throw std::runtime_error("Truncated BlobHeader in PBF file: " + path);
+        }
+
+        ProtoReader header(base + pos, header_size);
+        std::uint32_t field, wire;
+        std::string_view type;
+        std::size_t data_size = 0;
+        while (header.next(field, wire)) {
+            if (field == 1) type = header.bytes();
+            else if (field == 3) data_size = static_cast<std::size_t>(header.varint());
+            else header.skip(wire);
+        }
+        pos += header_size;
+        if (pos + data_size > length_) {
+            throw std::runtime_error("Truncated Blob in PBF file: " + path);
+        }
+        if (type == "OSMData") {
+            blocks_.push_back({pos, data_size});
+        }
+        pos += data_size;
+    }
+}
+
+void PbfReader::read_block(std::size_t index, const PbfHandler& handler) const {
+    const BlockRef& ref = blocks_.at(index);
+    std::string inflated;
+    std::string_view block = blob_payload(
+        std::string_view(static_cast<const char*>(mapping_.get()) + ref.offset, ref.size), inflated);
+
+    // PrimitiveBlock: string table and scaling first, groups decoded afterwards
+    BlockContext ctx;
+    std::vector<std::string_view> groups;
+    ProtoReader r(block);
+    std::uint32_t field, wire;
+    while (r.next(field, wire)) {
+        switch (field) {
+            case 1: {
+                ProtoReader st(r.bytes());
+                std::uint32_t sf, sw;
+                while (st.next(sf, sw)) {
+                    if (sf == 1) ctx.strings.push_back(st.bytes());
+                    else st.skip(sw);
+                }
+                break;
+            }
+            case 2: groups.push_back(r.bytes()); break;
+            case 17: ctx.granularity = static_cast<std::int64_t>(r.varint()); break;
+            case 19: ctx.lat_offset = static_cast<std::int64_t>(r.varint()); break;
+            case 20: ctx.lon_offset = static_cast<std::int64_t>(r.varint()); break;
+            default: r.skip(wire); break;
+        }
+    }
+
+    PbfTags tags;
+    std::vector<std::int64_t> refs;
+    std::vector<PbfMember> members;
+    for (std::string_view group : groups) {
+        ProtoReader g(group);
+        while (g.next(field, wire)) {
+            if (field == 1 && handler.node) {
+                decode_node(g.bytes(), ctx, handler, tags);
+            } else if (field == 2 && handler.node) {
+                decode_dense_nodes(g.bytes(), ctx, handler, tags);
+            } else if (field == 3 && handler.way) {
+                decode_way(g.bytes(), ctx, handler, tags, refs);
+            } else if (field == 4 && handler.relation) {
+                decode_relation(g.bytes(), ctx, handler, tags, members);
+            } else {
+                g.skip(wire); // Changesets, or element types nobody asked for
+            }
+        }
+    }
+}
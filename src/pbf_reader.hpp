@@ -0,0 +1,79 @@
+#ifndef PBF_READER_HPP
+#define PBF_READER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Minimal reader for OSM PBF files (https://wiki.openstreetmap.org/wiki/PBF_Format).
+// Only what the importer needs: nodes (plain and dense), ways and relations
+// with their tags. The file is mapped once and split into independent data blocks, which
+// can be decoded concurrently from several threads.
+
+using PbfTags = std::vector<std::pair<std::string_view, std::string_view>>;
+
+struct PbfNode {
+    std::int64_t id;
+    double lon;
+    double lat;
+    const PbfTags& tags; // Views into the block's string table, valid during the callback
+};
+
+struct PbfWay {
+    std::int64_t id;
+    const std::vector<std::int64_t>& refs;
+    const PbfTags& tags;
+};
+
+enum class PbfMemberType : std::uint8_t { Node = 0, Way = 1, Relation = 2 };
+
+struct PbfMember {
+    PbfMemberType type;
+    std::int64_t ref;
+    std::string_view role;
+};
+
+struct PbfRelation {
+    std::int64_t id;
+    const std::vector<PbfMember>& members;
+    const PbfTags& tags;
+};
+
+// Leave a callback empty to skip decoding that element type entirely
+struct PbfHandler {
+    std::function<void(const PbfNode&)> node;
+    std::function<void(const PbfWay&)> way;
+    std::function<void(const PbfRelation&)> relation;
+};
+
+class PbfReader {
+public:
+    explicit PbfReader(const std::string& path);
+
+    PbfReader(const PbfReader&) = delete;
+    PbfReader& operator=(const PbfReader&) = delete;
+
+    // Number of OSMData blocks in the file
+    std::size_t block_count() const { return blocks_.size(); }
+
+    // Decompresses and decodes one data block. Thread-safe; each block can be
+    // handled by a different thread.
+    void read_block(std::size_t index, const PbfHandler& handler) const;
+
+private:
+    struct BlockRef {
+        std::size_t offset; // Start of the Blob message
+        std::size_t size;
+    };
+
+    std::shared_ptr<const void> mapping_;
+    std::size_t length_ = 0;
+    std::vector<BlockRef> blocks_;
+};
+
+#endif // PBF_READER_HPP
@@ -1,8 +1,10 @@
 #ifndef PROJECTION_HPP
 #define PROJECTION_HPP
 
+#include <algorithm>
 #include <cmath>
 #include <numbers> // Requires C++20, or define M_PI manually
+#include <mapnik/box2d.hpp> // For tileToMercatorBoundingBox
 
 // Define M_PI if not using C++20 <numbers>
 #ifndef M_PI
@@ -12,7 +14,13 @@
 const double EARTH_RADIUS = 6378137.0;
 const double DEG_TO_RAD = M_PI / 180.0;
 const double RAD_TO_DEG = 180.0 / M_PI;
-const int TILE_SIZE = 256; // Standard web map tile size
+// Tile size of the zoom grid: the world is 256 * 2^z of these pixels wide at
+// zoom z, and style scales are worked out for it. Tiles may be rendered with
+// more pixels (--tile_size, @2x); they cover the same extent, drawn with a
+// matching scale factor.
+const int TILE_SIZE = 256;
+// OGC standard rendering pixel in metres; Mapnik's scale denominators assume it
+const double PIXEL_SIZE_METRES = 0.00028;
 
 struct Point {
     double x;
@@ -53,18 +61,40 @@ inline Point tileToPixels(int x, int y) {
     return { (double)x * TILE_SIZE, (double)y * TILE_SIZE };
 }
 
-// Convert pixel coordinates in the world map to Mercator coordinates
-inline Point pixelsToMercator(double px, double py, int z) {
+// Meters per pixel at zoom z (in Mercator units, i.e. at the equator)
+inline double resolutionForZoom(int z) {
     double total_pixels = numTiles(z) * TILE_SIZE;
     // Circumference at equator in meters for EPSG:3857
+    return (2 * M_PI * EARTH_RADIUS) / total_pixels;
+}
+
+// Inverse of resolutionForZoom: the (fractional) zoom at which a pixel covers
+// the given number of Mercator meters
+inline double zoomForResolution(double meters_per_pixel) {
+    return std::log2((2 * M_PI * EARTH_RADIUS) / (TILE_SIZE * meters_per_pixel));
+}
+
+// Zoom (fractional) whose TILE_SIZE tiles are drawn at a Mapnik scale denominator
+inline double zoomForScaleDenominator(double scale_denominator) {
+    return zoomForResolution(scale_denominator * PIXEL_SIZE_METRES);
+}
+
+// Convert pixel coordinates in the world map to Mercator coordinates
+inline Point pixelsToMercator(double px, double py, int z) {
     double half_circumference = M_PI * EARTH_RADIUS;
-    double resolution = (2 * half_circumference) / total_pixels; // meters per pixel
+    double resolution = resolutionForZoom(z); // meters per pixel
 
     double mx = -half_circumference + px * resolution;
     double my = half_circumference - py * resolution; // Y is flipped in pixel vs mercator
     return {mx, my};
 }
 
+// Convert Mercator coordinates to pixel coordinates in the world map at zoom z
+inline Point mercatorToPixels(double mx, double my, int z) {
+    double half_circumference = M_PI * EARTH_RADIUS;
+    double resolution = resolutionForZoom(z);
+    return {(mx + half_circumference) / resolution, (half_circumference - my) / resolution};
+}
 
 // Get the geographic bounding box (lon/lat) for a given tile Z/X/Y
 // Note: Mapnik often works directly with Mercator coordinates for bounding boxes.
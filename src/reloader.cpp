@@ -0,0 +1,82 @@
+#include "reloader.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <iostream>
+
+#include "tile_route.hpp" // kMaxZoom
+
+Reloader::Reloader(std::shared_ptr<TileService> tiles, std::vector<std::string> style_files, std::string data_file,
+                   RenderOptions options)
+    : tiles_(std::move(tiles)),
+      style_files_(std::move(style_files)),
+      data_file_(std::move(data_file)),
+      options_(std::move(options)) {}
+
+Reloader::~Reloader() {
+    wait();
+}
+
+void Reloader::wait() {
+    // Not joined under the lock: the reload thread takes it once more on its way out
+    std::thread thread;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        thread = std::move(thread_);
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+bool Reloader::start(std::function<void(const Result&)> done) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+        return false;
+    }
+    // The previous reload has finished, its thread only needs collecting
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    running_ = true;
+    thread_ = std::thread([this, done = std::move(done)] {
+        Result result = run();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = false;
+        }
+        if (done) {
+            done(result);
+        }
+    });
+    return true;
+}
+
+Reloader::Result Reloader::run() {
+    Result result;
+    const auto start = std::chrono::steady_clock::now();
+    std::clog << "INFO: Reloading " << style_files_.size() << " style(s) and " << data_file_ << "..." << std::endl;
+    try {
+        // Built next to the running renderers, so for a moment both sets are
+        // in memory. Requests keep using the old ones until reload() swaps.
+        auto data = std::make_shared<RenderData>(data_file_, 8 * std::max<std::size_t>(1, options_.map_pool_size));
+        std::vector<std::shared_ptr<TileRenderer>> renderers;
+        for (const std::string& style_file : style_files_) {
+            renderers.push_back(std::make_shared<TileRenderer>(style_file, data, options_));
+        }
+        result.changed_zooms = tiles_->reload(std::move(renderers));
+        result.ok = true;
+    } catch (const std::exception& e) {
+        result.error = e.what();
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (result.ok) {
+        std::clog << "INFO: Reload done in " << result.seconds << "s, " << result.changed_zooms << " of "
+                  << (kMaxZoom + 1) * style_files_.size() << " zoom levels changed." << std::endl;
+    } else {
+        std::cerr << "ERROR: Reload failed, keeping the current style: " << result.error << std::endl;
+    }
+    return result;
+}
@@ -0,0 +1,62 @@
+#ifndef RELOADER_HPP
+#define RELOADER_HPP
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tile_renderer.hpp"
+#include "tile_service.hpp"
+
+// Reloads the style XML files and the data behind a running server.
+//
+// The data is opened again and a new TileRenderer built for every style on a
+// background thread while the old ones keep serving; once they are ready they
+// are swapped into the TileService together. Connections are never touched,
+// and cached or stored tiles of zoom levels whose style did not change stay
+// valid (see TileRenderer::style_fingerprint()). If loading fails, the old
+// renderers simply stay in place.
+class Reloader {
+public:
+    struct Result {
+        bool ok = false;
+        std::string error;     // Why it failed
+        int changed_zooms = 0; // Zoom levels (over all styles) whose tiles have to be redrawn
+        double seconds = 0;    // Time to load the new style and data
+    };
+
+    // The files are read again from the same paths on each reload, so
+    // editing or replacing them in place and reloading picks up the change.
+    // `style_files` has one entry per tileset of `tiles`, in order
+    Reloader(std::shared_ptr<TileService> tiles, std::vector<std::string> style_files, std::string data_file,
+             RenderOptions options);
+    ~Reloader();
+
+    Reloader(const Reloader&) = delete;
+    Reloader& operator=(const Reloader&) = delete;
+
+    // Starts a reload in the background and returns right away; `done`, if
+    // given, is called with the outcome on the reload thread. Returns false
+    // (and does nothing) if a reload is already running.
+    bool start(std::function<void(const Result&)> done = nullptr);
+
+    // Blocks until a reload still running has finished
+    void wait();
+
+private:
+    Result run();
+
+    std::shared_ptr<TileService> tiles_;
+    const std::vector<std::string> style_files_;
+    const std::string data_file_;
+    const RenderOptions options_;
+
+    std::mutex mutex_;
+    bool running_ = false;
+    std::thread thread_;
+};
+
+#endif // RELOADER_HPP
@@ -0,0 +1,50 @@
+#include "render_data.hpp"
+
+#include <iostream>
+#include <sys/stat.h> // PBF modification time
+
+#include <mapnik/datasource_cache.hpp>
+
+namespace {
+// Imported data is recognised by extension; anything else goes to Mapnik's own plugins
+bool is_geo_store(const std::string& path) {
+    static const std::string ext = ".geostore";
+    return path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+}
+}
+
+RenderData::RenderData(const std::string& path, std::size_t query_cache_entries)
+    : path_(path) {
+    if (is_geo_store(path_)) {
+        geo_store_ = std::make_shared<const GeoStore>(path_);
+        geo_queries_ = std::make_shared<GeoQueryCache>(query_cache_entries);
+        modified_ = geo_store_->created();
+        std::clog << "INFO: Using geostore " << path_ << " (" << geo_store_->feature_count() << " features)" << std::endl;
+    } else {
+        struct stat st;
+        if (::stat(path_.c_str(), &st) == 0) {
+            modified_ = static_cast<std::int64_t>(st.st_mtime);
+        }
+    }
+}
+
+std::shared_ptr<mapnik::datasource> RenderData::datasource(mapnik::parameters params) {
+    params["file"] = path_;
+    if (geo_store_) {
+        // Cheap: every instance reads the same mapping and query cache
+        params["type"] = std::string(GeoStoreDatasource::name());
+        return std::make_shared<GeoStoreDatasource>(params, geo_store_, geo_queries_);
+    }
+
+    // The osm plugin reads the whole file per datasource, so sharing them is
+    // what keeps several layers and styles from parsing it again each
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& known : datasources_) {
+        if (known.first == params) {
+            return known.second;
+        }
+    }
+    std::shared_ptr<mapnik::datasource> ds = mapnik::datasource_cache::instance().create(params);
+    datasources_.emplace_back(params, ds);
+    return ds;
+}
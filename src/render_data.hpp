@@ -0,0 +1,56 @@
+#ifndef RENDER_DATA_HPP
+#define RENDER_DATA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <mapnik/datasource.hpp>
+#include <mapnik/params.hpp>
+
+#include "geo_store.hpp"            // Imported, indexed OSM data
+#include "geostore_datasource.hpp"  // GeoQueryCache
+
+// The data behind the styles: opened once and shared by every TileRenderer
+// drawing from it, so several styles over the same data cost one copy of it.
+//
+// A .geostore (see osm_import) is mapped once, with one query cache for all
+// layers of all styles. Anything else goes to Mapnik's plugins; layers that
+// ask for a datasource with the same parameters, in any style, share one.
+class RenderData {
+public:
+    // Opens `path`; throws std::runtime_error if a geostore cannot be read.
+    // `query_cache_entries` sizes the shared geostore query cache.
+    explicit RenderData(const std::string& path, std::size_t query_cache_entries = 64);
+
+    RenderData(const RenderData&) = delete;
+    RenderData& operator=(const RenderData&) = delete;
+
+    const std::string& path() const { return path_; }
+    // Null when rendering straight from a PBF
+    const std::shared_ptr<const GeoStore>& geo_store() const { return geo_store_; }
+    const std::shared_ptr<GeoQueryCache>& geo_queries() const { return geo_queries_; }
+    // When the data was produced: the import time of a geostore, else the
+    // file's modification time (Unix seconds, 0 if unknown)
+    std::int64_t modified() const { return modified_; }
+
+    // Datasource for a layer: a geostore one, or a Mapnik plugin one created
+    // from `params` (with "file" set to the data), shared with every earlier
+    // layer that asked with the same parameters. Thread-safe.
+    std::shared_ptr<mapnik::datasource> datasource(mapnik::parameters params);
+
+private:
+    std::string path_;
+    std::shared_ptr<const GeoStore> geo_store_;
+    std::shared_ptr<GeoQueryCache> geo_queries_;
+    std::int64_t modified_ = 0;
+
+    std::mutex mutex_;
+    std::vector<std::pair<mapnik::parameters, std::shared_ptr<mapnik::datasource>>> datasources_; // Plugin ones
+};
+
+#endif // RENDER_DATA_HPP
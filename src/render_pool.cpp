@@ -0,0 +1,170 @@
+#include "render_pool.hpp"
+#include <algorithm>
+#include <iostream>
+
+const char* render_priority_name(RenderPriority priority) {
+    switch (priority) {
+        case RenderPriority::Interactive: return "interactive";
+        case RenderPriority::Refresh: return "refresh";
+        case RenderPriority::Background: return "background";
+    }
+    return "unknown";
+}
+
+RenderPool::RenderPool(unsigned int threads, std::size_t max_queue, std::vector<unsigned int> weights, Limits limits) {
+    if (threads == 0) threads = 1;
+    std::size_t total_weight = 0;
+    for (unsigned int& weight : weights) {
+        weight = std::max(1u, weight);
+        total_weight += weight;
+    }
+    for (std::size_t p = 0; p < kRenderPriorities; ++p) {
+        Class& c = classes_[p];
+        c.flows.resize(std::max<std::size_t>(1, weights.size()));
+        if (weights.empty()) {
+            c.flows[0].max_queued = max_queue;
+        }
+        for (std::size_t i = 0; i < weights.size(); ++i) {
+            c.flows[i].weight = weights[i];
+            // Rounded up so every flow can queue something
+            c.flows[i].max_queued = (max_queue * weights[i] + total_weight - 1) / total_weight;
+        }
+        c.limit = p == 0 || limits[p] == 0 ? threads : std::min(limits[p], threads);
+    }
+    workers_.reserve(threads);
+    for (unsigned int i = 0; i < threads; ++i) {
+        workers_.emplace_back([this] { worker_loop(); });
+    }
+}
+
+RenderPool::~RenderPool() {
+    stop();
+}
+
+bool RenderPool::submit(Job job, RenderPriority priority, std::size_t flow, int zoom) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Class& c = classes_[static_cast<std::size_t>(priority)];
+        Flow& f = c.flows[flow < c.flows.size() ? flow : 0];
+        if (stopping_ || f.queued >= f.max_queued) {
+            return false;
+        }
+        const std::size_t z = static_cast<std::size_t>(std::max(zoom, 0));
+        if (f.by_zoom.size() <= z) {
+            f.by_zoom.resize(z + 1);
+        }
+        f.by_zoom[z].push_back(std::move(job));
+        ++f.queued;
+        ++c.queued;
+        ++queued_;
+    }
+    cv_.notify_one();
+    return true;
+}
+
+void RenderPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            return;
+        }
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : workers_) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+}
+
+std::size_t RenderPool::queued() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queued_;
+}
+
+std::size_t RenderPool::queued(RenderPriority priority) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return classes_[static_cast<std::size_t>(priority)].queued;
+}
+
+unsigned int RenderPool::running(RenderPriority priority) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return classes_[static_cast<std::size_t>(priority)].running;
+}
+
+std::size_t RenderPool::runnable() const {
+    for (std::size_t p = 0; p < kRenderPriorities; ++p) {
+        if (classes_[p].queued > 0 && classes_[p].running < classes_[p].limit) {
+            return p;
+        }
+    }
+    return kRenderPriorities;
+}
+
+RenderPool::Job RenderPool::next_job(std::size_t priority) {
+    // Weighted round robin over the flows with work, lowest zoom first within one
+    Class& c = classes_[priority];
+    for (;;) {
+        Flow& flow = c.flows[c.turn];
+        if (flow.queued > 0 && c.taken < flow.weight) {
+            ++c.taken;
+            auto queue = std::find_if(flow.by_zoom.begin(), flow.by_zoom.end(),
+                                      [](const std::deque<Job>& q) { return !q.empty(); });
+            Job job = std::move(queue->front());
+            queue->pop_front();
+            --flow.queued;
+            --c.queued;
+            --queued_;
+            ++c.running;
+            return job;
+        }
+        c.turn = (c.turn + 1) % c.flows.size();
+        c.taken = 0;
+    }
+}
+
+void RenderPool::worker_loop() {
+    for (;;) {
+        Job job;
+        std::size_t priority;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            // Jobs held back by their limit wait for a running one of their
+            // priority to finish, which wakes a worker for them
+            cv_.wait(lock, [&] {
+                priority = runnable();
+                return priority < kRenderPriorities || (stopping_ && queued_ == 0);
+            });
+            if (priority == kRenderPriorities) {
+                return; // Stopping and nothing left to do
+            }
+            job = next_job(priority);
+        }
+
+        // Jobs are expected to report their own errors back to the session;
+        // this is only a last line of defence so a worker never dies.
+        try {
+            job();
+        } catch (const std::exception& e) {
+            std::cerr << "ERROR: Unhandled exception in render job: " << e.what() << std::endl;
+        } catch (...) {
+            std::cerr << "ERROR: Unknown exception in render job" << std::endl;
+        }
+        job = nullptr; // Whatever it captured goes before the slot is given back
+
+        bool held_back;
+        bool drained;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Class& c = classes_[priority];
+            held_back = c.running-- == c.limit && c.queued > 0;
+            drained = stopping_ && queued_ == 0;
+        }
+        if (drained) {
+            cv_.notify_all(); // Workers that were waiting on held back jobs can leave now
+        } else if (held_back) {
+            cv_.notify_one();
+        }
+    }
+}
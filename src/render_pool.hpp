@@ -0,0 +1,103 @@
+#ifndef RENDER_POOL_HPP
+#define RENDER_POOL_HPP
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// What a render is for, most urgent first. A worker always takes the most
+// urgent job it is allowed to run.
+enum class RenderPriority {
+    Interactive, // A client is waiting for the tile
+    Refresh,     // Redraws of expired or stale tiles that are served meanwhile
+    Background,  // Maintenance nobody waits on: change file expiry and the like
+};
+
+constexpr std::size_t kRenderPriorities = 3;
+
+const char* render_priority_name(RenderPriority priority);
+
+// Fixed-size thread pool that runs tile renders away from the Asio I/O threads.
+// The queues are bounded so that a render backlog turns into fast 503s instead
+// of unbounded memory growth and ever-increasing latency.
+//
+// Each priority has its own queue, bound and thread limit. Refreshes and
+// background work can only ever occupy their share of the threads, and
+// never take a slot in the queue interactive requests are turned away by.
+//
+// Within a priority, jobs are queued per flow (one per tileset) and the
+// workers take turns between the flows that have work, `weight` jobs from
+// each per round, so a style with a deep backlog does not hold up the
+// others' renders. Each flow also gets its share of the queue bound, by
+// weight, so such a backlog cannot fill the queue for the others either.
+// Within a flow, lower zooms go first and equal zooms in the order they
+// came: a low-zoom tile is on the screen of far more viewers than one at
+// z18, and there are so few of them that they cannot keep the rest waiting
+// for long.
+class RenderPool {
+public:
+    using Job = std::function<void()>;
+    // Most threads running jobs of each priority at once, by RenderPriority;
+    // 0 means all of them. Interactive jobs may always use every thread.
+    using Limits = std::array<unsigned int, kRenderPriorities>;
+
+    // `weights` has one entry per flow; none means a single flow
+    RenderPool(unsigned int threads, std::size_t max_queue, std::vector<unsigned int> weights = {}, Limits limits = {});
+    ~RenderPool();
+
+    RenderPool(const RenderPool&) = delete;
+    RenderPool& operator=(const RenderPool&) = delete;
+
+    // Queues a job on a flow (out of range counts as flow 0), for a tile at
+    // `zoom`. Returns false (and drops the job) if the flow's share of its
+    // priority's queue is full or the pool is stopping; the caller is
+    // expected to report overload.
+    bool submit(Job job, RenderPriority priority = RenderPriority::Interactive, std::size_t flow = 0, int zoom = 0);
+
+    // Stops accepting work, lets the workers drain the queues and joins them.
+    void stop();
+
+    std::size_t queued() const; // Over all priorities
+    std::size_t queued(RenderPriority priority) const;
+    unsigned int running(RenderPriority priority) const;
+    unsigned int limit(RenderPriority priority) const { return classes_[static_cast<std::size_t>(priority)].limit; }
+    unsigned int threads() const { return static_cast<unsigned int>(workers_.size()); }
+
+private:
+    struct Flow {
+        std::vector<std::deque<Job>> by_zoom; // Index is the zoom
+        std::size_t queued = 0;
+        std::size_t max_queued = 0; // Its share of max_queue
+        unsigned int weight = 1;
+    };
+
+    // The queues of one priority
+    struct Class {
+        std::vector<Flow> flows;
+        std::size_t queued = 0;   // Over all flows
+        std::size_t turn = 0;     // Flow whose turn it is
+        unsigned int taken = 0;   // Jobs it has had this turn
+        unsigned int running = 0;
+        unsigned int limit = 0;
+    };
+
+    void worker_loop();
+    // Priority of the job next_job() would hand out, or kRenderPriorities
+    // if nothing queued may run yet. Both with the lock held.
+    std::size_t runnable() const;
+    Job next_job(std::size_t priority);
+
+    std::vector<std::thread> workers_;
+    std::array<Class, kRenderPriorities> classes_;
+    std::size_t queued_ = 0; // Over all priorities
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+};
+
+#endif // RENDER_POOL_HPP
@@ -0,0 +1,293 @@
+#include "seeder.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+std::int64_t unix_now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Position of cell (x, y) along the Hilbert curve filling an n x n grid (n a power of two)
+std::uint64_t hilbert_index(std::uint32_t n, std::uint32_t x, std::uint32_t y) {
+    std::uint64_t d = 0;
+    for (std::uint32_t s = n / 2; s > 0; s /= 2) {
+        std::uint32_t rx = (x & s) ? 1 : 0;
+        std::uint32_t ry = (y & s) ? 1 : 0;
+        d += static_cast<std::uint64_t>(s) * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Tile column/row containing a Mercator point at zoom z, clamped to the world
+int tile_coord(double pixels, int z) {
+    int max = (1 << z) - 1;
+    return std::min(std::max(static_cast<int>(std::floor(pixels / TILE_SIZE)), 0), max);
+}
+
+// Metatile origins covering the bbox, zoom by zoom, each zoom in Hilbert order
+std::vector<TileKey> enumerate_metatiles(const BBox& bbox, int min_zoom, int max_zoom, int metatile_size) {
+    const Point top_left = lonLatToMercator(bbox.min_lon, bbox.max_lat);
+    const Point bottom_right = lonLatToMercator(bbox.max_lon, bbox.min_lat);
+
+    std::vector<TileKey> out;
+    for (int z = min_zoom; z <= max_zoom; ++z) {
+        const int span = metatile_span(z, metatile_size);
+        const Point p0 = mercatorToPixels(top_left.x, top_left.y, z);
+        const Point p1 = mercatorToPixels(bottom_right.x, bottom_right.y, z);
+        const int mx0 = tile_coord(p0.x, z) / span, mx1 = tile_coord(p1.x, z) / span;
+        const int my0 = tile_coord(p0.y, z) / span, my1 = tile_coord(p1.y, z) / span;
+
+        const std::uint32_t grid = static_cast<std::uint32_t>((1 << z) / span);
+        std::vector<std::pair<std::uint64_t, TileKey>> level;
+        level.reserve(static_cast<std::size_t>(mx1 - mx0 + 1) * static_cast<std::size_t>(my1 - my0 + 1));
+        for (int my = my0; my <= my1; ++my) {
+            for (int mx = mx0; mx <= mx1; ++mx) {
+                level.emplace_back(hilbert_index(grid, static_cast<std::uint32_t>(mx), static_cast<std::uint32_t>(my)),
+                                   TileKey{z, mx * span, my * span});
+            }
+        }
+        std::sort(level.begin(), level.end(),
+                  [](const auto& a, const auto& b) { return a.first < b.first; });
+        for (const auto& item : level) {
+            out.push_back(item.second);
+        }
+    }
+    return out;
+}
+
+std::string format_duration(double seconds) {
+    long s = static_cast<long>(seconds);
+    std::ostringstream out;
+    if (s >= 3600) out << s / 3600 << "h";
+    if (s >= 60) out << (s / 60) % 60 << "m";
+    out << s % 60 << "s";
+    return out.str();
+}
+
+} // namespace
+
+Seeder::Seeder(std::shared_ptr<TileRenderer> renderer, std::shared_ptr<TileStore> store, SeedOptions options)
+    : renderer_(std::move(renderer)), store_(std::move(store)), options_(std::move(options)) {
+    if (options_.threads == 0) options_.threads = 1;
+    options_.min_zoom = std::max(options_.min_zoom, 0);
+    options_.max_zoom = std::min(options_.max_zoom, 20); // TileKey packing limit
+
+    jobs_ = enumerate_metatiles(options_.bbox, options_.min_zoom, options_.max_zoom, renderer_->metatile_size());
+
+    // One contiguous run of the curve per worker
+    const std::size_t threads = options_.threads;
+    for (std::size_t w = 0; w < threads; ++w) {
+        auto run = std::make_unique<Run>();
+        run->begin = jobs_.size() * w / threads;
+        run->end = jobs_.size() * (w + 1) / threads;
+        runs_.push_back(std::move(run));
+    }
+}
+
+std::int64_t Seeder::load_refresh_start() const {
+    // The state file pins the start time of a refresh to the bbox and zooms it
+    // was started for; anything else starts a new refresh from now
+    std::ostringstream params;
+    params << std::setprecision(10) << options_.bbox.min_lon << "," << options_.bbox.min_lat << ","
+           << options_.bbox.max_lon << "," << options_.bbox.max_lat << " "
+           << options_.min_zoom << "-" << options_.max_zoom;
+    if (options_.tileset != 0) {
+        params << " tileset " << static_cast<int>(options_.tileset);
+    }
+
+    if (!options_.state_file.empty()) {
+        std::ifstream in(options_.state_file);
+        std::string saved_params;
+        std::int64_t saved_start = 0;
+        if (std::getline(in, saved_params) && in >> saved_start && saved_params == params.str()) {
+            std::clog << "INFO: Seed: resuming refresh started at " << saved_start << std::endl;
+            return saved_start;
+        }
+    }
+
+    const std::int64_t start = unix_now();
+    if (!options_.state_file.empty()) {
+        std::ofstream out(options_.state_file, std::ios::trunc);
+        out << params.str() << "\n" << start << "\n";
+        if (!out) {
+            std::cerr << "WARNING: Cannot write seed state " << options_.state_file
+                      << "; an interrupted refresh will start over" << std::endl;
+        }
+    }
+    return start;
+}
+
+bool Seeder::run() {
+    started_ = std::chrono::steady_clock::now();
+    refresh_before_ = options_.refresh ? load_refresh_start() : 0;
+
+    std::clog << "INFO: Seed: " << jobs_.size() << " metatile(s), z" << options_.min_zoom << "-z" << options_.max_zoom
+              << ", " << options_.threads << " thread(s)" << (options_.refresh ? ", refreshing" : "") << std::endl;
+
+    active_workers_ = runs_.size();
+    std::vector<std::thread> workers;
+    for (std::size_t w = 0; w < runs_.size(); ++w) {
+        workers.emplace_back([this, w] { worker_loop(w); });
+    }
+
+    // Report progress until the workers are done
+    {
+        std::unique_lock<std::mutex> lock(done_mutex_);
+        while (!done_cv_.wait_for(lock, options_.report_interval, [this] { return active_workers_ == 0; })) {
+            report(false);
+        }
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+    report(true);
+
+    // Failed metatiles are not in the store (or still carry their old date),
+    // so running the same command again retries just those
+    const std::uint64_t failed = failed_.load();
+    if (failed > 0) {
+        std::cerr << "WARNING: Seed: " << failed << " metatile(s) failed; run the seed again to retry them" << std::endl;
+    }
+    const bool complete = done_.load() == jobs_.size() && failed == 0;
+    if (complete && options_.refresh && !options_.state_file.empty()) {
+        std::remove(options_.state_file.c_str());
+    }
+    return complete;
+}
+
+void Seeder::stop() {
+    stopping_ = true;
+}
+
+bool Seeder::next_job(std::size_t worker, std::size_t& index) {
+    if (stopping_) {
+        return false;
+    }
+    {
+        Run& own = *runs_[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (own.begin < own.end) {
+            index = own.begin++;
+            return true;
+        }
+    }
+
+    // Own run is empty: steal the back half of the largest remaining one
+    for (;;) {
+        std::size_t victim = runs_.size();
+        std::size_t largest = 0;
+        for (std::size_t w = 0; w < runs_.size(); ++w) {
+            std::lock_guard<std::mutex> lock(runs_[w]->mutex);
+            std::size_t remaining = runs_[w]->end - runs_[w]->begin;
+            if (remaining > largest) {
+                largest = remaining;
+                victim = w;
+            }
+        }
+        if (victim == runs_.size()) {
+            return false; // Nothing left anywhere
+        }
+
+        std::size_t begin, end;
+        {
+            Run& run = *runs_[victim];
+            std::lock_guard<std::mutex> lock(run.mutex);
+            if (run.begin >= run.end) {
+                continue; // Drained while we were looking; pick again
+            }
+            end = run.end;
+            begin = run.begin + (run.end - run.begin) / 2; // A single job goes to the thief
+            run.end = begin;
+        }
+        index = begin;
+        Run& own = *runs_[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        own.begin = begin + 1;
+        own.end = end;
+        return true;
+    }
+}
+
+void Seeder::worker_loop(std::size_t worker) {
+    std::size_t index;
+    while (next_job(worker, index)) {
+        seed_one(jobs_[index]);
+        done_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> lock(done_mutex_);
+    if (--active_workers_ == 0) {
+        done_cv_.notify_all();
+    }
+}
+
+void Seeder::seed_one(const TileKey& job) {
+    TileKey origin = job;
+    origin.tileset = options_.tileset;
+    const std::uint32_t style = renderer_->style_fingerprint(origin.z);
+    const std::int64_t created = store_->bundle_created(origin, style);
+    if (created > 0 && created >= refresh_before_) { // 0 = marked dirty by an expiry, or another style
+        skipped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    try {
+        TileBatch batch;
+        if (renderer_->metatile_size() > 1) {
+            batch = renderer_->render_metatile(origin.z, origin.x, origin.y);
+        } else {
+            batch.emplace_back(origin, renderer_->render_tile(origin.z, origin.x, origin.y));
+        }
+        for (auto& rendered : batch) {
+            rendered.first.tileset = origin.tileset;
+        }
+        store_->save(batch, style);
+        tiles_.fetch_add(batch.size(), std::memory_order_relaxed);
+    } catch (const std::exception& e) {
+        std::cerr << "ERROR: Seed: failed to render metatile " << origin.z << "/" << origin.x << "/" << origin.y
+                  << ": " << e.what() << std::endl;
+        failed_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Seeder::report(bool final) const {
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started_).count();
+    const std::uint64_t done = done_.load(std::memory_order_relaxed);
+    const std::uint64_t skipped = skipped_.load(std::memory_order_relaxed);
+    const std::uint64_t tiles = tiles_.load(std::memory_order_relaxed);
+    const double percent = jobs_.empty() ? 100.0 : 100.0 * static_cast<double>(done) / static_cast<double>(jobs_.size());
+    const double tiles_per_second = elapsed > 0 ? static_cast<double>(tiles) / elapsed : 0.0;
+
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1)
+         << "INFO: Seed" << (final ? " finished" : "") << ": " << done << "/" << jobs_.size() << " metatile(s) ("
+         << percent << "%), " << skipped << " already stored, " << failed_.load(std::memory_order_relaxed)
+         << " failed, " << tiles << " tile(s) at " << tiles_per_second << " tiles/s";
+
+    // Skipped metatiles cost next to nothing, so estimate from rendered ones only
+    const std::uint64_t rendered = done - skipped;
+    if (final) {
+        line << " in " << format_duration(elapsed);
+        if (done < jobs_.size()) line << " (interrupted; run again to resume)";
+    } else if (rendered > 0) {
+        double eta = elapsed / static_cast<double>(rendered) * static_cast<double>(jobs_.size() - done);
+        line << ", ETA " << format_duration(eta);
+    }
+    std::clog << line.str() << std::endl;
+}
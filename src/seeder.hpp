@@ -0,0 +1,90 @@
+#ifndef SEEDER_HPP
+#define SEEDER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "projection.hpp"
+#include "tile.hpp"
+#include "tile_renderer.hpp"
+#include "tile_store.hpp"
+
+struct SeedOptions {
+    BBox bbox{-180.0, -85.0511, 180.0, 85.0511}; // lon/lat
+    int min_zoom = 0;
+    int max_zoom = 14;
+    unsigned int threads = 1;
+    // Re-render bundles that already exist but were written before this seed
+    // run started (e.g. from older data). Otherwise existing bundles are kept.
+    bool refresh = false;
+    // Remembers when a refresh run started, so resuming it does not redo the
+    // bundles it already wrote. Removed once a run completes without failures.
+    std::string state_file;
+    std::chrono::seconds report_interval{10};
+    // Tileset the bundles are stored for (TileKey::tileset), when seeding
+    // one of several styles
+    std::uint8_t tileset = 0;
+};
+
+// Pre-renders every metatile of a bbox and zoom range into the tile store.
+//
+// Metatiles are visited zoom by zoom in Hilbert curve order, so consecutive
+// renders touch neighbouring data. The list is split into one contiguous run
+// per thread; a thread that runs dry steals the back half of the largest
+// remaining run, which keeps each thread's work spatially clustered while
+// still balancing uneven render times. Bundles already in the store are
+// skipped, which is what makes an interrupted seed resumable: run the same
+// command again and it continues where it stopped.
+class Seeder {
+public:
+    Seeder(std::shared_ptr<TileRenderer> renderer, std::shared_ptr<TileStore> store, SeedOptions options);
+
+    // Seeds on options.threads threads, reporting progress to std::clog.
+    // Blocks until done or stop(); returns true if every metatile was rendered
+    // or already stored, false if any failed or the run was stopped.
+    bool run();
+
+    // Asks the workers to finish their current metatile and return. Thread-safe.
+    void stop();
+
+private:
+    struct Run {
+        std::mutex mutex;
+        std::size_t begin = 0;
+        std::size_t end = 0;
+    };
+
+    bool next_job(std::size_t worker, std::size_t& index);
+    void worker_loop(std::size_t worker);
+    void seed_one(const TileKey& origin);
+    void report(bool final) const;
+    std::int64_t load_refresh_start() const;
+
+    std::shared_ptr<TileRenderer> renderer_;
+    std::shared_ptr<TileStore> store_;
+    SeedOptions options_;
+
+    std::vector<TileKey> jobs_; // Metatile origins in seeding order
+    std::vector<std::unique_ptr<Run>> runs_;
+    std::int64_t refresh_before_ = 0; // Bundles created earlier than this are re-rendered
+
+    std::atomic<bool> stopping_{false};
+    std::atomic<std::size_t> active_workers_{0};
+    std::mutex done_mutex_;
+    std::condition_variable done_cv_;
+
+    std::chrono::steady_clock::time_point started_;
+    std::atomic<std::uint64_t> done_{0};    // Metatiles handled (rendered, skipped or failed)
+    std::atomic<std::uint64_t> skipped_{0};
+    std::atomic<std::uint64_t> failed_{0};
+    std::atomic<std::uint64_t> tiles_{0};   // Tiles rendered and stored
+};
+
+#endif // SEEDER_HPP
@@ -0,0 +1,62 @@
+#include "solid_tile.hpp"
+
+#include <cstddef>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+bool row_uniform(const std::uint32_t* row, std::size_t n, std::uint32_t color) {
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i c = _mm_set1_epi32(static_cast<int>(color));
+    // 16 pixels per iteration: four compares folded into one mask test
+    for (; i + 16 <= n; i += 16) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(row + i);
+        __m128i eq = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128(p), c), _mm_cmpeq_epi32(_mm_loadu_si128(p + 1), c)),
+            _mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128(p + 2), c), _mm_cmpeq_epi32(_mm_loadu_si128(p + 3), c)));
+        if (_mm_movemask_epi8(eq) != 0xffff) {
+            return false;
+        }
+    }
+    for (; i + 4 <= n; i += 4) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i)), c);
+        if (_mm_movemask_epi8(eq) != 0xffff) {
+            return false;
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        if (row[i] != color) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename Image>
+bool uniform(const Image& image, std::uint32_t& color) {
+    if (image.width() == 0 || image.height() == 0) {
+        return false;
+    }
+    color = image.get_row(0)[0];
+    for (unsigned y = 0; y < image.height(); ++y) {
+        if (!row_uniform(image.get_row(y), image.width(), color)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+bool uniform_color(const mapnik::image_rgba8& image, std::uint32_t& color) {
+    return uniform(image, color);
+}
+
+bool uniform_color(const mapnik::image_view_rgba8& image, std::uint32_t& color) {
+    return uniform(image, color);
+}
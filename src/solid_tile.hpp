@@ -0,0 +1,21 @@
+#ifndef SOLID_TILE_HPP
+#define SOLID_TILE_HPP
+
+#include <cstdint>
+
+#include <mapnik/image.hpp>
+#include <mapnik/image_view.hpp>
+
+// Uniform ("solid") tile detection. Ocean, bare land and most high-zoom tiles
+// away from data are a single colour; spotting that after the render lets the
+// renderer hand out one shared pre-encoded tile instead of encoding, caching
+// and storing the same bytes over and over.
+//
+// The scan compares four pixels per instruction with SSE2 where available and
+// stops at the first differing pixel, so busy tiles cost almost nothing extra.
+
+// True if every pixel of the image equals the first one, which is returned in `color`
+bool uniform_color(const mapnik::image_rgba8& image, std::uint32_t& color);
+bool uniform_color(const mapnik::image_view_rgba8& image, std::uint32_t& color);
+
+#endif // SOLID_TILE_HPP
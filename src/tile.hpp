@@ -0,0 +1,115 @@
+#ifndef TILE_HPP
+#define TILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// What a tile is encoded as. Both kinds share the cache and the render
+// machinery, so the kind is part of the key.
+enum class TileFormat : std::uint8_t {
+    Raster = 0, // Image in the configured TileEncoder format
+    Vector = 1, // Mapbox Vector Tile
+};
+
+// Identifies one tile in the tile pyramid
+struct TileKey {
+    int z = 0;
+    int x = 0;
+    int y = 0;
+    TileFormat format = TileFormat::Raster;
+    std::uint8_t scale = 1; // Pixel density of raster tiles, the n of @{n}x
+    std::uint8_t tileset = 0; // Which style drew it: 0 is the default, see TileService
+
+    bool operator==(const TileKey& other) const {
+        return z == other.z && x == other.x && y == other.y && format == other.format && scale == other.scale &&
+               tileset == other.tileset;
+    }
+    bool operator!=(const TileKey& other) const { return !(*this == other); }
+};
+
+struct TileKeyHash {
+    std::size_t operator()(const TileKey& key) const {
+        // z <= 20 and x, y < 2^20 pack losslessly into 64 bits, with the top
+        // bit for the format, the tileset above x and the scale in the gap
+        // above y; then mix so neighbouring tiles spread over hash buckets
+        // and cache shards.
+        std::uint64_t h = (static_cast<std::uint64_t>(key.format) << 63) ^
+                          (static_cast<std::uint64_t>(key.z) << 58) ^
+                          (static_cast<std::uint64_t>(key.tileset) << 49) ^
+                          (static_cast<std::uint64_t>(key.x) << 29) ^
+                          (static_cast<std::uint64_t>(key.scale) << 20) ^
+                          static_cast<std::uint64_t>(key.y);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<std::size_t>(h);
+    }
+};
+
+// Metatiles are NxN blocks of tiles rendered in one pass. At low zooms the
+// block is clamped to the whole world (2^z tiles across).
+inline int metatile_span(int z, int metatile_size) {
+    int world = 1 << z;
+    return metatile_size < world ? metatile_size : world;
+}
+
+// Top-left tile of the metatile that contains `key`; identifies the metatile
+inline TileKey metatile_origin(const TileKey& key, int metatile_size) {
+    int span = metatile_span(key.z, metatile_size);
+    return {key.z, key.x - key.x % span, key.y - key.y % span, key.format, key.scale, key.tileset};
+}
+
+// Fast 64-bit content hash of tile bytes, used as the tile's ETag.
+// Mixes a word at a time; not cryptographic, only has to tell tiles apart.
+inline std::uint64_t content_hash(std::string_view bytes) {
+    std::uint64_t h = 0x9e3779b97f4a7c15ULL ^ bytes.size();
+    std::size_t i = 0;
+    for (; i + 8 <= bytes.size(); i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, bytes.data() + i, sizeof word);
+        h = (h ^ word) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    std::uint64_t tail = 0;
+    std::memcpy(&tail, bytes.data() + i, bytes.size() - i);
+    h = (h ^ tail) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// An encoded tile. Immutable once built, so one instance can be shared by the
+// cache and any number of in-flight responses without copying the bytes.
+struct EncodedTile {
+    std::string data; // Encoded bytes (image, or gzipped vector tile), when the tile owns them
+
+    // Tiles loaded from the disk store point into a shared read-only mapping
+    // of their bundle instead of owning a copy; `mapping` keeps it alive.
+    std::shared_ptr<const void> mapping;
+    std::string_view mapped;
+
+    // One instance stands in for many tile keys (e.g. the pre-encoded
+    // solid-colour tiles), so caches should not charge its bytes per key
+    bool shared = false;
+
+    // content_hash(bytes()), set by whoever builds the tile so responses and
+    // revalidations never hash the bytes again
+    std::uint64_t hash = 0;
+
+    std::string_view bytes() const { return mapping ? mapped : std::string_view(data); }
+};
+
+using TilePtr = std::shared_ptr<const EncodedTile>;
+
+// All tiles produced by one metatile render
+using TileBatch = std::vector<std::pair<TileKey, TilePtr>>;
+
+#endif // TILE_HPP
@@ -0,0 +1,48 @@
+#ifndef TILE_BODY_HPP
+#define TILE_BODY_HPP
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/optional.hpp>
+#include <cstdint>
+#include <utility>
+
+#include "tile.hpp"
+
+// Beast Body type that serializes a shared EncodedTile in place.
+// The response only holds a reference to the tile, so a cache hit (or a tile
+// that many sessions are waiting on) is written straight from the shared
+// buffer with no per-response copy of the image bytes.
+struct TileBody {
+    using value_type = TilePtr;
+
+    static std::uint64_t size(const value_type& tile) {
+        return tile ? tile->bytes().size() : 0;
+    }
+
+    class writer {
+        const value_type& tile_;
+
+    public:
+        using const_buffers_type = boost::asio::const_buffer;
+
+        template<bool isRequest, class Fields>
+        writer(const boost::beast::http::header<isRequest, Fields>&, const value_type& tile)
+            : tile_(tile) {}
+
+        void init(boost::beast::error_code& ec) { ec = {}; }
+
+        boost::optional<std::pair<const_buffers_type, bool>> get(boost::beast::error_code& ec) {
+            ec = {};
+            if (!tile_ || tile_->bytes().empty()) {
+                return boost::none;
+            }
+            // Whole body in one buffer, nothing more to follow
+            std::string_view bytes = tile_->bytes();
+            return {{const_buffers_type(bytes.data(), bytes.size()), false}};
+        }
+    };
+};
+
+#endif // TILE_BODY_HPP
@@ -0,0 +1,170 @@
+#include "tile_cache.hpp"
+
+namespace {
+// Rough per-entry bookkeeping: list node, hash node, control block and EncodedTile
+constexpr std::size_t kEntryOverhead = 128;
+}
+
+TileCache::TileCache(std::size_t capacity_bytes, std::size_t shard_count, std::vector<std::size_t> quotas)
+    : capacity_bytes_(capacity_bytes) {
+    if (shard_count == 0) shard_count = 1;
+    if (quotas.empty()) quotas.push_back(0);
+    shard_capacity_ = capacity_bytes_ / shard_count;
+    for (std::size_t quota : quotas) {
+        shard_quotas_.push_back(quota > 0 && quota < capacity_bytes_ ? quota / shard_count : shard_capacity_);
+    }
+    shards_.reserve(shard_count);
+    for (std::size_t i = 0; i < shard_count; ++i) {
+        shards_.push_back(std::make_unique<Shard>());
+        shards_.back()->lru.resize(quotas.size());
+        shards_.back()->tileset_bytes.resize(quotas.size());
+    }
+}
+
+std::size_t TileCache::entry_cost(const TilePtr& tile) {
+    // Mapped tiles are charged for their bytes too: the mapping stays resident
+    // for as long as the cache holds a reference to it. Shared tiles exist
+    // once however many keys point at them, so an entry costs only itself.
+    return (tile->shared ? 0 : tile->bytes().size()) + kEntryOverhead;
+}
+
+TileCache::Shard& TileCache::shard_for(const TileKey& key) {
+    // The high bits of the hash pick the shard, the low bits the bucket within it
+    std::size_t h = TileKeyHash{}(key);
+    return *shards_[((h >> 32) ^ (h >> 16)) % shards_.size()];
+}
+
+TilePtr TileCache::get(const TileKey& key, std::uint32_t* style, std::int64_t* stale_since) {
+    if (!enabled()) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    Shard& shard = shard_for(key);
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            // Move to front without reallocating the node
+            Shard::LruList& lru = shard.lru[key.tileset];
+            lru.splice(lru.begin(), lru, it->second);
+            it->second->used = ++shard.clock;
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            if (style) {
+                *style = it->second->style;
+            }
+            if (stale_since) {
+                *stale_since = it->second->stale_since;
+            }
+            return it->second->tile;
+        }
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+TilePtr TileCache::peek(const TileKey& key, std::uint32_t* style) {
+    if (!enabled()) {
+        return nullptr;
+    }
+    Shard& shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+        return nullptr;
+    }
+    if (style) {
+        *style = it->second->style;
+    }
+    return it->second->tile;
+}
+
+void TileCache::evict(Shard& shard, std::size_t tileset) {
+    Entry& victim = shard.lru[tileset].back();
+    const std::size_t cost = entry_cost(victim.tile);
+    shard.bytes -= cost;
+    shard.tileset_bytes[tileset] -= cost;
+    shard.index.erase(victim.key);
+    shard.lru[tileset].pop_back();
+}
+
+void TileCache::put(const TileKey& key, TilePtr tile, std::uint32_t style, std::int64_t stale_since) {
+    if (!enabled() || !tile || key.tileset >= shard_quotas_.size()) {
+        return;
+    }
+    const std::size_t tileset = key.tileset;
+    const std::size_t cost = entry_cost(tile);
+    if (cost > shard_quotas_[tileset]) {
+        return;
+    }
+
+    Shard& shard = shard_for(key);
+    std::uint64_t evicted = 0;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        Shard::LruList& lru = shard.lru[tileset];
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            const std::size_t old_cost = entry_cost(it->second->tile);
+            shard.bytes -= old_cost;
+            shard.tileset_bytes[tileset] -= old_cost;
+            it->second->tile = std::move(tile);
+            it->second->style = style;
+            it->second->stale_since = stale_since;
+            it->second->used = ++shard.clock;
+            lru.splice(lru.begin(), lru, it->second);
+        } else {
+            lru.push_front(Entry{key, std::move(tile), style, stale_since, ++shard.clock});
+            shard.index.emplace(key, lru.begin());
+        }
+        shard.bytes += cost;
+        shard.tileset_bytes[tileset] += cost;
+
+        // Over quota: the tileset makes room among its own tiles
+        while (shard.tileset_bytes[tileset] > shard_quotas_[tileset] && lru.size() > 1) {
+            evict(shard, tileset);
+            ++evicted;
+        }
+        // Over the shared budget: whichever tile was used longest ago goes
+        while (shard.bytes > shard_capacity_) {
+            std::size_t oldest = shard.lru.size();
+            for (std::size_t t = 0; t < shard.lru.size(); ++t) {
+                const bool is_new_tile = t == tileset && lru.size() == 1;
+                if (!shard.lru[t].empty() && !is_new_tile &&
+                    (oldest == shard.lru.size() || shard.lru[t].back().used < shard.lru[oldest].back().used)) {
+                    oldest = t;
+                }
+            }
+            if (oldest == shard.lru.size()) {
+                break;
+            }
+            evict(shard, oldest);
+            ++evicted;
+        }
+    }
+
+    insertions_.fetch_add(1, std::memory_order_relaxed);
+    if (evicted) {
+        evictions_.fetch_add(evicted, std::memory_order_relaxed);
+    }
+}
+
+TileCache::Stats TileCache::stats() const {
+    Stats s;
+    s.hits = hits_.load(std::memory_order_relaxed);
+    s.misses = misses_.load(std::memory_order_relaxed);
+    s.insertions = insertions_.load(std::memory_order_relaxed);
+    s.evictions = evictions_.load(std::memory_order_relaxed);
+    s.capacity_bytes = capacity_bytes_;
+    s.tileset_bytes.resize(shard_quotas_.size());
+    for (const auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        s.entries += shard->index.size();
+        s.bytes += shard->bytes;
+        for (std::size_t t = 0; t < shard->tileset_bytes.size(); ++t) {
+            s.tileset_bytes[t] += shard->tileset_bytes[t];
+        }
+    }
+    return s;
+}
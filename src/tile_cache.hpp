@@ -0,0 +1,103 @@
+#ifndef TILE_CACHE_HPP
+#define TILE_CACHE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "tile.hpp"
+
+// Byte-budgeted in-memory LRU cache of encoded tiles.
+// The key space is split over independent shards, each with its own lock and
+// its own slice of the byte budget, so concurrent lookups rarely contend.
+// Values are shared immutable buffers: a hit costs a refcount bump, not a copy.
+//
+// All tilesets (TileKey::tileset) share the budget. A tileset can also be
+// given a quota: past it, it evicts its own least recently used tiles rather
+// than anyone else's, so a busy style cannot push the others out.
+class TileCache {
+public:
+    struct Stats {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t insertions = 0;
+        std::uint64_t evictions = 0;
+        std::size_t entries = 0;
+        std::size_t bytes = 0;
+        std::size_t capacity_bytes = 0;
+        std::vector<std::size_t> tileset_bytes; // Bytes held per tileset
+    };
+
+    // capacity_bytes == 0 disables caching entirely. `quotas` has one entry
+    // per tileset, the most bytes its tiles may take (0 = no limit but the
+    // capacity); tiles of tilesets past its end are not cached. No quotas
+    // means one tileset without a limit.
+    TileCache(std::size_t capacity_bytes, std::size_t shard_count, std::vector<std::size_t> quotas = {});
+
+    TileCache(const TileCache&) = delete;
+    TileCache& operator=(const TileCache&) = delete;
+
+    // Returns the cached tile and marks it most recently used, or nullptr.
+    // `style` and `stale_since`, if given, receive the tags the tile was put with.
+    TilePtr get(const TileKey& key, std::uint32_t* style = nullptr, std::int64_t* stale_since = nullptr);
+
+    // Like get(), but leaves the counters and LRU order alone
+    TilePtr peek(const TileKey& key, std::uint32_t* style = nullptr);
+
+    // Inserts or replaces a tile, evicting least recently used entries of the
+    // same shard until it fits: of its own tileset while that is over quota,
+    // then of any. Tiles larger than a shard's budget are not cached.
+    // `style` tags the entry with the style it was drawn with (see
+    // TileRenderer::style_fingerprint()); it belongs to the key, not the tile,
+    // since one shared tile can be stored under many keys. `stale_since`
+    // is the Unix time a tile known to be out of date went stale, 0 if not.
+    void put(const TileKey& key, TilePtr tile, std::uint32_t style = 0, std::int64_t stale_since = 0);
+
+    Stats stats() const;
+    bool enabled() const { return capacity_bytes_ > 0; }
+
+private:
+    struct Entry {
+        TileKey key;
+        TilePtr tile;
+        std::uint32_t style;
+        std::int64_t stale_since;
+        std::uint64_t used; // Shard clock at the last use
+    };
+
+    // One LRU list per tileset; the oldest entry of the shard is the oldest
+    // of the list tails, by their clocks
+    struct Shard {
+        using LruList = std::list<Entry>;
+
+        std::mutex mutex;
+        std::vector<LruList> lru; // Per tileset, front = most recently used
+        std::vector<std::size_t> tileset_bytes;
+        std::unordered_map<TileKey, LruList::iterator, TileKeyHash> index;
+        std::size_t bytes = 0;
+        std::uint64_t clock = 0;
+    };
+
+    static std::size_t entry_cost(const TilePtr& tile);
+    Shard& shard_for(const TileKey& key);
+    // Drops the least recently used entry of `tileset`'s list
+    void evict(Shard& shard, std::size_t tileset);
+
+    std::size_t capacity_bytes_;
+    std::size_t shard_capacity_;
+    std::vector<std::size_t> shard_quotas_; // Per tileset, per shard
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    std::atomic<std::uint64_t> hits_{0};
+    std::atomic<std::uint64_t> misses_{0};
+    std::atomic<std::uint64_t> insertions_{0};
+    std::atomic<std::uint64_t> evictions_{0};
+};
+
+#endif // TILE_CACHE_HPP
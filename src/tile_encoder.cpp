@@ -0,0 +1,161 @@
+#include "tile_encoder.hpp"
+
+#include <mapnik/image_util.hpp>
+#include <mapnik/palette.hpp>
+
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <vector>
+
+namespace {
+
+// Output buffer that appends straight to a std::string
+class StringAppendBuf : public std::streambuf {
+public:
+    explicit StringAppendBuf(std::string& out) : out_(out) {}
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            out_.push_back(traits_type::to_char_type(ch));
+        }
+        return traits_type::not_eof(ch);
+    }
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        out_.append(s, static_cast<std::size_t>(n));
+        return n;
+    }
+
+private:
+    std::string& out_;
+};
+
+std::uint32_t fnv1a(const std::string& data, std::uint32_t hash = 2166136261u) {
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+} // namespace
+
+// Scratch state for one encode at a time. rgba_palette memoizes its colour
+// lookups in a mutable table, so concurrent encodes each need their own copy.
+struct TileEncoder::State {
+    std::unique_ptr<mapnik::rgba_palette> palette;
+    std::size_t last_size = 0; // Size of the previous tile, to size the next buffer
+};
+
+// States not in use. An encode borrows one and puts it back, so whichever
+// thread encodes next (a render thread or a metatile slice helper) gets one
+// that is already warm, and there are only ever as many as encodes ran at once.
+class TileEncoder::StatePool {
+public:
+    std::unique_ptr<State> take() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.empty()) {
+            return std::make_unique<State>();
+        }
+        std::unique_ptr<State> state = std::move(free_.back());
+        free_.pop_back();
+        return state;
+    }
+
+    void give_back(std::unique_ptr<State> state) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(std::move(state));
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<State>> free_;
+};
+
+TileEncoder::TileEncoder(const std::string& format, const std::string& palette_file)
+    : format_(format.empty() ? "png" : format), states_(std::make_shared<StatePool>()) {
+    const std::string type = format_.substr(0, format_.find(':'));
+    if (type.compare(0, 4, "webp") == 0) {
+        content_type_ = "image/webp";
+        extension_ = "webp";
+    } else if (type.compare(0, 4, "jpeg") == 0 || type.compare(0, 3, "jpg") == 0) {
+        content_type_ = "image/jpeg";
+        extension_ = "jpg";
+    } else {
+        content_type_ = "image/png";
+        extension_ = "png";
+    }
+
+    if (!palette_file.empty()) {
+        if (type != "png8" && type != "png") {
+            throw std::runtime_error("A palette only applies to png8 tiles, not '" + format_ + "'");
+        }
+        std::ifstream in(palette_file, std::ios::binary);
+        if (!in.is_open()) {
+            throw std::runtime_error("Cannot open palette file: " + palette_file);
+        }
+        // Reading through the streambuf never sets eofbit, only a failed read sets badbit
+        palette_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        if (in.bad() || palette_.empty()) {
+            throw std::runtime_error("Cannot read palette file: " + palette_file);
+        }
+        // Adobe .act files are 768 bytes of RGB (+4 with a colour count); otherwise guess from the size
+        const bool act = palette_file.size() > 4 && palette_file.compare(palette_file.size() - 4, 4, ".act") == 0;
+        palette_type_ = act ? mapnik::rgba_palette::PALETTE_ACT
+                            : (palette_.size() % 4 == 0 ? mapnik::rgba_palette::PALETTE_RGBA
+                                                        : mapnik::rgba_palette::PALETTE_RGB);
+        if (!mapnik::rgba_palette(palette_, static_cast<mapnik::rgba_palette::palette_type>(palette_type_)).valid()) {
+            throw std::runtime_error("Invalid palette file: " + palette_file);
+        }
+    }
+
+    fingerprint_ = fnv1a(palette_, fnv1a(format_));
+}
+
+template<typename Image>
+void TileEncoder::encode_image(const Image& image, std::string& out) const {
+    // Back to the pool however the encode ends
+    struct Lease {
+        StatePool& pool;
+        std::unique_ptr<State> state;
+        ~Lease() { pool.give_back(std::move(state)); }
+    } lease{*states_, states_->take()};
+    State& state = *lease.state;
+
+    // Neighbouring tiles compress to similar sizes; start from the last one
+    // with some headroom so most tiles are written without reallocating
+    out.clear();
+    out.reserve(state.last_size + state.last_size / 8 + 256);
+
+    StringAppendBuf buf(out);
+    std::ostream stream(&buf);
+    if (!palette_.empty()) {
+        if (!state.palette) {
+            state.palette = std::make_unique<mapnik::rgba_palette>(
+                palette_, static_cast<mapnik::rgba_palette::palette_type>(palette_type_));
+        }
+        mapnik::save_to_stream(image, stream, format_, *state.palette);
+    } else {
+        mapnik::save_to_stream(image, stream, format_);
+    }
+    if (!stream) {
+        throw std::runtime_error("Failed to encode tile as " + format_);
+    }
+    state.last_size = out.size();
+
+    // The string becomes a long-lived cache entry; do not keep a big overshoot
+    if (out.capacity() > out.size() + out.size() / 2 + 4096) {
+        out.shrink_to_fit();
+    }
+}
+
+void TileEncoder::encode(const mapnik::image_rgba8& image, std::string& out) const {
+    encode_image(image, out);
+}
+
+void TileEncoder::encode(const mapnik::image_view_rgba8& image, std::string& out) const {
+    encode_image(image, out);
+}
@@ -0,0 +1,60 @@
+#ifndef TILE_ENCODER_HPP
+#define TILE_ENCODER_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <mapnik/image.hpp>
+#include <mapnik/image_view.hpp>
+
+// Turns rendered images into tile bytes in one configurable format.
+//
+// The format is a Mapnik image format string, so everything Mapnik's encoders
+// support can be tuned from the command line, e.g.
+//   png                 Mapnik's default PNG
+//   png8:m=h:z=1        paletted PNG, hextree quantizer, fast deflate
+//   png32:z=1           full colour, fast deflate
+//   webp:quality=80     needs a Mapnik built with WebP
+// For png8 a fixed palette file (.act, or raw RGB/RGBA triples/quads) can be
+// given; tiles are then mapped onto it instead of being quantized one by one,
+// which is faster and keeps colours identical across tile edges.
+//
+// Output is streamed straight into the destination string, which becomes the
+// body of the shared tile, so there is no intermediate buffer to copy.
+//
+// encode() may be called from any number of threads at once. Copies share
+// their scratch state, which goes away with the last of them.
+class TileEncoder {
+public:
+    // Throws std::runtime_error if the palette cannot be read
+    explicit TileEncoder(const std::string& format = "png", const std::string& palette_file = "");
+
+    void encode(const mapnik::image_rgba8& image, std::string& out) const;
+    void encode(const mapnik::image_view_rgba8& image, std::string& out) const;
+
+    const std::string& format() const { return format_; }
+    const std::string& content_type() const { return content_type_; }
+    const std::string& extension() const { return extension_; } // File extension used in tile URLs
+
+    // Identifies the format and palette, so stored tiles from another encoder
+    // configuration are never mistaken for ours
+    std::uint32_t fingerprint() const { return fingerprint_; }
+
+private:
+    struct State;
+    class StatePool;
+
+    template<typename Image>
+    void encode_image(const Image& image, std::string& out) const;
+
+    std::string format_;
+    std::string content_type_;
+    std::string extension_;
+    std::string palette_;   // Raw palette file contents, empty if none
+    int palette_type_ = 0;  // mapnik::rgba_palette::palette_type
+    std::shared_ptr<StatePool> states_;
+    std::uint32_t fingerprint_ = 0;
+};
+
+#endif // TILE_ENCODER_HPP
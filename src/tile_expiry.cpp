@@ -0,0 +1,277 @@
+#include "tile_expiry.hpp"
+#include "projection.hpp"
+#include "tile_route.hpp" // kMaxZoom
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+using MetatileSet = std::unordered_set<TileKey, TileKeyHash>;
+
+struct MetatileRange {
+    int x0, y0, x1, y1; // Inclusive, in metatile units
+    std::size_t count() const {
+        return static_cast<std::size_t>(x1 - x0 + 1) * static_cast<std::size_t>(y1 - y0 + 1);
+    }
+};
+
+// Metatiles at zoom z touched by a Mercator box grown by `buffer` metres
+MetatileRange metatile_range(double minx, double miny, double maxx, double maxy, double buffer, int z, int span) {
+    const Point top_left = mercatorToPixels(minx - buffer, maxy + buffer, z);
+    const Point bottom_right = mercatorToPixels(maxx + buffer, miny - buffer, z);
+    const int max = (1 << z) - 1;
+    auto tile = [max](double pixels) {
+        return std::min(std::max(static_cast<int>(std::floor(pixels / TILE_SIZE)), 0), max);
+    };
+    return {tile(top_left.x) / span, tile(top_left.y) / span, tile(bottom_right.x) / span, tile(bottom_right.y) / span};
+}
+
+void insert_range(MetatileSet& out, const MetatileRange& r, int z, int span) {
+    for (int y = r.y0; y <= r.y1; ++y) {
+        for (int x = r.x0; x <= r.x1; ++x) {
+            out.insert(TileKey{z, x * span, y * span});
+        }
+    }
+}
+
+Point stored_point(const GeoStore::Feature& f, std::size_t i) {
+    const GeoPoint p = f.point(i);
+    return {from_geo_units(p.x), from_geo_units(p.y)};
+}
+
+// All of a stored feature: its outline and interior, its line or its point
+void add_feature(TileExpiry& expiry, const GeoStore::Feature& f) {
+    if (f.type() == GeoType::Polygon) {
+        // The outer ring covers the holes as well
+        std::vector<std::pair<double, double>> ring;
+        ring.reserve(f.size());
+        for (std::size_t p = 0; p < f.size() && !is_ring_break(f.point(p)); ++p) {
+            const Point m = stored_point(f, p);
+            ring.emplace_back(m.x, m.y);
+        }
+        expiry.add_area(ring);
+    } else if (f.size() == 1) {
+        const Point m = stored_point(f, 0);
+        expiry.add_point(m.x, m.y);
+    } else {
+        for (std::size_t p = 1; p < f.size(); ++p) {
+            const Point a = stored_point(f, p - 1), b = stored_point(f, p);
+            expiry.add_segment(a.x, a.y, b.x, b.y);
+        }
+    }
+}
+
+} // namespace
+
+TileExpiry::TileExpiry(const ExpireOptions& options) : options_(options) {
+    options_.min_zoom = std::max(options_.min_zoom, 0);
+    options_.max_zoom = std::min(options_.max_zoom, kMaxZoom);
+    if (options_.metatile_size < 1) options_.metatile_size = 1;
+}
+
+void TileExpiry::add_point(double x, double y) {
+    boxes_.push_back({x, y, x, y});
+}
+
+void TileExpiry::add_segment(double x0, double y0, double x1, double y1) {
+    boxes_.push_back({std::min(x0, x1), std::min(y0, y1), std::max(x0, x1), std::max(y0, y1)});
+}
+
+void TileExpiry::add_area(const std::vector<std::pair<double, double>>& ring) {
+    if (ring.empty()) {
+        return;
+    }
+    Area area{{ring[0].first, ring[0].second, ring[0].first, ring[0].second}, outlines_.size(), 0};
+    for (std::size_t i = 0; i < ring.size(); ++i) {
+        const auto& a = ring[i];
+        const auto& b = ring[(i + 1) % ring.size()];
+        outlines_.push_back({std::min(a.first, b.first), std::min(a.second, b.second),
+                             std::max(a.first, b.first), std::max(a.second, b.second)});
+        area.box.minx = std::min(area.box.minx, a.first);
+        area.box.miny = std::min(area.box.miny, a.second);
+        area.box.maxx = std::max(area.box.maxx, a.first);
+        area.box.maxy = std::max(area.box.maxy, a.second);
+    }
+    area.segment_count = ring.size();
+    areas_.push_back(area);
+}
+
+std::vector<TileKey> TileExpiry::metatiles() const {
+    std::vector<TileKey> out;
+    for (int z = options_.min_zoom; z <= options_.max_zoom; ++z) {
+        const int span = metatile_span(z, options_.metatile_size);
+        const double buffer = options_.buffer_px * resolutionForZoom(z);
+
+        MetatileSet level;
+        for (const Box& b : boxes_) {
+            insert_range(level, metatile_range(b.minx, b.miny, b.maxx, b.maxy, buffer, z, span), z, span);
+        }
+        for (const Area& area : areas_) {
+            MetatileRange fill = metatile_range(area.box.minx, area.box.miny, area.box.maxx, area.box.maxy, buffer, z, span);
+            if (fill.count() <= options_.max_fill_metatiles) {
+                insert_range(level, fill, z, span);
+                continue;
+            }
+            for (std::size_t i = 0; i < area.segment_count; ++i) {
+                const Box& b = outlines_[area.first_segment + i];
+                insert_range(level, metatile_range(b.minx, b.miny, b.maxx, b.maxy, buffer, z, span), z, span);
+            }
+        }
+        out.insert(out.end(), level.begin(), level.end());
+    }
+    return out;
+}
+
+std::vector<TileKey> expire_osc_tiles(const OscChanges& changes, const GeoStore* store, const ExpireOptions& options) {
+    TileExpiry expiry(options);
+    const bool indexed = store && store->has_element_index();
+    const std::size_t level = store ? store->full_level() : 0;
+
+    // New geometry, as far as the change file itself describes it
+    std::unordered_map<std::int64_t, Point> locations;
+    for (const auto& node : changes.nodes) {
+        if (node.has_location) {
+            Point m = lonLatToMercator(node.lon, node.lat);
+            locations[node.id] = m;
+            expiry.add_point(m.x, m.y);
+        }
+    }
+
+    // Nodes a changed way keeps where they were are not in the file; the
+    // index has them
+    auto location = [&](std::int64_t ref) -> const Point* {
+        auto it = locations.find(ref);
+        if (it != locations.end() || !indexed) {
+            return it != locations.end() ? &it->second : nullptr;
+        }
+        const Point* found = nullptr;
+        store->find_element(OsmType::Node, ref, [&](std::size_t feature, std::uint32_t vertex) {
+            if (!found && vertex != GeoStore::kWholeFeature) {
+                found = &locations.emplace(ref, stored_point(store->feature(level, feature), vertex)).first->second;
+            }
+        });
+        return found;
+    };
+
+    for (const auto& way : changes.ways) {
+        const bool closed = way.refs.size() >= 4 && way.refs.front() == way.refs.back();
+        std::vector<std::pair<double, double>> ring;
+        const Point* prev = nullptr;
+        for (std::int64_t ref : way.refs) {
+            const Point* p = location(ref);
+            if (!p) {
+                prev = nullptr; // Unchanged node the store cannot place; its old geometry covers it
+                continue;
+            }
+            if (prev) {
+                expiry.add_segment(prev->x, prev->y, p->x, p->y);
+            }
+            prev = p;
+            if (closed) ring.emplace_back(p->x, p->y);
+        }
+        if (closed && ring.size() == way.refs.size()) {
+            expiry.add_area(ring); // Every vertex is known, so the new interior is too
+        }
+    }
+
+    if (!store) {
+        return expiry.metatiles();
+    }
+
+    // Old geometry: whatever the store holds for the changed elements, from
+    // the full-detail level, which has everything
+    std::unordered_set<std::size_t> expired; // Features expired whole
+    auto expire_whole = [&](std::size_t feature) {
+        if (expired.insert(feature).second) {
+            add_feature(expiry, store->feature(level, feature));
+        }
+    };
+
+    if (indexed) {
+        // Where the moved nodes now are, by stored vertex, so a segment
+        // between two moved nodes ends up in the right place
+        std::unordered_map<std::uint64_t, Point> moved;
+        auto vertex_key = [](std::size_t feature, std::uint32_t vertex) {
+            return (static_cast<std::uint64_t>(feature) << 32) | vertex;
+        };
+        for (const auto& node : changes.nodes) {
+            auto it = locations.find(node.id);
+            if (!node.has_location || it == locations.end()) {
+                continue;
+            }
+            store->find_element(OsmType::Node, node.id, [&](std::size_t feature, std::uint32_t vertex) {
+                if (vertex != GeoStore::kWholeFeature) {
+                    moved.emplace(vertex_key(feature, vertex), it->second);
+                }
+            });
+        }
+
+        // A node only changes the segments on either side of it, in every
+        // way it is part of, whether or not those ways changed themselves
+        for (const auto& node : changes.nodes) {
+            store->find_element(OsmType::Node, node.id, [&](std::size_t feature, std::uint32_t vertex) {
+                if (vertex == GeoStore::kWholeFeature) {
+                    return expire_whole(feature); // The node's own point
+                }
+                GeoStore::Feature f = store->feature(level, feature);
+                auto now = [&](std::size_t v) {
+                    auto it = moved.find(vertex_key(feature, static_cast<std::uint32_t>(v)));
+                    return it != moved.end() ? it->second : stored_point(f, v);
+                };
+                const Point old = stored_point(f, vertex);
+                const Point current = now(vertex);
+                std::vector<std::pair<double, double>> swept{{old.x, old.y}};
+                // Closed rings have their first node at both ends, so the
+                // index gives both of its neighbours without wrapping around
+                for (std::size_t n : {std::size_t(vertex) - 1, std::size_t(vertex) + 1}) {
+                    if (n >= f.size() || is_ring_break(f.point(n))) {
+                        continue; // Line or ring ends here (vertex 0 wraps to a huge n)
+                    }
+                    const Point neighbour_old = stored_point(f, n);
+                    const Point neighbour_now = now(n);
+                    expiry.add_segment(neighbour_old.x, neighbour_old.y, old.x, old.y);
+                    expiry.add_segment(neighbour_now.x, neighbour_now.y, current.x, current.y);
+                    swept.emplace_back(neighbour_old.x, neighbour_old.y);
+                }
+                if (f.type() == GeoType::Polygon && swept.size() == 3) {
+                    // The fill changes between the old and new vertex
+                    swept.insert(swept.begin() + 2, std::make_pair(current.x, current.y));
+                    expiry.add_area(swept);
+                }
+            });
+        }
+
+        // A changed way or relation may have lost nodes or members the
+        // change file says nothing about, so all of its old geometry goes;
+        // that includes multipolygons a way is a member of
+        for (const auto& way : changes.ways) {
+            store->find_element(OsmType::Way, way.id, [&](std::size_t feature, std::uint32_t) { expire_whole(feature); });
+        }
+        for (std::int64_t relation : changes.relations) {
+            store->find_element(OsmType::Relation, relation, [&](std::size_t feature, std::uint32_t) { expire_whole(feature); });
+        }
+        return expiry.metatiles();
+    }
+
+    // A store without an index: scan it for the changed ids, until every
+    // node and way has been seen. Points are nodes, everything else ways or
+    // multipolygons, which share a number space here, and one relation can
+    // make several areas, so changed relations keep the scan going to the end.
+    std::unordered_set<std::int64_t> node_ids, way_ids, relation_ids(changes.relations.begin(), changes.relations.end());
+    for (const auto& node : changes.nodes) node_ids.insert(node.id);
+    for (const auto& way : changes.ways) way_ids.insert(way.id);
+    for (std::size_t i = 0; i < store->feature_count(level); ++i) {
+        if (node_ids.empty() && way_ids.empty() && relation_ids.empty()) {
+            break;
+        }
+        GeoStore::Feature f = store->feature(level, i);
+        if (f.type() == GeoType::Point ? node_ids.erase(f.id()) > 0
+                                       : way_ids.erase(f.id()) > 0 || relation_ids.count(f.id()) > 0) {
+            expire_whole(i);
+        }
+    }
+    return expiry.metatiles();
+}
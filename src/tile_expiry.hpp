@@ -0,0 +1,60 @@
+#ifndef TILE_EXPIRY_HPP
+#define TILE_EXPIRY_HPP
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "geo_store.hpp"
+#include "osc_reader.hpp"
+#include "tile.hpp"
+
+struct ExpireOptions {
+    int min_zoom = 0;
+    int max_zoom = 18;
+    int metatile_size = 1;  // Results are metatile origins for this size
+    double buffer_px = 16;  // Margin for line widths and symbols drawn past the geometry
+    // Polygons covering more metatiles than this at a zoom only expire their
+    // outline there (like osm2pgsql), so a changed forest does not dirty a country
+    std::size_t max_fill_metatiles = 256;
+};
+
+// Collects changed geometry (Web Mercator metres) and turns it into the set of
+// metatiles that have to be re-rendered.
+class TileExpiry {
+public:
+    explicit TileExpiry(const ExpireOptions& options);
+
+    void add_point(double x, double y);
+    void add_segment(double x0, double y0, double x1, double y1);
+    // A closed ring; its interior is expired too, within max_fill_metatiles
+    void add_area(const std::vector<std::pair<double, double>>& ring);
+
+    // Distinct metatile origins, lowest zoom first
+    std::vector<TileKey> metatiles() const;
+
+private:
+    struct Box {
+        double minx, miny, maxx, maxy;
+    };
+    struct Area {
+        Box box;
+        std::size_t first_segment; // Outline segments in outlines_
+        std::size_t segment_count;
+    };
+
+    ExpireOptions options_;
+    std::vector<Box> boxes_;    // Points and line segments
+    std::vector<Box> outlines_; // Segments of areas, used when an area is too big to fill
+    std::vector<Area> areas_;
+};
+
+// Expires everything an OSM change file touches: the new locations of changed
+// nodes and ways from the file itself, plus the stored geometry of changed
+// features in `store` (may be null), which covers where they used to be. With
+// the store's element index a moved node expires the segments next to it in
+// every way it is on, and changed ways also the multipolygons they belong to;
+// without one the store is scanned for the changed ids.
+std::vector<TileKey> expire_osc_tiles(const OscChanges& changes, const GeoStore* store, const ExpireOptions& options);
+
+#endif // TILE_EXPIRY_HPP
@@ -1,11 +1,77 @@
 #include "tile_renderer.hpp"
-#include <sstream> // For string stream formatting of PNG
+#include "solid_tile.hpp"
+#include "metrics.hpp"
+#include <mapnik/save_map.hpp> // For style fingerprints
+#include <algorithm>
+#include <set>
+
+namespace {
+// Splits the time since `start` into datasource queries and the drawing or
+// building around them; datasources report their share as they run
+void observe_render(int z, Metrics::Clock::time_point start) {
+    const Metrics::Clock::duration total = Metrics::Clock::now() - start;
+    const Metrics::Clock::duration query = std::min(Metrics::take_query_time(), total);
+    Metrics::observe(Metrics::Stage::Query, z, query);
+    Metrics::observe(Metrics::Stage::Render, z, total - query);
+}
+
+// Fingerprint of what a tile at `scale_denominator` is drawn from: the map
+// cut down to the layers visible at that scale and the style rules active
+// there, serialized, plus the identity of the data. Changes elsewhere in the
+// style (other zooms, unused styles) leave it alone.
+std::uint32_t zoom_fingerprint(const mapnik::Map& prototype, double scale_denominator, const std::string& data_id) {
+    mapnik::Map view(prototype);
+    view.layers().clear();
+    std::set<std::string> used;
+    for (const mapnik::layer& layer : prototype.layers()) {
+        if (layer.active() && layer.visible(scale_denominator)) {
+            view.layers().push_back(layer);
+            used.insert(layer.styles().begin(), layer.styles().end());
+        }
+    }
+    for (auto it = view.styles().begin(); it != view.styles().end();) {
+        if (!used.count(it->first)) {
+            it = view.styles().erase(it);
+            continue;
+        }
+        auto& rules = it->second.get_rules_nonconst();
+        rules.erase(std::remove_if(rules.begin(), rules.end(),
+                                   [scale_denominator](const mapnik::rule& rule) { return !rule.active(scale_denominator); }),
+                    rules.end());
+        ++it;
+    }
+    const std::string xml = mapnik::save_map_to_string(view);
+    const std::uint32_t h = static_cast<std::uint32_t>(content_hash(xml) ^ (content_hash(data_id) >> 1));
+    return h != 0 ? h : 1; // 0 is for tiles of unknown origin
+}
+
+// Only a few background colours ever show up; anything beyond is encoded per tile
+constexpr std::size_t kMaxSolidTiles = 64;
+
+// Solid tiles are only shared for colours that look the same premultiplied or
+// not, so the singleton is byte-identical to what the encoder would produce
+bool shareable_color(std::uint32_t color) {
+    std::uint32_t alpha = color >> 24;
+    return alpha == 0xff || color == 0;
+}
+}
 
 // Constructor
-TileRenderer::TileRenderer(const std::string& style_path, const std::string& pbf_file_path, unsigned int tile_size)
-    : tile_size_(tile_size),
-      map_prototype_(tile_size, tile_size), // Initialize prototype with tile dimensions
-      pbf_path_(pbf_file_path),
+TileRenderer::TileRenderer(const std::string& style_path, const std::string& pbf_file_path, const RenderOptions& options)
+    // A few recent queries per render thread: enough for the other scales of
+    // a metatile to find its features
+    : TileRenderer(style_path, std::make_shared<RenderData>(pbf_file_path, 8 * std::max<std::size_t>(1, options.map_pool_size)),
+                   options) {}
+
+TileRenderer::TileRenderer(const std::string& style_path, std::shared_ptr<RenderData> data, const RenderOptions& options)
+    : options_(options),
+      tile_size_(options.tile_size),
+      encoder_(options.image_format, options.palette_file),
+      encode_pool_(options.encode_pool ? options.encode_pool
+                                       : std::make_shared<EncodePool>(std::max(1u, options.encode_threads) - 1)),
+      map_prototype_(options.tile_size, options.tile_size), // Initialize prototype with tile dimensions
+      data_(std::move(data)),
+      geo_store_(data_->geo_store().get()),
       proj_web_mercator_("+init=epsg:3857"), // Define Web Mercator projection
       proj_latlon_("+init=epsg:4326")        // Define Lat/Lon projection
 {
@@ -17,30 +83,83 @@ TileRenderer::TileRenderer(const std::string& style_path, const std::string& pbf
         // Load the map style XML
         mapnik::load_map(map_prototype_, style_path, true); // true = strict mode
 
-        // *** CRITICAL: Update the PBF file path in the datasource ***
-        // The XML style likely has a placeholder or default path. We need to set the
-        // actual path provided at runtime.
-        // This assumes the layer using the PBF is the FIRST layer (index 0). Adjust if needed.
-        if (!map_prototype_.layers().empty()) {
-            mapnik::parameters params = map_prototype_.layers()[0].datasource()->params();
-            params["file"] = pbf_path_; // Set the 'file' parameter to the actual PBF path
-            // Optional: Set encoding if needed (often utf-8 for OSM)
-            // params["encoding"] = "utf-8";
-
-            // Create a *new* datasource with updated parameters and assign it
-            std::shared_ptr<mapnik::datasource> ds = mapnik::datasource_cache::instance().create(params);
-            map_prototype_.layers()[0].set_datasource(ds);
-             std::clog << "INFO: Mapnik Datasource 'file' parameter updated to: " << pbf_path_ << std::endl;
-        } else {
+        // *** CRITICAL: Update the PBF file path in the datasources ***
+        // The XML style has a placeholder path ("(file)" in basic_style.xml). We need
+        // to set the actual path provided at runtime, in every layer that reads it.
+        // The datasources come from the shared data, so other styles over the
+        // same file reuse them.
+        if (map_prototype_.layers().empty()) {
              std::cerr << "WARNING: Mapnik style loaded, but no layers found. Cannot set PBF path." << std::endl;
+        } else if (geo_store_) {
+            // Imported data (see osm_import): one mapped store shared by every layer.
+            // Its geometry is already in Web Mercator, so no reprojection at render time.
+            for (mapnik::layer& layer : map_prototype_.layers()) {
+                mapnik::parameters params = layer.datasource() ? layer.datasource()->params() : mapnik::parameters();
+                layer.set_datasource(data_->datasource(params));
+                layer.set_srs(proj_web_mercator_.params());
+            }
+            std::clog << "INFO: Using geostore " << data_->path() << " for " << map_prototype_.layers().size()
+                      << " layer(s)" << std::endl;
+        } else {
+            for (mapnik::layer& layer : map_prototype_.layers()) {
+                // Same parameters with the 'file' parameter set to the actual PBF path
+                layer.set_datasource(data_->datasource(layer.datasource()->params()));
+            }
+             std::clog << "INFO: Mapnik Datasource 'file' parameter updated to: " << data_->path() << std::endl;
         }
 
-
         // Set the map's projection to Web Mercator (EPSG:3857)
         map_prototype_.set_srs(proj_web_mercator_.params());
 
         std::clog << "INFO: Mapnik style '" << style_path << "' loaded successfully." << std::endl;
 
+        // Metatiles are rendered with a buffer so labels and symbols that cross
+        // tile edges are placed once and appear identically in every slice
+        if (options_.metatile_size > 1) {
+            map_prototype_.set_buffer_size(options_.buffer_size);
+        }
+
+        // With imported data, an extent without features renders to the bare
+        // background, so those renders can be skipped outright. Not with a
+        // background image, which is not a single colour.
+        if (geo_store_ && !map_prototype_.background_image()) {
+            empty_color_ = map_prototype_.background() ? map_prototype_.background()->rgba() : 0;
+            skip_empty_ = shareable_color(empty_color_);
+        }
+        query_buffer_px_ = std::max(0, map_prototype_.buffer_size());
+        for (const mapnik::layer& layer : map_prototype_.layers()) {
+            if (layer.buffer_size()) {
+                query_buffer_px_ = std::max(query_buffer_px_, *layer.buffer_size());
+            }
+        }
+
+        // Layers without a zoom range are in every fingerprint, so a typical
+        // style edit changes all zooms; minzoom/maxzoom and rule scales are
+        // what let the other zooms keep their tiles across a reload. The tile
+        // size is in it too: stored tiles of another size are redrawn.
+        const std::string data_id = data_->path() + "@" + std::to_string(data_->modified()) + "/" + std::to_string(tile_size_);
+        style_fingerprints_.resize(kMaxZoom + 1);
+        for (int z = 0; z <= kMaxZoom; ++z) {
+            const double scale_denominator = tileToMercatorBoundingBox(z, 0, 0).width() / TILE_SIZE / PIXEL_SIZE_METRES;
+            style_fingerprints_[z] = zoom_fingerprint(map_prototype_, scale_denominator, data_id);
+        }
+
+        // Pay the Map copy cost up front, once per render thread. Maps are sized
+        // for a full metatile, the common case when metatiling is on.
+        unsigned int map_pixels = tile_size_ * static_cast<unsigned int>(std::max(1, options_.metatile_size));
+        map_pool_ = std::make_unique<MapPool>(map_prototype_, map_pixels, map_pixels, options_.map_pool_size);
+        std::clog << "INFO: Map pool ready with " << map_pool_->size() << " map(s)." << std::endl;
+
+        // Vector tiles use the rules of standard raster tiles, whatever their pixel size
+        vector_builder_ = std::make_unique<VectorTileBuilder>(map_prototype_, TILE_SIZE, options_.vector);
+        auto empty = std::make_shared<EncodedTile>();
+        if (options_.vector.gzip) {
+            empty->data = gzip_compress({});
+        }
+        empty->shared = true;
+        empty->hash = content_hash(empty->bytes());
+        empty_vector_tile_ = std::move(empty);
+
     } catch (const mapnik::config_error& e) {
         std::cerr << "Mapnik Config ERROR: " << e.what() << std::endl;
         throw std::runtime_error("Failed to configure Mapnik: " + std::string(e.what()));
@@ -50,31 +169,265 @@ TileRenderer::TileRenderer(const std::string& style_path, const std::string& pbf
     }
 }
 
+TilePtr TileRenderer::solid_tile(std::uint32_t color, unsigned int pixels) {
+    const std::uint64_t id = static_cast<std::uint64_t>(pixels) << 32 | color;
+    std::lock_guard<std::mutex> lock(solid_mutex_);
+    auto it = solid_tiles_.find(id);
+    if (it != solid_tiles_.end()) {
+        return it->second;
+    }
+    if (solid_tiles_.size() >= kMaxSolidTiles) {
+        return nullptr;
+    }
+    mapnik::image_rgba8 image(pixels, pixels);
+    image.set(color);
+    auto tile = std::make_shared<EncodedTile>();
+    encoder_.encode(image, tile->data);
+    tile->shared = true;
+    tile->hash = content_hash(tile->data);
+    return solid_tiles_[id] = std::move(tile);
+}
+
+bool TileRenderer::has_features(const mapnik::box2d<double>& extent, double buffer, int z) const {
+    if (!geo_store_) {
+        return true;
+    }
+    GeoBox box{to_geo_units(extent.minx() - buffer), to_geo_units(extent.miny() - buffer),
+               to_geo_units(extent.maxx() + buffer), to_geo_units(extent.maxy() + buffer)};
+    return geo_store_->any(box, geo_store_->level_for_zoom(z));
+}
+
+void TileRenderer::query_extent(const mapnik::box2d<double>& extent, double buffer, int z) {
+    const std::shared_ptr<GeoQueryCache>& queries = data_->geo_queries();
+    if (!geo_store_ || !queries) {
+        return;
+    }
+    const mapnik::box2d<double> box(extent.minx() - buffer, extent.miny() - buffer,
+                                    extent.maxx() + buffer, extent.maxy() + buffer);
+    const std::size_t level = geo_store_->level_for_zoom(z);
+    if (queries->find(*geo_store_, box, level)) {
+        return;
+    }
+    auto found = std::make_shared<std::vector<std::size_t>>();
+    geo_store_->query({to_geo_units(box.minx()), to_geo_units(box.miny()), to_geo_units(box.maxx()), to_geo_units(box.maxy())},
+                      level, [&found](std::size_t index) { found->push_back(index); });
+    queries->insert(box, level, std::move(found));
+}
+
+template<typename Image>
+TilePtr TileRenderer::encode_or_share(const Image& image) {
+    std::uint32_t color;
+    if (uniform_color(image, color) && shareable_color(color)) {
+        if (TilePtr tile = solid_tile(color, static_cast<unsigned int>(image.width()))) {
+            solid_count_.fetch_add(1, std::memory_order_relaxed);
+            return tile;
+        }
+    }
+    // Encode straight into the shared tile's buffer, which is what the
+    // response body points at; no intermediate string or byte vector
+    auto tile = std::make_shared<EncodedTile>();
+    encoder_.encode(image, tile->data);
+    tile->hash = content_hash(tile->data);
+    return tile;
+}
+
+TileRenderer::Stats TileRenderer::stats() const {
+    Stats s;
+    s.solid_tiles = solid_count_.load(std::memory_order_relaxed);
+    s.skipped_renders = skipped_count_.load(std::memory_order_relaxed);
+    s.reused_queries = data_->geo_queries() ? data_->geo_queries()->reused() : 0;
+    return s;
+}
+
 // Render tile implementation
-std::vector<unsigned char> TileRenderer::render_tile(int z, int x, int y) {
+TilePtr TileRenderer::render_tile(int z, int x, int y, int scale) {
     // Lock mutex for thread safety if Map object is shared or modified.
     // Rendering might be safe depending on Mapnik internals, but safer to lock.
     // std::lock_guard<std::mutex> lock(map_mutex_); // Lock if needed
-
-    // Create a working copy of the map for this request
-    // This might be slow; consider a pool of pre-initialized map objects if performance is critical.
-    mapnik::Map map_instance = map_prototype_; // Copy constructor
-    map_instance.resize(tile_size_, tile_size_);
+    const unsigned int pixels = tile_size_ * static_cast<unsigned int>(scale);
 
     // Calculate the bounding box for the tile in Web Mercator coordinates
     mapnik::box2d<double> merc_bbox = tileToMercatorBoundingBox(z, x, y);
 
+    // Nothing to draw: it would come out as plain background. Same box the
+    // layers would query: the extent plus their buffer, which Mapnik scales
+    // along with everything else.
+    const double buffer = query_buffer_px_ * scale_factor(scale) * merc_bbox.width() / pixels;
+    if (skip_empty_ && !has_features(merc_bbox, buffer, z)) {
+        if (TilePtr tile = solid_tile(empty_color_, pixels)) {
+            skipped_count_.fetch_add(1, std::memory_order_relaxed);
+            solid_count_.fetch_add(1, std::memory_order_relaxed);
+            return tile;
+        }
+    }
+
+    // Check out a pre-built map; it is already sized and only needs its extent set.
+    // The lease hands it back to the pool when this function returns.
+    Metrics::Clock::time_point start = Metrics::Clock::now();
+    MapPool::Lease map_lease = map_pool_->lease();
+    mapnik::Map& map_instance = *map_lease;
+    if (map_instance.width() != pixels || map_instance.height() != pixels) {
+        map_instance.resize(pixels, pixels);
+    }
+
     // Set the map extent to the tile's bounding box
     map_instance.zoom_to_box(merc_bbox);
+    Metrics::observe(Metrics::Stage::MapSetup, z, Metrics::Clock::now() - start);
 
     // Render the map to an image
+    start = Metrics::Clock::now();
+    Metrics::take_query_time();
     mapnik::image_rgba8 image(map_instance.width(), map_instance.height());
-    mapnik::agg_renderer<mapnik::image_rgba8> renderer(map_instance, image);
+    mapnik::agg_renderer<mapnik::image_rgba8> renderer(map_instance, image, scale_factor(scale));
     renderer.apply(); // Perform the rendering
+    observe_render(z, start);
+
+    start = Metrics::Clock::now();
+    TilePtr tile = encode_or_share(image);
+    Metrics::observe(Metrics::Stage::Encode, z, Metrics::Clock::now() - start);
+    return tile;
+}
+// Render metatile implementation
+TileBatch TileRenderer::render_metatile(int z, int x, int y, int scale) {
+    const TileKey origin = metatile_origin({z, x, y}, options_.metatile_size);
+    const int span = metatile_span(z, options_.metatile_size);
+    const unsigned int tile_pixels = tile_size_ * static_cast<unsigned int>(scale);
+    const unsigned int pixels = tile_pixels * static_cast<unsigned int>(span);
+    const std::uint8_t key_scale = static_cast<std::uint8_t>(scale);
+
+    const std::size_t count = static_cast<std::size_t>(span) * static_cast<std::size_t>(span);
+
+    // Combined extent: top edge of the top-left tile to bottom edge of the bottom-right one
+    const mapnik::box2d<double> top_left = tileToMercatorBoundingBox(z, origin.x, origin.y);
+    const mapnik::box2d<double> bottom_right = tileToMercatorBoundingBox(z, origin.x + span - 1, origin.y + span - 1);
+    const mapnik::box2d<double> extent(top_left.minx(), bottom_right.miny(), bottom_right.maxx(), top_left.maxy());
+
+    // No data anywhere in (or near) the block: every slice is plain background
+    if (skip_empty_ && !has_features(extent, query_buffer_px_ * scale_factor(scale) * extent.width() / pixels, z)) {
+        if (TilePtr tile = solid_tile(empty_color_, tile_pixels)) {
+            TileBatch batch;
+            batch.reserve(count);
+            for (std::size_t i = 0; i < count; ++i) {
+                batch.emplace_back(TileKey{z, origin.x + static_cast<int>(i % span), origin.y + static_cast<int>(i / span),
+                                           TileFormat::Raster, key_scale},
+                                   tile);
+            }
+            skipped_count_.fetch_add(1, std::memory_order_relaxed);
+            solid_count_.fetch_add(count, std::memory_order_relaxed);
+            return batch;
+        }
+    }
+
+    // At @Nx a block has N² the pixels (an 8x8 one at @3x would be a 6144px
+    // image per render thread), so above scale 1 it is drawn in parts no
+    // larger than the scale-1 block. Each part is sliced before the next.
+    // The block is queried once up front and the parts' layers take their
+    // features from it. Labels are still placed per part: one crossing a
+    // part edge is placed by both parts and may be doubled or left out
+    // there, much as at the edge of two separate metatiles.
+    const int part = scale > 1 ? std::max(1, span / scale) : span;
+
+    Metrics::Clock::time_point start = Metrics::Clock::now();
+    MapPool::Lease map_lease = map_pool_->lease();
+    mapnik::Map& map_instance = *map_lease;
+    Metrics::Clock::duration setup_time = Metrics::Clock::now() - start;
+    Metrics::Clock::duration render_time{};
+    Metrics::Clock::duration encode_time{};
+    Metrics::take_query_time();
+    if (part < span) {
+        // Mapnik pads each layer's query by twice its buffer
+        start = Metrics::Clock::now();
+        query_extent(extent, 2 * query_buffer_px_ * scale_factor(scale) * extent.width() / pixels, z);
+        const Metrics::Clock::duration elapsed = Metrics::Clock::now() - start;
+        Metrics::add_query_time(elapsed);
+        render_time += elapsed; // Taken back out as query time below
+    }
+
+    TileBatch batch(count);
+    for (int part_row = 0; part_row < span; part_row += part) {
+        for (int part_col = 0; part_col < span; part_col += part) {
+            const int cols = std::min(part, span - part_col);
+            const int rows = std::min(part, span - part_row);
+            const unsigned int width = tile_pixels * static_cast<unsigned int>(cols);
+            const unsigned int height = tile_pixels * static_cast<unsigned int>(rows);
+
+            start = Metrics::Clock::now();
+            if (map_instance.width() != width || map_instance.height() != height) {
+                map_instance.resize(width, height); // Low zooms have fewer tiles than a full metatile
+            }
+            const mapnik::box2d<double> first = tileToMercatorBoundingBox(z, origin.x + part_col, origin.y + part_row);
+            const mapnik::box2d<double> last =
+                tileToMercatorBoundingBox(z, origin.x + part_col + cols - 1, origin.y + part_row + rows - 1);
+            map_instance.zoom_to_box({first.minx(), last.miny(), last.maxx(), first.maxy()});
+            setup_time += Metrics::Clock::now() - start;
+
+            start = Metrics::Clock::now();
+            mapnik::image_rgba8 image(width, height);
+            mapnik::agg_renderer<mapnik::image_rgba8> renderer(map_instance, image, scale_factor(scale));
+            renderer.apply();
+            render_time += Metrics::Clock::now() - start;
+
+            // Slice into tiles and encode them. Views avoid copying pixels; the slices
+            // are independent so the encode helpers can take some of them.
+            // Uniform slices (open water, empty land) become the shared solid tile.
+            start = Metrics::Clock::now();
+            encode_pool_->run(static_cast<std::size_t>(cols) * static_cast<std::size_t>(rows), [&](std::size_t i) {
+                const int col = static_cast<int>(i % cols);
+                const int row = static_cast<int>(i / cols);
+                mapnik::image_view_rgba8 view(col * tile_pixels, row * tile_pixels, tile_pixels, tile_pixels, image);
+                const int block_col = part_col + col;
+                const int block_row = part_row + row;
+                batch[static_cast<std::size_t>(block_row) * span + block_col] = {
+                    TileKey{z, origin.x + block_col, origin.y + block_row, TileFormat::Raster, key_scale},
+                    encode_or_share(view)};
+            });
+            encode_time += Metrics::Clock::now() - start;
+        }
+    }
+
+    const Metrics::Clock::duration query_time = std::min(Metrics::take_query_time(), render_time);
+    Metrics::observe(Metrics::Stage::MapSetup, z, setup_time);
+    Metrics::observe(Metrics::Stage::Query, z, query_time);
+    Metrics::observe(Metrics::Stage::Render, z, render_time - query_time);
+    Metrics::observe(Metrics::Stage::Encode, z, encode_time); // Wall time of all slices
+
+    return batch;
+}
 
-    // Encode the image to PNG format in memory
-    std::string png_string = mapnik::save_to_string(image, "png"); // Corrected function name
+TileBatch TileRenderer::build_vector(int z, int x, int y, int span) {
+    const mapnik::box2d<double> top_left = tileToMercatorBoundingBox(z, x, y);
+    const mapnik::box2d<double> bottom_right = tileToMercatorBoundingBox(z, x + span - 1, y + span - 1);
+    const mapnik::box2d<double> extent(top_left.minx(), bottom_right.miny(), bottom_right.maxx(), top_left.maxy());
+    const double buffer = top_left.width() * options_.vector.buffer / options_.vector.extent;
 
-    // Convert the PNG string to a byte vector
-    return std::vector<unsigned char>(png_string.begin(), png_string.end());
-}
\ No newline at end of file
+    TileBatch batch;
+    if (!has_features(extent, buffer, z)) {
+        skipped_count_.fetch_add(1, std::memory_order_relaxed);
+        const std::size_t count = static_cast<std::size_t>(span) * static_cast<std::size_t>(span);
+        batch.resize(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            batch[i].first = TileKey{z, x + static_cast<int>(i % span), y + static_cast<int>(i / span), TileFormat::Vector};
+        }
+    } else {
+        // Layer building and MVT encoding are one pass; it all counts as render
+        const Metrics::Clock::time_point start = Metrics::Clock::now();
+        Metrics::take_query_time();
+        batch = vector_builder_->build(z, x, y, span);
+        observe_render(z, start);
+    }
+    for (auto& tile : batch) {
+        if (!tile.second) {
+            tile.second = empty_vector_tile_;
+        }
+    }
+    return batch;
+}
+
+TilePtr TileRenderer::render_vector_tile(int z, int x, int y) {
+    return build_vector(z, x, y, 1).front().second;
+}
+
+TileBatch TileRenderer::render_vector_metatile(int z, int x, int y) {
+    const TileKey origin = metatile_origin({z, x, y}, options_.metatile_size);
+    return build_vector(z, origin.x, origin.y, metatile_span(z, options_.metatile_size));
+}
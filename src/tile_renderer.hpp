@@ -1,9 +1,12 @@
 #ifndef TILE_RENDERER_HPP
 #define TILE_RENDERER_HPP
 
+#include <atomic>
 #include <string>
 #include <vector>
+#include <memory>
 #include <mutex>
+#include <unordered_map>
 #include <stdexcept> // For runtime_error
 #include <iostream> // For cerr
 
@@ -23,20 +26,117 @@
 #include <mapnik/proj_transform.hpp> // For projections if needed manually
 
 #include "projection.hpp" // For tile BBox calculation
+#include "map_pool.hpp"   // Pre-built maps, one per concurrent render
+#include "encode_pool.hpp" // Helpers encoding metatile slices
+#include "tile.hpp"       // EncodedTile / TilePtr
+#include "tile_route.hpp" // kMaxZoom
+#include "geo_store.hpp"  // Imported, indexed OSM data
+#include "render_data.hpp" // Data shared between styles
+#include "tile_encoder.hpp" // Image -> tile bytes
+#include "vector_tile.hpp"  // Mapbox Vector Tile output
+
+// Tunables for TileRenderer
+struct RenderOptions {
+    unsigned int tile_size = 256;  // Pixels across a standard tile; any size covers the same extent
+    int max_scale = 3;             // Largest @{n}x pixel density served
+    std::size_t map_pool_size = 1; // Should match the number of threads calling render_*()
+    int metatile_size = 1;         // Render NxN tiles per pass (1 = one tile at a time)
+    int buffer_size = 128;         // Extra pixels rendered around a metatile so labels are not clipped
+    unsigned int encode_threads = 1; // Threads encoding the slices of a metatile, the render thread included
+    std::shared_ptr<EncodePool> encode_pool; // Helpers shared between renderers (null = start encode_threads - 1 own ones)
+    std::string image_format = "png"; // Mapnik format string, see TileEncoder
+    std::string palette_file;         // Fixed png8 palette (empty = quantize each tile)
+    VectorTileOptions vector;         // Extent, buffer and compression of vector tiles
+};
 
 class TileRenderer {
 public:
-    // Constructor: Loads the style XML and registers datasources
-    TileRenderer(const std::string& style_path, const std::string& pbf_file_path, unsigned int tile_size = 256);
+    struct Stats {
+        std::uint64_t solid_tiles = 0;   // Tiles answered with a shared solid-colour tile
+        std::uint64_t skipped_renders = 0; // Renders skipped because there was no data in range
+        std::uint64_t reused_queries = 0;  // Geostore queries answered from another scale, layer or style
+    };
+
+    // Constructor: Loads the style XML and registers datasources.
+    // pbf_file_path may be a raw .pbf (read through Mapnik's osm plugin) or a
+    // .geostore produced by osm_import.
+    TileRenderer(const std::string& style_path, const std::string& pbf_file_path, const RenderOptions& options = {});
+
+    // Same, drawing from data already opened for other styles
+    TileRenderer(const std::string& style_path, std::shared_ptr<RenderData> data, const RenderOptions& options = {});
+
+    // Renders a single tile Z/X/Y into a shared, immutable encoded buffer.
+    // `scale` multiplies the pixels across (@2x, @3x) and draws lines, text
+    // and symbols that much larger, so the tile looks like the standard one
+    // at a higher density. 1 <= scale <= max_scale().
+    TilePtr render_tile(int z, int x, int y, int scale = 1);
 
-    // Renders a single tile Z/X/Y into a PNG image buffer
-    std::vector<unsigned char> render_tile(int z, int x, int y);
+    // Renders the whole metatile containing Z/X/Y in one pass (one datasource
+    // query, one label placement) and slices it into individually encoded tiles
+    TileBatch render_metatile(int z, int x, int y, int scale = 1);
+
+    // Vector tile counterparts: the same layers as Mapbox Vector Tiles, keyed
+    // with TileFormat::Vector. A metatile queries each layer once for the block.
+    TilePtr render_vector_tile(int z, int x, int y);
+    TileBatch render_vector_metatile(int z, int x, int y);
+
+    // The loaded style, used as the template for pooled maps
+    const mapnik::Map& prototype() const { return map_prototype_; }
+    MapPool& map_pool() { return *map_pool_; }
+    unsigned int tile_size() const { return tile_size_; }
+    int max_scale() const { return options_.max_scale; }
+    int metatile_size() const { return options_.metatile_size; }
+    const TileEncoder& encoder() const { return encoder_; }
+    const VectorTileOptions& vector_options() const { return options_.vector; }
+    Stats stats() const;
+    // When the data was produced: the import time of a geostore, else the
+    // PBF's modification time (Unix seconds, 0 if unknown)
+    std::int64_t data_modified() const { return data_->modified(); }
+    // The imported data being rendered, or null when rendering straight from a PBF
+    std::shared_ptr<const GeoStore> geo_store() const { return data_->geo_store(); }
+    const std::shared_ptr<RenderData>& data() const { return data_; }
+    // Identifies what tiles of zoom z are drawn from: the layers and rules
+    // active at that scale, and the data. Renderers that agree on it for a
+    // zoom draw the same tiles there, so a reload only redraws zooms whose
+    // fingerprint changed. Never 0.
+    std::uint32_t style_fingerprint(int z) const { return style_fingerprints_[z]; }
 
 private:
+    // Shared pre-encoded tile of one colour and size, or null past the singleton limit
+    TilePtr solid_tile(std::uint32_t color, unsigned int pixels);
+    // Mapnik scale factor drawing `scale` tiles of tile_size_ pixels like TILE_SIZE ones
+    double scale_factor(int scale) const { return scale * static_cast<double>(tile_size_) / TILE_SIZE; }
+    // False only when nothing at all can be drawn in the extent (grown by
+    // `buffer` metres): imported data with no features there
+    bool has_features(const mapnik::box2d<double>& extent, double buffer, int z) const;
+    // Puts the features of the extent (grown by `buffer` metres) in the
+    // geostore query cache, where smaller queries inside it find them
+    void query_extent(const mapnik::box2d<double>& extent, double buffer, int z);
+    TileBatch build_vector(int z, int x, int y, int span);
+    template<typename Image>
+    TilePtr encode_or_share(const Image& image);
+
+    RenderOptions options_;
     unsigned int tile_size_;
+    TileEncoder encoder_;
+    std::shared_ptr<EncodePool> encode_pool_; // Shared by every render thread, and usually other renderers
     mapnik::Map map_prototype_; // A configured map instance used as a template
-    std::string pbf_path_;      // Store PBF path to potentially update datasource params
+    std::shared_ptr<RenderData> data_; // Possibly shared with other styles
+    const GeoStore* geo_store_;        // data_'s, when it is an imported .geostore
+    std::vector<std::uint32_t> style_fingerprints_; // Per zoom, 0..kMaxZoom
     std::mutex map_mutex_;     // Mutex to protect access to map object if needed (rendering itself might be complex)
+    std::unique_ptr<MapPool> map_pool_; // Ready-to-render copies of map_prototype_
+    std::unique_ptr<VectorTileBuilder> vector_builder_; // Reads map_prototype_'s layers
+    TilePtr empty_vector_tile_; // Shared by every vector tile without features
+
+    // Uniform tiles
+    std::mutex solid_mutex_;
+    std::unordered_map<std::uint64_t, TilePtr> solid_tiles_; // By size << 32 | colour
+    bool skip_empty_ = false;     // Empty extents can be answered with the background tile
+    std::uint32_t empty_color_ = 0; // What an empty extent renders to (the map background)
+    int query_buffer_px_ = 0;     // Largest buffer any layer queries with
+    std::atomic<std::uint64_t> solid_count_{0};
+    std::atomic<std::uint64_t> skipped_count_{0};
 
     // Mapnik projections
     mapnik::projection proj_web_mercator_; // EPSG:3857
@@ -0,0 +1,136 @@
+#include "tile_route.hpp"
+
+namespace {
+
+// Non-empty run of digits; false on anything else. Numbers too long to be a
+// tile coordinate set `too_long` instead of overflowing.
+bool parse_number(std::string_view text, int& value, bool& too_long) {
+    if (text.empty()) {
+        return false;
+    }
+    value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        value = value * 10 + (c - '0');
+        if (value > (1 << kMaxZoom)) {
+            too_long = true;
+            value = 1 << kMaxZoom; // Keeps scanning for non-digits without overflowing
+        }
+    }
+    return true;
+}
+
+bool known_extension(std::string_view ext) {
+    return ext == "png" || ext == "webp" || ext == "jpg" || ext == "mvt" || ext == "pbf";
+}
+
+} // namespace
+
+RouteStatus parse_tile_route(std::string_view target, TileRoute& route) {
+    route = TileRoute();
+
+    const std::size_t question = target.find('?');
+    if (question != std::string_view::npos) {
+        route.query = target.substr(question + 1);
+        target = target.substr(0, question);
+    }
+    if (target.empty() || target[0] != '/') {
+        return RouteStatus::NotTile;
+    }
+
+    // Three or four segments; the last is {y}[@{n}x].{ext}. Empty segments
+    // ("//", a trailing slash) fail the checks below.
+    std::string_view rest = target.substr(1);
+    std::string_view segments[4];
+    std::size_t count = 0;
+    for (;;) {
+        if (count == 4) {
+            return RouteStatus::NotTile;
+        }
+        const std::size_t slash = rest.find('/');
+        segments[count++] = rest.substr(0, slash);
+        if (slash == std::string_view::npos) {
+            break;
+        }
+        rest = rest.substr(slash + 1);
+    }
+    if (count < 3) {
+        return RouteStatus::NotTile;
+    }
+    std::size_t first = 0;
+    if (count == 4) {
+        if (!valid_style_name(segments[0])) {
+            return RouteStatus::NotTile;
+        }
+        route.style = segments[0];
+        first = 1;
+    }
+
+    std::string_view last = segments[first + 2];
+    const std::size_t dot = last.rfind('.');
+    if (dot == std::string_view::npos || !known_extension(last.substr(dot + 1))) {
+        return RouteStatus::NotTile;
+    }
+    route.extension = last.substr(dot + 1);
+    std::string_view y_text = last.substr(0, dot);
+
+    const std::size_t at = y_text.find('@');
+    if (at != std::string_view::npos) {
+        std::string_view scale = y_text.substr(at + 1);
+        if (scale.size() != 2 || scale[0] < '1' || scale[0] > '9' || scale[1] != 'x') {
+            return RouteStatus::NotTile;
+        }
+        route.scale = scale[0] - '0';
+        y_text = y_text.substr(0, at);
+    }
+
+    bool too_long = false;
+    if (!parse_number(segments[first], route.z, too_long) ||
+        !parse_number(segments[first + 1], route.x, too_long) ||
+        !parse_number(y_text, route.y, too_long)) {
+        return RouteStatus::NotTile;
+    }
+    if (route.z > kMaxZoom) {
+        return RouteStatus::BadZoom;
+    }
+    const int max_coord = 1 << route.z;
+    if (too_long || route.x >= max_coord || route.y >= max_coord) {
+        return RouteStatus::BadCoordinates;
+    }
+    return RouteStatus::Ok;
+}
+
+std::string_view find_query_param(std::string_view query, std::string_view name, bool* found) {
+    if (found) {
+        *found = false;
+    }
+    while (!query.empty()) {
+        const std::size_t amp = query.find('&');
+        std::string_view pair = query.substr(0, amp);
+        query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+
+        const std::size_t eq = pair.find('=');
+        if (pair.substr(0, eq) == name) {
+            if (found) {
+                *found = true;
+            }
+            return eq == std::string_view::npos ? std::string_view() : pair.substr(eq + 1);
+        }
+    }
+    return {};
+}
+
+bool valid_style_name(std::string_view name) {
+    if (name.empty()) {
+        return false;
+    }
+    for (char c : name) {
+        const bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef TILE_ROUTE_HPP
+#define TILE_ROUTE_HPP
+
+#include <string_view>
+
+// Request target parsing for tile URLs, without regexes or allocations.
+//
+// Accepted paths:
+//   /{z}/{x}/{y}.{ext}
+//   /{z}/{x}/{y}@{n}x.{ext}
+//   /{style}/{z}/{x}/{y}.{ext}          (and with @{n}x)
+// optionally followed by ?query. The result points into the target string,
+// so it is only valid as long as that is.
+
+constexpr int kMaxZoom = 20; // TileKey packing limit
+
+struct TileRoute {
+    std::string_view style;     // Empty when the path has no style segment
+    int z = 0;
+    int x = 0;
+    int y = 0;
+    int scale = 1;              // n of a @{n}x suffix
+    std::string_view extension; // png, webp, jpg, mvt or pbf
+    std::string_view query;     // Text after '?', empty if none
+};
+
+enum class RouteStatus {
+    Ok,
+    NotTile,        // Not a tile path at all (404)
+    BadZoom,        // Zoom out of range (400)
+    BadCoordinates, // x or y outside the zoom's grid, or absurdly long (400)
+};
+
+RouteStatus parse_tile_route(std::string_view target, TileRoute& route);
+
+// Style names that can appear as the {style} segment: letters, digits, _ and -
+bool valid_style_name(std::string_view name);
+
+// Raw (still percent-encoded) value of a query parameter; empty if absent.
+// Sets `found` when the parameter is present, even without a value.
+std::string_view find_query_param(std::string_view query, std::string_view name, bool* found = nullptr);
+
+#endif // TILE_ROUTE_HPP
@@ -0,0 +1,557 @@
+#include "tile_service.hpp"
+#include "osc_reader.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+
+const std::string TileService::kClientGone = "Dropped before rendering: client gone";
+const std::string TileService::kDeadlinePassed = "Dropped before rendering: deadline passed";
+
+namespace {
+
+std::int64_t unix_now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+TileService::TileService(std::vector<Tileset> tilesets,
+                         std::shared_ptr<RenderPool> render_pool,
+                         std::shared_ptr<TileCache> cache,
+                         std::shared_ptr<TileStore> store,
+                         std::vector<int> max_stale)
+    : encoder_(tilesets.at(0).renderer->encoder()),
+      vector_options_(tilesets[0].renderer->vector_options()),
+      metatile_size_(tilesets[0].renderer->metatile_size()),
+      max_scale_(tilesets[0].renderer->max_scale()),
+      max_stale_(std::move(max_stale)),
+      render_pool_(std::move(render_pool)),
+      cache_(std::move(cache)),
+      store_(std::move(store)) {
+    for (Tileset& tileset : tilesets) {
+        if (tileset.renderer->encoder().fingerprint() != encoder_.fingerprint() ||
+            tileset.renderer->metatile_size() != metatile_size_) {
+            throw std::runtime_error("Style '" + tileset.name + "' encodes tiles differently from the default style");
+        }
+        auto state = std::make_unique<TilesetState>();
+        state->name = std::move(tileset.name);
+        // Stored tiles of another style are from before this start
+        const std::int64_t now = unix_now();
+        for (int z = 0; z <= kMaxZoom; ++z) {
+            state->styles[z].store(tileset.renderer->style_fingerprint(z), std::memory_order_relaxed);
+            state->style_since[z].store(now, std::memory_order_relaxed);
+        }
+        state->renderer = std::move(tileset.renderer);
+        tilesets_.push_back(std::move(state));
+    }
+    data_modified_.store(tilesets_[0]->renderer->data_modified(), std::memory_order_relaxed);
+}
+
+int TileService::find_tileset(std::string_view name) const {
+    for (std::size_t i = 0; i < tilesets_.size(); ++i) {
+        if (tilesets_[i]->name == name) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+TilePtr TileService::cached(const TileKey& key, bool* stale) {
+    std::uint32_t style = 0;
+    std::int64_t stale_since = 0;
+    TilePtr tile = cache_->get(key, &style, &stale_since);
+    if (!tile) {
+        Metrics::cache_lookup(Metrics::Tier::Memory, key.z, false);
+        return nullptr;
+    }
+
+    // When the tile went out of date, if it has. Drawn before a reload
+    // changed this zoom (or loaded as an out of date bundle, which knows
+    // when it went stale), and/or expired by a change file since.
+    const TilesetState& state = *tilesets_[key.tileset];
+    std::int64_t since = 0;
+    if (style != state.styles[key.z].load(std::memory_order_relaxed)) {
+        stale_hits_.fetch_add(1, std::memory_order_relaxed);
+        since = stale_since > 0 ? stale_since : state.style_since[key.z].load(std::memory_order_relaxed);
+    }
+    const TileKey job_key = job_key_for(key);
+    if (dirty_count_.load(std::memory_order_relaxed) > 0) {
+        const std::int64_t dirty = dirty_since(job_key);
+        if (dirty > 0 && (since == 0 || dirty < since)) {
+            since = dirty;
+        }
+    }
+    if (since == 0) {
+        Metrics::cache_lookup(Metrics::Tier::Memory, key.z, true);
+        return tile;
+    }
+
+    if (too_stale(key.z, since)) {
+        // Out of date for longer than this zoom allows: the caller renders
+        // it and waits for the new tile
+        too_stale_.fetch_add(1, std::memory_order_relaxed);
+        Metrics::cache_lookup(Metrics::Tier::Memory, key.z, false);
+        return nullptr;
+    }
+    // Still the best we have: serve it and redraw it in the background
+    stale_served_.fetch_add(1, std::memory_order_relaxed);
+    refresh(job_key);
+    Metrics::cache_lookup(Metrics::Tier::Memory, key.z, true);
+    if (stale) {
+        *stale = true;
+    }
+    return tile;
+}
+
+std::int64_t TileService::dirty_since(const TileKey& job_key) const {
+    std::lock_guard<std::mutex> lock(dirty_mutex_);
+    auto it = dirty_.find(job_key);
+    return it != dirty_.end() ? it->second : 0;
+}
+
+void TileService::mark_dirty(const TileKey& job_key, std::int64_t since) {
+    // An earlier mark stands: the tiles have been out of date since then
+    std::lock_guard<std::mutex> lock(dirty_mutex_);
+    auto inserted = dirty_.emplace(job_key, since);
+    if (!inserted.second && since < inserted.first->second) {
+        inserted.first->second = since; // A failed render putting its mark back
+    }
+    dirty_count_.store(dirty_.size(), std::memory_order_relaxed);
+}
+
+bool TileService::too_stale(int z, std::int64_t since) const {
+    const int limit = static_cast<std::size_t>(z) < max_stale_.size() ? max_stale_[z] : -1;
+    return limit >= 0 && unix_now() - since > limit;
+}
+
+void TileService::retag(TileBatch& batch, std::uint8_t tileset) {
+    // Renderers only know their own style; the tileset is ours to add
+    for (auto& rendered : batch) {
+        rendered.first.tileset = tileset;
+    }
+}
+
+TileKey TileService::job_key_for(const TileKey& key) const {
+    // Every tile of a metatile is produced by the same render
+    return metatile_size_ > 1 ? metatile_origin(key, metatile_size_) : key;
+}
+
+void TileService::cache_remote(const TileKey& key, TilePtr tile) {
+    // Peers are run with the same styles, so the tile is as good as our own
+    const std::uint32_t style = tilesets_[key.tileset]->styles[key.z].load(std::memory_order_relaxed);
+    cache_->put(key, std::move(tile), style);
+}
+
+bool TileService::submit(const TileKey& job_key, RenderPriority priority) {
+    const Metrics::Clock::time_point queued = Metrics::Clock::now();
+    return render_pool_->submit([this, job_key, queued] {
+        Metrics::observe(Metrics::Stage::QueueWait, job_key.z, Metrics::Clock::now() - queued);
+        if (start_render(job_key)) {
+            run_render(job_key);
+        }
+    }, priority, job_key.tileset, job_key.z);
+}
+
+bool TileService::render(const TileKey& key, RenderCallback done, RenderClient client) {
+    const TileKey job_key = job_key_for(key);
+    bool promote = false;
+    {
+        std::lock_guard<std::mutex> lock(in_flight_mutex_);
+
+        auto it = in_flight_.find(job_key);
+        if (it != in_flight_.end()) {
+            // Someone is already rendering this; wait for their result
+            it->second.waiters.push_back({key, std::move(done), std::move(client)});
+            coalesced_.fetch_add(1, std::memory_order_relaxed);
+            if (it->second.started || it->second.priority == RenderPriority::Interactive) {
+                return true;
+            }
+            // A redraw still queued behind other work would keep this client
+            // waiting with it. Queue the job again up front; whichever copy
+            // gets a thread first draws it, and if that queue is full it is
+            // still drawn in its turn.
+            it->second.priority = RenderPriority::Interactive;
+            promote = true;
+        } else {
+            // The render we would have joined may have finished between the
+            // caller's cache miss and now. Results are cached before the in-flight
+            // entry is removed, so checking here under the lock closes that gap.
+            // Out of date tiles do not count: the caller already passed on them.
+            std::uint32_t style = 0;
+            TilePtr tile = cache_->peek(key, &style);
+            if (tile && style == tilesets_[key.tileset]->styles[key.z].load(std::memory_order_relaxed) &&
+                (dirty_count_.load(std::memory_order_relaxed) == 0 || dirty_since(job_key) == 0)) {
+                done(std::move(tile), {}, false);
+                return true;
+            }
+
+            in_flight_[job_key].waiters.push_back({key, std::move(done), std::move(client)});
+        }
+    }
+
+    if (promote) {
+        submit(job_key, RenderPriority::Interactive);
+        return true;
+    }
+    if (!submit(job_key, RenderPriority::Interactive)) {
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> lock(in_flight_mutex_);
+            auto it = in_flight_.find(job_key);
+            waiters = std::move(it->second.waiters);
+            in_flight_.erase(it);
+        }
+        // The first waiter is our own caller, which learns about it from the
+        // return value. Anyone who attached in the meantime was told the render
+        // was queued, so they are failed here instead.
+        for (std::size_t i = 1; i < waiters.size(); ++i) {
+            waiters[i].done(nullptr, "Render queue full", false);
+        }
+        return false;
+    }
+    return true;
+}
+
+void TileService::refresh(const TileKey& job_key) {
+    {
+        std::lock_guard<std::mutex> lock(in_flight_mutex_);
+        if (in_flight_.count(job_key)) {
+            return; // Already being rendered
+        }
+        in_flight_[job_key].priority = RenderPriority::Refresh; // No waiters: the old tiles were already served
+    }
+    if (!submit(job_key, RenderPriority::Refresh)) {
+        // Busy; it stays dirty and the next hit tries again. A request may
+        // have joined and queued the job again up front in the meantime, in
+        // which case that copy owns the entry and its waiters.
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> lock(in_flight_mutex_);
+            auto it = in_flight_.find(job_key);
+            if (it == in_flight_.end() || it->second.started ||
+                it->second.priority != RenderPriority::Refresh) {
+                return;
+            }
+            waiters = std::move(it->second.waiters);
+            in_flight_.erase(it);
+        }
+        notify(waiters, {}, "Render queue full");
+        return;
+    }
+    refreshes_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool TileService::start_render(const TileKey& job_key) {
+    // Claims the job, and lets go of the waiters nobody is listening to any more
+    std::vector<Waiter> dropped;
+    bool skip;
+    {
+        std::lock_guard<std::mutex> lock(in_flight_mutex_);
+        auto it = in_flight_.find(job_key);
+        if (it == in_flight_.end() || it->second.started) {
+            return false; // The other copy of a job queued twice got to it first
+        }
+        InFlight& job = it->second;
+        const Metrics::Clock::time_point now = Metrics::Clock::now();
+        const bool had_waiters = !job.waiters.empty();
+        auto listening = std::stable_partition(job.waiters.begin(), job.waiters.end(), [now](const Waiter& waiter) {
+            return !waiter.client.is_gone() && waiter.client.deadline > now;
+        });
+        std::move(listening, job.waiters.end(), std::back_inserter(dropped));
+        job.waiters.erase(listening, job.waiters.end());
+
+        // Refreshes have nobody waiting to begin with and are drawn anyway.
+        // A skipped one stays dirty or stale, so the next hit queues it again.
+        skip = had_waiters && job.waiters.empty();
+        if (skip) {
+            in_flight_.erase(it);
+        } else {
+            job.started = true;
+        }
+    }
+    for (Waiter& waiter : dropped) {
+        if (waiter.client.is_gone()) {
+            abandoned_.fetch_add(1, std::memory_order_relaxed);
+            waiter.done(nullptr, kClientGone, false);
+        } else {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            waiter.done(nullptr, kDeadlinePassed, false);
+        }
+    }
+    if (skip) {
+        skipped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return !skip;
+}
+
+void TileService::run_render(const TileKey& job_key) {
+    renders_.fetch_add(1, std::memory_order_relaxed);
+
+    // The job finishes on the renderer it started with, even if a reload
+    // swaps in another one meanwhile; its tiles are tagged accordingly
+    const std::shared_ptr<TileRenderer> renderer = this->renderer(job_key.tileset);
+    const std::uint32_t style = renderer->style_fingerprint(job_key.z);
+
+    // A dirty metatile skips the disk store, whose copy is out of date too.
+    // The mark comes off now so that a change expiring it again mid-render
+    // leaves a new one; a failed render puts it back.
+    std::int64_t dirty = 0;
+    {
+        std::lock_guard<std::mutex> lock(dirty_mutex_);
+        auto it = dirty_.find(job_key);
+        if (it != dirty_.end()) {
+            dirty = it->second;
+            dirty_.erase(it);
+            dirty_count_.store(dirty_.size(), std::memory_order_relaxed);
+        }
+    }
+    const bool refreshing = dirty > 0;
+
+    TileBatch batch;
+    std::string error;
+    try {
+        // Disk reads run here rather than on the I/O threads; a hit brings the
+        // whole bundle into memory, backed by one shared mapping
+        const bool vector = job_key.format == TileFormat::Vector;
+        bool stale = false;
+        std::int64_t stale_since = 0;
+        if (store_ && !refreshing && !vector) {
+            batch = store_->load(job_key, style, &stale, &stale_since);
+            Metrics::cache_lookup(Metrics::Tier::Store, job_key.z, !batch.empty());
+        }
+
+        if (stale && !batch.empty()) {
+            // The bundle was expired by a change file, outlived the store's
+            // max_age or was drawn with an older style
+            const std::int64_t since = stale_since > 0
+                ? stale_since : tilesets_[job_key.tileset]->style_since[job_key.z].load(std::memory_order_relaxed);
+            if (too_stale(job_key.z, since)) {
+                // Out of date for longer than this zoom allows: render it now
+                // and let the waiters have the new tiles
+                too_stale_.fetch_add(1, std::memory_order_relaxed);
+                batch.clear();
+            } else {
+                // Answer with it now and leave its replacement to a refresh,
+                // behind the renders clients are waiting for. Requests arriving
+                // meanwhile hit the cache; untagged, the tiles stay stale there
+                // should the refresh fail.
+                for (const auto& loaded : batch) {
+                    cache_->put(loaded.first, loaded.second, 0, since);
+                }
+                mark_dirty(job_key, since); // So the refresh skips the store
+                std::vector<Waiter> waiters = take_waiters(job_key, true);
+                stale_served_.fetch_add(waiters.size(), std::memory_order_relaxed);
+                notify(waiters, batch, {}, true);
+                refresh(job_key);
+                return;
+            }
+        }
+
+        if (batch.empty() && vector) {
+            if (renderer->metatile_size() > 1) {
+                batch = renderer->render_vector_metatile(job_key.z, job_key.x, job_key.y);
+            } else {
+                batch.emplace_back(job_key, renderer->render_vector_tile(job_key.z, job_key.x, job_key.y));
+            }
+            retag(batch, job_key.tileset);
+        } else if (batch.empty()) {
+            if (renderer->metatile_size() > 1) {
+                // Render the whole block; the neighbours land in the cache for
+                // the requests that are almost certainly about to follow
+                batch = renderer->render_metatile(job_key.z, job_key.x, job_key.y, job_key.scale);
+            } else {
+                batch.emplace_back(job_key, renderer->render_tile(job_key.z, job_key.x, job_key.y, job_key.scale));
+            }
+            retag(batch, job_key.tileset);
+            if (store_) {
+                store_->save(batch, style);
+            }
+        }
+
+        for (const auto& rendered : batch) {
+            cache_->put(rendered.first, rendered.second, style);
+        }
+    } catch (const std::exception& e) {
+        error = e.what();
+        if (refreshing) {
+            // The cached tiles are as old as before; keep serving them as such
+            mark_dirty(job_key, dirty);
+        }
+    }
+
+    std::vector<Waiter> waiters = take_waiters(job_key, true);
+    notify(waiters, batch, error);
+}
+
+std::vector<TileService::Waiter> TileService::take_waiters(const TileKey& job_key, bool finished) {
+    // Detach the waiters before calling them so no callback runs under the lock
+    std::vector<Waiter> waiters;
+    std::lock_guard<std::mutex> lock(in_flight_mutex_);
+    auto it = in_flight_.find(job_key);
+    if (it == in_flight_.end()) {
+        return waiters; // Already finished by another copy of the job
+    }
+    waiters = std::move(it->second.waiters);
+    it->second.waiters.clear();
+    if (finished) {
+        in_flight_.erase(it);
+    }
+    return waiters;
+}
+
+void TileService::notify(std::vector<Waiter>& waiters, const TileBatch& batch, const std::string& error, bool stale) {
+    for (auto& waiter : waiters) {
+        TilePtr tile;
+        for (const auto& rendered : batch) {
+            if (rendered.first == waiter.key) {
+                tile = rendered.second;
+                break;
+            }
+        }
+        if (!tile && error.empty()) {
+            waiter.done(nullptr, "Rendered metatile did not contain the requested tile", false);
+        } else {
+            waiter.done(std::move(tile), error, stale);
+        }
+    }
+}
+
+TileService::ExpireResult TileService::expire(const std::vector<TileKey>& metatiles) {
+    ExpireResult result;
+    result.metatiles = metatiles.size();
+    const std::int64_t now = unix_now();
+    for (const TileKey& key : metatiles) {
+        const TileKey job_key = job_key_for(key);
+
+        // Only metatiles that are actually in memory need remembering; the
+        // rest are re-rendered when the store hands out its dirty bundle.
+        // Raster tiles at every scale and vector tiles of the area are all
+        // out of date.
+        const int span = metatile_size_ > 1 ? metatile_span(job_key.z, metatile_size_) : 1;
+        bool in_cache = false;
+        bool in_store = false;
+        std::vector<TileKey> variants;
+        for (std::size_t tileset = 0; tileset < tilesets_.size(); ++tileset) {
+            const auto t = static_cast<std::uint8_t>(tileset);
+            variants.push_back(TileKey{job_key.z, job_key.x, job_key.y, TileFormat::Vector, 1, t});
+            for (int scale = 1; scale <= max_scale_; ++scale) {
+                variants.push_back(TileKey{job_key.z, job_key.x, job_key.y, TileFormat::Raster, static_cast<std::uint8_t>(scale), t});
+            }
+        }
+        for (const TileKey& origin : variants) {
+            bool variant_cached = false;
+            for (int i = 0; i < span * span && !variant_cached; ++i) {
+                variant_cached = cache_->peek(TileKey{origin.z, origin.x + i % span, origin.y + i / span,
+                                                      origin.format, origin.scale, origin.tileset}) != nullptr;
+            }
+            if (variant_cached) {
+                mark_dirty(origin, now);
+                in_cache = true;
+            }
+            // Vector tiles are never stored
+            if (store_ && origin.format == TileFormat::Raster && store_->expire(origin)) {
+                in_store = true;
+            }
+        }
+        if (in_cache) {
+            ++result.cached;
+        }
+        if (in_store) {
+            ++result.stored;
+        }
+    }
+    return result;
+}
+
+TileService::ExpireResult TileService::expire_osc(const std::string& path, int min_zoom, int max_zoom) {
+    const OscChanges changes = read_osc(path);
+
+    ExpireOptions options;
+    options.min_zoom = min_zoom;
+    options.max_zoom = max_zoom;
+    options.metatile_size = metatile_size_;
+    ExpireResult result = expire(expire_osc_tiles(changes, renderer()->geo_store().get(), options));
+    result.nodes = changes.nodes.size();
+    result.ways = changes.ways.size();
+    result.relations = changes.relations.size();
+
+    std::clog << "INFO: Expired " << path << ": " << result.nodes << " node(s), " << result.ways << " way(s), "
+              << result.relations << " relation(s) -> "
+              << result.metatiles << " metatile(s), " << result.cached << " cached, " << result.stored << " stored"
+              << std::endl;
+    return result;
+}
+
+int TileService::reload(std::vector<std::shared_ptr<TileRenderer>> renderers) {
+    if (renderers.size() != tilesets_.size()) {
+        throw std::runtime_error("Reload needs one renderer per style");
+    }
+    // Everything keyed or stored by encoder and metatile layout stays put
+    int changed = 0;
+    for (std::size_t t = 0; t < renderers.size(); ++t) {
+        const TileRenderer& renderer = *renderers[t];
+        if (renderer.encoder().fingerprint() != encoder_.fingerprint() || renderer.metatile_size() != metatile_size_ ||
+            renderer.vector_options().gzip != vector_options_.gzip) {
+            throw std::runtime_error("The new renderer encodes tiles differently; that needs a restart");
+        }
+        for (int z = 0; z <= kMaxZoom; ++z) {
+            if (renderer.style_fingerprint(z) != tilesets_[t]->styles[z].load(std::memory_order_relaxed)) {
+                ++changed;
+            }
+        }
+    }
+
+    // New renders pick up the new renderers from here on. A tile rendered
+    // by an old one in between is tagged with the old style and simply
+    // redrawn on its next hit.
+    data_modified_.store(renderers[0]->data_modified(), std::memory_order_relaxed);
+    const std::int64_t now = unix_now();
+    for (std::size_t t = 0; t < renderers.size(); ++t) {
+        TilesetState& state = *tilesets_[t];
+        for (int z = 0; z <= kMaxZoom; ++z) {
+            const std::uint32_t style = renderers[t]->style_fingerprint(z);
+            if (style != state.styles[z].load(std::memory_order_relaxed)) {
+                state.style_since[z].store(now, std::memory_order_relaxed);
+            }
+            state.styles[z].store(style, std::memory_order_relaxed);
+        }
+        std::atomic_store(&state.renderer, std::move(renderers[t]));
+    }
+    reloads_.fetch_add(1, std::memory_order_relaxed);
+    return changed;
+}
+
+TileRenderer::Stats TileService::render_stats() const {
+    TileRenderer::Stats total;
+    for (std::size_t t = 0; t < tilesets_.size(); ++t) {
+        const TileRenderer::Stats s = renderer(t)->stats();
+        total.solid_tiles += s.solid_tiles;
+        total.skipped_renders += s.skipped_renders;
+        // Styles over the same data share one query cache, and all report it
+        total.reused_queries = std::max(total.reused_queries, s.reused_queries);
+    }
+    return total;
+}
+
+TileService::Stats TileService::stats() const {
+    Stats s;
+    s.renders = renders_.load(std::memory_order_relaxed);
+    s.coalesced = coalesced_.load(std::memory_order_relaxed);
+    s.refreshes = refreshes_.load(std::memory_order_relaxed);
+    s.dirty = dirty_count_.load(std::memory_order_relaxed);
+    s.stale_hits = stale_hits_.load(std::memory_order_relaxed);
+    s.stale_served = stale_served_.load(std::memory_order_relaxed);
+    s.too_stale = too_stale_.load(std::memory_order_relaxed);
+    s.reloads = reloads_.load(std::memory_order_relaxed);
+    s.dropped = dropped_.load(std::memory_order_relaxed);
+    s.abandoned = abandoned_.load(std::memory_order_relaxed);
+    s.skipped = skipped_.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(in_flight_mutex_);
+    s.in_flight = in_flight_.size();
+    return s;
+}
@@ -0,0 +1,236 @@
+#ifndef TILE_SERVICE_HPP
+#define TILE_SERVICE_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "metrics.hpp"
+#include "render_pool.hpp"
+#include "tile.hpp"
+#include "tile_cache.hpp"
+#include "tile_expiry.hpp"
+#include "tile_renderer.hpp"
+#include "tile_store.hpp"
+
+// Who is waiting on a render, so it can be dropped once nobody is
+struct RenderClient {
+    std::shared_ptr<const std::atomic<bool>> gone; // Set when the connection or stream closes; may be null
+    Metrics::Clock::time_point deadline = Metrics::Clock::time_point::max(); // Not worth a render after this
+
+    bool is_gone() const { return gone && gone->load(std::memory_order_relaxed); }
+};
+
+// Ties the tile pipeline together: memory cache in front, then the optional
+// disk store, then renders on the render pool. Sessions talk to this instead
+// of the renderer.
+//
+// Several styles can be served side by side, as tilesets: TileKey::tileset
+// picks the renderer. They share the cache (with per-tileset quotas), the
+// store, the render threads (taking turns, one pool flow per tileset) and,
+// through RenderData, the data.
+//
+// Renders are queued by priority: tiles a client is waiting for first,
+// redraws of tiles that are being served anyway after them, background
+// work last. A queued render whose clients all went away (or waited past
+// their deadline) is not drawn at all.
+//
+// The renderers can be replaced while serving (see reload()). Each render
+// takes a reference to the current one and finishes on it; cached and
+// stored tiles are tagged with the style fingerprint they were drawn with,
+// and ones from before a reload are served while they are redrawn.
+//
+// Out of date tiles (expired by a change file, older than the store's
+// max_age, or drawn before a reload) are answered with right away while a
+// refresh redraws them in the background, for as long as the zoom's
+// maximum staleness allows. Past it, requests wait for the new tile.
+class TileService {
+public:
+    // Invoked on a render thread (or inline if the tile turned up in the cache
+    // meanwhile). On failure tile is null and error is set. `stale` says the
+    // tile is an out of date one from the disk store, being redrawn.
+    using RenderCallback = std::function<void(TilePtr tile, const std::string& error, bool stale)>;
+
+    // The errors a waiter is failed with when it is dropped before its render
+    // starts: its client went away, or its deadline passed
+    static const std::string kClientGone;
+    static const std::string kDeadlinePassed;
+
+    struct Stats {
+        std::uint64_t renders = 0;   // Render jobs started (including disk store loads)
+        std::uint64_t coalesced = 0; // Requests that attached to a render already in flight
+        std::size_t in_flight = 0;   // Renders queued or running right now
+        std::uint64_t refreshes = 0; // Background re-renders of dirty metatiles
+        std::size_t dirty = 0;       // Cached metatiles waiting for a refresh
+        std::uint64_t stale_hits = 0; // Cache hits on tiles drawn before a reload changed their zoom
+        std::uint64_t stale_served = 0; // Out of date tiles answered with while they are redrawn
+        std::uint64_t too_stale = 0;  // ... and ones past their zoom's maximum staleness, redrawn first
+        std::uint64_t reloads = 0;
+        std::uint64_t dropped = 0;   // Waiters failed with kDeadlinePassed
+        std::uint64_t abandoned = 0; // Waiters failed with kClientGone
+        std::uint64_t skipped = 0;   // Renders not drawn because all their waiters were dropped
+    };
+
+    struct ExpireResult {
+        std::size_t nodes = 0;     // Elements in the change file
+        std::size_t ways = 0;
+        std::size_t relations = 0;
+        std::size_t metatiles = 0; // Affected metatiles over the zoom range
+        std::size_t cached = 0;    // ... of which had tiles in the memory cache
+        std::size_t stored = 0;    // ... of which had a bundle in the disk store
+    };
+
+    // One style being served
+    struct Tileset {
+        std::string name; // URL prefix, /{name}/z/x/y; empty for the default style at /z/x/y
+        std::shared_ptr<TileRenderer> renderer;
+    };
+
+    // tilesets[i] serves TileKey::tileset i; the first is the default style.
+    // Every renderer has to encode tiles the same way. `max_stale` is how
+    // many seconds an out of date tile may still be served, per zoom (-1 or
+    // past the end: no limit; 0: never).
+    TileService(std::vector<Tileset> tilesets,
+                std::shared_ptr<RenderPool> render_pool,
+                std::shared_ptr<TileCache> cache,
+                std::shared_ptr<TileStore> store = nullptr,
+                std::vector<int> max_stale = {});
+
+    // Cheap cache lookup, safe to call from I/O threads. nullptr on miss.
+    // A hit on an out of date tile still returns it, with *stale set, and
+    // queues a background re-render that replaces it; unless it has been
+    // out of date too long, which counts as a miss.
+    TilePtr cached(const TileKey& key, bool* stale = nullptr);
+
+    // Queues a render of the tile (of its whole metatile when metatiling is
+    // on), or a load from the disk store if it has the bundle (raster tiles
+    // only; vector tiles are cheap enough to rebuild); results are
+    // stored in the cache before done() runs. Concurrent
+    // requests for the same tile or metatile share a single render.
+    // Returns false if the render queue is full.
+    //
+    // The request is dropped if the render has not started by the time the
+    // client is gone (failing with kClientGone) or past its deadline
+    // (kDeadlinePassed).
+    bool render(const TileKey& key, RenderCallback done, RenderClient client = {});
+
+    // Origin of the metatile the tile is rendered with (the tile itself
+    // without metatiling); identifies the render job
+    TileKey job_key_for(const TileKey& key) const;
+
+    // Caches a tile another node rendered, as one of the current style
+    void cache_remote(const TileKey& key, TilePtr tile);
+
+    // Marks the given metatiles (origins) dirty in the cache and the disk
+    // store. Nothing is thrown away: old tiles keep being served until their
+    // replacement is rendered, on the next request for them.
+    ExpireResult expire(const std::vector<TileKey>& metatiles);
+
+    // Expires everything an OSM change file (.osc or .osc.gz) touches, between
+    // min_zoom and max_zoom. Reads the file and looks up the data, so run it off
+    // the I/O threads. Throws if the file cannot be read.
+    ExpireResult expire_osc(const std::string& path, int min_zoom, int max_zoom);
+
+    // Swaps in renderers built from new style or data files, one per
+    // tileset in order. Renders already running finish on the old ones,
+    // which go away with the last of them. Returns the number of zoom levels
+    // (over all tilesets) whose tiles changed; their cached and stored tiles
+    // are redrawn as they are requested. Throws std::runtime_error if a
+    // renderer encodes tiles differently, which takes a restart.
+    int reload(std::vector<std::shared_ptr<TileRenderer>> renderers);
+
+    Stats stats() const;
+    TileCache& cache() { return *cache_; }
+    TileStore* store() { return store_.get(); } // nullptr when there is no disk tier
+    RenderPool& render_pool() { return *render_pool_; }
+    std::shared_ptr<TileRenderer> renderer(std::size_t tileset = 0) const {
+        return std::atomic_load(&tilesets_[tileset]->renderer);
+    }
+    std::size_t tileset_count() const { return tilesets_.size(); }
+    const std::string& tileset_name(std::size_t tileset) const { return tilesets_[tileset]->name; }
+    // Index of the tileset served under `name` ("" for the default), or -1
+    int find_tileset(std::string_view name) const;
+    // Fixed for the life of the service, so these outlive reloads
+    const TileEncoder& encoder() const { return encoder_; }
+    const VectorTileOptions& vector_options() const { return vector_options_; }
+    int max_scale() const { return max_scale_; } // Largest @{n}x served
+    std::int64_t data_modified() const { return data_modified_.load(std::memory_order_relaxed); }
+    TileRenderer::Stats render_stats() const; // Over all tilesets
+
+private:
+    struct Waiter {
+        TileKey key;
+        RenderCallback done;
+        RenderClient client;
+    };
+
+    // One entry per render job, keyed by metatile origin
+    struct InFlight {
+        std::vector<Waiter> waiters;
+        RenderPriority priority = RenderPriority::Interactive; // Most urgent it was queued at
+        bool started = false;
+    };
+
+    bool submit(const TileKey& job_key, RenderPriority priority);
+    bool start_render(const TileKey& job_key);
+    void run_render(const TileKey& job_key);
+    void refresh(const TileKey& job_key);
+    std::vector<Waiter> take_waiters(const TileKey& job_key, bool finished);
+    static void notify(std::vector<Waiter>& waiters, const TileBatch& batch, const std::string& error, bool stale = false);
+    std::int64_t dirty_since(const TileKey& job_key) const; // 0 if not dirty
+    void mark_dirty(const TileKey& job_key, std::int64_t since);
+    bool too_stale(int z, std::int64_t since) const;
+    static void retag(TileBatch& batch, std::uint8_t tileset);
+
+    struct TilesetState {
+        std::string name;
+        std::shared_ptr<TileRenderer> renderer; // Only through std::atomic_load/atomic_store
+        // Style fingerprint of the current renderer per zoom, so cache hits
+        // can check a tile's tag without touching the renderer pointer
+        std::array<std::atomic<std::uint32_t>, kMaxZoom + 1> styles;
+        // Unix time each zoom's style took over: tiles of an older one are
+        // out of date since then
+        std::array<std::atomic<std::int64_t>, kMaxZoom + 1> style_since;
+    };
+
+    std::vector<std::unique_ptr<TilesetState>> tilesets_; // Fixed after construction
+    const TileEncoder encoder_;
+    const VectorTileOptions vector_options_;
+    const int metatile_size_;
+    const int max_scale_;
+    const std::vector<int> max_stale_; // Per zoom
+    std::shared_ptr<RenderPool> render_pool_;
+    std::shared_ptr<TileCache> cache_;
+    std::shared_ptr<TileStore> store_;
+
+    mutable std::mutex in_flight_mutex_;
+    std::unordered_map<TileKey, InFlight, TileKeyHash> in_flight_;
+
+    // Metatiles expired while they had tiles in the memory cache, with the
+    // Unix time they went out of date
+    mutable std::mutex dirty_mutex_;
+    std::unordered_map<TileKey, std::int64_t, TileKeyHash> dirty_;
+    std::atomic<std::size_t> dirty_count_{0}; // Lets cache hits skip the lock when nothing is dirty
+
+    std::atomic<std::uint64_t> renders_{0};
+    std::atomic<std::uint64_t> coalesced_{0};
+    std::atomic<std::uint64_t> refreshes_{0};
+
+    std::atomic<std::int64_t> data_modified_{0};
+    std::atomic<std::uint64_t> stale_hits_{0};
+    std::atomic<std::uint64_t> stale_served_{0};
+    std::atomic<std::uint64_t> too_stale_{0};
+    std::atomic<std::uint64_t> reloads_{0};
+    std::atomic<std::uint64_t> dropped_{0};
+    std::atomic<std::uint64_t> abandoned_{0};
+    std::atomic<std::uint64_t> skipped_{0};
+};
+
+#endif // TILE_SERVICE_HPP
@@ -0,0 +1,296 @@
+#include "tile_store.hpp"
+#include "mapped_file.hpp"
+
+#include <boost/filesystem.hpp>
+#include <cstddef>  // For offsetof
+#include <cstdio>   // For std::rename
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h> // For getpid
+
+namespace {
+
+// On-disk layout, native byte order (bundles are a local cache, not an exchange format)
+struct BundleHeader {
+    char magic[4];        // "OMTS"
+    std::uint32_t version;
+    std::int32_t z;       // Metatile origin
+    std::int32_t x;
+    std::int32_t y;
+    std::int32_t span;    // Tiles per side in this bundle
+    std::int64_t created; // Unix time the bundle was rendered; -t = dirty since t (see expire()), 0 = dirty since unknown
+    std::uint32_t format; // TileEncoder fingerprint of the tiles inside
+    std::uint32_t style;  // TileRenderer::style_fingerprint() of the zoom; 0 in bundles from before reloads
+};
+static_assert(sizeof(BundleHeader) == 40, "Bundle header layout changed");
+
+struct BundleEntry {
+    std::uint32_t offset; // From the start of the file
+    std::uint32_t size;   // 0 = tile not present
+    std::uint64_t hash;   // content_hash() of the tile, so loading does not read every byte
+};
+static_assert(sizeof(BundleEntry) == 16, "Bundle index layout changed");
+
+constexpr char kMagic[4] = {'O', 'M', 'T', 'S'};
+constexpr std::uint32_t kVersion = 3;
+
+std::int64_t unix_now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+TileStore::TileStore(const std::string& root, int metatile_size, std::chrono::seconds max_age, std::uint32_t format,
+                     std::vector<std::string> tilesets)
+    : root_(root), metatile_size_(metatile_size > 0 ? metatile_size : 1), max_age_(max_age), format_(format) {
+    boost::filesystem::create_directories(root_);
+    tileset_roots_.push_back(root_);
+    for (std::size_t i = 1; i < tilesets.size(); ++i) {
+        tileset_roots_.push_back(root_ + "/styles/" + tilesets[i]);
+    }
+}
+
+std::string TileStore::bundle_path(const TileKey& origin) const {
+    // High-density bundles sit next to the standard ones, named like their URLs
+    std::string scale;
+    if (origin.scale != 1) {
+        scale = "@" + std::to_string(origin.scale) + "x";
+    }
+    const std::string root = origin.tileset < tileset_roots_.size() ? tileset_roots_[origin.tileset]
+                                                                     : root_ + "/styles/" + std::to_string(origin.tileset);
+    return root + "/" + std::to_string(origin.z) + "/" + std::to_string(origin.x) + "/" +
+           std::to_string(origin.y) + scale + ".meta";
+}
+
+TileBatch TileStore::load(const TileKey& key, std::uint32_t style, bool* dirty, std::int64_t* stale_since) {
+    reads_.fetch_add(1, std::memory_order_relaxed);
+
+    const TileKey origin = metatile_origin(key, metatile_size_);
+    const int span = metatile_span(key.z, metatile_size_);
+
+    std::size_t length = 0;
+    std::shared_ptr<const void> mapping = map_file_readonly(bundle_path(origin), length, sizeof(BundleHeader));
+    if (!mapping) {
+        return {};
+    }
+
+    const char* base = static_cast<const char*>(mapping.get());
+    BundleHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion ||
+        header.z != origin.z || header.x != origin.x || header.y != origin.y || header.span != span ||
+        header.format != format_) {
+        // Stale layout, or a different --metatile or --format setting: re-render and overwrite
+        return {};
+    }
+
+    // A style reload, an expiry or old age leave the bundle usable, just out
+    // of date; the caller decides whether it is still good enough to serve
+    std::int64_t since = header.created < 0 ? -header.created : 0;
+    if (header.created > 0 && max_age_.count() > 0 && unix_now() - header.created > max_age_.count()) {
+        expired_.fetch_add(1, std::memory_order_relaxed);
+        since = header.created + max_age_.count();
+    }
+    const bool is_dirty = header.created <= 0 || since > 0 || header.style != style;
+    if (dirty) {
+        *dirty = is_dirty;
+    }
+    if (stale_since) {
+        *stale_since = since;
+    }
+
+    const std::size_t count = static_cast<std::size_t>(span) * static_cast<std::size_t>(span);
+    const std::size_t index_end = sizeof(BundleHeader) + count * sizeof(BundleEntry);
+    if (length < index_end) {
+        return {};
+    }
+
+    std::vector<BundleEntry> entries(count);
+    std::memcpy(entries.data(), base + sizeof(BundleHeader), count * sizeof(BundleEntry));
+
+    // Slots deduplicated by save() share one offset and come back as one shared tile
+    std::unordered_map<std::uint32_t, std::size_t> uses;
+    for (const BundleEntry& entry : entries) {
+        if (entry.size != 0) ++uses[entry.offset];
+    }
+    std::unordered_map<std::uint32_t, TilePtr> loaded;
+
+    TileBatch batch;
+    batch.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        const BundleEntry& entry = entries[i];
+        if (entry.size == 0 || entry.offset < index_end ||
+            static_cast<std::size_t>(entry.offset) + entry.size > length) {
+            continue;
+        }
+        TilePtr& tile = loaded[entry.offset];
+        if (!tile) {
+            auto fresh = std::make_shared<EncodedTile>();
+            fresh->mapping = mapping; // Shared by every tile of the bundle
+            fresh->mapped = std::string_view(base + entry.offset, entry.size);
+            fresh->shared = uses[entry.offset] > 1;
+            fresh->hash = entry.hash;
+            tile = std::move(fresh);
+        }
+        batch.emplace_back(TileKey{origin.z, origin.x + static_cast<int>(i % span), origin.y + static_cast<int>(i / span),
+                                   origin.format, origin.scale, origin.tileset},
+                           tile);
+    }
+
+    if (!batch.empty()) {
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        if (is_dirty) {
+            dirty_reads_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return batch;
+}
+
+std::int64_t TileStore::bundle_created(const TileKey& key, std::uint32_t style) const {
+    const TileKey origin = metatile_origin(key, metatile_size_);
+    std::ifstream in(bundle_path(origin), std::ios::binary);
+    BundleHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        return -1;
+    }
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion ||
+        header.z != origin.z || header.x != origin.x || header.y != origin.y ||
+        header.span != metatile_span(origin.z, metatile_size_) || header.format != format_) {
+        return -1;
+    }
+    if (header.created <= 0 || header.style != style ||
+        (max_age_.count() > 0 && unix_now() - header.created > max_age_.count())) {
+        return 0;
+    }
+    return header.created;
+}
+
+bool TileStore::expire(const TileKey& key) {
+    const TileKey origin = metatile_origin(key, metatile_size_);
+    std::fstream file(bundle_path(origin), std::ios::binary | std::ios::in | std::ios::out);
+    BundleHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+        return false;
+    }
+
+    if (header.created <= 0) {
+        return true; // Already dirty; keep the time it went stale
+    }
+
+    // Patch just the timestamp in place. A concurrent save() renames a new
+    // bundle over this one, in which case the write lands on the old file and
+    // the fresh bundle wins, which is what we want anyway.
+    const std::int64_t dirty = -unix_now();
+    file.seekp(offsetof(BundleHeader, created));
+    file.write(reinterpret_cast<const char*>(&dirty), sizeof(dirty));
+    if (!file.flush()) {
+        std::cerr << "ERROR: Failed to mark tile bundle dirty: " << bundle_path(origin) << std::endl;
+        return false;
+    }
+    expirations_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void TileStore::save(const TileBatch& batch, std::uint32_t style) {
+    if (batch.empty()) {
+        return;
+    }
+
+    const TileKey origin = metatile_origin(batch.front().first, metatile_size_);
+    const int span = metatile_span(origin.z, metatile_size_);
+    const std::size_t count = static_cast<std::size_t>(span) * static_cast<std::size_t>(span);
+
+    BundleHeader header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.z = origin.z;
+    header.x = origin.x;
+    header.y = origin.y;
+    header.span = span;
+    header.created = unix_now();
+    header.format = format_;
+    header.style = style;
+
+    // Lay out the index, then the tiles in index order
+    std::vector<BundleEntry> index(count, BundleEntry{0, 0, 0});
+    std::vector<std::string_view> slots(count);
+    std::vector<std::uint64_t> hashes(count, 0);
+    for (const auto& item : batch) {
+        int col = item.first.x - origin.x;
+        int row = item.first.y - origin.y;
+        if (item.first.z != origin.z || col < 0 || row < 0 || col >= span || row >= span || !item.second) {
+            continue; // Not part of this metatile
+        }
+        slots[static_cast<std::size_t>(row) * span + col] = item.second->bytes();
+        hashes[static_cast<std::size_t>(row) * span + col] = item.second->hash;
+    }
+    // Tiles that share their bytes (solid-colour singletons) are written once
+    // and every slot using them points at that copy. Sharing means the very
+    // same buffer, so the address is the key.
+    std::vector<bool> written(count, true);
+    std::unordered_map<const char*, std::size_t> first_slot;
+    std::size_t offset = sizeof(BundleHeader) + count * sizeof(BundleEntry);
+    for (std::size_t i = 0; i < count; ++i) {
+        if (!slots[i].empty()) {
+            auto it = first_slot.emplace(slots[i].data(), i).first;
+            const std::size_t same = it->second;
+            if (same != i && slots[same].size() == slots[i].size()) {
+                index[i] = index[same];
+                written[i] = false;
+                continue;
+            }
+        }
+        index[i] = {static_cast<std::uint32_t>(offset), static_cast<std::uint32_t>(slots[i].size()), hashes[i]};
+        offset += slots[i].size();
+    }
+
+    // Write to a temporary name and rename, so concurrent readers see either
+    // the old bundle or the new one, never a torn write
+    const std::string path = bundle_path(origin);
+    const std::string tmp_path = path + ".tmp." + std::to_string(::getpid()) + "." +
+                                 std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    try {
+        boost::filesystem::create_directories(boost::filesystem::path(path).parent_path());
+
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(index.data()), static_cast<std::streamsize>(index.size() * sizeof(BundleEntry)));
+        for (std::size_t i = 0; i < count; ++i) {
+            if (written[i]) {
+                out.write(slots[i].data(), static_cast<std::streamsize>(slots[i].size()));
+            }
+        }
+        out.close();
+        if (!out) {
+            throw std::runtime_error("write failed");
+        }
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("rename failed");
+        }
+        writes_.fetch_add(1, std::memory_order_relaxed);
+    } catch (const std::exception& e) {
+        std::cerr << "ERROR: Failed to write tile bundle " << path << ": " << e.what() << std::endl;
+        std::remove(tmp_path.c_str());
+        write_errors_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+TileStore::Stats TileStore::stats() const {
+    Stats s;
+    s.reads = reads_.load(std::memory_order_relaxed);
+    s.hits = hits_.load(std::memory_order_relaxed);
+    s.expired = expired_.load(std::memory_order_relaxed);
+    s.writes = writes_.load(std::memory_order_relaxed);
+    s.write_errors = write_errors_.load(std::memory_order_relaxed);
+    s.dirty_reads = dirty_reads_.load(std::memory_order_relaxed);
+    s.expirations = expirations_.load(std::memory_order_relaxed);
+    return s;
+}
@@ -0,0 +1,88 @@
+#ifndef TILE_STORE_HPP
+#define TILE_STORE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tile.hpp"
+
+// Persistent on-disk tier behind the memory cache.
+//
+// Each metatile is stored as one packed bundle file,
+//   <root>/<z>/<x>/<y>.meta   (x, y = metatile origin)
+//   <root>/<z>/<x>/<y>@2x.meta   (the same metatile at another scale)
+//   <root>/styles/<name>/<z>/...  (tiles of the other named tilesets)
+// holding a small header, an offset/size/hash index with one slot per tile and the
+// encoded tiles back to back. Bundles are written to a temporary file and
+// renamed into place, so readers never see a partial bundle. Reads mmap the
+// bundle and hand out tiles that point straight into the mapping.
+class TileStore {
+public:
+    struct Stats {
+        std::uint64_t reads = 0;   // Bundle lookups
+        std::uint64_t hits = 0;    // Lookups answered from disk
+        std::uint64_t expired = 0; // Bundles found older than max_age (served as dirty)
+        std::uint64_t writes = 0;  // Bundles written
+        std::uint64_t write_errors = 0;
+        std::uint64_t dirty_reads = 0; // Bundles served while marked dirty, or drawn with an older style
+        std::uint64_t expirations = 0; // Bundles marked dirty
+    };
+
+    // Bundles older than max_age are out of date, like expired ones;
+    // max_age == 0 keeps them current forever. `format` tags the bundles with the
+    // encoder configuration (TileEncoder::fingerprint()); bundles written with
+    // another one are treated as missing.
+    // `tilesets` names the tilesets by TileKey::tileset; the first (the
+    // default style) is stored at the root, the others in their own directory.
+    TileStore(const std::string& root, int metatile_size, std::chrono::seconds max_age, std::uint32_t format = 0,
+              std::vector<std::string> tilesets = {});
+
+    // Loads every tile of the bundle containing `key`. Returns an empty batch
+    // if the bundle is missing, corrupt or from another metatile size.
+    // A bundle marked by expire(), older than max_age or drawn with another
+    // style than `style` (TileRenderer::style_fingerprint()) is still
+    // returned, with *dirty set, so the caller can serve it while it renders
+    // a replacement. *stale_since gets the Unix time it went out of date when
+    // the bundle knows it (expiry, age), 0 otherwise.
+    TileBatch load(const TileKey& key, std::uint32_t style, bool* dirty = nullptr, std::int64_t* stale_since = nullptr);
+
+    // Unix time the bundle containing `key` was written, 0 if it is dirty in
+    // any of the ways load() reports, or -1 if there is no usable bundle
+    // (missing or from another layout). Reads only the header, for
+    // callers that need to know what is stored without loading it.
+    std::int64_t bundle_created(const TileKey& key, std::uint32_t style) const;
+
+    // Marks the bundle containing `key` dirty: its data changed, so it should
+    // be re-rendered, but it stays usable until then. The mark, with the time
+    // it was made, is written into the bundle header and survives restarts.
+    // Returns false if there is no bundle for it.
+    bool expire(const TileKey& key);
+
+    // Writes one metatile worth of tiles (as returned by the renderer),
+    // drawn with the given style fingerprint
+    void save(const TileBatch& batch, std::uint32_t style);
+
+    Stats stats() const;
+
+private:
+    std::string bundle_path(const TileKey& origin) const;
+
+    std::string root_;
+    std::vector<std::string> tileset_roots_; // Per tileset
+    int metatile_size_;
+    std::chrono::seconds max_age_;
+    std::uint32_t format_;
+
+    std::atomic<std::uint64_t> reads_{0};
+    std::atomic<std::uint64_t> hits_{0};
+    std::atomic<std::uint64_t> expired_{0};
+    std::atomic<std::uint64_t> writes_{0};
+    std::atomic<std::uint64_t> write_errors_{0};
+    std::atomic<std::uint64_t> dirty_reads_{0};
+    std::atomic<std::uint64_t> expirations_{0};
+};
+
+#endif // TILE_STORE_HPP
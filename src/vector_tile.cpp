@@ -0,0 +1,625 @@
+#include "vector_tile.hpp"
+
+#include <mapnik/attribute.hpp>
+#include <mapnik/datasource.hpp>
+#include <mapnik/expression_evaluator.hpp>
+#include <mapnik/feature.hpp>
+#include <mapnik/feature_layer_desc.hpp>
+#include <mapnik/feature_type_style.hpp>
+#include <mapnik/geometry.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/proj_transform.hpp>
+#include <mapnik/projection.hpp>
+#include <mapnik/query.hpp>
+#include <mapnik/rule.hpp>
+#include <mapnik/util/variant.hpp>
+
+#include <zlib.h>
+
+#include "projection.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+
+enum GeomType : std::uint32_t { kPoint = 1, kLineString = 2, kPolygon = 3 };
+
+struct XY {
+    double x;
+    double y;
+};
+
+// One MVT geometry type's worth of a Mapnik feature, in map coordinates.
+// Points are one per part; polygon rings are parts too, `outer` marking the
+// first ring of each polygon.
+struct Shape {
+    GeomType type;
+    std::vector<std::vector<XY>> parts;
+    std::vector<bool> outer;
+    mapnik::box2d<double> bbox;
+    bool has_bbox = false;
+
+    void add_part(std::vector<XY> part, bool is_outer = false) {
+        for (const XY& p : part) {
+            if (!has_bbox) {
+                bbox.init(p.x, p.y, p.x, p.y);
+                has_bbox = true;
+            } else {
+                bbox.expand_to_include(p.x, p.y);
+            }
+        }
+        parts.push_back(std::move(part));
+        outer.push_back(is_outer);
+    }
+};
+
+// Splits a Mapnik geometry (possibly multi-part or a collection) by MVT type,
+// reprojecting into the map's SRS when the layer has another one
+struct ShapeCollector {
+    std::vector<Shape>& shapes;
+    const mapnik::proj_transform* transform; // Map -> layer, or null
+
+    Shape& shape(GeomType type) {
+        for (Shape& s : shapes) {
+            if (s.type == type) return s;
+        }
+        shapes.push_back(Shape{type, {}, {}, {}, false});
+        return shapes.back();
+    }
+
+    XY map_point(double x, double y) const {
+        if (transform) {
+            double z = 0;
+            transform->backward(x, y, z);
+        }
+        return {x, y};
+    }
+
+    template<typename Line>
+    std::vector<XY> points(const Line& line) const {
+        std::vector<XY> out;
+        out.reserve(line.size());
+        for (const auto& p : line) {
+            out.push_back(map_point(p.x, p.y));
+        }
+        return out;
+    }
+
+    void operator()(const mapnik::geometry::geometry_empty&) {}
+    void operator()(const mapnik::geometry::point<double>& p) { shape(kPoint).add_part({map_point(p.x, p.y)}); }
+    void operator()(const mapnik::geometry::line_string<double>& line) { shape(kLineString).add_part(points(line)); }
+    void operator()(const mapnik::geometry::polygon<double>& polygon) {
+        for (std::size_t i = 0; i < polygon.size(); ++i) {
+            shape(kPolygon).add_part(points(polygon[i]), i == 0);
+        }
+    }
+    void operator()(const mapnik::geometry::multi_point<double>& points) {
+        for (const auto& p : points) (*this)(p);
+    }
+    void operator()(const mapnik::geometry::multi_line_string<double>& lines) {
+        for (const auto& line : lines) (*this)(line);
+    }
+    void operator()(const mapnik::geometry::multi_polygon<double>& polygons) {
+        for (const auto& polygon : polygons) (*this)(polygon);
+    }
+    void operator()(const mapnik::geometry::geometry_collection<double>& collection) {
+        for (const auto& geometry : collection) mapnik::util::apply_visitor(*this, geometry);
+    }
+};
+
+// Just enough protobuf to write vector tiles
+class ProtoWriter {
+public:
+    explicit ProtoWriter(std::string& out) : out_(out) {}
+
+    void varint(std::uint64_t v) {
+        while (v >= 0x80) {
+            out_.push_back(static_cast<char>((v & 0x7f) | 0x80));
+            v >>= 7;
+        }
+        out_.push_back(static_cast<char>(v));
+    }
+    void uint_field(int field, std::uint64_t v) {
+        varint(static_cast<std::uint64_t>(field) << 3); // Wire type 0
+        varint(v);
+    }
+    void bytes_field(int field, std::string_view data) {
+        varint((static_cast<std::uint64_t>(field) << 3) | 2);
+        varint(data.size());
+        out_.append(data.data(), data.size());
+    }
+    void double_field(int field, double v) {
+        varint((static_cast<std::uint64_t>(field) << 3) | 1);
+        std::uint64_t bits;
+        std::memcpy(&bits, &v, sizeof bits);
+        for (int i = 0; i < 8; ++i) {
+            out_.push_back(static_cast<char>(bits >> (8 * i))); // Fixed64 is little-endian
+        }
+    }
+    void packed_field(int field, const std::vector<std::uint32_t>& values) {
+        if (values.empty()) return;
+        std::size_t length = 0;
+        for (std::uint32_t v : values) {
+            length += v < (1u << 7) ? 1 : v < (1u << 14) ? 2 : v < (1u << 21) ? 3 : v < (1u << 28) ? 4 : 5;
+        }
+        varint((static_cast<std::uint64_t>(field) << 3) | 2);
+        varint(length);
+        for (std::uint32_t v : values) varint(v);
+    }
+
+private:
+    std::string& out_;
+};
+
+std::uint32_t zigzag(std::int32_t v) {
+    return (static_cast<std::uint32_t>(v) << 1) ^ static_cast<std::uint32_t>(v >> 31);
+}
+
+// Serialized tile.Value message, which doubles as its key in the value table
+bool encode_value(const mapnik::value& v, std::string& out) {
+    ProtoWriter w(out);
+    if (v.is<mapnik::value_null>()) {
+        return false;
+    } else if (v.is<mapnik::value_bool>()) {
+        w.uint_field(7, v.get<mapnik::value_bool>() ? 1 : 0);
+    } else if (v.is<mapnik::value_integer>()) {
+        const std::int64_t i = v.get<mapnik::value_integer>();
+        if (i >= 0) {
+            w.uint_field(5, static_cast<std::uint64_t>(i));
+        } else {
+            w.uint_field(6, (static_cast<std::uint64_t>(i) << 1) ^ static_cast<std::uint64_t>(i >> 63));
+        }
+    } else if (v.is<mapnik::value_double>()) {
+        w.double_field(3, v.get<mapnik::value_double>());
+    } else {
+        w.bytes_field(1, v.to_string());
+    }
+    return true;
+}
+
+// Features, keys and values of one layer of one tile
+struct LayerBuilder {
+    std::string features;
+    std::vector<std::string> keys;
+    std::unordered_map<std::string, std::uint32_t> key_ids;
+    std::vector<std::string> values; // Encoded tile.Value messages
+    std::unordered_map<std::string, std::uint32_t> value_ids;
+
+    std::uint32_t key_id(const std::string& key) {
+        auto it = key_ids.emplace(key, static_cast<std::uint32_t>(keys.size()));
+        if (it.second) keys.push_back(key);
+        return it.first->second;
+    }
+    std::uint32_t value_id(const std::string& value) {
+        auto it = value_ids.emplace(value, static_cast<std::uint32_t>(values.size()));
+        if (it.second) values.push_back(value);
+        return it.first->second;
+    }
+
+    // Appends the finished layer to the tile and starts over
+    void flush(const std::string& name, unsigned int extent, std::string& tile) {
+        if (features.empty()) return;
+        std::string layer;
+        ProtoWriter w(layer);
+        w.uint_field(15, 2); // version
+        w.bytes_field(1, name);
+        layer += features;
+        for (const std::string& key : keys) w.bytes_field(3, key);
+        for (const std::string& value : values) w.bytes_field(4, value);
+        w.uint_field(5, extent);
+        ProtoWriter(tile).bytes_field(3, layer);
+
+        features.clear();
+        keys.clear();
+        key_ids.clear();
+        values.clear();
+        value_ids.clear();
+    }
+};
+
+// Turns map coordinates into one tile's coordinates: clip, quantize, encode
+class TileGeometry {
+public:
+    TileGeometry(const mapnik::box2d<double>& tile_box, unsigned int extent, unsigned int buffer)
+        : minx_(tile_box.minx()),
+          maxy_(tile_box.maxy()),
+          scale_(extent / tile_box.width()),
+          lo_(-static_cast<double>(buffer)),
+          hi_(static_cast<double>(extent + buffer)) {}
+
+    // Geometry commands for the shape, empty if nothing of it is left in the tile
+    std::vector<std::uint32_t> encode(const Shape& shape) {
+        commands_.clear();
+        cx_ = cy_ = 0;
+        switch (shape.type) {
+            case kPoint: encode_points(shape); break;
+            case kLineString: encode_lines(shape); break;
+            case kPolygon: encode_polygons(shape); break;
+        }
+        return std::move(commands_);
+    }
+
+private:
+    using Ring = std::vector<XY>;
+
+    XY to_tile(const XY& p) const { return {(p.x - minx_) * scale_, (maxy_ - p.y) * scale_}; }
+
+    static std::uint32_t command(std::uint32_t id, std::size_t count) {
+        return (id & 0x7) | (static_cast<std::uint32_t>(count) << 3);
+    }
+    void vertex(std::int32_t x, std::int32_t y) {
+        commands_.push_back(zigzag(x - cx_));
+        commands_.push_back(zigzag(y - cy_));
+        cx_ = x;
+        cy_ = y;
+    }
+
+    // Rounds to the integer grid, dropping repeated vertices
+    static std::vector<std::pair<std::int32_t, std::int32_t>> quantize(const Ring& points) {
+        std::vector<std::pair<std::int32_t, std::int32_t>> out;
+        out.reserve(points.size());
+        for (const XY& p : points) {
+            std::pair<std::int32_t, std::int32_t> q(static_cast<std::int32_t>(std::lround(p.x)),
+                                                   static_cast<std::int32_t>(std::lround(p.y)));
+            if (out.empty() || out.back() != q) out.push_back(q);
+        }
+        return out;
+    }
+
+    void encode_points(const Shape& shape) {
+        std::vector<std::pair<std::int32_t, std::int32_t>> kept;
+        for (const auto& part : shape.parts) {
+            XY p = to_tile(part[0]);
+            if (p.x >= lo_ && p.x <= hi_ && p.y >= lo_ && p.y <= hi_) {
+                kept.emplace_back(static_cast<std::int32_t>(std::lround(p.x)), static_cast<std::int32_t>(std::lround(p.y)));
+            }
+        }
+        if (kept.empty()) return;
+        commands_.push_back(command(1, kept.size())); // MoveTo
+        for (const auto& p : kept) vertex(p.first, p.second);
+    }
+
+    // Liang-Barsky: narrows [t0, t1] to the part of a->b inside the box
+    bool clip_segment(const XY& a, const XY& b, double& t0, double& t1) const {
+        const double dx = b.x - a.x, dy = b.y - a.y;
+        const double p[4] = {-dx, dx, -dy, dy};
+        const double q[4] = {a.x - lo_, hi_ - a.x, a.y - lo_, hi_ - a.y};
+        for (int i = 0; i < 4; ++i) {
+            if (p[i] == 0) {
+                if (q[i] < 0) return false;
+            } else {
+                const double t = q[i] / p[i];
+                if (p[i] < 0) t0 = std::max(t0, t);
+                else t1 = std::min(t1, t);
+            }
+        }
+        return t0 <= t1;
+    }
+
+    void emit_line(const Ring& line) {
+        auto q = quantize(line);
+        if (q.size() < 2) return;
+        commands_.push_back(command(1, 1));
+        vertex(q[0].first, q[0].second);
+        commands_.push_back(command(2, q.size() - 1)); // LineTo
+        for (std::size_t i = 1; i < q.size(); ++i) vertex(q[i].first, q[i].second);
+    }
+
+    void encode_lines(const Shape& shape) {
+        for (const auto& part : shape.parts) {
+            // A line leaving and re-entering the buffered tile becomes several lines
+            Ring current;
+            for (std::size_t i = 1; i < part.size(); ++i) {
+                const XY a = to_tile(part[i - 1]), b = to_tile(part[i]);
+                double t0 = 0, t1 = 1;
+                if (!clip_segment(a, b, t0, t1)) {
+                    emit_line(current);
+                    current.clear();
+                    continue;
+                }
+                if (current.empty()) {
+                    current.push_back({a.x + t0 * (b.x - a.x), a.y + t0 * (b.y - a.y)});
+                }
+                current.push_back({a.x + t1 * (b.x - a.x), a.y + t1 * (b.y - a.y)});
+                if (t1 < 1) {
+                    emit_line(current);
+                    current.clear();
+                }
+            }
+            emit_line(current);
+        }
+    }
+
+    // Sutherland-Hodgman against one edge of the buffered tile
+    template<typename Inside, typename Cross>
+    static Ring clip_edge(const Ring& in, Inside inside, Cross cross) {
+        Ring out;
+        if (in.empty()) return out;
+        out.reserve(in.size() + 4);
+        XY prev = in.back();
+        bool prev_in = inside(prev);
+        for (const XY& p : in) {
+            const bool p_in = inside(p);
+            if (p_in != prev_in) out.push_back(cross(prev, p));
+            if (p_in) out.push_back(p);
+            prev = p;
+            prev_in = p_in;
+        }
+        return out;
+    }
+
+    Ring clip_ring(Ring ring) const {
+        const double lo = lo_, hi = hi_;
+        auto at_x = [](const XY& a, const XY& b, double x) { return XY{x, a.y + (b.y - a.y) * (x - a.x) / (b.x - a.x)}; };
+        auto at_y = [](const XY& a, const XY& b, double y) { return XY{a.x + (b.x - a.x) * (y - a.y) / (b.y - a.y), y}; };
+        ring = clip_edge(ring, [lo](const XY& p) { return p.x >= lo; }, [&](const XY& a, const XY& b) { return at_x(a, b, lo); });
+        ring = clip_edge(ring, [hi](const XY& p) { return p.x <= hi; }, [&](const XY& a, const XY& b) { return at_x(a, b, hi); });
+        ring = clip_edge(ring, [lo](const XY& p) { return p.y >= lo; }, [&](const XY& a, const XY& b) { return at_y(a, b, lo); });
+        ring = clip_edge(ring, [hi](const XY& p) { return p.y <= hi; }, [&](const XY& a, const XY& b) { return at_y(a, b, hi); });
+        return ring;
+    }
+
+    void encode_polygons(const Shape& shape) {
+        bool outer_kept = false;
+        for (std::size_t r = 0; r < shape.parts.size(); ++r) {
+            if (!shape.outer[r] && !outer_kept) continue; // Hole of a polygon that is gone
+
+            Ring ring;
+            ring.reserve(shape.parts[r].size());
+            for (const XY& p : shape.parts[r]) ring.push_back(to_tile(p));
+            if (ring.size() > 1 && ring.front().x == ring.back().x && ring.front().y == ring.back().y) {
+                ring.pop_back(); // ClosePath closes it
+            }
+            auto q = quantize(clip_ring(std::move(ring)));
+            while (q.size() > 1 && q.front() == q.back()) q.pop_back();
+
+            // Surveyor's formula in tile coordinates (y down): exterior rings
+            // must come out positive, holes negative
+            std::int64_t area2 = 0;
+            for (std::size_t i = 0; i < q.size(); ++i) {
+                const auto& a = q[i];
+                const auto& b = q[(i + 1) % q.size()];
+                area2 += static_cast<std::int64_t>(a.first) * b.second - static_cast<std::int64_t>(b.first) * a.second;
+            }
+            if (q.size() < 3 || area2 == 0) {
+                if (shape.outer[r]) outer_kept = false;
+                continue;
+            }
+            if ((area2 > 0) != static_cast<bool>(shape.outer[r])) {
+                std::reverse(q.begin(), q.end());
+            }
+            if (shape.outer[r]) outer_kept = true;
+
+            commands_.push_back(command(1, 1));
+            vertex(q[0].first, q[0].second);
+            commands_.push_back(command(2, q.size() - 1));
+            for (std::size_t i = 1; i < q.size(); ++i) vertex(q[i].first, q[i].second);
+            commands_.push_back(command(7, 1)); // ClosePath
+        }
+    }
+
+    double minx_, maxy_, scale_;
+    double lo_, hi_;
+    std::vector<std::uint32_t> commands_;
+    std::int32_t cx_ = 0, cy_ = 0;
+};
+
+// The active rules of a layer's styles at one scale
+struct LayerRules {
+    std::vector<const mapnik::rule*> rules;
+    bool match_all = false; // An else/also rule draws whatever the others don't
+
+    bool empty() const { return rules.empty() && !match_all; }
+
+    bool matches(const mapnik::feature_impl& feature, const mapnik::attributes& vars) const {
+        if (match_all) return true;
+        for (const mapnik::rule* rule : rules) {
+            const mapnik::expression_ptr& filter = rule->get_filter();
+            if (!filter) return true;
+            mapnik::value result = mapnik::util::apply_visitor(
+                mapnik::evaluate<mapnik::feature_impl, mapnik::value_type, mapnik::attributes>(feature, vars), *filter);
+            if (result.to_bool()) return true;
+        }
+        return false;
+    }
+};
+
+LayerRules active_rules(const mapnik::Map& map, const mapnik::layer& layer, double scale_denominator) {
+    LayerRules out;
+    for (const std::string& style_name : layer.styles()) {
+        boost::optional<const mapnik::feature_type_style&> style = map.find_style(style_name);
+        if (!style) continue;
+        for (const mapnik::rule& rule : style->get_rules()) {
+            if (!rule.active(scale_denominator)) continue;
+            if (rule.has_else_filter() || rule.has_also_filter()) {
+                out.match_all = true;
+            } else {
+                out.rules.push_back(&rule);
+            }
+        }
+    }
+    return out;
+}
+
+} // namespace
+
+VectorTileBuilder::VectorTileBuilder(const mapnik::Map& map, unsigned int tile_size, const VectorTileOptions& options)
+    : map_(map), tile_size_(tile_size), options_(options) {
+    // MVT layer names have to be unique within a tile; styles often draw the
+    // same data twice (casing and fill), so only the first layer of a name is used
+    std::set<std::string> names;
+    for (std::size_t i = 0; i < map_.layers().size(); ++i) {
+        const mapnik::layer& layer = map_.layers()[i];
+        if (!layer.datasource()) continue;
+        if (!names.insert(layer.name()).second) {
+            std::cerr << "WARNING: Vector tiles: skipping layer '" << layer.name()
+                      << "', an earlier layer has the same name" << std::endl;
+            continue;
+        }
+        layers_.push_back(i);
+    }
+}
+
+TileBatch VectorTileBuilder::build(int z, int x, int y, int span) const {
+    const std::size_t count = static_cast<std::size_t>(span) * static_cast<std::size_t>(span);
+    std::vector<mapnik::box2d<double>> tile_boxes(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        tile_boxes[i] = tileToMercatorBoundingBox(z, x + static_cast<int>(i % span), y + static_cast<int>(i / span));
+    }
+    const mapnik::box2d<double>& top_left = tile_boxes.front();
+    const mapnik::box2d<double>& bottom_right = tile_boxes.back();
+    const mapnik::box2d<double> extent(top_left.minx(), bottom_right.miny(), bottom_right.maxx(), top_left.maxy());
+
+    // Same scale as the raster tiles of this zoom, so the same layers and rules apply
+    const double tile_width = top_left.width();
+    const double metres_per_pixel = tile_width / tile_size_;
+    const double scale_denominator = metres_per_pixel / PIXEL_SIZE_METRES;
+    const double buffer = tile_width * options_.buffer / options_.extent; // In metres
+    const mapnik::box2d<double> query_box(extent.minx() - buffer, extent.miny() - buffer,
+                                          extent.maxx() + buffer, extent.maxy() + buffer);
+
+    std::vector<std::string> tiles(count);
+    std::vector<LayerBuilder> builders(count);
+    const mapnik::attributes vars;
+
+    for (std::size_t index : layers_) {
+        const mapnik::layer& layer = map_.layers()[index];
+        if (!layer.active() || !layer.visible(scale_denominator)) continue;
+        const LayerRules rules = active_rules(map_, layer, scale_denominator);
+        if (rules.empty()) continue;
+        const mapnik::datasource_ptr& ds = layer.datasource();
+
+        // Layers in another SRS (the osm plugin reports lon/lat) are queried
+        // and reprojected like the raster renderer does
+        std::unique_ptr<mapnik::proj_transform> transform;
+        mapnik::box2d<double> layer_box = query_box;
+        if (layer.srs() != map_.srs()) {
+            mapnik::projection map_proj(map_.srs()), layer_proj(layer.srs());
+            transform = std::make_unique<mapnik::proj_transform>(map_proj, layer_proj);
+            if (!transform->forward(layer_box)) continue;
+        }
+
+        mapnik::query q(layer_box, mapnik::query::resolution_type(1.0 / metres_per_pixel, 1.0 / metres_per_pixel),
+                        scale_denominator, extent);
+        for (const mapnik::attribute_descriptor& attribute : ds->get_descriptor().get_descriptors()) {
+            q.add_property_name(attribute.get_name());
+        }
+
+        mapnik::featureset_ptr features = ds->features(q);
+        if (!features) continue;
+        std::vector<Shape> shapes;
+        std::vector<std::pair<std::string, std::string>> attributes; // Key, encoded value
+        while (mapnik::feature_ptr feature = features->next()) {
+            if (!rules.matches(*feature, vars)) continue;
+
+            shapes.clear();
+            ShapeCollector collect{shapes, transform.get()};
+            mapnik::util::apply_visitor(collect, feature->get_geometry());
+
+            attributes.clear();
+            for (const auto& kv : *feature) {
+                std::string value;
+                if (encode_value(std::get<1>(kv), value)) {
+                    attributes.emplace_back(std::get<0>(kv), std::move(value));
+                }
+            }
+
+            for (const Shape& shape : shapes) {
+                if (!shape.has_bbox) continue;
+                for (std::size_t i = 0; i < count; ++i) {
+                    const mapnik::box2d<double>& box = tile_boxes[i];
+                    if (shape.bbox.maxx() < box.minx() - buffer || shape.bbox.minx() > box.maxx() + buffer ||
+                        shape.bbox.maxy() < box.miny() - buffer || shape.bbox.miny() > box.maxy() + buffer) {
+                        continue;
+                    }
+                    TileGeometry geometry(box, options_.extent, options_.buffer);
+                    std::vector<std::uint32_t> commands = geometry.encode(shape);
+                    if (commands.empty()) continue;
+
+                    LayerBuilder& builder = builders[i];
+                    std::vector<std::uint32_t> tags;
+                    tags.reserve(attributes.size() * 2);
+                    for (const auto& attribute : attributes) {
+                        tags.push_back(builder.key_id(attribute.first));
+                        tags.push_back(builder.value_id(attribute.second));
+                    }
+                    std::string encoded;
+                    ProtoWriter w(encoded);
+                    if (feature->id() > 0) w.uint_field(1, static_cast<std::uint64_t>(feature->id()));
+                    w.packed_field(2, tags);
+                    w.uint_field(3, shape.type);
+                    w.packed_field(4, commands);
+                    ProtoWriter(builder.features).bytes_field(2, encoded);
+                }
+            }
+        }
+
+        for (std::size_t i = 0; i < count; ++i) {
+            builders[i].flush(layer.name(), options_.extent, tiles[i]);
+        }
+    }
+
+    TileBatch batch(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        batch[i].first = TileKey{z, x + static_cast<int>(i % span), y + static_cast<int>(i / span), TileFormat::Vector};
+        if (!tiles[i].empty()) {
+            auto tile = std::make_shared<EncodedTile>();
+            tile->data = options_.gzip ? gzip_compress(tiles[i]) : std::move(tiles[i]);
+            tile->hash = content_hash(tile->data);
+            batch[i].second = std::move(tile);
+        }
+    }
+    return batch;
+}
+
+std::string gzip_compress(std::string_view data) {
+    z_stream zs{};
+    // 15 window bits + 16 = gzip wrapper instead of zlib's
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("deflateInit2 failed");
+    }
+    std::string out(deflateBound(&zs, static_cast<uLong>(data.size())), '\0');
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in = static_cast<uInt>(data.size());
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = static_cast<uInt>(out.size());
+    const int ret = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        throw std::runtime_error("gzip compression failed");
+    }
+    out.resize(zs.total_out);
+    return out;
+}
+
+std::string gzip_decompress(std::string_view data) {
+    z_stream zs{};
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        throw std::runtime_error("inflateInit2 failed");
+    }
+    std::string out;
+    char chunk[16384];
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in = static_cast<uInt>(data.size());
+    int ret;
+    do {
+        zs.next_out = reinterpret_cast<Bytef*>(chunk);
+        zs.avail_out = sizeof chunk;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            inflateEnd(&zs);
+            throw std::runtime_error("gzip decompression failed");
+        }
+        out.append(chunk, sizeof chunk - zs.avail_out);
+    } while (ret != Z_STREAM_END);
+    inflateEnd(&zs);
+    return out;
+}
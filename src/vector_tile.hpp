@@ -0,0 +1,59 @@
+#ifndef VECTOR_TILE_HPP
+#define VECTOR_TILE_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <mapnik/box2d.hpp>
+#include <mapnik/map.hpp>
+
+#include "tile.hpp"
+
+// Mapbox Vector Tile (MVT 2.1) output for the layers of a loaded style.
+//
+// Each style layer becomes one MVT layer of the same name. A layer only gets
+// the features its style would draw at that zoom: layers and rules outside
+// their scale range are skipped and features must pass at least one active
+// rule filter, so layers sharing one datasource (the osm plugin, a geostore)
+// do not all carry the whole dataset. Geometry is clipped to the tile plus a
+// buffer and quantized to the tile extent; attributes are whatever the
+// datasource reports for the feature.
+//
+// The protobuf is written by hand (the schema is tiny), so there is no
+// protobuf or mapnik-vector-tile dependency.
+
+struct VectorTileOptions {
+    unsigned int extent = 4096; // Tile coordinate range
+    unsigned int buffer = 64;   // Geometry kept outside the tile, in extent units
+    bool gzip = true;           // Store and serve tiles gzip-compressed
+};
+
+class VectorTileBuilder {
+public:
+    // `map` must outlive the builder; its layers and styles are only read.
+    // tile_size is the raster tile size, used to pick the same scale (and so
+    // the same layers and rules) as the raster tiles of a zoom.
+    VectorTileBuilder(const mapnik::Map& map, unsigned int tile_size, const VectorTileOptions& options);
+
+    // Encodes the span x span block of tiles whose top-left tile is z/x/y.
+    // Every layer is queried once for the whole block. Keys carry
+    // TileFormat::Vector; tiles without any features are left null.
+    TileBatch build(int z, int x, int y, int span) const;
+
+    const VectorTileOptions& options() const { return options_; }
+
+    static const char* content_type() { return "application/vnd.mapbox-vector-tile"; }
+
+private:
+    const mapnik::Map& map_;
+    unsigned int tile_size_;
+    VectorTileOptions options_;
+    std::vector<std::size_t> layers_; // Indices of the map layers that are encoded (names are unique)
+};
+
+// gzip helpers for vector tiles. Both throw std::runtime_error on zlib errors.
+std::string gzip_compress(std::string_view data);
+std::string gzip_decompress(std::string_view data);
+
+#endif // VECTOR_TILE_HPP